@@ -2,7 +2,9 @@ QT       += core gui network serialport
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
-CONFIG += c++11
+# coroutine in ccl/coroutine.h need c++20
+CONFIG += c++2a
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
 
 # The following define makes your compiler emit warnings if you use
 # any Qt feature that has been marked deprecated (the exact warnings
@@ -15,22 +17,111 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+# qmake CONFIG+=ccl_trace compile trace point in, see ccl/trace.h
+CONFIG(ccl_trace): DEFINES += CCL_ENABLE_TRACE
+
+# qmake CONFIG+=ccl_lz4 CONFIG+=ccl_zstd link codec of ccl/compression.h, zlib is always there,
+# system one on unix, on windows qmake ZLIB_DIR=<zlib build> (zlib bundled in QtCore is not exported)
+unix: LIBS += -lz
+win32 {
+    !isEmpty(ZLIB_DIR) {
+        INCLUDEPATH += $$ZLIB_DIR/include
+        LIBS += -L$$ZLIB_DIR/lib
+    }
+    LIBS += -lzlib
+}
+CONFIG(ccl_lz4) {
+    DEFINES += CCL_HAVE_LZ4
+    LIBS += -llz4
+}
+CONFIG(ccl_zstd) {
+    DEFINES += CCL_HAVE_ZSTD
+    LIBS += -lzstd
+}
+
 SOURCES += \
+    ccl/queue/bytequeue.cpp \
+    ccl/queue/slaballocator.cpp \
+    ccl/buffermeta.cpp \
+    ccl/checksum.cpp \
+    ccl/compression.cpp \
+    ccl/coroutine.cpp \
+    ccl/cpufeature.cpp \
+    ccl/framescanner.cpp \
+    ccl/latencyhistogram.cpp \
+    ccl/lifecycle.cpp \
+    ccl/linkthreadpool.cpp \
+    ccl/metrics.cpp \
+    ccl/metricsexporter.cpp \
+    ccl/outboundbuffer.cpp \
+    ccl/outboundspool.cpp \
+    ccl/pollscheduler.cpp \
+    ccl/requestengine.cpp \
+    ccl/serialbus.cpp \
     ccl/serialportclient.cpp \
+    ccl/tagstore.cpp \
     ccl/tcpclient.cpp \
+    ccl/tcpserver.cpp \
+    ccl/timerwheel.cpp \
+    ccl/trace.cpp \
+    ccl/uibridge.cpp \
     ccl/udpclient.cpp \
+    ccl/udpreassembler.cpp \
     main.cpp \
     mainwindow.cpp
 
 HEADERS += \
     ccl/queue/abstractqueue.h \
+    ccl/queue/bytebudgetqueue.h \
+    ccl/queue/bytequeue.h \
     ccl/queue/dropqueue.h \
+    ccl/queue/slaballocator.h \
+    ccl/queue/teequeue.h \
     ccl/queue/waitqueue.h \
+    ccl/queue/waitstrategy.h \
+    ccl/buffermeta.h \
+    ccl/checksum.h \
+    ccl/compression.h \
+    ccl/coroutine.h \
+    ccl/cpufeature.h \
+    ccl/framescanner.h \
+    ccl/latencyhistogram.h \
+    ccl/lifecycle.h \
+    ccl/linkthreadpool.h \
+    ccl/metrics.h \
+    ccl/metricsexporter.h \
+    ccl/outboundbuffer.h \
+    ccl/outboundspool.h \
+    ccl/pollscheduler.h \
+    ccl/requestengine.h \
+    ccl/schema.h \
+    ccl/serialbus.h \
     ccl/serialportclient.h \
+    ccl/tagstore.h \
     ccl/tcpclient.h \
+    ccl/tcpserver.h \
+    ccl/timerwheel.h \
+    ccl/trace.h \
+    ccl/uibridge.h \
     ccl/udpclient.h \
+    ccl/udpreassembler.h \
     mainwindow.h
 
+linux {
+    HEADERS += \
+        ccl/queue/shmqueue.h
+
+    LIBS += -lrt
+}
+
+unix {
+    SOURCES += \
+        ccl/serialbussimulator.cpp
+
+    HEADERS += \
+        ccl/serialbussimulator.h
+}
+
 FORMS += \
     mainwindow.ui
 
@@ -0,0 +1,13 @@
+# shared setting of benchmark, console app, no gui
+QT       -= gui
+QT       += core
+
+CONFIG += console c++2a
+CONFIG -= app_bundle
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# include "ccl/..." as in the app
+INCLUDEPATH += $$PWD/..
+CCL_DIR = $$PWD/../ccl
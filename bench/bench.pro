@@ -0,0 +1,10 @@
+# qmake bench/bench.pro && make, then run every bench from its build dir
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    checksumbench \
+    metricsbench \
+    queuebench \
+    schemabench
+
+unix: SUBDIRS += serialbusbench
@@ -0,0 +1,12 @@
+include(../bench.pri)
+
+TARGET = checksumbench
+
+SOURCES += \
+    $$CCL_DIR/checksum.cpp \
+    $$CCL_DIR/cpufeature.cpp \
+    main.cpp
+
+HEADERS += \
+    $$CCL_DIR/checksum.h \
+    $$CCL_DIR/cpufeature.h
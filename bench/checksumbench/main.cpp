@@ -0,0 +1,78 @@
+﻿#include "ccl/checksum.h"
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * checksum benchmark, every implementation against ChecksumByte(scalar byte table) baseline.
+ * 1.size: frame length from short modbus frame to large block.
+ * 2.print MB/s and speedup of baseline, unsupported implementation is skipped.
+ * usage: checksumbench [bytes], default 256 MB hashed per case.
+ */
+
+#define CHECKSUM_BENCH_DEFAULT_BYTES (256LL * 1024 * 1024)
+
+static volatile quint32 sink;
+
+static double run(ChecksumType type,ChecksumImpl impl,const char * data,qint64 len,qint64 bytes)
+{
+    qint64 loops = bytes / len > 0 ? bytes / len : 1;
+    quint32 result = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    for(qint64 i = 0;i < loops;i++){
+        // depend on last result, compiler can not hoist the call
+        result += Checksum::compute(type,data + (result & 7),len,impl);
+    }
+    qint64 ns = timer.nsecsElapsed();
+    sink = result;
+
+    return static_cast<double>(loops * len) * 1e3 / (ns > 0 ? ns : 1);
+}
+
+int main(int argc,char * argv[])
+{
+    qint64 bytes = argc > 1 ? atoll(argv[1]) : CHECKSUM_BENCH_DEFAULT_BYTES;
+
+    const qint64 sizes[] = {8,64,256,1024,65536};
+    std::vector<char> data(65536 + 8);
+    for(size_t i = 0;i < data.size();i++){
+        data[i] = static_cast<char>(rand());
+    }
+
+    struct Type{
+        ChecksumType type;
+        const char * name;
+    };
+    const Type types[] = {
+        {ChecksumSum8,"sum8"},
+        {ChecksumLrc,"lrc"},
+        {ChecksumCrc16Modbus,"crc16modbus"},
+        {ChecksumCrc32,"crc32"},
+        {ChecksumCrc32c,"crc32c"}
+    };
+    const ChecksumImpl impls[] = {
+        ChecksumByte,ChecksumSlice8,ChecksumSse42,ChecksumPclmul,ChecksumAvx2
+    };
+
+    printf("%-12s %6s %-8s %10s %8s\n","type","size","impl","MB/s","speedup");
+    for(const Type &type : types){
+        for(qint64 size : sizes){
+            double baseline = 0;
+            for(ChecksumImpl impl : impls){
+                if(!Checksum::isSupported(impl)){
+                    continue;
+                }
+                double speed = run(type.type,impl,data.data(),size,bytes);
+                if(impl == ChecksumByte){
+                    baseline = speed;
+                }
+                printf("%-12s %6lld %-8s %10.0f %7.2fx\n",type.name,static_cast<long long>(size),
+                       qPrintable(Checksum::implementationName(impl)),speed,speed / baseline);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+﻿#include "ccl/metrics.h"
+#include <QElapsedTimer>
+#include <QThread>
+#include <QVector>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * metric hot path benchmark, cost added to a link or parse thread per record.
+ * 1.single: one thread, every case against an empty loop of the same shape.
+ *  1) counter: MetricCounter::add.
+ *  2) gauge: MetricGauge::set.
+ *  3) histogram: LatencyHistogram::record of latency from a ring of varied value.
+ *  4) ingest: LatencyHistogram::recordIngest, clock read included.
+ * 2.contended: METRICS_BENCH_THREAD_COUNT thread record the same counter and histogram,
+ *   the case of many link sharing one metric.
+ * cases run in turn METRICS_BENCH_ROUND time, best round is printed.
+ * usage: metricsbench [count], default 50000000 record per round.
+ */
+
+#define METRICS_BENCH_DEFAULT_COUNT 50000000
+#define METRICS_BENCH_LATENCY_COUNT 1024
+#define METRICS_BENCH_THREAD_COUNT 4
+#define METRICS_BENCH_ROUND 5
+
+typedef enum MetricsBenchCase_TAG{
+    MetricsBenchBaseline = 0,
+    MetricsBenchCounter,
+    MetricsBenchGauge,
+    MetricsBenchHistogram,
+    MetricsBenchIngest,
+    MetricsBenchCaseCount
+}MetricsBenchCase;
+
+static const char * caseNames[MetricsBenchCaseCount] = {
+    "baseline","counter","gauge","histogram","ingest"
+};
+
+static volatile qint64 sink;
+
+typedef struct MetricsBenchTarget_TAG{
+    MetricCounter counter;
+    MetricGauge gauge;
+    LatencyHistogram histogram;
+    std::vector<qint64> latencies;
+    BufferMeta meta;
+}MetricsBenchTarget;
+
+static void runCase(MetricsBenchCase benchCase,MetricsBenchTarget * target,qint64 count)
+{
+    const qint64 * latencies = target->latencies.data();
+    qint64 sum = 0;
+    for(qint64 i = 0;i < count;i++){
+        qint64 latency = latencies[i % METRICS_BENCH_LATENCY_COUNT];
+        switch(benchCase){
+        case MetricsBenchCounter:
+            target->counter.add();
+            break;
+        case MetricsBenchGauge:
+            target->gauge.set(latency);
+            break;
+        case MetricsBenchHistogram:
+            target->histogram.record(latency);
+            break;
+        case MetricsBenchIngest:
+            target->histogram.recordIngest(target->meta);
+            break;
+        default:
+            break;
+        }
+        sum += latency;
+    }
+    sink = sum;
+}
+
+/**
+ * run whole case in its own loop, switch is hoisted out by the compiler.
+ */
+static double single(MetricsBenchCase benchCase,MetricsBenchTarget * target,qint64 count)
+{
+    QElapsedTimer timer;
+    timer.start();
+    switch(benchCase){
+    case MetricsBenchCounter:
+        runCase(MetricsBenchCounter,target,count);
+        break;
+    case MetricsBenchGauge:
+        runCase(MetricsBenchGauge,target,count);
+        break;
+    case MetricsBenchHistogram:
+        runCase(MetricsBenchHistogram,target,count);
+        break;
+    case MetricsBenchIngest:
+        runCase(MetricsBenchIngest,target,count);
+        break;
+    default:
+        runCase(MetricsBenchBaseline,target,count);
+        break;
+    }
+    return static_cast<double>(timer.nsecsElapsed()) / count;
+}
+
+class MetricsBenchThread: public QThread
+{
+public:
+    MetricsBenchThread(MetricsBenchCase benchCase,MetricsBenchTarget * target,qint64 count)
+        :m_case(benchCase),m_target(target),m_count(count){}
+
+protected:
+    void run() override
+    {
+        single(m_case,m_target,m_count);
+    }
+
+private:
+    MetricsBenchCase m_case;
+    MetricsBenchTarget * m_target;
+    qint64 m_count;
+};
+
+/**
+ * wall time per record of all thread, single / thread count if core is enough and no contention.
+ */
+static double contended(MetricsBenchCase benchCase,MetricsBenchTarget * target,qint64 count)
+{
+    QVector<MetricsBenchThread *> threads;
+    for(int i = 0;i < METRICS_BENCH_THREAD_COUNT;i++){
+        threads.append(new MetricsBenchThread(benchCase,target,count));
+    }
+    QElapsedTimer timer;
+    timer.start();
+    for(MetricsBenchThread * thread : threads){
+        thread->start();
+    }
+    for(MetricsBenchThread * thread : threads){
+        thread->wait();
+    }
+    qint64 ns = timer.nsecsElapsed();
+    for(MetricsBenchThread * thread : threads){
+        delete thread;
+    }
+    return static_cast<double>(ns) / (count * METRICS_BENCH_THREAD_COUNT);
+}
+
+static void report(const char * name,double (*measure)(MetricsBenchCase,MetricsBenchTarget *,qint64),
+                   MetricsBenchTarget * target,qint64 count)
+{
+    double best[MetricsBenchCaseCount];
+    for(int round = 0;round < METRICS_BENCH_ROUND;round++){
+        for(int i = 0;i < MetricsBenchCaseCount;i++){
+            double ns = measure(static_cast<MetricsBenchCase>(i),target,count);
+            best[i] = round == 0 ? ns : qMin(best[i],ns);
+        }
+    }
+
+    printf("%s\n",name);
+    for(int i = 0;i < MetricsBenchCaseCount;i++){
+        printf("  %-10s %8.2f ns/record  overhead %8.2f ns\n",
+               caseNames[i],best[i],best[i] - best[MetricsBenchBaseline]);
+    }
+}
+
+int main(int argc,char * argv[])
+{
+    qint64 count = argc > 1 ? atoll(argv[1]) : METRICS_BENCH_DEFAULT_COUNT;
+
+    // latency of a link, 1 us to 10 ms, spread over many bucket
+    MetricsBenchTarget * target = new MetricsBenchTarget;
+    target->latencies.resize(METRICS_BENCH_LATENCY_COUNT);
+    for(int i = 0;i < METRICS_BENCH_LATENCY_COUNT;i++){
+        target->latencies[i] = 1000 + static_cast<qint64>(rand()) % 10000000;
+    }
+    memset(&target->meta,0,sizeof(BufferMeta));
+    target->meta.recvTime = bufferMetaNow();
+
+    printf("count %lld\n",static_cast<long long>(count));
+    report("single",single,target,count);
+    report("contended",contended,target,count / METRICS_BENCH_THREAD_COUNT);
+    delete target;
+    return 0;
+}
@@ -0,0 +1,14 @@
+include(../bench.pri)
+
+TARGET = metricsbench
+
+SOURCES += \
+    $$CCL_DIR/buffermeta.cpp \
+    $$CCL_DIR/latencyhistogram.cpp \
+    $$CCL_DIR/metrics.cpp \
+    main.cpp
+
+HEADERS += \
+    $$CCL_DIR/buffermeta.h \
+    $$CCL_DIR/latencyhistogram.h \
+    $$CCL_DIR/metrics.h
@@ -0,0 +1,217 @@
+﻿#include "ccl/queue/waitqueue.h"
+#include "ccl/queue/dropqueue.h"
+#include <QElapsedTimer>
+#include <QThread>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#endif
+
+/**
+ * queue benchmark, every case print buffer per second and context switch of the process.
+ * 1.spsc: one writer, one reader, queue often full or empty, measure wakeup cost.
+ * 2.mpsc: 4 writer, one reader, contended mutex.
+ * 3.pingpong: one buffer in flight in each direction, round trip latency.
+ * usage: queuebench [count], default 200000 buffer per case.
+ */
+
+#define QUEUE_BENCH_DEFAULT_COUNT 200000
+#define QUEUE_BENCH_QUEUE_SIZE 20
+#define QUEUE_BENCH_WRITER_COUNT 4
+
+typedef struct BenchBuffer_TAG{
+    char buffer[64];
+    qint64 len;
+    quint64 sequence;
+}BenchBuffer;
+
+class BenchThread: public QThread
+{
+public:
+    explicit BenchThread(const std::function<void()> &function)
+        :m_function(function)
+    {
+
+    }
+
+protected:
+    void run() override
+    {
+        m_function();
+    }
+
+private:
+    std::function<void()> m_function;
+};
+
+static qint64 contextSwitches()
+{
+#ifdef Q_OS_LINUX
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+#else
+    return 0;
+#endif
+}
+
+static void report(const char * name,const char * queue,const char * strategy,
+                   qint64 count,qint64 ns,qint64 switches)
+{
+    printf("%-9s %-10s %-14s %10.0f buffer/s %8.0f ns/buffer %10lld switch\n",
+           name,queue,strategy,count * 1e9 / ns,static_cast<double>(ns) / count,
+           static_cast<long long>(switches));
+}
+
+static void write(AbstractQueue<BenchBuffer> * queue,qint64 count)
+{
+    for(qint64 i = 0;i < count;i++){
+        BenchBuffer * buffer = queue->peekWriteable();
+        if(!buffer){
+            return;
+        }
+        buffer->len = sizeof(buffer->buffer);
+        buffer->sequence = static_cast<quint64>(i);
+        queue->push(buffer);
+    }
+}
+
+static qint64 read(AbstractQueue<BenchBuffer> * queue,qint64 count)
+{
+    qint64 got = 0;
+    while(got < count){
+        BenchBuffer * buffer = queue->peekReadable(1000);
+        if(!buffer){
+            if(queue->isAbort()){
+                break;
+            }
+            continue;
+        }
+        got++;
+        queue->next(buffer);
+    }
+    return got;
+}
+
+static void spsc(AbstractQueue<BenchBuffer> * queue,const char * name,const char * strategy,qint64 count)
+{
+    qint64 switches = contextSwitches();
+    QElapsedTimer timer;
+    timer.start();
+
+    BenchThread writer([queue,count](){ write(queue,count); });
+    writer.start();
+    qint64 got = read(queue,count);
+    writer.wait();
+
+    report("spsc",name,strategy,got,timer.nsecsElapsed(),contextSwitches() - switches);
+}
+
+static void mpsc(AbstractQueue<BenchBuffer> * queue,const char * name,const char * strategy,qint64 count)
+{
+    qint64 switches = contextSwitches();
+    QElapsedTimer timer;
+    timer.start();
+
+    qint64 perWriter = count / QUEUE_BENCH_WRITER_COUNT;
+    std::vector<BenchThread *> writers;
+    for(int i = 0;i < QUEUE_BENCH_WRITER_COUNT;i++){
+        writers.push_back(new BenchThread([queue,perWriter](){ write(queue,perWriter); }));
+        writers.back()->start();
+    }
+    qint64 got = read(queue,perWriter * QUEUE_BENCH_WRITER_COUNT);
+    for(BenchThread * writer : writers){
+        writer->wait();
+        delete writer;
+    }
+
+    report("mpsc",name,strategy,got,timer.nsecsElapsed(),contextSwitches() - switches);
+}
+
+static void pingpong(AbstractQueue<BenchBuffer> * ping,AbstractQueue<BenchBuffer> * pong,
+                     const char * name,const char * strategy,qint64 count)
+{
+    qint64 switches = contextSwitches();
+    QElapsedTimer timer;
+    timer.start();
+
+    // echo every buffer back
+    BenchThread echo([ping,pong,count](){
+        for(qint64 i = 0;i < count;i++){
+            BenchBuffer * in = ping->peekReadable(1000);
+            if(!in){
+                return;
+            }
+            BenchBuffer * out = pong->peekWriteable();
+            if(!out){
+                return;
+            }
+            out->sequence = in->sequence;
+            ping->next(in);
+            pong->push(out);
+        }
+    });
+    echo.start();
+
+    qint64 got = 0;
+    for(qint64 i = 0;i < count;i++){
+        BenchBuffer * out = ping->peekWriteable();
+        out->sequence = static_cast<quint64>(i);
+        ping->push(out);
+        BenchBuffer * in = pong->peekReadable(1000);
+        if(!in){
+            break;
+        }
+        got++;
+        pong->next(in);
+    }
+    echo.wait();
+
+    report("pingpong",name,strategy,got,timer.nsecsElapsed(),contextSwitches() - switches);
+}
+
+int main(int argc,char * argv[])
+{
+    qint64 count = argc > 1 ? atoll(argv[1]) : QUEUE_BENCH_DEFAULT_COUNT;
+    printf("count %lld, queue size %d, cpu %d\n",static_cast<long long>(count),
+           QUEUE_BENCH_QUEUE_SIZE,QThread::idealThreadCount());
+
+    struct Strategy{
+        QueueWaitStrategy strategy;
+        const char * name;
+    };
+    const Strategy strategies[] = {
+        {BlockingWait,"BlockingWait"},
+        {SpinBlockWait,"SpinBlockWait"}
+    };
+
+    for(const Strategy &strategy : strategies){
+        {
+            WaitQueue<BenchBuffer> queue(QUEUE_BENCH_QUEUE_SIZE,strategy.strategy);
+            spsc(&queue,"WaitQueue",strategy.name,count);
+        }
+        {
+            WaitQueue<BenchBuffer> queue(QUEUE_BENCH_QUEUE_SIZE,strategy.strategy);
+            mpsc(&queue,"WaitQueue",strategy.name,count);
+        }
+        {
+            WaitQueue<BenchBuffer> ping(QUEUE_BENCH_QUEUE_SIZE,strategy.strategy);
+            WaitQueue<BenchBuffer> pong(QUEUE_BENCH_QUEUE_SIZE,strategy.strategy);
+            pingpong(&ping,&pong,"WaitQueue",strategy.name,count / 4);
+        }
+        {
+            // drop timeout far above bench time, reader keep up, nothing is dropped
+            DropQueue<BenchBuffer> queue(QUEUE_BENCH_QUEUE_SIZE,ULONG_MAX,strategy.strategy);
+            spsc(&queue,"DropQueue",strategy.name,count);
+        }
+        {
+            DropQueue<BenchBuffer> queue(QUEUE_BENCH_QUEUE_SIZE,ULONG_MAX,strategy.strategy);
+            mpsc(&queue,"DropQueue",strategy.name,count);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+include(../bench.pri)
+
+TARGET = queuebench
+
+SOURCES += \
+    $$CCL_DIR/queue/slaballocator.cpp \
+    $$CCL_DIR/buffermeta.cpp \
+    $$CCL_DIR/trace.cpp \
+    main.cpp
+
+HEADERS += \
+    $$CCL_DIR/queue/abstractqueue.h \
+    $$CCL_DIR/queue/dropqueue.h \
+    $$CCL_DIR/queue/slaballocator.h \
+    $$CCL_DIR/queue/waitqueue.h \
+    $$CCL_DIR/queue/waitstrategy.h
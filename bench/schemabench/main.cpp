@@ -0,0 +1,170 @@
+﻿#include "ccl/schema.h"
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * schema decode benchmark, SchemaFrame against hand written memcpy and byte swap.
+ * 1.registers: modbus tcp read holding register response, 125 register summed.
+ * 2.telemetry: fixed frame of integer, float and bit field, every field summed.
+ * frame is read from a ring of SCHEMA_BENCH_FRAME_COUNT frame, result feed a volatile sink.
+ * schema and hand run in turn SCHEMA_BENCH_ROUND time, best round is printed.
+ * usage: schemabench [count], default 20000000 frame per round.
+ */
+
+#define SCHEMA_BENCH_DEFAULT_COUNT 20000000
+#define SCHEMA_BENCH_FRAME_COUNT 256
+#define SCHEMA_BENCH_REGISTER_COUNT 125
+#define SCHEMA_BENCH_ROUND 5
+
+typedef SchemaFrame<SchemaField<quint16>,SchemaField<quint16>,SchemaField<quint16>,
+                    SchemaField<quint8>,SchemaField<quint8>,SchemaField<quint8>,
+                    SchemaRepeated<5,SchemaField<quint16>,SchemaCountByte>> RegisterFrame;
+
+typedef SchemaFrame<SchemaField<quint16>,
+                    SchemaField<quint32>,
+                    SchemaField<float>,SchemaField<float>,SchemaField<float>,
+                    SchemaBits<quint16,SchemaBigEndian,4,4,8>> TelemetryFrame;
+
+static volatile double sink;
+
+static quint16 load16(const char * p)
+{
+    quint16 value;
+    memcpy(&value,p,sizeof(value));
+    return qbswap(value);
+}
+
+static quint32 load32(const char * p)
+{
+    quint32 value;
+    memcpy(&value,p,sizeof(value));
+    return qbswap(value);
+}
+
+static float loadFloat(const char * p)
+{
+    quint32 raw = load32(p);
+    float value;
+    memcpy(&value,&raw,sizeof(value));
+    return value;
+}
+
+static double registersSchema(const char * frame)
+{
+    if(!RegisterFrame::fits(frame,RegisterFrame::size + SCHEMA_BENCH_REGISTER_COUNT * 2)){
+        return 0;
+    }
+    SchemaArrayView<SchemaField<quint16>> registers = RegisterFrame::get<6>(frame);
+    quint64 sum = RegisterFrame::get<0>(frame);
+    for(int i = 0;i < registers.count();i++){
+        sum += registers.at(i);
+    }
+    return static_cast<double>(sum);
+}
+
+static double registersHand(const char * frame)
+{
+    int count = static_cast<uchar>(frame[8]) / 2;
+    if(9 + count * 2 > RegisterFrame::size + SCHEMA_BENCH_REGISTER_COUNT * 2){
+        return 0;
+    }
+    quint64 sum = load16(frame);
+    for(int i = 0;i < count;i++){
+        sum += load16(frame + 9 + i * 2);
+    }
+    return static_cast<double>(sum);
+}
+
+static double telemetrySchema(const char * frame)
+{
+    return TelemetryFrame::get<0>(frame) + TelemetryFrame::get<1>(frame) +
+            TelemetryFrame::get<2>(frame) + TelemetryFrame::get<3>(frame) +
+            TelemetryFrame::get<4>(frame) + TelemetryFrame::bits<5,0>(frame) +
+            TelemetryFrame::bits<5,1>(frame) + TelemetryFrame::bits<5,2>(frame);
+}
+
+static double telemetryHand(const char * frame)
+{
+    quint16 flags = load16(frame + 18);
+    return load16(frame) + load32(frame + 2) +
+            loadFloat(frame + 6) + loadFloat(frame + 10) +
+            loadFloat(frame + 14) + (flags & 0xf) +
+            ((flags >> 4) & 0xf) + ((flags >> 8) & 0xff);
+}
+
+static double run(double (*decode)(const char *),const std::vector<char> &frames,
+                  int frameSize,qint64 count)
+{
+    double sum = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for(qint64 i = 0;i < count;i++){
+        sum += decode(frames.data() + (i % SCHEMA_BENCH_FRAME_COUNT) * frameSize);
+    }
+    qint64 ns = timer.nsecsElapsed();
+    sink = sum;
+    return static_cast<double>(ns) / count;
+}
+
+static void compare(const char * name,double (*schemaDecode)(const char *),
+                    double (*handDecode)(const char *),const std::vector<char> &frames,
+                    int frameSize,qint64 count)
+{
+    double schema = 0;
+    double hand = 0;
+    for(int round = 0;round < SCHEMA_BENCH_ROUND;round++){
+        double schemaRound = run(schemaDecode,frames,frameSize,count);
+        double handRound = run(handDecode,frames,frameSize,count);
+        schema = round == 0 ? schemaRound : qMin(schema,schemaRound);
+        hand = round == 0 ? handRound : qMin(hand,handRound);
+    }
+
+    printf("%-10s schema %8.2f ns/frame  hand %8.2f ns/frame  ratio %5.2f\n",
+           name,schema,hand,schema / hand);
+}
+
+int main(int argc,char * argv[])
+{
+    qint64 count = argc > 1 ? atoll(argv[1]) : SCHEMA_BENCH_DEFAULT_COUNT;
+
+    // modbus response, byte count at offset 8
+    const int registerSize = RegisterFrame::size + SCHEMA_BENCH_REGISTER_COUNT * 2;
+    std::vector<char> registers(static_cast<size_t>(registerSize) * SCHEMA_BENCH_FRAME_COUNT);
+    for(size_t i = 0;i < registers.size();i++){
+        registers[i] = static_cast<char>(rand());
+    }
+    for(int i = 0;i < SCHEMA_BENCH_FRAME_COUNT;i++){
+        char * frame = registers.data() + i * registerSize;
+        RegisterFrame::set<5>(frame,static_cast<quint8>(SCHEMA_BENCH_REGISTER_COUNT * 2));
+    }
+
+    const int telemetrySize = TelemetryFrame::size;
+    std::vector<char> telemetry(static_cast<size_t>(telemetrySize) * SCHEMA_BENCH_FRAME_COUNT);
+    for(int i = 0;i < SCHEMA_BENCH_FRAME_COUNT;i++){
+        char * frame = telemetry.data() + i * telemetrySize;
+        TelemetryFrame::set<0>(frame,static_cast<quint16>(i));
+        TelemetryFrame::set<1>(frame,static_cast<quint32>(rand()));
+        TelemetryFrame::set<2>(frame,static_cast<float>(i) * 0.5f);
+        TelemetryFrame::set<3>(frame,static_cast<float>(rand() % 1000));
+        TelemetryFrame::set<4>(frame,-1.25f);
+        TelemetryFrame::set<5>(frame,static_cast<quint16>(rand()));
+    }
+
+    // same result or the comparison is void
+    for(int i = 0;i < SCHEMA_BENCH_FRAME_COUNT;i++){
+        if(registersSchema(registers.data() + i * registerSize) !=
+                registersHand(registers.data() + i * registerSize) ||
+                telemetrySchema(telemetry.data() + i * telemetrySize) !=
+                telemetryHand(telemetry.data() + i * telemetrySize)){
+            printf("decode mismatch at frame %d\n",i);
+            return 1;
+        }
+    }
+
+    printf("count %lld\n",static_cast<long long>(count));
+    compare("registers",registersSchema,registersHand,registers,registerSize,count / 16);
+    compare("telemetry",telemetrySchema,telemetryHand,telemetry,telemetrySize,count);
+    return 0;
+}
@@ -0,0 +1,9 @@
+include(../bench.pri)
+
+TARGET = schemabench
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    $$CCL_DIR/schema.h
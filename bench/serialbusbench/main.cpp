@@ -0,0 +1,137 @@
+﻿#include "ccl/linkthreadpool.h"
+#include "ccl/serialbus.h"
+#include "ccl/serialbussimulator.h"
+#include "ccl/serialportclient.h"
+#include "ccl/queue/waitqueue.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <vector>
+
+/**
+ * SerialBus benchmark against SerialBusSimulator on pseudo terminal, modbus rtu at real line timing.
+ * 1.SERIALBUS_BENCH_SLAVE_COUNT slave read SERIALBUS_BENCH_REGISTER_COUNT holding register,
+ *   every request is queued at once, bus poll slave round robin.
+ * 2.ideal transaction is request and response on wire, two interFrameDelay and response delay
+ *   of slave, efficiency is ideal over measured.
+ * 3.check: every response is valid, simulator see no frame gap violation and no crc error.
+ *   return 1 if check fail.
+ * usage: serialbusbench [count] [baud], default 2000 request at 115200.
+ */
+
+#define SERIALBUS_BENCH_DEFAULT_COUNT 2000
+#define SERIALBUS_BENCH_SLAVE_COUNT 3
+#define SERIALBUS_BENCH_REGISTER_COUNT 10
+#define SERIALBUS_BENCH_WARM_UP 50
+
+int main(int argc,char * argv[])
+{
+    QCoreApplication app(argc,argv);
+    qRegisterMetaType<SerialPortBuffer>("SerialPortBuffer");
+
+    int count = argc > 1 ? atoi(argv[1]) : SERIALBUS_BENCH_DEFAULT_COUNT;
+    qint32 baudRate = argc > 2 ? atoi(argv[2]) : QSerialPort::Baud115200;
+    SerialBusTiming timing = SerialBus::timing(baudRate,QSerialPort::Data8,
+                                               QSerialPort::NoParity,QSerialPort::OneStop);
+
+    SerialBusSimulator simulator(timing);
+    for(int i = 1;i <= SERIALBUS_BENCH_SLAVE_COUNT;i++){
+        simulator.addSlave(i);
+    }
+    if(!simulator.open()){
+        printf("open pty failure\n");
+        return 1;
+    }
+    simulator.start();
+
+    WaitQueue<SerialPortBuffer> queue;
+    SerialPortClient * client = new SerialPortClient(simulator.slavePath(),
+                                                     static_cast<QSerialPort::BaudRate>(baudRate),
+                                                     QSerialPort::Data8,QSerialPort::NoParity,
+                                                     QSerialPort::OneStop,QSerialPort::NoFlowControl,
+                                                     &queue);
+    SerialBus * bus = new SerialBus(client,SerialBus::modbusRtuFrameLength);
+    bus->setFrameValidator(Checksum::validator(ChecksumCrc16Modbus,ChecksumLittleEndian));
+
+    // bus and client share a thread, bus stop and delete before client drain
+    LinkThreadPool pool;
+    pool.add(bus,LinkGroup,"bus");
+    pool.add(client,LinkGroup,"bus");
+    ResponseThread<SerialPortBuffer,SerialBus> responseThread(&queue,bus);
+    responseThread.start();
+    pool.start();
+
+    // port is opened in link thread, wait first answer
+    bool ready = false;
+    for(int i = 0;i < SERIALBUS_BENCH_WARM_UP && !ready;i++){
+        ready = bus->request(1,SerialBus::modbusRtuRequest(1,0x03,0,1)).get().status == RequestSuccess;
+    }
+
+    int success = 0;
+    qint64 ns = 0;
+    SerialBusStats stats;
+    memset(&stats,0,sizeof(stats));
+    if(ready){
+        bus->resetStats();
+        quint64 gapViolations = simulator.frameGapViolationCount();
+        std::vector<std::future<RequestResult>> results;
+        results.reserve(static_cast<size_t>(count));
+
+        QElapsedTimer timer;
+        timer.start();
+        for(int i = 0;i < count;i++){
+            quint8 slave = static_cast<quint8>(1 + i % SERIALBUS_BENCH_SLAVE_COUNT);
+            results.push_back(bus->request(slave,SerialBus::modbusRtuRequest(slave,0x03,0,
+                                                                            SERIALBUS_BENCH_REGISTER_COUNT)));
+        }
+        for(std::future<RequestResult> &result : results){
+            RequestResult response = result.get();
+            if(response.status == RequestSuccess &&
+                    response.response.size() == 5 + SERIALBUS_BENCH_REGISTER_COUNT * 2){
+                success++;
+            }
+        }
+        ns = timer.nsecsElapsed();
+        stats = bus->stats();
+        gapViolations = simulator.frameGapViolationCount() - gapViolations;
+
+        qint64 ideal = (8 + 5 + SERIALBUS_BENCH_REGISTER_COUNT * 2) * timing.charTime +
+                2 * timing.interFrameDelay + SERIALBUS_SIMULATOR_DEFAULT_RESPONSE_DELAY * 1000;
+        double measured = static_cast<double>(ns) / count;
+        printf("baud %d  slave %d  register %d  count %d\n",
+               baudRate,SERIALBUS_BENCH_SLAVE_COUNT,SERIALBUS_BENCH_REGISTER_COUNT,count);
+        printf("transaction %8.1f /s  %8.1f us  ideal %8.1f us  efficiency %5.2f\n",
+               1e9 / measured,measured / 1000,ideal / 1000.0,ideal / measured);
+        printf("utilization %5.2f  timeout %llu  invalid %llu  unmatched byte %llu\n",
+               stats.utilization,static_cast<unsigned long long>(stats.timeouts),
+               static_cast<unsigned long long>(stats.invalids),
+               static_cast<unsigned long long>(stats.unmatchedBytes));
+        for(int i = 1;i <= SERIALBUS_BENCH_SLAVE_COUNT;i++){
+            SerialBusSlaveStats slave = bus->slaveStats(i);
+            printf("slave %d  response %llu  last latency %lld us  max latency %lld us\n",
+                   i,static_cast<unsigned long long>(slave.responses),
+                   static_cast<long long>(slave.lastLatency),static_cast<long long>(slave.maxLatency));
+        }
+        printf("simulator frame gap violation %llu  crc error %llu\n",
+               static_cast<unsigned long long>(gapViolations),
+               static_cast<unsigned long long>(simulator.crcErrorCount()));
+        if(gapViolations > 0){
+            success = 0;
+        }
+    }else{
+        printf("no answer from simulator on %s\n",qPrintable(simulator.slavePath()));
+    }
+
+    // feed stop before bus is deleted
+    responseThread.requestInterruption();
+    queue.abort();
+    responseThread.wait();
+    pool.shutdown();
+    simulator.requestInterruption();
+    simulator.wait();
+
+    return ready && success == count && simulator.crcErrorCount() == 0 ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+include(../bench.pri)
+
+# SerialBus against SerialBusSimulator on a pseudo terminal, unix only
+QT += network serialport
+
+TARGET = serialbusbench
+
+SOURCES += \
+    $$CCL_DIR/queue/slaballocator.cpp \
+    $$CCL_DIR/buffermeta.cpp \
+    $$CCL_DIR/checksum.cpp \
+    $$CCL_DIR/cpufeature.cpp \
+    $$CCL_DIR/framescanner.cpp \
+    $$CCL_DIR/latencyhistogram.cpp \
+    $$CCL_DIR/linkthreadpool.cpp \
+    $$CCL_DIR/metrics.cpp \
+    $$CCL_DIR/outboundbuffer.cpp \
+    $$CCL_DIR/outboundspool.cpp \
+    $$CCL_DIR/requestengine.cpp \
+    $$CCL_DIR/serialbus.cpp \
+    $$CCL_DIR/serialbussimulator.cpp \
+    $$CCL_DIR/serialportclient.cpp \
+    $$CCL_DIR/tcpclient.cpp \
+    $$CCL_DIR/timerwheel.cpp \
+    $$CCL_DIR/trace.cpp \
+    main.cpp
+
+HEADERS += \
+    $$CCL_DIR/queue/waitqueue.h \
+    $$CCL_DIR/linkthreadpool.h \
+    $$CCL_DIR/requestengine.h \
+    $$CCL_DIR/serialbus.h \
+    $$CCL_DIR/serialbussimulator.h \
+    $$CCL_DIR/serialportclient.h \
+    $$CCL_DIR/tcpclient.h
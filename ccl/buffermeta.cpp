@@ -0,0 +1,110 @@
+﻿#include "buffermeta.h"
+#include "trace.h"
+#include <QElapsedTimer>
+
+#ifdef Q_OS_LINUX
+#include <time.h>
+#endif
+
+qint64 bufferMetaNow()
+{
+#if defined(Q_OS_LINUX) && defined(CLOCK_MONOTONIC_RAW)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW,&ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    // one reference for all thread
+    static const QElapsedTimer reference = [](){
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return reference.nsecsElapsed();
+#endif
+}
+
+quint32 bufferMetaNextLinkId()
+{
+    static QAtomicInteger<quint32> linkId(0);
+    return linkId.fetchAndAddRelaxed(1) + 1;
+}
+
+BufferStamper::BufferStamper(quint32 linkId)
+    :m_linkId(linkId),
+      m_sequence(0)
+{
+
+}
+
+quint32 BufferStamper::linkId() const
+{
+    return m_linkId;
+}
+
+void BufferStamper::setLinkId(quint32 linkId)
+{
+    m_linkId = linkId;
+}
+
+quint64 BufferStamper::sequence() const
+{
+    return m_sequence;
+}
+
+void BufferStamper::stamp(BufferMeta *meta, qint64 recvTime)
+{
+    meta->recvTime = recvTime;
+    meta->enqueueTime = bufferMetaNow();
+    meta->sequence = ++m_sequence;
+    meta->linkId = m_linkId;
+
+    CCL_TRACE_MESSAGE_BEGIN(*meta);
+    CCL_TRACE_MESSAGE_STEP(*meta,"enqueue",meta->enqueueTime);
+}
+
+SequenceTracker::SequenceTracker()
+    :m_lostCount(0),
+      m_reorderedCount(0)
+{
+
+}
+
+bool SequenceTracker::check(const BufferMeta &meta)
+{
+    QHash<quint32,quint64>::iterator it = m_lastSequences.find(meta.linkId);
+    if(it == m_lastSequences.end()){
+        // first buffer seen of link, earlier one is not lost
+        m_lastSequences.insert(meta.linkId,meta.sequence);
+        return true;
+    }
+
+    quint64 last = it.value();
+    if(meta.sequence <= last){
+        m_reorderedCount++;
+        return false;
+    }
+
+    it.value() = meta.sequence;
+    if(meta.sequence != last + 1){
+        m_lostCount += meta.sequence - last - 1;
+        return false;
+    }
+    return true;
+}
+
+void SequenceTracker::reset()
+{
+    m_lastSequences.clear();
+    m_lostCount = 0;
+    m_reorderedCount = 0;
+}
+
+quint64 SequenceTracker::lostCount() const
+{
+    return m_lostCount;
+}
+
+quint64 SequenceTracker::reorderedCount() const
+{
+    return m_reorderedCount;
+}
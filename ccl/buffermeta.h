@@ -0,0 +1,84 @@
+﻿#ifndef BUFFERMETA_H
+#define BUFFERMETA_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QHash>
+
+/**
+ * metadata of queued buffer, filled by client.
+ * 1.recvTime: monotonic ns when client got the byte from device, before read syscall.
+ *   all frame split from one read share it.
+ * 2.enqueueTime: monotonic ns just before push to queue.
+ *   stamp begin trace span of the buffer, consumer end it with CCL_TRACE_MESSAGE_END.
+ * 3.sequence: per link, from 1, +1 every pushed buffer. gap is buffer lost, e.g. dropped by DropQueue.
+ * 4.linkId: unique in process, given to client in constructor.
+ * consumer take bufferMetaNow() - recvTime as ingest to consume latency,
+ * and enqueueTime - recvTime as client time.
+ */
+typedef struct BufferMeta_TAG{
+    qint64 recvTime;
+    qint64 enqueueTime;
+    quint64 sequence;
+    quint32 linkId;
+}BufferMeta;
+
+/**
+ * monotonic ns, CLOCK_MONOTONIC_RAW on linux(not slewed by ntp), same clock in every thread.
+ */
+qint64 bufferMetaNow();
+
+/**
+ * next unused link id, from 1.
+ */
+quint32 bufferMetaNextLinkId();
+
+/**
+ * fill metadata of one link, used in client thread only.
+ */
+class BufferStamper
+{
+public:
+    explicit BufferStamper(quint32 linkId = bufferMetaNextLinkId());
+
+    quint32 linkId() const;
+    void setLinkId(quint32 linkId);
+
+    quint64 sequence() const;
+
+    /**
+     * set all field, enqueueTime is now, call just before push.
+     */
+    void stamp(BufferMeta * meta,qint64 recvTime);
+
+private:
+    quint32 m_linkId;
+    quint64 m_sequence;
+};
+
+/**
+ * check sequence of buffer from many link, used in consumer thread only.
+ * lost: skipped sequence. reordered: sequence older than last one of the link.
+ * late buffer is counted in lost when skipped, and in reordered when it arrive.
+ */
+class SequenceTracker
+{
+public:
+    SequenceTracker();
+
+    /**
+     * return false if buffer is not next of its link.
+     */
+    bool check(const BufferMeta &meta);
+    void reset();
+
+    quint64 lostCount() const;
+    quint64 reorderedCount() const;
+
+private:
+    QHash<quint32,quint64> m_lastSequences;
+    quint64 m_lostCount;
+    quint64 m_reorderedCount;
+};
+
+#endif // BUFFERMETA_H
@@ -0,0 +1,588 @@
+﻿#include "checksum.h"
+#include <QtEndian>
+#include <cstring>
+
+#include "cpufeature.h"
+
+#ifdef CCL_X86
+#include <immintrin.h>
+#endif
+
+// folding need at least 4 lane of 16 byte, shorter buffer use table
+#define CHECKSUM_FOLD_MIN 64
+#define CHECKSUM_WIDE_FOLD_MIN 256
+
+namespace {
+
+struct CrcTable{
+    quint32 table[8][256];
+    // carry less multiply constant of fold distance 128, 256, 512, 1024 bit
+    // [0]: x^(distance + 63) mod poly, [1]: x^(distance - 1) mod poly, bit reflected
+    quint64 fold128[2];
+    quint64 fold256[2];
+    quint64 fold512[2];
+    quint64 fold1024[2];
+};
+
+quint32 reflect(quint32 value,int width)
+{
+    quint32 ret = 0;
+    for(int i = 0;i < width;i++){
+        if(value & (1u << i)){
+            ret |= 1u << (width - 1 - i);
+        }
+    }
+    return ret;
+}
+
+quint64 reflect64(quint64 value)
+{
+    quint64 ret = 0;
+    for(int i = 0;i < 64;i++){
+        if(value & (Q_UINT64_C(1) << i)){
+            ret |= Q_UINT64_C(1) << (63 - i);
+        }
+    }
+    return ret;
+}
+
+/**
+ * x^power mod poly, poly is normal form without top bit.
+ */
+quint64 foldConstant(int power,quint32 poly,int width)
+{
+    quint64 top = Q_UINT64_C(1) << (width - 1);
+    quint64 mask = (Q_UINT64_C(1) << width) - 1;
+    quint64 ret = 1;
+    for(int i = 0;i < power;i++){
+        bool carry = ret & top;
+        ret = (ret << 1) & mask;
+        if(carry){
+            ret ^= poly;
+        }
+    }
+    return reflect64(ret);
+}
+
+CrcTable makeTable(quint32 reflectedPoly,int width)
+{
+    CrcTable table;
+    for(quint32 i = 0;i < 256;i++){
+        quint32 crc = i;
+        for(int bit = 0;bit < 8;bit++){
+            crc = (crc & 1) ? (crc >> 1) ^ reflectedPoly : crc >> 1;
+        }
+        table.table[0][i] = crc;
+    }
+    for(int slice = 1;slice < 8;slice++){
+        for(int i = 0;i < 256;i++){
+            quint32 crc = table.table[slice - 1][i];
+            table.table[slice][i] = (crc >> 8) ^ table.table[0][crc & 0xff];
+        }
+    }
+
+    quint32 poly = reflect(reflectedPoly,width);
+    const int distances[4] = {128,256,512,1024};
+    quint64 * folds[4] = {table.fold128,table.fold256,table.fold512,table.fold1024};
+    for(int i = 0;i < 4;i++){
+        folds[i][0] = foldConstant(distances[i] + 63,poly,width);
+        folds[i][1] = foldConstant(distances[i] - 1,poly,width);
+    }
+    return table;
+}
+
+const CrcTable & crc16ModbusTable()
+{
+    static const CrcTable table = makeTable(0xa001,16);
+    return table;
+}
+
+const CrcTable & crc32Table()
+{
+    static const CrcTable table = makeTable(0xedb88320,32);
+    return table;
+}
+
+const CrcTable & crc32cTable()
+{
+    static const CrcTable table = makeTable(0x82f63b78,32);
+    return table;
+}
+
+inline quint32 loadLe32(const uchar * p)
+{
+    quint32 value;
+    memcpy(&value,p,sizeof(value));
+    return qFromLittleEndian(value);
+}
+
+quint32 crcByte(const CrcTable &t,quint32 crc,const uchar * p,qint64 len)
+{
+    while(len-- > 0){
+        crc = (crc >> 8) ^ t.table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+quint32 crcSlice8(const CrcTable &t,quint32 crc,const uchar * p,qint64 len)
+{
+    while(len >= 8){
+        quint32 one = loadLe32(p) ^ crc;
+        quint32 two = loadLe32(p + 4);
+        crc = t.table[7][one & 0xff] ^
+                t.table[6][(one >> 8) & 0xff] ^
+                t.table[5][(one >> 16) & 0xff] ^
+                t.table[4][one >> 24] ^
+                t.table[3][two & 0xff] ^
+                t.table[2][(two >> 8) & 0xff] ^
+                t.table[1][(two >> 16) & 0xff] ^
+                t.table[0][two >> 24];
+        p += 8;
+        len -= 8;
+    }
+    return crcByte(t,crc,p,len);
+}
+
+quint64 sumByte(const uchar * p,qint64 len)
+{
+    quint64 sum = 0;
+    while(len-- > 0){
+        sum += *p++;
+    }
+    return sum;
+}
+
+quint64 sumSlice8(const uchar * p,qint64 len)
+{
+    // 8 byte per step, even and odd byte add in 16 bit lane
+    const quint64 mask = Q_UINT64_C(0x00ff00ff00ff00ff);
+    quint64 ret = 0;
+    while(len >= 8){
+        quint64 acc = 0;
+        // 16 bit lane never overflow in 128 step
+        for(int step = 0;step < 128 && len >= 8;step++){
+            quint64 value;
+            memcpy(&value,p,sizeof(value));
+            acc += (value & mask) + ((value >> 8) & mask);
+            p += 8;
+            len -= 8;
+        }
+        ret += (acc & 0xffff) + ((acc >> 16) & 0xffff) + ((acc >> 32) & 0xffff) + (acc >> 48);
+    }
+    return ret + sumByte(p,len);
+}
+
+#ifdef CCL_X86
+
+CCL_TARGET("sse2")
+quint64 sumSse2(const uchar * p,qint64 len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    while(len >= 16){
+        // sum of absolute difference with zero is byte sum of every 8 byte
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        acc = _mm_add_epi64(acc,_mm_sad_epu8(data,zero));
+        p += 16;
+        len -= 16;
+    }
+    quint64 lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes),acc);
+    return lanes[0] + lanes[1] + sumByte(p,len);
+}
+
+CCL_TARGET("avx2")
+quint64 sumAvx2(const uchar * p,qint64 len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    while(len >= 32){
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        acc = _mm256_add_epi64(acc,_mm256_sad_epu8(data,zero));
+        p += 32;
+        len -= 32;
+    }
+    quint64 lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes),acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumByte(p,len);
+}
+
+CCL_TARGET("sse4.2")
+quint32 crc32cSse42(quint32 crc,const uchar * p,qint64 len)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    quint64 crc64 = crc;
+    while(len >= 8){
+        quint64 value;
+        memcpy(&value,p,sizeof(value));
+        crc64 = _mm_crc32_u64(crc64,value);
+        p += 8;
+        len -= 8;
+    }
+    crc = static_cast<quint32>(crc64);
+#endif
+    while(len >= 4){
+        quint32 value;
+        memcpy(&value,p,sizeof(value));
+        crc = _mm_crc32_u32(crc,value);
+        p += 4;
+        len -= 4;
+    }
+    while(len-- > 0){
+        crc = _mm_crc32_u8(crc,*p++);
+    }
+    return crc;
+}
+
+/**
+ * move 16 byte block forward by fold distance, x low is first 8 byte on wire.
+ */
+CCL_TARGET("sse2,pclmul")
+inline __m128i crcFold(__m128i x,__m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),_mm_clmulepi64_si128(x,k,0x11));
+}
+
+CCL_TARGET("sse2,pclmul")
+inline __m128i crcFoldConstant(const quint64 * fold)
+{
+    return _mm_set_epi64x(static_cast<qint64>(fold[1]),static_cast<qint64>(fold[0]));
+}
+
+CCL_TARGET("sse2,pclmul")
+inline const __m128i * crcBlock(const uchar * p)
+{
+    return reinterpret_cast<const __m128i *>(p);
+}
+
+/**
+ * fold 16 byte block to remainder of a 16 byte block, then finish by table.
+ */
+CCL_TARGET("sse2,pclmul")
+quint32 crcFoldTail(const CrcTable &t,__m128i x,const uchar * p,qint64 len)
+{
+    __m128i k128 = crcFoldConstant(t.fold128);
+    while(len >= 16){
+        x = _mm_xor_si128(crcFold(x,k128),_mm_loadu_si128(crcBlock(p)));
+        p += 16;
+        len -= 16;
+    }
+
+    uchar block[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(block),x);
+    quint32 crc = crcSlice8(t,0,block,16);
+    return crcSlice8(t,crc,p,len);
+}
+
+CCL_TARGET("sse2,pclmul")
+quint32 crcPclmul(const CrcTable &t,quint32 crc,const uchar * p,qint64 len)
+{
+    if(len < CHECKSUM_FOLD_MIN){
+        return crcSlice8(t,crc,p,len);
+    }
+
+    // crc register is xor into first byte of message
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128(crcBlock(p)),
+                               _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x1 = _mm_loadu_si128(crcBlock(p + 16));
+    __m128i x2 = _mm_loadu_si128(crcBlock(p + 32));
+    __m128i x3 = _mm_loadu_si128(crcBlock(p + 48));
+    p += 64;
+    len -= 64;
+
+    // 4 independent lane hide carry less multiply latency
+    __m128i k512 = crcFoldConstant(t.fold512);
+    while(len >= 64){
+        x0 = _mm_xor_si128(crcFold(x0,k512),_mm_loadu_si128(crcBlock(p)));
+        x1 = _mm_xor_si128(crcFold(x1,k512),_mm_loadu_si128(crcBlock(p + 16)));
+        x2 = _mm_xor_si128(crcFold(x2,k512),_mm_loadu_si128(crcBlock(p + 32)));
+        x3 = _mm_xor_si128(crcFold(x3,k512),_mm_loadu_si128(crcBlock(p + 48)));
+        p += 64;
+        len -= 64;
+    }
+
+    __m128i k128 = crcFoldConstant(t.fold128);
+    x0 = _mm_xor_si128(crcFold(x0,k128),x1);
+    x0 = _mm_xor_si128(crcFold(x0,k128),x2);
+    x0 = _mm_xor_si128(crcFold(x0,k128),x3);
+    return crcFoldTail(t,x0,p,len);
+}
+
+#if defined(__GNUC__)
+
+CCL_TARGET("avx2,pclmul,vpclmulqdq")
+inline __m256i crcFold256(__m256i y,__m256i k)
+{
+    return _mm256_xor_si256(_mm256_clmulepi64_epi128(y,k,0x00),
+                            _mm256_clmulepi64_epi128(y,k,0x11));
+}
+
+CCL_TARGET("avx2,pclmul,vpclmulqdq")
+inline __m256i crcFoldConstant256(const quint64 * fold)
+{
+    return _mm256_set_epi64x(static_cast<qint64>(fold[1]),static_cast<qint64>(fold[0]),
+                             static_cast<qint64>(fold[1]),static_cast<qint64>(fold[0]));
+}
+
+CCL_TARGET("avx2,pclmul,vpclmulqdq")
+inline __m256i crcLoad256(const uchar * p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+CCL_TARGET("avx2,pclmul,vpclmulqdq")
+quint32 crcVpclmul(const CrcTable &t,quint32 crc,const uchar * p,qint64 len)
+{
+    if(len < CHECKSUM_WIDE_FOLD_MIN){
+        return crcPclmul(t,crc,p,len);
+    }
+
+    __m256i y0 = _mm256_xor_si256(crcLoad256(p),
+                                  _mm256_setr_epi32(static_cast<int>(crc),0,0,0,0,0,0,0));
+    __m256i y1 = crcLoad256(p + 32);
+    __m256i y2 = crcLoad256(p + 64);
+    __m256i y3 = crcLoad256(p + 96);
+    p += 128;
+    len -= 128;
+
+    __m256i k1024 = crcFoldConstant256(t.fold1024);
+    while(len >= 128){
+        y0 = _mm256_xor_si256(crcFold256(y0,k1024),crcLoad256(p));
+        y1 = _mm256_xor_si256(crcFold256(y1,k1024),crcLoad256(p + 32));
+        y2 = _mm256_xor_si256(crcFold256(y2,k1024),crcLoad256(p + 64));
+        y3 = _mm256_xor_si256(crcFold256(y3,k1024),crcLoad256(p + 96));
+        p += 128;
+        len -= 128;
+    }
+
+    __m256i k256 = crcFoldConstant256(t.fold256);
+    y0 = _mm256_xor_si256(crcFold256(y0,k256),y1);
+    y0 = _mm256_xor_si256(crcFold256(y0,k256),y2);
+    y0 = _mm256_xor_si256(crcFold256(y0,k256),y3);
+
+    __m128i x = _mm_xor_si128(crcFold(_mm256_castsi256_si128(y0),crcFoldConstant(t.fold128)),
+                              _mm256_extracti128_si256(y0,1));
+    // tail is legacy sse, dirty upper ymm cost a state transition every call, x is kept
+    _mm256_zeroupper();
+    return crcFoldTail(t,x,p,len);
+}
+
+#endif
+
+#endif
+
+ChecksumImpl resolve(ChecksumType type,ChecksumImpl impl)
+{
+    if(impl == ChecksumAuto){
+        impl = ChecksumAvx2;
+    }
+
+    const CpuFeature &feature = cpuFeature();
+    switch(type){
+    case ChecksumSum8:
+    case ChecksumLrc:
+        if(impl == ChecksumAvx2 && !feature.avx2){
+            impl = ChecksumSse42;
+        }
+        if(impl == ChecksumPclmul){
+            impl = ChecksumSse42;
+        }
+        if(impl == ChecksumSse42 && !feature.sse2){
+            impl = ChecksumSlice8;
+        }
+        break;
+    case ChecksumCrc16Modbus:
+    case ChecksumCrc32:
+    case ChecksumCrc32c:
+#if !defined(__GNUC__)
+        // no vpclmulqdq intrinsic target on this compiler
+        if(impl == ChecksumAvx2){
+            impl = ChecksumPclmul;
+        }
+#endif
+        if(impl == ChecksumAvx2 && !feature.vpclmul){
+            impl = ChecksumPclmul;
+        }
+        if(impl == ChecksumPclmul && !(feature.pclmul && feature.sse2)){
+            impl = ChecksumSse42;
+        }
+        if(impl == ChecksumSse42 && !(type == ChecksumCrc32c && feature.sse42)){
+            impl = ChecksumSlice8;
+        }
+        break;
+    }
+    return impl;
+}
+
+quint64 byteSum(const char * data,qint64 len,ChecksumImpl impl)
+{
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    switch(resolve(ChecksumSum8,impl)){
+#ifdef CCL_X86
+    case ChecksumAvx2:
+        return sumAvx2(p,len);
+    case ChecksumSse42:
+        return sumSse2(p,len);
+#endif
+    case ChecksumSlice8:
+        return sumSlice8(p,len);
+    default:
+        return sumByte(p,len);
+    }
+}
+
+quint32 crcUpdate(ChecksumType type,const CrcTable &t,quint32 crc,const char * data,qint64 len,
+                  ChecksumImpl impl)
+{
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    impl = resolve(type,impl);
+#ifdef CCL_X86
+    // crc32 instruction is faster than folding setup for short frame
+    if(type == ChecksumCrc32c && impl >= ChecksumPclmul &&
+            len < CHECKSUM_WIDE_FOLD_MIN && cpuFeature().sse42){
+        impl = ChecksumSse42;
+    }
+#endif
+
+    switch(impl){
+#ifdef CCL_X86
+#if defined(__GNUC__)
+    case ChecksumAvx2:
+        return crcVpclmul(t,crc,p,len);
+#endif
+    case ChecksumPclmul:
+        return crcPclmul(t,crc,p,len);
+    case ChecksumSse42:
+        return crc32cSse42(crc,p,len);
+#endif
+    case ChecksumSlice8:
+        return crcSlice8(t,crc,p,len);
+    default:
+        return crcByte(t,crc,p,len);
+    }
+}
+
+}
+
+quint8 Checksum::sum8(const char *data, qint64 len, ChecksumImpl impl)
+{
+    return static_cast<quint8>(byteSum(data,len,impl));
+}
+
+quint8 Checksum::lrc(const char *data, qint64 len, ChecksumImpl impl)
+{
+    return static_cast<quint8>(0 - byteSum(data,len,impl));
+}
+
+quint16 Checksum::crc16Modbus(const char *data, qint64 len, quint16 crc, ChecksumImpl impl)
+{
+    return static_cast<quint16>(crcUpdate(ChecksumCrc16Modbus,crc16ModbusTable(),crc,data,len,impl));
+}
+
+quint32 Checksum::crc32(const char *data, qint64 len, quint32 crc, ChecksumImpl impl)
+{
+    return ~crcUpdate(ChecksumCrc32,crc32Table(),~crc,data,len,impl);
+}
+
+quint32 Checksum::crc32c(const char *data, qint64 len, quint32 crc, ChecksumImpl impl)
+{
+    return ~crcUpdate(ChecksumCrc32c,crc32cTable(),~crc,data,len,impl);
+}
+
+quint32 Checksum::compute(ChecksumType type, const char *data, qint64 len, ChecksumImpl impl)
+{
+    switch(type){
+    case ChecksumSum8:
+        return sum8(data,len,impl);
+    case ChecksumLrc:
+        return lrc(data,len,impl);
+    case ChecksumCrc16Modbus:
+        return crc16Modbus(data,len,0xffff,impl);
+    case ChecksumCrc32:
+        return crc32(data,len,0,impl);
+    case ChecksumCrc32c:
+        return crc32c(data,len,0,impl);
+    }
+    return 0;
+}
+
+int Checksum::size(ChecksumType type)
+{
+    switch(type){
+    case ChecksumSum8:
+    case ChecksumLrc:
+        return 1;
+    case ChecksumCrc16Modbus:
+        return 2;
+    case ChecksumCrc32:
+    case ChecksumCrc32c:
+        return 4;
+    }
+    return 0;
+}
+
+bool Checksum::verify(ChecksumType type, const char *data, qint64 len,
+                      ChecksumByteOrder order, int offset)
+{
+    int checksumSize = size(type);
+    if(len < offset + checksumSize){
+        return false;
+    }
+
+    const uchar * field = reinterpret_cast<const uchar *>(data + len - checksumSize);
+    quint32 expected = 0;
+    for(int i = 0;i < checksumSize;i++){
+        int idx = order == ChecksumLittleEndian ? checksumSize - 1 - i : i;
+        expected = (expected << 8) | field[idx];
+    }
+    return compute(type,data + offset,len - offset - checksumSize) == expected;
+}
+
+FrameValidator Checksum::validator(ChecksumType type, ChecksumByteOrder order, int offset)
+{
+    return [type,order,offset](const char * data,qint64 len){
+        return verify(type,data,len,order,offset);
+    };
+}
+
+bool Checksum::isSupported(ChecksumImpl impl)
+{
+    const CpuFeature &feature = cpuFeature();
+    switch(impl){
+    case ChecksumAuto:
+    case ChecksumByte:
+    case ChecksumSlice8:
+        return true;
+    case ChecksumSse42:
+        return feature.sse42;
+    case ChecksumPclmul:
+        return feature.pclmul;
+    case ChecksumAvx2:
+        return feature.avx2;
+    }
+    return false;
+}
+
+ChecksumImpl Checksum::implementation(ChecksumType type)
+{
+    return resolve(type,ChecksumAuto);
+}
+
+QString Checksum::implementationName(ChecksumImpl impl)
+{
+    switch(impl){
+    case ChecksumAuto:
+        return QString("auto");
+    case ChecksumByte:
+        return QString("byte");
+    case ChecksumSlice8:
+        return QString("slice8");
+    case ChecksumSse42:
+        return QString("sse4.2");
+    case ChecksumPclmul:
+        return QString("pclmul");
+    case ChecksumAvx2:
+        return QString("avx2");
+    }
+    return QString();
+}
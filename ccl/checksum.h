@@ -0,0 +1,80 @@
+﻿#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <QtGlobal>
+#include <QString>
+#include <functional>
+
+enum ChecksumType{
+    ChecksumSum8,
+    ChecksumLrc,
+    ChecksumCrc16Modbus,
+    ChecksumCrc32,
+    ChecksumCrc32c
+};
+
+/**
+ * checksum implementation, ChecksumAuto pick the fastest supported by cpu at runtime.
+ * 1.ChecksumByte: byte by byte table, baseline.
+ * 2.ChecksumSlice8: 8 byte per step with 8 table, portable.
+ * 3.ChecksumSse42: crc32 instruction, crc32c only. sse2 byte sum for sum8 and lrc.
+ * 4.ChecksumPclmul: carry less multiply folding, crc16 modbus, crc32, crc32c.
+ * 5.ChecksumAvx2: 256 bit carry less multiply(vpclmulqdq) folding for crc, 256 bit byte sum.
+ */
+enum ChecksumImpl{
+    ChecksumAuto,
+    ChecksumByte,
+    ChecksumSlice8,
+    ChecksumSse42,
+    ChecksumPclmul,
+    ChecksumAvx2
+};
+
+enum ChecksumByteOrder{
+    ChecksumLittleEndian,
+    ChecksumBigEndian
+};
+
+/**
+ * validate one complete frame, return false if frame must be dropped.
+ */
+typedef std::function<bool(const char * data,qint64 len)> FrameValidator;
+
+/**
+ * checksum of protocol frame.
+ * 1.sum8: byte sum mod 256. lrc: two's complement of sum8(modbus ascii, on binary byte).
+ * 2.crc16 modbus: poly 0x8005 reflected, init 0xffff, no final xor, low byte first on wire.
+ * 3.crc32(ethernet, zlib) and crc32c(castagnoli): reflected, init and final xor 0xffffffff.
+ * 4.continue a checksum: pass previous result as crc, start with default crc.
+ * Warning!!!
+ * implementation not supported by cpu fall back to the next lower one.
+ */
+class Checksum
+{
+public:
+    static quint8 sum8(const char * data,qint64 len,ChecksumImpl impl = ChecksumAuto);
+    static quint8 lrc(const char * data,qint64 len,ChecksumImpl impl = ChecksumAuto);
+    static quint16 crc16Modbus(const char * data,qint64 len,quint16 crc = 0xffff,
+                               ChecksumImpl impl = ChecksumAuto);
+    static quint32 crc32(const char * data,qint64 len,quint32 crc = 0,
+                         ChecksumImpl impl = ChecksumAuto);
+    static quint32 crc32c(const char * data,qint64 len,quint32 crc = 0,
+                          ChecksumImpl impl = ChecksumAuto);
+
+    static quint32 compute(ChecksumType type,const char * data,qint64 len,
+                           ChecksumImpl impl = ChecksumAuto);
+    static int size(ChecksumType type);
+
+    /**
+     * checksum is last size(type) byte of frame, computed over byte from offset to checksum.
+     */
+    static bool verify(ChecksumType type,const char * data,qint64 len,
+                       ChecksumByteOrder order,int offset = 0);
+    static FrameValidator validator(ChecksumType type,ChecksumByteOrder order,int offset = 0);
+
+    static bool isSupported(ChecksumImpl impl);
+    static ChecksumImpl implementation(ChecksumType type);
+    static QString implementationName(ChecksumImpl impl);
+};
+
+#endif // CHECKSUM_H
@@ -0,0 +1,498 @@
+﻿#include "compression.h"
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+#ifdef CCL_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef CCL_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+Compressor::Compressor(CompressionCodec codec, int level, const QByteArray &dictionary)
+    :m_codec(codec),
+      m_level(level),
+      m_dictionary(dictionary),
+      m_cctx(nullptr),
+      m_dctx(nullptr),
+      m_cdict(nullptr),
+      m_ddict(nullptr)
+{
+    if(!isAvailable(m_codec)){
+        qDebug()<<"Compression codec "<<name(m_codec)<<" is not compiled in, use zlib";
+        m_codec = CompressionZlib;
+    }
+
+    if(m_codec == CompressionZlib){
+        // level 0 of zlib is store, 0 here mean default
+        z_stream * deflater = new z_stream;
+        memset(deflater,0,sizeof(z_stream));
+        if(deflateInit(deflater,m_level > 0 ? m_level : Z_DEFAULT_COMPRESSION) != Z_OK){
+            qDebug()<<"Zlib deflate init failure! Level: "<<m_level;
+            delete deflater;
+            deflater = nullptr;
+        }
+        z_stream * inflater = new z_stream;
+        memset(inflater,0,sizeof(z_stream));
+        if(inflateInit(inflater) != Z_OK){
+            qDebug()<<"Zlib inflate init failure!";
+            delete inflater;
+            inflater = nullptr;
+        }
+        m_cctx = deflater;
+        m_dctx = inflater;
+    }
+
+#ifdef CCL_HAVE_LZ4
+    if(m_codec == CompressionLz4){
+        m_state.resize(LZ4_sizeofState());
+    }
+#endif
+
+#ifdef CCL_HAVE_ZSTD
+    if(m_codec == CompressionZstd){
+        m_cctx = ZSTD_createCCtx();
+        m_dctx = ZSTD_createDCtx();
+        if(!m_dictionary.isEmpty()){
+            // digest dictionary once, not per batch
+            m_cdict = ZSTD_createCDict(m_dictionary.constData(),static_cast<size_t>(m_dictionary.size()),m_level);
+            m_ddict = ZSTD_createDDict(m_dictionary.constData(),static_cast<size_t>(m_dictionary.size()));
+        }
+    }
+#endif
+}
+
+Compressor::~Compressor()
+{
+    if(m_codec == CompressionZlib){
+        z_stream * deflater = static_cast<z_stream *>(m_cctx);
+        z_stream * inflater = static_cast<z_stream *>(m_dctx);
+        if(deflater){
+            deflateEnd(deflater);
+            delete deflater;
+        }
+        if(inflater){
+            inflateEnd(inflater);
+            delete inflater;
+        }
+        return;
+    }
+
+#ifdef CCL_HAVE_ZSTD
+    ZSTD_freeCDict(static_cast<ZSTD_CDict *>(m_cdict));
+    ZSTD_freeDDict(static_cast<ZSTD_DDict *>(m_ddict));
+    ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(m_cctx));
+    ZSTD_freeDCtx(static_cast<ZSTD_DCtx *>(m_dctx));
+#endif
+}
+
+CompressionCodec Compressor::codec() const
+{
+    return m_codec;
+}
+
+int Compressor::level() const
+{
+    return m_level;
+}
+
+QByteArray Compressor::dictionary() const
+{
+    return m_dictionary;
+}
+
+bool Compressor::compress(const char *data, qint64 len, QByteArray *out)
+{
+    switch(m_codec){
+    case CompressionNone:
+        out->resize(static_cast<int>(len));
+        memcpy(out->data(),data,static_cast<size_t>(len));
+        return true;
+    case CompressionZlib:{
+        z_stream * stream = static_cast<z_stream *>(m_cctx);
+        if(!stream || deflateReset(stream) != Z_OK){
+            return false;
+        }
+        // out keep its capacity, no allocation once it is large enough
+        uLong bound = deflateBound(stream,static_cast<uLong>(len));
+        out->resize(static_cast<int>(bound));
+        stream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream->avail_in = static_cast<uInt>(len);
+        stream->next_out = reinterpret_cast<Bytef *>(out->data());
+        stream->avail_out = static_cast<uInt>(bound);
+        if(deflate(stream,Z_FINISH) != Z_STREAM_END){
+            qDebug()<<"Zlib deflate failure! Error: "<<(stream->msg ? stream->msg : "");
+            return false;
+        }
+        out->resize(static_cast<int>(stream->total_out));
+        return true;
+    }
+    case CompressionLz4:{
+#ifdef CCL_HAVE_LZ4
+        int bound = LZ4_compressBound(static_cast<int>(len));
+        out->resize(bound);
+        int size = LZ4_compress_fast_extState(m_state.data(),data,out->data(),static_cast<int>(len),
+                                              bound,m_level > 0 ? m_level : 1);
+        if(size <= 0){
+            return false;
+        }
+        out->resize(size);
+        return true;
+#else
+        return false;
+#endif
+    }
+    case CompressionZstd:{
+#ifdef CCL_HAVE_ZSTD
+        size_t bound = ZSTD_compressBound(static_cast<size_t>(len));
+        out->resize(static_cast<int>(bound));
+        size_t size = m_cdict ?
+                    ZSTD_compress_usingCDict(static_cast<ZSTD_CCtx *>(m_cctx),out->data(),bound,
+                                             data,static_cast<size_t>(len),
+                                             static_cast<const ZSTD_CDict *>(m_cdict)) :
+                    ZSTD_compressCCtx(static_cast<ZSTD_CCtx *>(m_cctx),out->data(),bound,
+                                      data,static_cast<size_t>(len),m_level);
+        if(ZSTD_isError(size)){
+            qDebug()<<"Zstd compress failure! Error: "<<ZSTD_getErrorName(size);
+            return false;
+        }
+        out->resize(static_cast<int>(size));
+        return true;
+#else
+        return false;
+#endif
+    }
+    }
+    return false;
+}
+
+bool Compressor::decompress(const char *data, qint64 len, qint64 rawSize, QByteArray *out)
+{
+    switch(m_codec){
+    case CompressionNone:
+        if(len != rawSize){
+            return false;
+        }
+        out->resize(static_cast<int>(len));
+        memcpy(out->data(),data,static_cast<size_t>(len));
+        return true;
+    case CompressionZlib:{
+        z_stream * stream = static_cast<z_stream *>(m_dctx);
+        if(!stream || inflateReset(stream) != Z_OK){
+            return false;
+        }
+        out->resize(static_cast<int>(rawSize));
+        stream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream->avail_in = static_cast<uInt>(len);
+        stream->next_out = reinterpret_cast<Bytef *>(out->data());
+        stream->avail_out = static_cast<uInt>(rawSize);
+        if(inflate(stream,Z_FINISH) != Z_STREAM_END){
+            qDebug()<<"Zlib inflate failure! Error: "<<(stream->msg ? stream->msg : "");
+            return false;
+        }
+        return static_cast<qint64>(stream->total_out) == rawSize;
+    }
+    case CompressionLz4:{
+#ifdef CCL_HAVE_LZ4
+        out->resize(static_cast<int>(rawSize));
+        int size = LZ4_decompress_safe(data,out->data(),static_cast<int>(len),static_cast<int>(rawSize));
+        return size == rawSize;
+#else
+        return false;
+#endif
+    }
+    case CompressionZstd:{
+#ifdef CCL_HAVE_ZSTD
+        out->resize(static_cast<int>(rawSize));
+        size_t size = m_ddict ?
+                    ZSTD_decompress_usingDDict(static_cast<ZSTD_DCtx *>(m_dctx),out->data(),
+                                               static_cast<size_t>(rawSize),data,static_cast<size_t>(len),
+                                               static_cast<const ZSTD_DDict *>(m_ddict)) :
+                    ZSTD_decompressDCtx(static_cast<ZSTD_DCtx *>(m_dctx),out->data(),
+                                        static_cast<size_t>(rawSize),data,static_cast<size_t>(len));
+        if(ZSTD_isError(size)){
+            qDebug()<<"Zstd decompress failure! Error: "<<ZSTD_getErrorName(size);
+            return false;
+        }
+        return static_cast<qint64>(size) == rawSize;
+#else
+        return false;
+#endif
+    }
+    }
+    return false;
+}
+
+bool Compressor::isAvailable(CompressionCodec codec)
+{
+    switch(codec){
+    case CompressionNone:
+    case CompressionZlib:
+        return true;
+    case CompressionLz4:
+#ifdef CCL_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    case CompressionZstd:
+#ifdef CCL_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char *Compressor::name(CompressionCodec codec)
+{
+    switch(codec){
+    case CompressionNone:
+        return "none";
+    case CompressionZlib:
+        return "zlib";
+    case CompressionLz4:
+        return "lz4";
+    case CompressionZstd:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+QByteArray Compressor::trainDictionary(const QList<QByteArray> &samples, int size)
+{
+#ifdef CCL_HAVE_ZSTD
+    QByteArray buffer;
+    std::vector<size_t> sizes;
+    for(const QByteArray &sample : samples){
+        buffer.append(sample);
+        sizes.push_back(static_cast<size_t>(sample.size()));
+    }
+
+    QByteArray dictionary(size,0);
+    size_t len = ZDICT_trainFromBuffer(dictionary.data(),static_cast<size_t>(size),buffer.constData(),
+                                       sizes.data(),static_cast<unsigned>(sizes.size()));
+    if(ZDICT_isError(len)){
+        qDebug()<<"Train dictionary failure! Error: "<<ZDICT_getErrorName(len);
+        return QByteArray();
+    }
+    dictionary.resize(static_cast<int>(len));
+    return dictionary;
+#else
+    Q_UNUSED(samples)
+    Q_UNUSED(size)
+    return QByteArray();
+#endif
+}
+
+CompressionStage::CompressionStage(CompressionCodec codec,
+                                   const CompressedBatchSink &sink,
+                                   int level,
+                                   const QByteArray &dictionary)
+    :m_compressor(codec,level,dictionary),
+      m_sink(sink),
+      m_batchBytes(COMPRESSION_DEFAULT_BATCH_BYTES),
+      m_batchCount(COMPRESSION_DEFAULT_BATCH_COUNT),
+      m_flushInterval(COMPRESSION_DEFAULT_FLUSH_INTERVAL),
+      m_frameCount(0),
+      m_firstRecvTime(0),
+      m_lastRecvTime(0),
+      m_batchStart(0)
+{
+    m_batch.reserve(m_batchBytes);
+    m_output.reserve(m_batchBytes);
+}
+
+void CompressionStage::setBatchLimits(int batchBytes, int batchCount, int flushInterval)
+{
+    m_batchBytes = batchBytes > 0 ? batchBytes : COMPRESSION_DEFAULT_BATCH_BYTES;
+    m_batchCount = batchCount > 0 ? batchCount : COMPRESSION_DEFAULT_BATCH_COUNT;
+    m_flushInterval = flushInterval > 0 ? flushInterval : COMPRESSION_DEFAULT_FLUSH_INTERVAL;
+    m_batch.reserve(m_batchBytes);
+    m_output.reserve(m_batchBytes);
+}
+
+int CompressionStage::flushInterval() const
+{
+    return m_flushInterval;
+}
+
+void CompressionStage::append(const char *data, qint64 len, const BufferMeta &meta)
+{
+    if(len < 0){
+        return;
+    }
+
+    if(m_frameCount == 0){
+        m_batchStart = bufferMetaNow();
+        m_firstRecvTime = meta.recvTime;
+    }
+
+    int offset = m_batch.size();
+    m_batch.resize(offset + COMPRESSION_RECORD_HEADER_SIZE + static_cast<int>(len));
+    char * p = m_batch.data() + offset;
+    qToBigEndian<quint32>(static_cast<quint32>(len),p);
+    qToBigEndian<quint32>(meta.linkId,p + 4);
+    qToBigEndian<quint64>(meta.sequence,p + 8);
+    qToBigEndian<qint64>(meta.recvTime,p + 16);
+    memcpy(p + COMPRESSION_RECORD_HEADER_SIZE,data,static_cast<size_t>(len));
+
+    m_frameCount++;
+    m_lastRecvTime = meta.recvTime;
+    m_metrics.frames.add();
+    m_metrics.bytesIn.add(static_cast<quint64>(len));
+
+    if(m_batch.size() >= m_batchBytes || m_frameCount >= m_batchCount){
+        flush();
+    }
+}
+
+void CompressionStage::flushIfDue(qint64 now)
+{
+    if(m_frameCount > 0 && now - m_batchStart >= static_cast<qint64>(m_flushInterval) * 1000000){
+        flush();
+    }
+}
+
+void CompressionStage::flush()
+{
+    if(m_frameCount == 0){
+        return;
+    }
+
+    CompressedBatch batch;
+    batch.codec = CompressionNone;
+    batch.frameCount = m_frameCount;
+    batch.rawSize = m_batch.size();
+    batch.firstRecvTime = m_firstRecvTime;
+    batch.lastRecvTime = m_lastRecvTime;
+
+    CompressionCodec codec = m_compressor.codec();
+    if(codec != CompressionNone){
+        qint64 begin = bufferMetaNow();
+        bool ok = m_compressor.compress(m_batch.constData(),m_batch.size(),&m_output);
+        m_metrics.busyTime.add(static_cast<quint64>(bufferMetaNow() - begin));
+
+        if(!ok){
+            m_metrics.failures.add();
+        }else if(m_output.size() >= m_batch.size()){
+            // random payload, raw is smaller
+            m_metrics.storedRaw.add();
+        }else{
+            batch.codec = codec;
+            // copy, m_output keep its capacity for next batch
+            batch.data = QByteArray(m_output.constData(),m_output.size());
+        }
+    }
+    if(batch.codec == CompressionNone){
+        batch.data = QByteArray(m_batch.constData(),m_batch.size());
+    }
+
+    m_batch.resize(0);
+    m_frameCount = 0;
+
+    m_metrics.batches.add();
+    m_metrics.bytesOut.add(static_cast<quint64>(batch.data.size()));
+    if(m_sink){
+        m_sink(batch);
+    }
+}
+
+CompressionCodec CompressionStage::codec() const
+{
+    return m_compressor.codec();
+}
+
+const CompressionMetrics *CompressionStage::metrics() const
+{
+    return &m_metrics;
+}
+
+double CompressionStage::ratio() const
+{
+    quint64 out = m_metrics.bytesOut.value();
+    return out > 0 ? static_cast<double>(m_metrics.bytesIn.value()) / out : 0;
+}
+
+double CompressionStage::throughput() const
+{
+    quint64 busyTime = m_metrics.busyTime.value();
+    return busyTime > 0 ? m_metrics.bytesIn.value() * 1e9 / busyTime : 0;
+}
+
+QByteArray CompressionStage::serialize(const CompressedBatch &batch)
+{
+    QByteArray data(COMPRESSION_BATCH_HEADER_SIZE + batch.data.size(),0);
+    char * p = data.data();
+    qToBigEndian<quint32>(COMPRESSION_BATCH_MAGIC,p);
+    p[4] = static_cast<char>(batch.codec);
+    qToBigEndian<quint32>(static_cast<quint32>(batch.frameCount),p + 8);
+    qToBigEndian<quint32>(static_cast<quint32>(batch.rawSize),p + 12);
+    qToBigEndian<quint32>(static_cast<quint32>(batch.data.size()),p + 16);
+    memcpy(p + COMPRESSION_BATCH_HEADER_SIZE,batch.data.constData(),static_cast<size_t>(batch.data.size()));
+    return data;
+}
+
+qint64 CompressionStage::deserialize(const char *data, qint64 len, CompressedBatch *batch)
+{
+    if(len < COMPRESSION_BATCH_HEADER_SIZE){
+        return 0;
+    }
+    if(qFromBigEndian<quint32>(data) != COMPRESSION_BATCH_MAGIC || static_cast<quint8>(data[4]) > CompressionZstd){
+        return -1;
+    }
+
+    qint64 size = qFromBigEndian<quint32>(data + 16);
+    if(len < COMPRESSION_BATCH_HEADER_SIZE + size){
+        return 0;
+    }
+
+    batch->codec = static_cast<CompressionCodec>(data[4]);
+    batch->frameCount = static_cast<int>(qFromBigEndian<quint32>(data + 8));
+    batch->rawSize = qFromBigEndian<quint32>(data + 12);
+    // in record, known after unpack
+    batch->firstRecvTime = 0;
+    batch->lastRecvTime = 0;
+    batch->data = QByteArray(data + COMPRESSION_BATCH_HEADER_SIZE,static_cast<int>(size));
+    return COMPRESSION_BATCH_HEADER_SIZE + size;
+}
+
+bool CompressionStage::unpack(const CompressedBatch &batch, Compressor *decompressor,
+                              QList<CompressionRecord> *records)
+{
+    QByteArray raw;
+    if(batch.codec == CompressionNone){
+        raw = batch.data;
+    }else if(!decompressor || decompressor->codec() != batch.codec ||
+             !decompressor->decompress(batch.data.constData(),batch.data.size(),batch.rawSize,&raw)){
+        return false;
+    }
+
+    const char * p = raw.constData();
+    qint64 offset = 0;
+    int count = 0;
+    while(offset + COMPRESSION_RECORD_HEADER_SIZE <= raw.size()){
+        qint64 len = qFromBigEndian<quint32>(p + offset);
+        if(offset + COMPRESSION_RECORD_HEADER_SIZE + len > raw.size()){
+            return false;
+        }
+
+        CompressionRecord record;
+        record.meta.linkId = qFromBigEndian<quint32>(p + offset + 4);
+        record.meta.sequence = qFromBigEndian<quint64>(p + offset + 8);
+        record.meta.recvTime = qFromBigEndian<qint64>(p + offset + 16);
+        record.meta.enqueueTime = 0;
+        record.payload = QByteArray(p + offset + COMPRESSION_RECORD_HEADER_SIZE,static_cast<int>(len));
+        records->append(record);
+
+        offset += COMPRESSION_RECORD_HEADER_SIZE + len;
+        count++;
+    }
+    return offset == raw.size() && count == batch.frameCount;
+}
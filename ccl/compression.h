@@ -0,0 +1,239 @@
+﻿#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <QtGlobal>
+#include <QThread>
+#include <QByteArray>
+#include <QList>
+#include <functional>
+
+#include "ccl/queue/abstractqueue.h"
+#include "ccl/buffermeta.h"
+#include "ccl/metrics.h"
+
+#define COMPRESSION_DEFAULT_LEVEL 0
+#define COMPRESSION_DEFAULT_BATCH_BYTES 65536
+#define COMPRESSION_DEFAULT_BATCH_COUNT 1024
+#define COMPRESSION_DEFAULT_FLUSH_INTERVAL 100
+#define COMPRESSION_DEFAULT_DICTIONARY_SIZE 16384
+#define COMPRESSION_RECORD_HEADER_SIZE 24
+#define COMPRESSION_BATCH_HEADER_SIZE 20
+#define COMPRESSION_BATCH_MAGIC 0x43434c5a
+
+/**
+ * 1.CompressionNone: batch is stored raw.
+ * 2.CompressionZlib: zlib deflate, stream and output buffer reused, always available.
+ * 3.CompressionLz4: fast, lowest cpu, qmake CONFIG+=ccl_lz4.
+ * 4.CompressionZstd: better ratio, trained dictionary for small repetitive frame, qmake CONFIG+=ccl_zstd.
+ * codec not compiled in fall back to CompressionZlib.
+ */
+enum CompressionCodec{
+    CompressionNone,
+    CompressionZlib,
+    CompressionLz4,
+    CompressionZstd
+};
+
+/**
+ * data is codec output of rawSize byte of frameCount record.
+ * record: len(4) linkId(4) sequence(8) recvTime(8) payload, big endian.
+ */
+typedef struct CompressedBatch_TAG{
+    CompressionCodec codec;
+    int frameCount;
+    qint64 rawSize;
+    qint64 firstRecvTime;
+    qint64 lastRecvTime;
+    QByteArray data;
+}CompressedBatch;
+
+typedef struct CompressionRecord_TAG{
+    BufferMeta meta;
+    QByteArray payload;
+}CompressionRecord;
+
+/**
+ * called in compression thread for every batch, e.g. write to archive file or forward link.
+ */
+typedef std::function<void(const CompressedBatch &batch)> CompressedBatchSink;
+
+/**
+ * one codec context, reused for every call, no allocation per call after the first.
+ * level 0 is codec default, lz4 take level as acceleration.
+ * dictionary is used by zstd only, compressor and decompressor must have same dictionary.
+ * Warning!!!
+ * not thread safe, one per thread.
+ */
+class Compressor
+{
+public:
+    explicit Compressor(CompressionCodec codec,
+                        int level = COMPRESSION_DEFAULT_LEVEL,
+                        const QByteArray &dictionary = QByteArray());
+    ~Compressor();
+
+    CompressionCodec codec() const;
+    int level() const;
+    QByteArray dictionary() const;
+
+    /**
+     * out is resized to output size, return false on codec error.
+     */
+    bool compress(const char * data,qint64 len,QByteArray * out);
+    bool decompress(const char * data,qint64 len,qint64 rawSize,QByteArray * out);
+
+    static bool isAvailable(CompressionCodec codec);
+    static const char * name(CompressionCodec codec);
+
+    /**
+     * zstd dictionary trained from sample frame, empty if zstd is not compiled in or train failure.
+     * a few hundred sample of real traffic is enough, keep dictionary with archive.
+     */
+    static QByteArray trainDictionary(const QList<QByteArray> &samples,
+                                      int size = COMPRESSION_DEFAULT_DICTIONARY_SIZE);
+
+private:
+    Q_DISABLE_COPY(Compressor)
+
+    CompressionCodec m_codec;
+    int m_level;
+    QByteArray m_dictionary;
+
+    void * m_cctx;
+    void * m_dctx;
+    void * m_cdict;
+    void * m_ddict;
+    QByteArray m_state;
+};
+
+/**
+ * pack frame into batch and compress batch, hand it to sink.
+ * 1.batch
+ *  append frame with meta, batch is compressed when batchBytes or batchCount is reached,
+ *  or flushIfDue is called flushInterval ms after first frame of batch.
+ *  every batch is compressed alone, archive can be read from any batch.
+ * 2.output
+ *  batch not smaller after compress is stored raw(CompressionNone), so is batch of codec error.
+ *  serialize function add header: magic(4) codec(1) reserved(3) frameCount(4) rawSize(4) size(4).
+ * 3.metrics
+ *  register metrics function with MetricsRegistry::addCompression.
+ * Warning!!!
+ * used in one thread, CompressionThread do it. read metrics from any thread.
+ */
+class CompressionStage
+{
+public:
+    explicit CompressionStage(CompressionCodec codec,
+                              const CompressedBatchSink &sink,
+                              int level = COMPRESSION_DEFAULT_LEVEL,
+                              const QByteArray &dictionary = QByteArray());
+
+    /**
+     * set before thread start.
+     */
+    void setBatchLimits(int batchBytes,int batchCount,int flushInterval);
+    int flushInterval() const;
+
+    void append(const char * data,qint64 len,const BufferMeta &meta);
+    void flushIfDue(qint64 now = bufferMetaNow());
+    void flush();
+
+    CompressionCodec codec() const;
+    const CompressionMetrics * metrics() const;
+
+    /**
+     * bytesIn / bytesOut.
+     */
+    double ratio() const;
+
+    /**
+     * raw byte per second of codec time.
+     */
+    double throughput() const;
+
+    static QByteArray serialize(const CompressedBatch &batch);
+
+    /**
+     * return consumed byte, 0 if data is not a complete batch, -1 if data is not a batch.
+     */
+    static qint64 deserialize(const char * data,qint64 len,CompressedBatch * batch);
+
+    /**
+     * decompress batch and split record, decompressor must use codec and dictionary of batch.
+     */
+    static bool unpack(const CompressedBatch &batch,Compressor * decompressor,
+                       QList<CompressionRecord> * records);
+
+private:
+    Q_DISABLE_COPY(CompressionStage)
+
+    Compressor m_compressor;
+    CompressedBatchSink m_sink;
+
+    int m_batchBytes;
+    int m_batchCount;
+    int m_flushInterval;
+
+    QByteArray m_batch;
+    QByteArray m_output;
+    int m_frameCount;
+    qint64 m_firstRecvTime;
+    qint64 m_lastRecvTime;
+    qint64 m_batchStart;
+
+    CompressionMetrics m_metrics;
+};
+
+/**
+ * read queue and compress every buffer, e.g. archive or forward tcpQueue.
+ * T must be buffer with buffer, len and meta member, e.g. TCPBuffer, UDPBuffer.
+ * last batch is flushed when queue is abort or thread is interrupted.
+ * Warning!!!
+ * it is the reader of queue, queue have one reader. to compress a queue read by parse thread too,
+ * give it secondary queue of TeeQueue, e.g.
+ *  TeeQueue<TCPBuffer> tcpQueue(&parseQueue,&archiveQueue);
+ *  CompressionThread<TCPBuffer> archive(&archiveQueue,&stage);
+ */
+template<typename T>
+class CompressionThread: public QThread
+{
+public:
+    CompressionThread(AbstractQueue<T> * queue,CompressionStage * stage,QObject * parent = nullptr);
+
+protected:
+    void run() override;
+
+private:
+    AbstractQueue<T> * m_queue;
+    CompressionStage * m_stage;
+};
+
+template<typename T>
+CompressionThread<T>::CompressionThread(AbstractQueue<T> *queue,
+                                        CompressionStage *stage,
+                                        QObject *parent)
+    :QThread(parent),
+      m_queue(queue),
+      m_stage(stage)
+{
+
+}
+
+template<typename T>
+void CompressionThread<T>::run()
+{
+    unsigned long timeout = static_cast<unsigned long>(m_stage->flushInterval());
+    while(!isInterruptionRequested()){
+        T * buffer = m_queue->peekReadable(timeout);
+        if(buffer){
+            m_stage->append(buffer->buffer,buffer->len,buffer->meta);
+            m_queue->next(buffer);
+        }else if(m_queue->isAbort()){
+            break;
+        }
+        m_stage->flushIfDue();
+    }
+    m_stage->flush();
+}
+
+#endif // COMPRESSION_H
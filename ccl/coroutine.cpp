@@ -0,0 +1,115 @@
+﻿#include "coroutine.h"
+#include <QDebug>
+
+/**
+ * worker thread of CoExecutor.
+ */
+class CoWorker: public QThread
+{
+public:
+    explicit CoWorker(CoExecutor * executor):m_executor(executor) {}
+
+protected:
+    void run() override
+    {
+        m_executor->work();
+    }
+
+private:
+    CoExecutor * m_executor;
+};
+
+CoExecutor::CoExecutor(int threadCount)
+    :m_stop(false),
+      m_taskCount(0)
+{
+    threadCount = threadCount > 0 ? threadCount : 1;
+    for(int i = 0;i < threadCount;i++){
+        QThread * thread = new CoWorker(this);
+        thread->setObjectName(QString("CoExecutor %1").arg(i));
+        m_threads.append(thread);
+        thread->start();
+    }
+}
+
+CoExecutor::~CoExecutor()
+{
+    stop();
+}
+
+void CoExecutor::schedule(std::coroutine_handle<> handle)
+{
+    m_mutex.lock();
+    m_ready.append(handle);
+    m_mutex.unlock();
+    m_cond.wakeOne();
+}
+
+void CoExecutor::spawn(CoTask<void> task)
+{
+    m_taskCount.ref();
+    schedule(run(this,std::move(task)).handle);
+}
+
+CoExecutor::ScheduleAwaiter CoExecutor::schedule()
+{
+    return ScheduleAwaiter{this};
+}
+
+void CoExecutor::stop()
+{
+    m_mutex.lock();
+    m_stop = true;
+    m_mutex.unlock();
+    m_cond.wakeAll();
+
+    for(QThread * thread : m_threads){
+        thread->wait();
+        delete thread;
+    }
+    m_threads.clear();
+
+    if(m_taskCount.load() > 0){
+        qDebug()<<"CoExecutor stopped with task not done! Count: "<<m_taskCount.load();
+    }
+}
+
+int CoExecutor::threadCount() const
+{
+    return m_threads.size();
+}
+
+int CoExecutor::taskCount() const
+{
+    return m_taskCount.load();
+}
+
+int CoExecutor::pendingCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_ready.size();
+}
+
+CoExecutor::Detached CoExecutor::run(CoExecutor *executor, CoTask<void> task)
+{
+    co_await task;
+    executor->m_taskCount.deref();
+}
+
+void CoExecutor::work()
+{
+    for(;;){
+        m_mutex.lock();
+        while(m_ready.isEmpty() && !m_stop){
+            m_cond.wait(&m_mutex);
+        }
+        if(m_stop){
+            m_mutex.unlock();
+            return;
+        }
+        std::coroutine_handle<> handle = m_ready.takeFirst();
+        m_mutex.unlock();
+
+        handle.resume();
+    }
+}
@@ -0,0 +1,452 @@
+﻿#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QList>
+#include <QVector>
+#include <QAtomicInteger>
+#include <QMetaObject>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+
+#include "ccl/queue/abstractqueue.h"
+#include "ccl/requestengine.h"
+
+#define COROUTINE_DEFAULT_THREAD 2
+
+class CoExecutor;
+
+/**
+ * lazy coroutine task, start when awaited, resume awaiting coroutine when done.
+ * e.g.
+ *  CoTask<int> parse(CoQueue<TCPBuffer> * queue){
+ *      TCPBuffer * buffer = co_await queue->read();
+ *      ...
+ *      co_return len;
+ *  }
+ * Warning!!!
+ * 1.exception is not supported, exception out of coroutine terminate process.
+ * 2.task is move only, destroyed task destroy its coroutine.
+ */
+template<typename T>
+class CoTask
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct FinalAwaiter{
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type{
+        T value{};
+        std::coroutine_handle<> continuation;
+
+        CoTask get_return_object() { return CoTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    CoTask(CoTask &&other) noexcept :m_handle(std::exchange(other.m_handle,nullptr)) {}
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if(this != &other){
+            if(m_handle){
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle,nullptr);
+        }
+        return *this;
+    }
+    ~CoTask()
+    {
+        if(m_handle){
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        m_handle.promise().continuation = continuation;
+        return m_handle;
+    }
+    T await_resume() { return std::move(m_handle.promise().value); }
+
+private:
+    explicit CoTask(Handle handle):m_handle(handle) {}
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+
+    Handle m_handle;
+};
+
+template<>
+class CoTask<void>
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct FinalAwaiter{
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type{
+        std::coroutine_handle<> continuation;
+
+        CoTask get_return_object() { return CoTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    CoTask(CoTask &&other) noexcept :m_handle(std::exchange(other.m_handle,nullptr)) {}
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if(this != &other){
+            if(m_handle){
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle,nullptr);
+        }
+        return *this;
+    }
+    ~CoTask()
+    {
+        if(m_handle){
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        m_handle.promise().continuation = continuation;
+        return m_handle;
+    }
+    void await_resume() {}
+
+private:
+    explicit CoTask(Handle handle):m_handle(handle) {}
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+
+    Handle m_handle;
+};
+
+/**
+ * small pool of thread resuming coroutine, many coroutine share few thread.
+ * 1.spawn start a CoTask<void> in pool and own it until done.
+ * 2.co_await schedule() move current coroutine into pool, e.g. from gui thread.
+ * 3.schedule resume a handle in pool, used by awaiter.
+ * 4.stop wait running coroutine suspend, then quit all thread, coroutine not done is never resumed.
+ * Warning!!!
+ * 1.coroutine in pool must not block, use co_await queue->read() instead of peekReadable.
+ * 2.abort queue and wait taskCount reach 0 before stop, suspended coroutine is leaked.
+ */
+class CoExecutor
+{
+public:
+    explicit CoExecutor(int threadCount = COROUTINE_DEFAULT_THREAD);
+    ~CoExecutor();
+
+    void schedule(std::coroutine_handle<> handle);
+    void spawn(CoTask<void> task);
+
+    struct ScheduleAwaiter{
+        CoExecutor * executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { executor->schedule(handle); }
+        void await_resume() const noexcept {}
+    };
+    ScheduleAwaiter schedule();
+
+    void stop();
+
+    int threadCount() const;
+    int taskCount() const;
+    int pendingCount();
+
+private:
+    Q_DISABLE_COPY(CoExecutor)
+
+    friend class CoWorker;
+
+    struct Detached{
+        struct promise_type{
+            Detached get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+    static Detached run(CoExecutor * executor,CoTask<void> task);
+
+    void work();
+
+    QMutex m_mutex;
+    QWaitCondition m_cond;
+    QList<std::coroutine_handle<>> m_ready;
+    bool m_stop;
+
+    QVector<QThread *> m_threads;
+    QAtomicInt m_taskCount;
+};
+
+/**
+ * awaitable read over AbstractQueue, reader coroutine suspend instead of block a thread.
+ * 1.co_await read() return readable buffer, nullptr if queue is abort, call next after use.
+ * 2.every push resume one suspended reader in executor, abort resume all.
+ * e.g.
+ *  CoTask<void> parse(CoQueue<TCPBuffer> * queue){
+ *      while(TCPBuffer * buffer = co_await queue->read()){
+ *          ...
+ *          queue->next(buffer);
+ *      }
+ *  }
+ *  executor.spawn(parse(&coQueue));
+ * Warning!!!
+ * 1.CoQueue set readable notifier of queue, one CoQueue per queue.
+ * 2.destroy CoQueue after writer stopped and reader done.
+ */
+template<typename T>
+class CoQueue
+{
+public:
+    CoQueue(AbstractQueue<T> * queue,CoExecutor * executor)
+        :m_queue(queue),
+          m_executor(executor)
+    {
+        m_queue->setReadableNotifier([this](){ notify(); });
+    }
+
+    ~CoQueue()
+    {
+        m_queue->setReadableNotifier(std::function<void()>());
+    }
+
+    CoTask<T *> read()
+    {
+        for(;;){
+            // timeout 0, never block executor thread
+            T * data = m_queue->peekReadable(0);
+            if(data || m_queue->isAbort()){
+                co_return data;
+            }
+            co_await ReadableAwaiter{this};
+        }
+    }
+
+    void next(T * data)
+    {
+        m_queue->next(data);
+    }
+
+    AbstractQueue<T> * queue() const
+    {
+        return m_queue;
+    }
+
+    int waiterCount()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_waiters.size();
+    }
+
+private:
+    Q_DISABLE_COPY(CoQueue)
+
+    struct ReadableAwaiter{
+        CoQueue * queue;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            // push after this check notify under same lock, wake is never lost
+            QMutexLocker locker(&queue->m_mutex);
+            if(queue->m_queue->readableCount() > 0 || queue->m_queue->isAbort()){
+                return false;
+            }
+            queue->m_waiters.append(handle);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    void notify()
+    {
+        QList<std::coroutine_handle<>> waiters;
+        {
+            QMutexLocker locker(&m_mutex);
+            if(m_waiters.isEmpty()){
+                return;
+            }
+            if(m_queue->isAbort()){
+                waiters.swap(m_waiters);
+            }else{
+                waiters.append(m_waiters.takeFirst());
+            }
+        }
+        for(std::coroutine_handle<> waiter : waiters){
+            m_executor->schedule(waiter);
+        }
+    }
+
+    AbstractQueue<T> * m_queue;
+    CoExecutor * m_executor;
+
+    QMutex m_mutex;
+    QList<std::coroutine_handle<>> m_waiters;
+};
+
+/**
+ * resumed in executor when client emit lowWatermarkReached, used by coWrite.
+ * connected in constructor, signal before co_await is not lost.
+ */
+template<typename Client>
+class CoWatermarkAwaiter
+{
+public:
+    CoWatermarkAwaiter(CoExecutor * executor,Client * client)
+        :m_wake(std::make_shared<Wake>())
+    {
+        m_wake->executor = executor;
+        m_wake->fired = false;
+
+        // signal is emitted in client thread, wake is shared with connection
+        std::shared_ptr<Wake> wake = m_wake;
+        m_connection = QObject::connect(client,&Client::lowWatermarkReached,[wake](qint64){
+            wake->fire();
+        });
+    }
+
+    ~CoWatermarkAwaiter()
+    {
+        QObject::disconnect(m_connection);
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        QMutexLocker locker(&m_wake->mutex);
+        if(m_wake->fired){
+            return false;
+        }
+        m_wake->handle = handle;
+        return true;
+    }
+    void await_resume() const noexcept {}
+
+private:
+    Q_DISABLE_COPY(CoWatermarkAwaiter)
+
+    struct Wake{
+        QMutex mutex;
+        bool fired;
+        std::coroutine_handle<> handle;
+        CoExecutor * executor;
+
+        void fire()
+        {
+            std::coroutine_handle<> waiter;
+            {
+                QMutexLocker locker(&mutex);
+                fired = true;
+                waiter = std::exchange(handle,nullptr);
+            }
+            if(waiter){
+                executor->schedule(waiter);
+            }
+        }
+    };
+
+    std::shared_ptr<Wake> m_wake;
+    QMetaObject::Connection m_connection;
+};
+
+/**
+ * co_await coWrite(executor,client,buffer), client is TcpClient or SerialPortClient.
+ * never block executor thread, with OutboundBlock policy suspend until low watermark.
+ * return false if buffer is dropped or client is stopped.
+ */
+template<typename Client,typename Buffer>
+CoTask<bool> coWrite(CoExecutor * executor,Client * client,Buffer buffer)
+{
+    for(;;){
+        CoWatermarkAwaiter<Client> watermark(executor,client);
+        bool isFull = false;
+        bool ret = client->tryWrite(buffer,&isFull);
+        if(!isFull){
+            co_return ret;
+        }
+        co_await watermark;
+    }
+}
+
+/**
+ * co_await coRequest(executor,engine,frame), resumed in executor with result.
+ */
+class CoRequestAwaiter
+{
+public:
+    CoRequestAwaiter(CoExecutor * executor,RequestEngine * engine,
+                     const QByteArray &frame,unsigned long timeout)
+        :m_executor(executor),
+          m_engine(engine),
+          m_frame(frame),
+          m_timeout(timeout)
+    {
+
+    }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // callback may run before request return, never touch this after schedule
+        RequestResult * result = &m_result;
+        CoExecutor * executor = m_executor;
+        m_engine->request(m_frame,[result,executor,handle](const RequestResult &requestResult){
+            *result = requestResult;
+            executor->schedule(handle);
+        },m_timeout);
+    }
+    RequestResult await_resume() const { return m_result; }
+
+private:
+    CoExecutor * m_executor;
+    RequestEngine * m_engine;
+    QByteArray m_frame;
+    unsigned long m_timeout;
+    RequestResult m_result;
+};
+
+inline CoRequestAwaiter coRequest(CoExecutor * executor,RequestEngine * engine,
+                                  const QByteArray &frame,unsigned long timeout = REQUEST_DEFAULT_TIMEOUT)
+{
+    return CoRequestAwaiter(executor,engine,frame,timeout);
+}
+
+#endif // COROUTINE_H
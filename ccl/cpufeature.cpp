@@ -0,0 +1,46 @@
+﻿#include "cpufeature.h"
+#include <cstring>
+
+#ifdef CCL_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+static CpuFeature detectCpuFeature()
+{
+    CpuFeature feature;
+    memset(&feature,0,sizeof(feature));
+#if defined(CCL_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info,1);
+    feature.sse2 = info[3] & (1 << 26);
+    feature.sse42 = info[2] & (1 << 20);
+    feature.pclmul = info[2] & (1 << 1);
+    bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+            ((_xgetbv(0) & 0x6) == 0x6);
+    __cpuidex(info,7,0);
+    feature.avx2 = osAvx && (info[1] & (1 << 5));
+    feature.vpclmul = feature.avx2 && feature.pclmul && (info[2] & (1 << 10));
+#elif defined(CCL_X86)
+    __builtin_cpu_init();
+    feature.sse2 = __builtin_cpu_supports("sse2");
+    feature.sse42 = __builtin_cpu_supports("sse4.2");
+    feature.pclmul = __builtin_cpu_supports("pclmul");
+    feature.avx2 = __builtin_cpu_supports("avx2");
+    unsigned int eax = 0,ebx = 0,ecx = 0,edx = 0;
+    if(__get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx)){
+        feature.vpclmul = feature.avx2 && feature.pclmul && (ecx & (1 << 10));
+    }
+#endif
+    return feature;
+}
+
+const CpuFeature &cpuFeature()
+{
+    static const CpuFeature feature = detectCpuFeature();
+    return feature;
+}
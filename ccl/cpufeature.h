@@ -0,0 +1,32 @@
+﻿#ifndef CPUFEATURE_H
+#define CPUFEATURE_H
+
+#include <QtGlobal>
+
+#if (defined(__GNUC__) || defined(_MSC_VER)) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define CCL_X86
+#endif
+
+#if defined(__GNUC__)
+#define CCL_TARGET(x) __attribute__((target(x)))
+#else
+#define CCL_TARGET(x)
+#endif
+
+typedef struct CpuFeature_TAG{
+    bool sse2;
+    bool sse42;
+    bool pclmul;
+    bool avx2;
+    bool vpclmul;
+}CpuFeature;
+
+/**
+ * instruction set supported by cpu and os, detected once at first call.
+ * function using instruction set beyond compile flag must be marked CCL_TARGET,
+ * and only called when cpuFeature report it.
+ */
+const CpuFeature & cpuFeature();
+
+#endif // CPUFEATURE_H
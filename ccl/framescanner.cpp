@@ -0,0 +1,421 @@
+﻿#include "framescanner.h"
+#include <cstring>
+
+#include "cpufeature.h"
+
+#ifdef CCL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+typedef const char * (*FindFunction)(const char * data,const char * end,
+                                     const quint8 * delimiters,int count);
+
+const char * findAnyByte(const char * data,const char * end,const quint8 * delimiters,int count)
+{
+    if(count == 1){
+        const void * found = memchr(data,delimiters[0],static_cast<size_t>(end - data));
+        return found ? static_cast<const char *>(found) : end;
+    }
+    for(;data < end;data++){
+        quint8 c = static_cast<quint8>(*data);
+        if(c == delimiters[0] || c == delimiters[1]){
+            return data;
+        }
+    }
+    return end;
+}
+
+#ifdef CCL_X86
+inline int countTrailingZero(quint32 mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index,mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+CCL_TARGET("sse2")
+const char * findAnySse2(const char * data,const char * end,const quint8 * delimiters,int count)
+{
+    // one delimiter compare twice against the same byte, no branch in loop
+    const __m128i first = _mm_set1_epi8(static_cast<char>(delimiters[0]));
+    const __m128i second = _mm_set1_epi8(static_cast<char>(delimiters[count > 1 ? 1 : 0]));
+    while(end - data >= 16){
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(chunk,first),_mm_cmpeq_epi8(chunk,second));
+        quint32 mask = static_cast<quint32>(_mm_movemask_epi8(hit));
+        if(mask){
+            return data + countTrailingZero(mask);
+        }
+        data += 16;
+    }
+    return findAnyByte(data,end,delimiters,count);
+}
+
+CCL_TARGET("avx2")
+const char * findAnyAvx2(const char * data,const char * end,const quint8 * delimiters,int count)
+{
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(delimiters[0]));
+    const __m256i second = _mm256_set1_epi8(static_cast<char>(delimiters[count > 1 ? 1 : 0]));
+
+    // 64 byte per step, delimiter is rare in bulk ascii telemetry
+    while(end - data >= 64){
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+        __m256i lowHit = _mm256_or_si256(_mm256_cmpeq_epi8(low,first),_mm256_cmpeq_epi8(low,second));
+        __m256i highHit = _mm256_or_si256(_mm256_cmpeq_epi8(high,first),_mm256_cmpeq_epi8(high,second));
+        if(!_mm256_testz_si256(_mm256_or_si256(lowHit,highHit),_mm256_or_si256(lowHit,highHit))){
+            quint32 mask = static_cast<quint32>(_mm256_movemask_epi8(lowHit));
+            if(mask){
+                return data + countTrailingZero(mask);
+            }
+            mask = static_cast<quint32>(_mm256_movemask_epi8(highHit));
+            return data + 32 + countTrailingZero(mask);
+        }
+        data += 64;
+    }
+    while(end - data >= 32){
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(chunk,first),_mm256_cmpeq_epi8(chunk,second));
+        quint32 mask = static_cast<quint32>(_mm256_movemask_epi8(hit));
+        if(mask){
+            return data + countTrailingZero(mask);
+        }
+        data += 32;
+    }
+    return findAnySse2(data,end,delimiters,count);
+}
+#endif
+
+FindFunction resolveFind()
+{
+#ifdef CCL_X86
+    const CpuFeature &feature = cpuFeature();
+    if(feature.avx2){
+        return findAnyAvx2;
+    }
+    if(feature.sse2){
+        return findAnySse2;
+    }
+#endif
+    return findAnyByte;
+}
+
+}
+
+FrameScanner::FrameScanner(FrameMode mode, int maxFrameSize)
+    :m_mode(FrameNone),
+      m_maxFrameSize(maxFrameSize > 0 ? maxFrameSize : FRAME_DEFAULT_MAX_SIZE),
+      m_buffer(nullptr),
+      m_capacity(0),
+      m_size(0),
+      m_start(0),
+      m_write(0),
+      m_read(0),
+      m_inFrame(true),
+      m_discard(false),
+      m_delimiterCount(0),
+      m_frameCount(0),
+      m_overflowCount(0),
+      m_errorCount(0),
+      m_rejectedCount(0)
+{
+    setMode(mode);
+}
+
+FrameScanner::~FrameScanner()
+{
+    delete [] m_buffer;
+}
+
+FrameMode FrameScanner::mode() const
+{
+    return m_mode;
+}
+
+void FrameScanner::setMode(FrameMode mode)
+{
+    m_mode = mode;
+    switch (mode) {
+    case FrameSlip:
+        m_delimiters[0] = FRAME_SLIP_END;
+        m_delimiters[1] = FRAME_SLIP_ESC;
+        m_delimiterCount = 2;
+        break;
+    case FrameStxEtx:
+        m_delimiters[0] = FRAME_STX;
+        m_delimiters[1] = FRAME_ETX;
+        m_delimiterCount = 2;
+        break;
+    case FrameDleStxEtx:
+        m_delimiters[0] = FRAME_DLE;
+        m_delimiters[1] = FRAME_DLE;
+        m_delimiterCount = 1;
+        break;
+    default:
+        m_delimiters[0] = '\n';
+        m_delimiters[1] = '\n';
+        m_delimiterCount = 1;
+        break;
+    }
+    reset();
+}
+
+int FrameScanner::maxFrameSize() const
+{
+    return m_maxFrameSize;
+}
+
+void FrameScanner::setMaxFrameSize(int maxFrameSize)
+{
+    m_maxFrameSize = maxFrameSize > 0 ? maxFrameSize : FRAME_DEFAULT_MAX_SIZE;
+}
+
+void FrameScanner::setFrameValidator(const FrameValidator &frameValidator)
+{
+    m_frameValidator = frameValidator;
+}
+
+char *FrameScanner::reserve(qint64 size)
+{
+    compact();
+    if(m_capacity - m_size < size){
+        qint64 capacity = qMax(m_capacity * 2,m_size + size);
+        char * buffer = new char[static_cast<size_t>(capacity)];
+        if(m_size > 0){
+            memcpy(buffer,m_buffer,static_cast<size_t>(m_size));
+        }
+        delete [] m_buffer;
+        m_buffer = buffer;
+        m_capacity = capacity;
+    }
+    return m_buffer + m_size;
+}
+
+int FrameScanner::scan(qint64 len, QVector<FrameView> *frames)
+{
+    if(len <= 0){
+        return 0;
+    }
+    m_size += len;
+
+    int before = frames->size();
+    if(m_mode == FrameNone){
+        m_read = m_write = m_size;
+        emitFrame(frames);
+        return frames->size() - before;
+    }
+
+    char * buffer = m_buffer;
+    while(m_read < m_size){
+        if(!m_inFrame){
+            // hunt start of frame, byte before it is garbage
+            const char * found = FrameScanner::findAny(buffer + m_read,buffer + m_size,m_delimiters,1);
+            m_read = found - buffer;
+            m_start = m_write = m_read;
+            if(m_read == m_size){
+                break;
+            }
+            if(m_mode == FrameStxEtx){
+                m_read++;
+            }else{
+                if(m_read + 1 >= m_size){
+                    break;
+                }
+                quint8 next = static_cast<quint8>(buffer[m_read + 1]);
+                m_read += next == FRAME_STX || next == FRAME_DLE ? 2 : 1;
+                if(next != FRAME_STX){
+                    m_start = m_write = m_read;
+                    continue;
+                }
+            }
+            m_start = m_write = m_read;
+            m_inFrame = true;
+            m_discard = false;
+            continue;
+        }
+
+        const char * found = FrameScanner::findAny(buffer + m_read,buffer + m_size,
+                                                   m_delimiters,m_delimiterCount);
+        qint64 position = found - buffer;
+        qint64 segment = position - m_read;
+        if(segment > 0){
+            // close the hole left by escape, nothing to copy if frame has no escape yet
+            if(m_write != m_read){
+                memmove(buffer + m_write,buffer + m_read,static_cast<size_t>(segment));
+            }
+            m_write += segment;
+            m_read = position;
+        }
+        if(!m_discard && m_write - m_start > m_maxFrameSize){
+            m_overflowCount.fetchAndAddRelaxed(1);
+            m_discard = true;
+        }
+        if(m_discard){
+            m_start = m_write = m_read;
+        }
+        if(position == m_size){
+            break;
+        }
+
+        quint8 c = static_cast<quint8>(buffer[position]);
+        if(m_mode == FrameLine){
+            if(m_write > m_start && buffer[m_write - 1] == '\r'){
+                m_write--;
+            }
+            m_read++;
+            emitFrame(frames);
+        }else if(m_mode == FrameSlip){
+            if(c == FRAME_SLIP_END){
+                m_read++;
+                emitFrame(frames);
+                continue;
+            }
+            if(m_read + 1 >= m_size){
+                break;
+            }
+            quint8 next = static_cast<quint8>(buffer[m_read + 1]);
+            m_read += 2;
+            if(next == FRAME_SLIP_ESC_END){
+                buffer[m_write++] = static_cast<char>(FRAME_SLIP_END);
+            }else if(next == FRAME_SLIP_ESC_ESC){
+                buffer[m_write++] = static_cast<char>(FRAME_SLIP_ESC);
+            }else{
+                dropFrame();
+            }
+        }else if(m_mode == FrameStxEtx){
+            m_read++;
+            if(c == FRAME_ETX){
+                emitFrame(frames);
+                m_inFrame = false;
+            }else{
+                // STX without ETX, restart frame
+                dropFrame();
+                m_start = m_write = m_read;
+                m_discard = false;
+            }
+        }else{
+            if(m_read + 1 >= m_size){
+                break;
+            }
+            quint8 next = static_cast<quint8>(buffer[m_read + 1]);
+            m_read += 2;
+            if(next == FRAME_DLE){
+                buffer[m_write++] = static_cast<char>(FRAME_DLE);
+            }else if(next == FRAME_ETX){
+                emitFrame(frames);
+                m_inFrame = false;
+            }else if(next == FRAME_STX){
+                dropFrame();
+                m_start = m_write = m_read;
+                m_discard = false;
+            }else{
+                dropFrame();
+                m_inFrame = false;
+            }
+        }
+    }
+    return frames->size() - before;
+}
+
+int FrameScanner::scan(const char *data, qint64 len, QVector<FrameView> *frames)
+{
+    if(len <= 0){
+        return 0;
+    }
+    memcpy(reserve(len),data,static_cast<size_t>(len));
+    return scan(len,frames);
+}
+
+void FrameScanner::reset()
+{
+    m_size = 0;
+    m_start = 0;
+    m_write = 0;
+    m_read = 0;
+    m_inFrame = m_mode != FrameStxEtx && m_mode != FrameDleStxEtx;
+    m_discard = false;
+}
+
+quint64 FrameScanner::frameCount() const
+{
+    return m_frameCount.load();
+}
+
+quint64 FrameScanner::overflowCount() const
+{
+    return m_overflowCount.load();
+}
+
+quint64 FrameScanner::errorCount() const
+{
+    return m_errorCount.load();
+}
+
+quint64 FrameScanner::rejectedCount() const
+{
+    return m_rejectedCount.load();
+}
+
+const char *FrameScanner::findAny(const char *data, const char *end,
+                                  const quint8 *delimiters, int count)
+{
+    static const FindFunction find = resolveFind();
+    return find(data,end,delimiters,count);
+}
+
+void FrameScanner::compact()
+{
+    // close escape hole, then move partial frame to front, frame view before it is gone
+    qint64 tail = m_size - m_read;
+    if(m_write != m_read && tail > 0){
+        memmove(m_buffer + m_write,m_buffer + m_read,static_cast<size_t>(tail));
+    }
+    m_size = m_write + tail;
+    m_read = m_write;
+
+    if(m_start > 0){
+        if(m_size > m_start){
+            memmove(m_buffer,m_buffer + m_start,static_cast<size_t>(m_size - m_start));
+        }
+        m_size -= m_start;
+        m_read -= m_start;
+        m_write -= m_start;
+        m_start = 0;
+    }
+}
+
+void FrameScanner::emitFrame(QVector<FrameView> *frames)
+{
+    qint64 len = m_write - m_start;
+    if(!m_discard && len > 0){
+        if(m_frameValidator && !m_frameValidator(m_buffer + m_start,len)){
+            m_rejectedCount.fetchAndAddRelaxed(1);
+        }else{
+            FrameView frame;
+            frame.data = m_buffer + m_start;
+            frame.len = len;
+            frames->append(frame);
+            m_frameCount.fetchAndAddRelaxed(1);
+        }
+    }
+    m_start = m_write = m_read;
+    m_discard = false;
+}
+
+void FrameScanner::dropFrame()
+{
+    if(!m_discard){
+        m_errorCount.fetchAndAddRelaxed(1);
+    }
+    m_discard = true;
+    m_start = m_write = m_read;
+}
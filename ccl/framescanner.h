@@ -0,0 +1,133 @@
+﻿#ifndef FRAMESCANNER_H
+#define FRAMESCANNER_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QVector>
+
+#include "checksum.h"
+
+#define FRAME_DEFAULT_MAX_SIZE 1024
+#define FRAME_DEFAULT_READ_SIZE 4096
+
+#define FRAME_SLIP_END 0xc0
+#define FRAME_SLIP_ESC 0xdb
+#define FRAME_SLIP_ESC_END 0xdc
+#define FRAME_SLIP_ESC_ESC 0xdd
+
+#define FRAME_STX 0x02
+#define FRAME_ETX 0x03
+#define FRAME_DLE 0x10
+
+/**
+ * framing of byte stream.
+ * 1.FrameNone: no framing, every read chunk is pushed as is.
+ * 2.FrameLine: ascii line end with LF, CR before LF is stripped.
+ * 3.FrameSlip: rfc1055, frame end with 0xc0, 0xdb 0xdc is 0xc0 and 0xdb 0xdd is 0xdb in payload.
+ * 4.FrameStxEtx: frame is STX payload ETX, byte outside STX and ETX is dropped.
+ * 5.FrameDleStxEtx: frame is DLE STX payload DLE ETX, DLE in payload is sent twice.
+ */
+enum FrameMode{
+    FrameNone,
+    FrameLine,
+    FrameSlip,
+    FrameStxEtx,
+    FrameDleStxEtx
+};
+
+typedef struct FrameView_TAG{
+    const char * data;
+    qint64 len;
+}FrameView;
+
+/**
+ * split received byte stream into frame in one pass.
+ * 1.delimiter and escape byte are found 16(sse2) or 32(avx2) byte at a time, picked at runtime,
+ *   byte between them is never looked at one by one.
+ * 2.escaped frame is unescaped in place, frame without escape is never copied.
+ * 3.frame is a view into receive buffer of scanner, read from device straight into buffer
+ *   given by reserve, then scan it. partial frame is kept to next scan.
+ * 4.frame longer than maxFrameSize is dropped to next delimiter, and counted as overflow.
+ *   frame with broken escape is dropped and counted as error.
+ *   frame rejected by validator is dropped and counted as rejected. empty frame is skipped.
+ * Warning!!!
+ * 1.not thread safe, configure it before client start, scan it only in client thread.
+ *   counter can be read from any thread.
+ * 2.view is valid until next reserve or scan.
+ */
+class FrameScanner
+{
+public:
+    explicit FrameScanner(FrameMode mode = FrameNone,int maxFrameSize = FRAME_DEFAULT_MAX_SIZE);
+    ~FrameScanner();
+
+    FrameMode mode() const;
+    void setMode(FrameMode mode);
+
+    int maxFrameSize() const;
+    void setMaxFrameSize(int maxFrameSize);
+
+    void setFrameValidator(const FrameValidator &frameValidator);
+
+    /**
+     * buffer for at least size byte at end of receive buffer.
+     */
+    char * reserve(qint64 size);
+
+    /**
+     * scan len byte written to buffer returned by reserve, append complete frame to frames.
+     * return count of frame appended.
+     */
+    int scan(qint64 len,QVector<FrameView> * frames);
+
+    /**
+     * copy data to receive buffer and scan it.
+     */
+    int scan(const char * data,qint64 len,QVector<FrameView> * frames);
+
+    /**
+     * drop partial frame, e.g. when connection lost.
+     */
+    void reset();
+
+    quint64 frameCount() const;
+    quint64 overflowCount() const;
+    quint64 errorCount() const;
+    quint64 rejectedCount() const;
+
+    /**
+     * first byte of data which is one of delimiter, or end if not found.
+     */
+    static const char * findAny(const char * data,const char * end,
+                                const quint8 * delimiters,int count);
+
+private:
+    void compact();
+    void emitFrame(QVector<FrameView> * frames);
+    void dropFrame();
+
+    FrameMode m_mode;
+    int m_maxFrameSize;
+    FrameValidator m_frameValidator;
+
+    char * m_buffer;
+    qint64 m_capacity;
+    qint64 m_size;
+
+    // start of current frame, end of unescaped payload, next byte to scan
+    qint64 m_start;
+    qint64 m_write;
+    qint64 m_read;
+    bool m_inFrame;
+    bool m_discard;
+
+    quint8 m_delimiters[2];
+    int m_delimiterCount;
+
+    QAtomicInteger<quint64> m_frameCount;
+    QAtomicInteger<quint64> m_overflowCount;
+    QAtomicInteger<quint64> m_errorCount;
+    QAtomicInteger<quint64> m_rejectedCount;
+};
+
+#endif // FRAMESCANNER_H
@@ -0,0 +1,160 @@
+﻿#include "latencyhistogram.h"
+#include <QtAlgorithms>
+#include <cmath>
+#include <limits>
+
+LatencyHistogram::LatencyHistogram()
+    :m_count(0),
+      m_sum(0),
+      m_min(std::numeric_limits<qint64>::max()),
+      m_max(0)
+{
+    for(int i = 0;i < LATENCY_BUCKET_COUNT;i++){
+        m_buckets[i].store(0);
+    }
+}
+
+void LatencyHistogram::record(qint64 latency)
+{
+    // clock of other thread may be a little behind
+    latency = qMax(latency,static_cast<qint64>(0));
+
+    m_buckets[bucketOf(latency)].fetchAndAddRelaxed(1);
+    m_count.fetchAndAddRelaxed(1);
+    m_sum.fetchAndAddRelaxed(static_cast<quint64>(latency));
+
+    qint64 current = m_min.load();
+    while(latency < current && !m_min.testAndSetRelaxed(current,latency)){
+        current = m_min.load();
+    }
+    current = m_max.load();
+    while(latency > current && !m_max.testAndSetRelaxed(current,latency)){
+        current = m_max.load();
+    }
+}
+
+void LatencyHistogram::recordIngest(const BufferMeta &meta, qint64 now)
+{
+    record(now - meta.recvTime);
+}
+
+void LatencyHistogram::recordQueue(const BufferMeta &meta, qint64 now)
+{
+    record(now - meta.enqueueTime);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for(int i = 0;i < LATENCY_BUCKET_COUNT;i++){
+        quint64 count = other.m_buckets[i].load();
+        if(count > 0){
+            m_buckets[i].fetchAndAddRelaxed(count);
+        }
+    }
+    m_count.fetchAndAddRelaxed(other.m_count.load());
+    m_sum.fetchAndAddRelaxed(other.m_sum.load());
+
+    qint64 otherMin = other.m_min.load();
+    qint64 current = m_min.load();
+    while(otherMin < current && !m_min.testAndSetRelaxed(current,otherMin)){
+        current = m_min.load();
+    }
+    qint64 otherMax = other.m_max.load();
+    current = m_max.load();
+    while(otherMax > current && !m_max.testAndSetRelaxed(current,otherMax)){
+        current = m_max.load();
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for(int i = 0;i < LATENCY_BUCKET_COUNT;i++){
+        m_buckets[i].store(0);
+    }
+    m_count.store(0);
+    m_sum.store(0);
+    m_min.store(std::numeric_limits<qint64>::max());
+    m_max.store(0);
+}
+
+quint64 LatencyHistogram::count() const
+{
+    return m_count.load();
+}
+
+quint64 LatencyHistogram::sum() const
+{
+    return m_sum.load();
+}
+
+qint64 LatencyHistogram::min() const
+{
+    return m_count.load() > 0 ? m_min.load() : 0;
+}
+
+qint64 LatencyHistogram::max() const
+{
+    return m_max.load();
+}
+
+qint64 LatencyHistogram::mean() const
+{
+    quint64 count = m_count.load();
+    return count > 0 ? static_cast<qint64>(m_sum.load() / count) : 0;
+}
+
+qint64 LatencyHistogram::percentile(double percent) const
+{
+    quint64 count = m_count.load();
+    if(count == 0){
+        return 0;
+    }
+
+    percent = qBound(0.0,percent,100.0);
+    quint64 target = qMax(static_cast<quint64>(1),
+                          static_cast<quint64>(std::ceil(count * percent / 100.0)));
+    quint64 seen = 0;
+    for(int i = 0;i < LATENCY_BUCKET_COUNT;i++){
+        seen += m_buckets[i].load();
+        if(seen >= target){
+            return qMin(bucketUpperBound(i),max());
+        }
+    }
+    return max();
+}
+
+QString LatencyHistogram::summary() const
+{
+    return QString("count=%1 min=%2 p50=%3 p99=%4 p999=%5 max=%6 ns")
+            .arg(count())
+            .arg(min())
+            .arg(percentile(50))
+            .arg(percentile(99))
+            .arg(percentile(99.9))
+            .arg(max());
+}
+
+int LatencyHistogram::bucketOf(qint64 latency)
+{
+    quint64 value = static_cast<quint64>(latency);
+    if(value < LATENCY_SUB_BUCKET_COUNT){
+        return static_cast<int>(value);
+    }
+
+    int msb = 63 - static_cast<int>(qCountLeadingZeroBits(value));
+    int shift = msb - LATENCY_SUB_BUCKET_BITS;
+    int sub = static_cast<int>(value >> shift) - LATENCY_SUB_BUCKET_COUNT;
+    return (shift + 1) * LATENCY_SUB_BUCKET_COUNT + sub;
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int bucket)
+{
+    if(bucket < LATENCY_SUB_BUCKET_COUNT){
+        return bucket;
+    }
+
+    int shift = bucket / LATENCY_SUB_BUCKET_COUNT - 1;
+    int sub = bucket % LATENCY_SUB_BUCKET_COUNT;
+    quint64 lower = static_cast<quint64>(LATENCY_SUB_BUCKET_COUNT + sub) << shift;
+    return static_cast<qint64>(lower + (Q_UINT64_C(1) << shift) - 1);
+}
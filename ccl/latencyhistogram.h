@@ -0,0 +1,69 @@
+﻿#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QString>
+
+#include "ccl/buffermeta.h"
+
+// 16 linear sub bucket per power of 2, relative error below 1/16
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKET_COUNT ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKET_COUNT)
+
+/**
+ * log linear histogram of latency in ns.
+ * 1.record is a few instruction and three relaxed atomic add, min and max change only on new extreme,
+ *   no lock, no allocation, see bench/metricsbench for cost.
+ *   many thread can record, reader see approximate snapshot.
+ * 2.value below 16 ns is exact, larger value is kept with 4 significant bit.
+ * 3.percentile return upper bound of bucket holding it.
+ * e.g. ingest to consume latency in parse thread:
+ *   buffer = queue->peekReadable(timeout);
+ *   histogram.recordIngest(buffer->meta);
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(qint64 latency);
+
+    /**
+     * now - recvTime, whole latency from device to consumer.
+     */
+    void recordIngest(const BufferMeta &meta,qint64 now = bufferMetaNow());
+
+    /**
+     * now - enqueueTime, time waiting in queue.
+     */
+    void recordQueue(const BufferMeta &meta,qint64 now = bufferMetaNow());
+
+    void merge(const LatencyHistogram &other);
+    void reset();
+
+    quint64 count() const;
+    quint64 sum() const;
+    qint64 min() const;
+    qint64 max() const;
+    qint64 mean() const;
+    qint64 percentile(double percent) const;
+
+    /**
+     * e.g. "count=100 min=1200 p50=2047 p99=8191 p999=16383 max=20000 ns".
+     */
+    QString summary() const;
+
+    static int bucketOf(qint64 latency);
+    static qint64 bucketUpperBound(int bucket);
+
+private:
+    QAtomicInteger<quint64> m_buckets[LATENCY_BUCKET_COUNT];
+    QAtomicInteger<quint64> m_count;
+    QAtomicInteger<quint64> m_sum;
+    QAtomicInteger<qint64> m_min;
+    QAtomicInteger<qint64> m_max;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,131 @@
+﻿#include "lifecycle.h"
+#include <QDebug>
+#include <QElapsedTimer>
+
+Lifecycle::Lifecycle(LinkThreadPool *links)
+    :m_links(links),
+      m_state(LifecycleStopped),
+      m_lastStopTime(0),
+      m_lastRetainedCount(0)
+{
+
+}
+
+Lifecycle::~Lifecycle()
+{
+
+}
+
+void Lifecycle::setLinks(LinkThreadPool *links)
+{
+    m_links = links;
+}
+
+void Lifecycle::addThread(QThread *thread)
+{
+    if(thread && !m_threads.contains(thread)){
+        m_threads.append(thread);
+    }
+}
+
+bool Lifecycle::start()
+{
+    if(m_state == LifecycleRunning){
+        return true;
+    }
+
+    bool ret = true;
+    for(const LifecycleQueue &queue : m_queues){
+        if(!queue.reset()){
+            qDebug()<<"Queue can not be reset! Create a new queue to restart.";
+            ret = false;
+        }
+    }
+
+    // reader before writer, first buffer never wait for reader
+    for(QThread * thread : m_threads){
+        if(thread->isRunning()){
+            qDebug()<<"Parse thread still running! Thread: "<<thread->objectName();
+            ret = false;
+            continue;
+        }
+        thread->start();
+    }
+
+    if(m_links){
+        m_links->start();
+    }
+
+    m_state = LifecycleRunning;
+    return ret;
+}
+
+bool Lifecycle::stop(int timeout)
+{
+    if(m_state == LifecycleStopped){
+        return true;
+    }
+    m_state = LifecycleStopped;
+
+    QElapsedTimer timer;
+    timer.start();
+    bool ret = true;
+
+    // 1.stop ingest, share deadline with drain and join
+    if(m_links && !m_links->stop(timeout)){
+        qDebug()<<"Link stop timeout!";
+        ret = false;
+    }
+
+    // 2.drain, reader take every buffer already pushed
+    while(readableCount() > 0 && timer.elapsed() < timeout){
+        QThread::msleep(LIFECYCLE_DRAIN_POLL_INTERVAL);
+    }
+    m_lastRetainedCount = readableCount();
+    if(m_lastRetainedCount > 0){
+        qDebug()<<"Drain timeout! Buffer retained in queue: "<<m_lastRetainedCount;
+    }
+
+    // 3.join, interrupt before abort, reader see interruption when peek return nullptr
+    for(QThread * thread : m_threads){
+        thread->requestInterruption();
+    }
+    for(const LifecycleQueue &queue : m_queues){
+        queue.abort();
+    }
+
+    for(QThread * thread : m_threads){
+        qint64 remaining = qMax(static_cast<qint64>(0),timeout - timer.elapsed());
+        if(!thread->wait(static_cast<unsigned long>(remaining))){
+            qDebug()<<"Parse thread exit timeout! Thread: "<<thread->objectName();
+            ret = false;
+        }
+    }
+
+    m_lastStopTime = timer.elapsed();
+    return ret;
+}
+
+LifecycleState Lifecycle::state() const
+{
+    return m_state;
+}
+
+qint64 Lifecycle::lastStopTime() const
+{
+    return m_lastStopTime;
+}
+
+int Lifecycle::lastRetainedCount() const
+{
+    return m_lastRetainedCount;
+}
+
+int Lifecycle::readableCount() const
+{
+    int count = 0;
+    for(const LifecycleQueue &queue : m_queues){
+        count += queue.readableCount();
+    }
+    return count;
+}
@@ -0,0 +1,88 @@
+﻿#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+
+#include <QThread>
+#include <QList>
+#include <functional>
+
+#include "ccl/linkthreadpool.h"
+#include "ccl/queue/abstractqueue.h"
+
+#define LIFECYCLE_DEFAULT_TIMEOUT 1000
+#define LIFECYCLE_DRAIN_POLL_INTERVAL 1
+
+enum LifecycleState{
+    LifecycleStopped,
+    LifecycleRunning
+};
+
+/**
+ * start and stop link, queue and parse thread together, in bounded time.
+ * 1.start: reset abort of queue, start parse thread, then start link.
+ * 2.stop: one timeout for all step, every step use what is left of it.
+ *  1) stop ingest: stop every link in its thread, client drain outbound and close device,
+ *     nothing is pushed to queue after it.
+ *  2) drain: wait reader take every buffer pushed, until timeout.
+ *     buffer left is kept in queue, not dropped, see Warning 3.
+ *  3) join: request interruption of parse thread, then abort queue, reader blocked in
+ *     peekReadable return at once, wait parse thread exit in remaining timeout.
+ *  return false if link or parse thread not stop in time.
+ * 3.parse thread loop while(!isInterruptionRequested()), and treat nullptr of peekReadable
+ *   with isAbort as exit, no wait for peekReadable timeout.
+ * Warning!!!
+ * 1.call function in one thread, e.g. gui thread. link pool, queue and thread is not owned.
+ * 2.link not stopped in timeout is reported, its thread still stop it later and
+ *   it may push to queue after stop return.
+ * 3.buffer still readable when timeout is not dropped, abort and reset keep it in queue,
+ *   counted in lastRetainedCount, parse thread read it first after next start.
+ */
+class Lifecycle
+{
+public:
+    explicit Lifecycle(LinkThreadPool * links = nullptr);
+    ~Lifecycle();
+
+    void setLinks(LinkThreadPool * links);
+
+    template<typename T>
+    void addQueue(AbstractQueue<T> * queue)
+    {
+        LifecycleQueue entry;
+        entry.readableCount = [queue](){ return queue->readableCount(); };
+        entry.abort = [queue](){ queue->abort(); };
+        entry.reset = [queue](){ return queue->reset(); };
+        m_queues.append(entry);
+    }
+
+    void addThread(QThread * thread);
+
+    bool start();
+    bool stop(int timeout = LIFECYCLE_DEFAULT_TIMEOUT);
+
+    LifecycleState state() const;
+
+    /**
+     * statistic of last stop, time in ms.
+     */
+    qint64 lastStopTime() const;
+    int lastRetainedCount() const;
+
+private:
+    typedef struct LifecycleQueue_TAG{
+        std::function<int()> readableCount;
+        std::function<void()> abort;
+        std::function<bool()> reset;
+    }LifecycleQueue;
+
+    int readableCount() const;
+
+    LinkThreadPool * m_links;
+    QList<LifecycleQueue> m_queues;
+    QList<QThread *> m_threads;
+
+    LifecycleState m_state;
+    qint64 m_lastStopTime;
+    int m_lastRetainedCount;
+};
+
+#endif // LIFECYCLE_H
@@ -0,0 +1,233 @@
+﻿#include "linkthreadpool.h"
+#include <QDebug>
+#include <QSemaphore>
+#include <QMutex>
+#include <memory>
+
+// shared with stop of link thread, it may finish after stop return
+typedef struct LinkStopState_TAG{
+    QSemaphore stopped;
+    QMutex mutex;
+    QList<QObject *> links;
+}LinkStopState;
+
+LinkThreadPool::LinkThreadPool(int poolSize, QObject *parent)
+    :QObject(parent),
+      m_poolSize(qBound(1,poolSize,LINK_MAX_POOL_SIZE)),
+      m_dedicatedSerial(0),
+      m_roundRobin(0)
+{
+    m_pool.fill(nullptr,m_poolSize);
+}
+
+LinkThreadPool::~LinkThreadPool()
+{
+    shutdown();
+}
+
+void LinkThreadPool::addLink(QObject *link, const LinkStartFunction &start,
+                             const LinkStopFunction &stop,
+                             LinkPlacement placement, const QString &key)
+{
+    if(!link){
+        return;
+    }
+    if(link->parent()){
+        qDebug()<<"Link with parent can not move to link thread!";
+        return;
+    }
+
+    QThread * thread = nullptr;
+    switch (placement) {
+    case LinkGroup:
+        thread = groupThread(key);
+        break;
+    case LinkHashed:
+        thread = hashedThread(key);
+        break;
+    default:
+        thread = dedicatedThread();
+        break;
+    }
+
+    link->moveToThread(thread);
+
+    LinkEntry entry;
+    entry.link = link;
+    entry.start = start;
+    entry.stop = stop;
+    entry.thread = thread;
+    m_links.append(entry);
+}
+
+void LinkThreadPool::remove(QObject *link)
+{
+    for(int i = 0;i < m_links.size();i++){
+        if(m_links.at(i).link != link){
+            continue;
+        }
+
+        LinkEntry entry = m_links.takeAt(i);
+        QMetaObject::invokeMethod(m_contexts.value(entry.thread),[entry](){
+            entry.stop();
+            delete entry.link;
+        },Qt::BlockingQueuedConnection);
+
+        if(m_dedicated.value(entry.thread)){
+            releaseThread(entry.thread);
+        }
+        return;
+    }
+}
+
+void LinkThreadPool::start()
+{
+    for(const LinkEntry &entry : m_links){
+        entry.start();
+    }
+}
+
+bool LinkThreadPool::stop(int timeout)
+{
+    // every thread stop its link in parallel, wait all of them
+    std::shared_ptr<LinkStopState> state = std::make_shared<LinkStopState>();
+    int count = 0;
+    for(QThread * thread : m_threads){
+        QList<LinkEntry> entries;
+        for(const LinkEntry &entry : m_links){
+            if(entry.thread == thread){
+                entries.append(entry);
+            }
+        }
+        if(entries.isEmpty()){
+            continue;
+        }
+
+        QMetaObject::invokeMethod(m_contexts.value(thread),[entries,state](){
+            for(const LinkEntry &entry : entries){
+                entry.stop();
+                state->mutex.lock();
+                state->links.append(entry.link);
+                state->mutex.unlock();
+            }
+            state->stopped.release();
+        },Qt::QueuedConnection);
+        count++;
+    }
+    if(state->stopped.tryAcquire(count,timeout)){
+        return true;
+    }
+
+    state->mutex.lock();
+    for(const LinkEntry &entry : m_links){
+        if(!state->links.contains(entry.link)){
+            qDebug()<<"Link stop timeout! Link: "<<entry.link<<
+                      " Thread: "<<entry.thread->objectName();
+        }
+    }
+    state->mutex.unlock();
+    return false;
+}
+
+void LinkThreadPool::shutdown()
+{
+    // every thread stop its link in parallel, then quit itself after the last one
+    for(QThread * thread : m_threads){
+        QList<LinkEntry> entries;
+        for(const LinkEntry &entry : m_links){
+            if(entry.thread == thread){
+                entries.append(entry);
+            }
+        }
+
+        QMetaObject::invokeMethod(m_contexts.value(thread),[entries](){
+            for(const LinkEntry &entry : entries){
+                entry.stop();
+                delete entry.link;
+            }
+            QThread::currentThread()->quit();
+        },Qt::QueuedConnection);
+    }
+    m_links.clear();
+
+    for(QThread * thread : m_threads){
+        thread->wait();
+        delete m_contexts.value(thread);
+        delete thread;
+    }
+    m_threads.clear();
+    m_contexts.clear();
+    m_dedicated.clear();
+    m_groups.clear();
+    m_pool.fill(nullptr);
+}
+
+int LinkThreadPool::poolSize() const
+{
+    return m_poolSize;
+}
+
+int LinkThreadPool::threadCount() const
+{
+    return m_threads.size();
+}
+
+int LinkThreadPool::linkCount() const
+{
+    return m_links.size();
+}
+
+QThread *LinkThreadPool::dedicatedThread()
+{
+    QThread * thread = createThread(QString("link-%1").arg(m_dedicatedSerial++));
+    m_dedicated.insert(thread,true);
+    return thread;
+}
+
+QThread *LinkThreadPool::groupThread(const QString &key)
+{
+    QThread * thread = m_groups.value(key,nullptr);
+    if(!thread){
+        thread = createThread(QString("link-group-%1").arg(key));
+        m_groups.insert(key,thread);
+    }
+    return thread;
+}
+
+QThread *LinkThreadPool::hashedThread(const QString &key)
+{
+    int index = key.isEmpty() ? m_roundRobin++ % m_poolSize :
+                                static_cast<int>(qHash(key) % static_cast<uint>(m_poolSize));
+    if(!m_pool.at(index)){
+        m_pool[index] = createThread(QString("link-pool-%1").arg(index));
+    }
+    return m_pool.at(index);
+}
+
+QThread *LinkThreadPool::createThread(const QString &name)
+{
+    QThread * thread = new QThread();
+    thread->setObjectName(name);
+
+    // invoke target in thread, link may be deleted before thread quit
+    QObject * context = new QObject();
+    context->moveToThread(thread);
+
+    thread->start();
+    m_threads.append(thread);
+    m_contexts.insert(thread,context);
+    return thread;
+}
+
+void LinkThreadPool::releaseThread(QThread *thread)
+{
+    QMetaObject::invokeMethod(m_contexts.value(thread),[](){
+        QThread::currentThread()->quit();
+    },Qt::QueuedConnection);
+    thread->wait();
+
+    delete m_contexts.take(thread);
+    m_dedicated.remove(thread);
+    m_threads.removeAll(thread);
+    delete thread;
+}
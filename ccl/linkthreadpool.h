@@ -0,0 +1,108 @@
+﻿#ifndef LINKTHREADPOOL_H
+#define LINKTHREADPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include <QString>
+#include <functional>
+
+#define LINK_DEFAULT_POOL_SIZE 4
+#define LINK_MAX_POOL_SIZE 64
+
+/**
+ * which io thread a link(TcpClient, UdpClient, SerialPortClient...) live in.
+ * 1.LinkDedicated: own thread, slow link never delay other link.
+ * 2.LinkGroup: thread shared by all link with the same key, created when first used.
+ * 3.LinkHashed: one of fixed pool of poolSize thread, picked by hash of key,
+ *   same key always same thread, empty key round robin.
+ */
+enum LinkPlacement{
+    LinkDedicated,
+    LinkGroup,
+    LinkHashed
+};
+
+/**
+ * start link, called in caller thread, e.g. emit start signal of client.
+ */
+typedef std::function<void()> LinkStartFunction;
+
+/**
+ * stop link in its own thread, e.g. drain outbound buffer and close device.
+ */
+typedef std::function<void()> LinkStopFunction;
+
+/**
+ * own io thread and link living in them.
+ * 1.add move link to thread chosen by placement and take ownership, start link after add.
+ * 2.start start every link. stop stop every link in its thread, thread stop in parallel,
+ *   return after all stopped, link and thread is kept, start again to restart.
+ *   stop with timeout(ms, -1 wait forever) return false when it expire,
+ *   link not stopped yet is reported, its thread still stop it later.
+ * 3.remove stop link in its thread, wait stop return, then delete link.
+ *   dedicated thread of link is quit too.
+ * 4.shutdown stop every link in its thread, link of one thread in add order,
+ *   thread drain in parallel, then quit and wait all thread. destructor call shutdown.
+ * Warning!!!
+ * 1.call function of pool in one thread, e.g. gui thread.
+ * 2.stop, shutdown and remove block caller until link stopped, stop of client wait its drainTimeout at most.
+ */
+class LinkThreadPool: public QObject
+{
+    Q_OBJECT
+public:
+    explicit LinkThreadPool(int poolSize = LINK_DEFAULT_POOL_SIZE,QObject * parent = nullptr);
+    virtual ~LinkThreadPool() override;
+
+    /**
+     * link is a client with start and stop function.
+     */
+    template<typename Link>
+    Link * add(Link * link,LinkPlacement placement,const QString &key = QString())
+    {
+        addLink(link,[link](){ link->start(); },[link](){ link->stop(); },placement,key);
+        return link;
+    }
+
+    void addLink(QObject * link,const LinkStartFunction &start,const LinkStopFunction &stop,
+                 LinkPlacement placement,const QString &key = QString());
+    void remove(QObject * link);
+
+    void start();
+    bool stop(int timeout = -1);
+    void shutdown();
+
+    int poolSize() const;
+    int threadCount() const;
+    int linkCount() const;
+
+private:
+    typedef struct LinkEntry_TAG{
+        QObject * link;
+        LinkStartFunction start;
+        LinkStopFunction stop;
+        QThread * thread;
+    }LinkEntry;
+
+    QThread * dedicatedThread();
+    QThread * groupThread(const QString &key);
+    QThread * hashedThread(const QString &key);
+    QThread * createThread(const QString &name);
+    void releaseThread(QThread * thread);
+
+    int m_poolSize;
+    int m_dedicatedSerial;
+    int m_roundRobin;
+
+    QList<LinkEntry> m_links;
+    QList<QThread *> m_threads;
+    QHash<QThread *,QObject *> m_contexts;
+    QHash<QThread *,bool> m_dedicated;
+    QHash<QString,QThread *> m_groups;
+    QVector<QThread *> m_pool;
+};
+
+#endif // LINKTHREADPOOL_H
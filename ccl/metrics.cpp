@@ -0,0 +1,304 @@
+﻿#include "metrics.h"
+#include <QMutexLocker>
+#include <QDebug>
+#include <QThread>
+#include <cmath>
+#include <memory>
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifdef Q_OS_LINUX
+static double threadCpuTime(clockid_t clock)
+{
+    struct timespec ts;
+    if(clock_gettime(clock,&ts) != 0){
+        return std::nan("");
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+MetricsRegistry::MetricsRegistry()
+{
+
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    for(int i = 0;i < m_entries.size();i++){
+        deleteEntry(m_entries.at(i));
+    }
+}
+
+MetricCounter *MetricsRegistry::counter(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricEntry * entry = find(name,labels);
+    if(!entry){
+        entry = insert(MetricTypeCounter,name,help,labels);
+        entry->counter = new MetricCounter;
+    }
+    return entry->counter;
+}
+
+MetricGauge *MetricsRegistry::gauge(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricEntry * entry = find(name,labels);
+    if(!entry){
+        entry = insert(MetricTypeGauge,name,help,labels);
+        entry->gauge = new MetricGauge;
+    }
+    return entry->gauge;
+}
+
+LatencyHistogram *MetricsRegistry::histogram(const QString &name, const QString &help, const QString &labels)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricEntry * entry = find(name,labels);
+    if(!entry){
+        entry = insert(MetricTypeSummary,name,help,labels);
+        entry->histogram = new LatencyHistogram;
+    }
+    return entry->histogram;
+}
+
+void MetricsRegistry::addReader(MetricType type, const QString &name, const QString &help,
+                                const QString &labels, const MetricReader &reader)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricEntry * entry = find(name,labels);
+    if(!entry){
+        entry = insert(type,name,help,labels);
+    }else if(!entry->reader){
+        qDebug()<<"Metric already registered! Name: "<<name<<" Labels: "<<labels;
+        return;
+    }
+    // reader of restarted thread or recreated component replace old one
+    entry->reader = reader;
+}
+
+void MetricsRegistry::addLink(const QString &link, const LinkMetrics *metrics)
+{
+    QString labels = label("link",link);
+    addReader(MetricTypeCounter,"ccl_link_read_bytes_total","Byte read from link.",labels,
+              [metrics](){ return static_cast<double>(metrics->bytesRead.value()); });
+    addReader(MetricTypeCounter,"ccl_link_read_messages_total","Buffer pushed to queue.",labels,
+              [metrics](){ return static_cast<double>(metrics->messagesRead.value()); });
+    addReader(MetricTypeCounter,"ccl_link_written_bytes_total","Byte written by link device.",labels,
+              [metrics](){ return static_cast<double>(metrics->bytesWritten.value()); });
+    addReader(MetricTypeCounter,"ccl_link_read_errors_total","Device read failure.",labels,
+              [metrics](){ return static_cast<double>(metrics->readErrors.value()); });
+    addReader(MetricTypeCounter,"ccl_link_write_errors_total","Device write failure.",labels,
+              [metrics](){ return static_cast<double>(metrics->writeErrors.value()); });
+    addReader(MetricTypeCounter,"ccl_link_errors_total","Error reported by link device.",labels,
+              [metrics](){ return static_cast<double>(metrics->errors.value()); });
+    addReader(MetricTypeCounter,"ccl_link_reconnects_total","Reconnect or reopen try.",labels,
+              [metrics](){ return static_cast<double>(metrics->reconnects.value()); });
+    addReader(MetricTypeCounter,"ccl_link_queue_full_total","Queue full, data left in device.",labels,
+              [metrics](){ return static_cast<double>(metrics->queueFull.value()); });
+}
+
+void MetricsRegistry::addCompression(const QString &stage, const CompressionMetrics *metrics)
+{
+    QString labels = label("stage",stage);
+    addReader(MetricTypeCounter,"ccl_compression_frames_total","Record taken by compression stage.",labels,
+              [metrics](){ return static_cast<double>(metrics->frames.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_input_bytes_total","Raw byte before compression.",labels,
+              [metrics](){ return static_cast<double>(metrics->bytesIn.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_batches_total","Batch handed to sink.",labels,
+              [metrics](){ return static_cast<double>(metrics->batches.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_output_bytes_total","Byte handed to sink.",labels,
+              [metrics](){ return static_cast<double>(metrics->bytesOut.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_stored_raw_total","Batch not smaller after compression.",labels,
+              [metrics](){ return static_cast<double>(metrics->storedRaw.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_failures_total","Codec failure.",labels,
+              [metrics](){ return static_cast<double>(metrics->failures.value()); });
+    addReader(MetricTypeCounter,"ccl_compression_busy_seconds_total","Time spent in codec.",labels,
+              [metrics](){ return metrics->busyTime.value() / 1e9; });
+    addReader(MetricTypeGauge,"ccl_compression_ratio","Input byte over output byte.",labels,
+              [metrics](){
+        quint64 out = metrics->bytesOut.value();
+        return out > 0 ? static_cast<double>(metrics->bytesIn.value()) / out : std::nan("");
+    });
+}
+
+void MetricsRegistry::addSpool(const QString &spool, const SpoolMetrics *metrics)
+{
+    QString labels = label("spool",spool);
+    addReader(MetricTypeCounter,"ccl_spool_frames_total","Record written to spool segment.",labels,
+              [metrics](){ return static_cast<double>(metrics->frames.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_bytes_total","Byte written to spool segment.",labels,
+              [metrics](){ return static_cast<double>(metrics->bytes.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_dropped_frames_total","Buffer dropped by spool.",labels,
+              [metrics](){ return static_cast<double>(metrics->dropped.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_dropped_bytes_total","Byte dropped by spool.",labels,
+              [metrics](){ return static_cast<double>(metrics->droppedBytes.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_replayed_frames_total","Record replayed to peer.",labels,
+              [metrics](){ return static_cast<double>(metrics->replayedFrames.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_replayed_bytes_total","Byte replayed to peer.",labels,
+              [metrics](){ return static_cast<double>(metrics->replayedBytes.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_corrupt_total","Torn or corrupt record skipped.",labels,
+              [metrics](){ return static_cast<double>(metrics->corrupt.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_write_errors_total","Segment open, write or sync failure.",labels,
+              [metrics](){ return static_cast<double>(metrics->writeErrors.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_syncs_total","Segment fsync call.",labels,
+              [metrics](){ return static_cast<double>(metrics->syncs.value()); });
+    addReader(MetricTypeCounter,"ccl_spool_sync_seconds_total","Time spent in fsync.",labels,
+              [metrics](){ return metrics->syncTime.value() / 1e9; });
+    addReader(MetricTypeCounter,"ccl_spool_segments_total","Segment file opened.",labels,
+              [metrics](){ return static_cast<double>(metrics->segments.value()); });
+    addReader(MetricTypeGauge,"ccl_spool_backlog_bytes","Byte not yet replayed.",labels,
+              [metrics](){ return static_cast<double>(metrics->backlog.value()); });
+}
+
+bool MetricsRegistry::addCurrentThread(const QString &thread)
+{
+#ifdef Q_OS_LINUX
+    clockid_t clock;
+    if(pthread_getcpuclockid(pthread_self(),&clock) != 0){
+        qDebug()<<"Get thread cpu clock failure! Thread: "<<thread;
+        return false;
+    }
+    QString labels = label("thread",thread);
+    addReader(MetricTypeCounter,"ccl_thread_cpu_seconds_total","Cpu time of thread.",
+              labels,[clock](){ return threadCpuTime(clock); });
+
+    // clock is invalid after thread exit, finished is emitted in the thread before it,
+    // keep last cpu time and drop reader of clock
+    std::shared_ptr<QMetaObject::Connection> connection = std::make_shared<QMetaObject::Connection>();
+    *connection = QObject::connect(QThread::currentThread(),&QThread::finished,
+                                   [this,clock,labels,connection](){
+        double last = threadCpuTime(clock);
+        addReader(MetricTypeCounter,"ccl_thread_cpu_seconds_total","Cpu time of thread.",
+                  labels,[last](){ return last; });
+        QObject::disconnect(*connection);
+    });
+    return true;
+#else
+    Q_UNUSED(thread)
+    return false;
+#endif
+}
+
+int MetricsRegistry::removeLabels(const QString &labels)
+{
+    QMutexLocker locker(&m_mutex);
+    int removed = 0;
+    for(int i = m_entries.size() - 1;i >= 0;i--){
+        if(m_entries.at(i)->labels == labels){
+            deleteEntry(m_entries.at(i));
+            m_entries.remove(i);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+int MetricsRegistry::count() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_entries.size();
+}
+
+QByteArray MetricsRegistry::prometheusText() const
+{
+    static const double quantiles[] = {0.5,0.9,0.99,0.999};
+
+    QMutexLocker locker(&m_mutex);
+    QByteArray text;
+    text.reserve(m_entries.size() * 128);
+    for(int i = 0;i < m_entries.size();i++){
+        const MetricEntry * entry = m_entries.at(i);
+        if(i == 0 || m_entries.at(i - 1)->name != entry->name){
+            static const char * typeNames[] = {"counter","gauge","summary"};
+            text += "# HELP " + entry->name.toUtf8() + " " + entry->help.toUtf8() + "\n";
+            text += "# TYPE " + entry->name.toUtf8() + " " + typeNames[entry->type] + "\n";
+        }
+
+        if(entry->reader){
+            appendSample(&text,entry->name,entry->labels,entry->reader());
+        }else if(entry->counter){
+            appendSample(&text,entry->name,entry->labels,static_cast<double>(entry->counter->value()));
+        }else if(entry->gauge){
+            appendSample(&text,entry->name,entry->labels,static_cast<double>(entry->gauge->value()));
+        }else if(entry->histogram){
+            // ns to second
+            QString prefix = entry->labels.isEmpty() ? QString() : entry->labels + ",";
+            for(double quantile : quantiles){
+                appendSample(&text,entry->name,prefix + label("quantile",QString::number(quantile)),
+                             entry->histogram->percentile(quantile * 100) / 1e9);
+            }
+            appendSample(&text,entry->name + "_sum",entry->labels,entry->histogram->sum() / 1e9);
+            appendSample(&text,entry->name + "_count",entry->labels,
+                         static_cast<double>(entry->histogram->count()));
+        }
+    }
+    return text;
+}
+
+QString MetricsRegistry::label(const QString &key, const QString &value)
+{
+    QString escaped = value;
+    escaped.replace("\\","\\\\").replace("\"","\\\"").replace("\n","\\n");
+    return key + "=\"" + escaped + "\"";
+}
+
+MetricsRegistry::MetricEntry *MetricsRegistry::find(const QString &name, const QString &labels) const
+{
+    for(int i = 0;i < m_entries.size();i++){
+        MetricEntry * entry = m_entries.at(i);
+        if(entry->name == name && entry->labels == labels){
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+MetricsRegistry::MetricEntry *MetricsRegistry::insert(MetricType type, const QString &name,
+                                                      const QString &help, const QString &labels)
+{
+    MetricEntry * entry = new MetricEntry;
+    entry->type = type;
+    entry->name = name;
+    entry->help = help;
+    entry->labels = labels;
+    entry->counter = nullptr;
+    entry->gauge = nullptr;
+    entry->histogram = nullptr;
+
+    // after last entry of same name, HELP and TYPE written once
+    int index = m_entries.size();
+    for(int i = m_entries.size() - 1;i >= 0;i--){
+        if(m_entries.at(i)->name == name){
+            index = i + 1;
+            break;
+        }
+    }
+    m_entries.insert(index,entry);
+    return entry;
+}
+
+void MetricsRegistry::deleteEntry(MetricsRegistry::MetricEntry *entry)
+{
+    delete entry->counter;
+    delete entry->gauge;
+    delete entry->histogram;
+    delete entry;
+}
+
+void MetricsRegistry::appendSample(QByteArray *text, const QString &name, const QString &labels, double value)
+{
+    if(std::isnan(value)){
+        return;
+    }
+
+    *text += name.toUtf8();
+    if(!labels.isEmpty()){
+        *text += "{" + labels.toUtf8() + "}";
+    }
+    *text += " " + QByteArray::number(value,'g',15) + "\n";
+}
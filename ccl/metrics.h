@@ -0,0 +1,229 @@
+﻿#ifndef METRICS_H
+#define METRICS_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <functional>
+
+#include "ccl/latencyhistogram.h"
+#include "ccl/queue/abstractqueue.h"
+
+enum MetricType{
+    MetricTypeCounter,
+    MetricTypeGauge,
+    MetricTypeSummary
+};
+
+/**
+ * read value at scrape, NaN mean no sample, e.g. thread is finished.
+ */
+typedef std::function<double()> MetricReader;
+
+/**
+ * monotonic counter, add is one relaxed atomic add, no lock.
+ */
+class MetricCounter
+{
+public:
+    MetricCounter():m_value(0){}
+
+    inline void add(quint64 value = 1)
+    {
+        m_value.fetchAndAddRelaxed(value);
+    }
+
+    inline quint64 value() const
+    {
+        return m_value.load();
+    }
+
+private:
+    QAtomicInteger<quint64> m_value;
+};
+
+/**
+ * value can go up and down, e.g. queue depth, connection count.
+ */
+class MetricGauge
+{
+public:
+    MetricGauge():m_value(0){}
+
+    inline void set(qint64 value)
+    {
+        m_value.store(value);
+    }
+
+    inline void add(qint64 value)
+    {
+        m_value.fetchAndAddRelaxed(value);
+    }
+
+    inline qint64 value() const
+    {
+        return m_value.load();
+    }
+
+private:
+    QAtomicInteger<qint64> m_value;
+};
+
+/**
+ * counter of one link, owned by client, updated in client thread.
+ * 1.bytesRead: byte read from device. messagesRead: buffer pushed to queue.
+ * 2.bytesWritten: byte written by device, TcpServer count byte handed to socket.
+ * 3.readErrors, writeErrors: device read or write return failure.
+ * 4.errors: error signal of device.
+ * 5.reconnects: reconnect try of TcpClient, reopen try of SerialPortClient, first open is not counted.
+ * 6.queueFull: peek of full queue timed out, data is left in device and read again later.
+ */
+typedef struct LinkMetrics_TAG{
+    MetricCounter bytesRead;
+    MetricCounter messagesRead;
+    MetricCounter bytesWritten;
+    MetricCounter readErrors;
+    MetricCounter writeErrors;
+    MetricCounter errors;
+    MetricCounter reconnects;
+    MetricCounter queueFull;
+}LinkMetrics;
+
+/**
+ * counter of one compression stage, updated in compression thread.
+ * 1.frames, bytesIn: record and payload byte taken from queue.
+ * 2.batches, bytesOut: batch and byte handed to sink, bytesIn / bytesOut is ratio.
+ * 3.storedRaw: batch not smaller after compress, handed to sink uncompressed.
+ * 4.failures: codec error, batch handed to sink uncompressed.
+ * 5.busyTime: ns spent in codec, bytesIn / busyTime is throughput.
+ */
+typedef struct CompressionMetrics_TAG{
+    MetricCounter frames;
+    MetricCounter bytesIn;
+    MetricCounter batches;
+    MetricCounter bytesOut;
+    MetricCounter storedRaw;
+    MetricCounter failures;
+    MetricCounter busyTime;
+}CompressionMetrics;
+
+/**
+ * counter of one outbound spool.
+ * 1.frames, bytes: record and byte written to segment, header included.
+ * 2.dropped, droppedBytes: buffer dropped above memory limit or max size, or by write failure.
+ * 3.replayedFrames, replayedBytes: record acknowledged after replay.
+ * 4.corrupt: torn or bad crc record, rest of its segment is skipped.
+ * 5.writeErrors: segment open, write or sync failure.
+ * 6.syncs, syncTime: fsync call and ns spent in it.
+ * 7.segments: segment file opened.
+ * 8.backlog: byte not yet replayed, in memory and on disk.
+ */
+typedef struct SpoolMetrics_TAG{
+    MetricCounter frames;
+    MetricCounter bytes;
+    MetricCounter dropped;
+    MetricCounter droppedBytes;
+    MetricCounter replayedFrames;
+    MetricCounter replayedBytes;
+    MetricCounter corrupt;
+    MetricCounter writeErrors;
+    MetricCounter syncs;
+    MetricCounter syncTime;
+    MetricCounter segments;
+    MetricGauge backlog;
+}SpoolMetrics;
+
+/**
+ * registry of metric, exported in prometheus text format.
+ * 1.register
+ *  1) counter, gauge, histogram function create metric owned by registry,
+ *     same name and labels return the same one. keep returned pointer, record in hot path.
+ *  2) addReader register function read at scrape, e.g. counter already kept by component,
+ *     same name and labels replace old reader.
+ *  3) addLink, addQueue, addCompression, addSpool, addCurrentThread register all metric of a component.
+ *  labels is prometheus label list without brace, e.g. label("link","plc1").
+ * 2.record, lock free, any thread.
+ * 3.export
+ *  call prometheusText function, every name has HELP and TYPE line.
+ *  histogram is recorded in ns, exported as summary in second, name it xxx_seconds.
+ *  histogram is LatencyHistogram, log linear with 4 significant bit, not HDR,
+ *  quantile is upper bound of bucket, at most 1/16 (6.25%) above true value.
+ * Warning!!!
+ * 1.registry keep pointer to component, call removeLabels before delete component.
+ * 2.register and scrape lock a mutex, never register in hot path.
+ */
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    MetricCounter * counter(const QString &name,const QString &help,const QString &labels = QString());
+    MetricGauge * gauge(const QString &name,const QString &help,const QString &labels = QString());
+    LatencyHistogram * histogram(const QString &name,const QString &help,const QString &labels = QString());
+
+    void addReader(MetricType type,const QString &name,const QString &help,
+                   const QString &labels,const MetricReader &reader);
+
+    void addLink(const QString &link,const LinkMetrics * metrics);
+    void addCompression(const QString &stage,const CompressionMetrics * metrics);
+    void addSpool(const QString &spool,const SpoolMetrics * metrics);
+
+    template<typename T>
+    void addQueue(const QString &queue,AbstractQueue<T> * q)
+    {
+        addReader(MetricTypeGauge,"ccl_queue_depth","Buffer pushed and not yet read.",
+                  label("queue",queue),[q](){ return static_cast<double>(q->readableCount()); });
+    }
+
+    /**
+     * cpu time of calling thread, linux only, return false on other platform.
+     * when thread finish, reader of its clock is replaced by last cpu time.
+     * Warning!!!
+     * registry must outlive the thread, e.g. owned by MainWindow, thread waited in destructor.
+     */
+    bool addCurrentThread(const QString &thread);
+
+    /**
+     * remove every metric with exactly these labels, return removed count.
+     */
+    int removeLabels(const QString &labels);
+
+    int count() const;
+
+    QByteArray prometheusText() const;
+
+    /**
+     * key="value", value escaped.
+     */
+    static QString label(const QString &key,const QString &value);
+
+private:
+    Q_DISABLE_COPY(MetricsRegistry)
+
+    typedef struct MetricEntry_TAG{
+        MetricType type;
+        QString name;
+        QString help;
+        QString labels;
+        MetricCounter * counter;
+        MetricGauge * gauge;
+        LatencyHistogram * histogram;
+        MetricReader reader;
+    }MetricEntry;
+
+    MetricEntry * find(const QString &name,const QString &labels) const;
+    MetricEntry * insert(MetricType type,const QString &name,const QString &help,const QString &labels);
+    static void deleteEntry(MetricEntry * entry);
+    static void appendSample(QByteArray * text,const QString &name,const QString &labels,double value);
+
+    mutable QMutex m_mutex;
+
+    // grouped by name, sample of one name together
+    QVector<MetricEntry *> m_entries;
+};
+
+#endif // METRICS_H
@@ -0,0 +1,166 @@
+﻿#include "metricsexporter.h"
+#include <QSaveFile>
+#include <QDebug>
+
+MetricsExporter::MetricsExporter(MetricsRegistry *registry, QObject *parent)
+    :QObject(parent),
+      m_registry(registry),
+      m_server(nullptr),
+      m_timer(nullptr)
+{
+    m_server = new QTcpServer(this);
+    m_timer = new QTimer(this);
+
+    connect(m_server,&QTcpServer::newConnection,this,&MetricsExporter::newConnectionSlot);
+    connect(m_timer,&QTimer::timeout,this,&MetricsExporter::timeoutSlot);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    close();
+}
+
+bool MetricsExporter::listen(quint16 port, const QHostAddress &address)
+{
+    if(m_server->isListening()){
+        m_server->close();
+    }
+    if(!m_server->listen(address,port)){
+        m_errorString = m_server->errorString();
+        qDebug()<<"Metrics listen failure! Error: "<<m_errorString<<" Port: "<<port;
+        emit listenFailure(m_errorString);
+        return false;
+    }
+    return true;
+}
+
+void MetricsExporter::close()
+{
+    m_server->close();
+    QList<QTcpSocket *> sockets = m_requests.keys();
+    m_requests.clear();
+    for(QTcpSocket * socket : sockets){
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+}
+
+bool MetricsExporter::isListening() const
+{
+    return m_server->isListening();
+}
+
+quint16 MetricsExporter::serverPort() const
+{
+    return m_server->serverPort();
+}
+
+void MetricsExporter::startDump(const QString &fileName, int interval)
+{
+    m_fileName = fileName;
+    m_timer->start(interval);
+}
+
+void MetricsExporter::stopDump()
+{
+    m_timer->stop();
+}
+
+bool MetricsExporter::dump()
+{
+    if(m_fileName.isEmpty()){
+        return false;
+    }
+
+    QSaveFile file(m_fileName);
+    if(!file.open(QIODevice::WriteOnly)){
+        m_errorString = file.errorString();
+        qDebug()<<"Metrics dump failure! Error: "<<m_errorString<<" File: "<<m_fileName;
+        emit dumpFailure(m_errorString);
+        return false;
+    }
+    file.write(m_registry->prometheusText());
+    if(!file.commit()){
+        m_errorString = file.errorString();
+        qDebug()<<"Metrics dump failure! Error: "<<m_errorString<<" File: "<<m_fileName;
+        emit dumpFailure(m_errorString);
+        return false;
+    }
+    return true;
+}
+
+QString MetricsExporter::errorString() const
+{
+    return m_errorString;
+}
+
+void MetricsExporter::newConnectionSlot()
+{
+    while(m_server->hasPendingConnections()){
+        QTcpSocket * socket = m_server->nextPendingConnection();
+        m_requests.insert(socket,QByteArray());
+        connect(socket,&QTcpSocket::readyRead,this,&MetricsExporter::readyReadSlot);
+        connect(socket,&QTcpSocket::disconnected,this,&MetricsExporter::disconnectedSlot);
+    }
+}
+
+void MetricsExporter::readyReadSlot()
+{
+    QTcpSocket * socket = qobject_cast<QTcpSocket *>(sender());
+    if(!socket || !m_requests.contains(socket)){
+        return;
+    }
+
+    QByteArray &request = m_requests[socket];
+    request += socket->readAll();
+    int end = request.indexOf("\r\n\r\n");
+    if(end < 0){
+        if(request.size() > METRICS_MAX_REQUEST_SIZE){
+            reply(socket,"431 Request Header Fields Too Large",QByteArray());
+        }
+        return;
+    }
+
+    // request line: method path version
+    QList<QByteArray> requestLine = request.left(request.indexOf("\r\n")).split(' ');
+    if(requestLine.size() < 3){
+        reply(socket,"400 Bad Request",QByteArray());
+    }else if(requestLine.at(0) != "GET"){
+        reply(socket,"405 Method Not Allowed",QByteArray());
+    }else if(requestLine.at(1) != "/metrics"){
+        reply(socket,"404 Not Found",QByteArray());
+    }else{
+        reply(socket,"200 OK",m_registry->prometheusText());
+    }
+}
+
+void MetricsExporter::disconnectedSlot()
+{
+    QTcpSocket * socket = qobject_cast<QTcpSocket *>(sender());
+    if(!socket){
+        return;
+    }
+    m_requests.remove(socket);
+    socket->deleteLater();
+}
+
+void MetricsExporter::timeoutSlot()
+{
+    dump();
+}
+
+void MetricsExporter::reply(QTcpSocket *socket, const QByteArray &status, const QByteArray &body)
+{
+    QByteArray response;
+    response += "HTTP/1.1 " + status + "\r\n";
+    response += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+    response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    response += "Connection: close\r\n\r\n";
+    response += body;
+
+    // one request per connection, disconnected slot delete socket
+    m_requests[socket].clear();
+    socket->write(response);
+    socket->disconnectFromHost();
+}
@@ -0,0 +1,69 @@
+﻿#ifndef METRICSEXPORTER_H
+#define METRICSEXPORTER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QHash>
+#include <QHostAddress>
+
+#include "ccl/metrics.h"
+
+#define METRICS_DEFAULT_PORT 9464
+#define METRICS_DEFAULT_DUMP_INTERVAL 10000
+#define METRICS_MAX_REQUEST_SIZE 8192
+
+/**
+ * export registry out of process, in thread it live in, e.g. gui thread.
+ * 1.pull
+ *  call listen function, GET /metrics return prometheus text, one request per connection.
+ *  listen on localhost by default, scrape it with local agent or reverse proxy.
+ * 2.dump
+ *  call startDump function, registry is written to file every interval ms,
+ *  file is replaced at once(QSaveFile), reader never see half file,
+ *  e.g. textfile collector of node exporter.
+ */
+class MetricsExporter: public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetricsExporter(MetricsRegistry * registry,QObject * parent = nullptr);
+    virtual ~MetricsExporter() override;
+
+    bool listen(quint16 port = METRICS_DEFAULT_PORT,const QHostAddress &address = QHostAddress::LocalHost);
+    void close();
+    bool isListening() const;
+    quint16 serverPort() const;
+
+    void startDump(const QString &fileName,int interval = METRICS_DEFAULT_DUMP_INTERVAL);
+    void stopDump();
+    bool dump();
+
+    QString errorString() const;
+
+signals:
+    void listenFailure(const QString &errorString);
+    void dumpFailure(const QString &errorString);
+
+private slots:
+    void newConnectionSlot();
+    void readyReadSlot();
+    void disconnectedSlot();
+    void timeoutSlot();
+
+private:
+    void reply(QTcpSocket * socket,const QByteArray &status,const QByteArray &body);
+
+    MetricsRegistry * m_registry;
+
+    QTcpServer * m_server;
+    QHash<QTcpSocket *,QByteArray> m_requests;
+
+    QTimer * m_timer;
+    QString m_fileName;
+
+    QString m_errorString;
+};
+
+#endif // METRICSEXPORTER_H
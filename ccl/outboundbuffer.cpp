@@ -0,0 +1,269 @@
+﻿#include "outboundbuffer.h"
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <climits>
+
+OutboundBuffer::OutboundBuffer(qint64 highWatermark,
+                               qint64 lowWatermark,
+                               OutboundPolicy policy)
+    :m_highWatermark(highWatermark),
+      m_lowWatermark(lowWatermark < highWatermark ? lowWatermark : highWatermark),
+      m_policy(policy),
+      m_blockTimeout(OUTBOUND_DEFAULT_BLOCK_TIMEOUT),
+      m_outstanding(0),
+      m_deviceBytes(0),
+      m_aboveHigh(false),
+      m_abort(false),
+      m_droppedFrames(0),
+      m_droppedBytes(0),
+      m_highWatermarkCount(0),
+      m_waiters(0)
+{
+
+}
+
+bool OutboundBuffer::admit(qint64 len, bool canBlock, Crossing *crossing)
+{
+    QMutexLocker locker(&m_mutex);
+    if(crossing){
+        *crossing = NoCrossing;
+    }
+
+    if(m_policy == OutboundBlock && canBlock && m_aboveHigh){
+        QElapsedTimer timer;
+        timer.start();
+        while(m_aboveHigh && !m_abort){
+            qint64 elapsed = timer.elapsed();
+            if(m_blockTimeout != ULONG_MAX && elapsed >= static_cast<qint64>(m_blockTimeout)){
+                break;
+            }
+
+            unsigned long remaining = m_blockTimeout == ULONG_MAX ?
+                        ULONG_MAX : m_blockTimeout - static_cast<unsigned long>(elapsed);
+            m_waiters++;
+            m_cond.wait(&m_mutex,remaining);
+            m_waiters--;
+        }
+    }
+
+    return admitLocked(len,crossing);
+}
+
+bool OutboundBuffer::tryAdmit(qint64 len, bool *isFull, Crossing *crossing)
+{
+    QMutexLocker locker(&m_mutex);
+    if(crossing){
+        *crossing = NoCrossing;
+    }
+
+    // caller wait low watermark instead of block
+    *isFull = m_policy == OutboundBlock && m_aboveHigh && !m_abort && m_outstanding > 0;
+    if(*isFull){
+        return false;
+    }
+
+    return admitLocked(len,crossing);
+}
+
+bool OutboundBuffer::admitLocked(qint64 len, Crossing *crossing)
+{
+    bool isFull = m_outstanding + len > m_highWatermark;
+    bool isDrop = (m_policy == OutboundBlock && m_aboveHigh) ||
+            (m_policy == OutboundDropNewest && isFull);
+    if(m_abort || (isDrop && m_outstanding > 0)){
+        m_droppedFrames++;
+        m_droppedBytes += static_cast<quint64>(len);
+        return false;
+    }
+
+    // a buffer greater than watermark is admitted when nothing outstanding
+    m_outstanding += len;
+    Crossing ret = checkHigh();
+    if(crossing){
+        *crossing = ret;
+    }
+    return true;
+}
+
+OutboundBuffer::Crossing OutboundBuffer::enqueue(const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pending.append(data);
+
+    Crossing crossing = NoCrossing;
+    if(m_policy == OutboundDropOldest){
+        // drop oldest pending, keep the newest one
+        while(m_outstanding > m_highWatermark && m_pending.size() > 1){
+            qint64 len = m_pending.takeFirst().size();
+            m_droppedFrames++;
+            m_droppedBytes += static_cast<quint64>(len);
+            Crossing ret = release(len);
+            if(ret != NoCrossing){
+                crossing = ret;
+            }
+        }
+    }
+    return crossing;
+}
+
+bool OutboundBuffer::hasPending()
+{
+    QMutexLocker locker(&m_mutex);
+    return !m_pending.isEmpty();
+}
+
+QByteArray OutboundBuffer::takePending()
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_pending.isEmpty()){
+        return QByteArray();
+    }
+    return m_pending.takeFirst();
+}
+
+void OutboundBuffer::handed(qint64 len)
+{
+    QMutexLocker locker(&m_mutex);
+    m_deviceBytes += len;
+}
+
+OutboundBuffer::Crossing OutboundBuffer::written(qint64 len)
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 deviceLen = len < m_deviceBytes ? len : m_deviceBytes;
+    m_deviceBytes -= deviceLen;
+    return release(deviceLen);
+}
+
+OutboundBuffer::Crossing OutboundBuffer::discard(qint64 len)
+{
+    QMutexLocker locker(&m_mutex);
+    return release(len);
+}
+
+OutboundBuffer::Crossing OutboundBuffer::resetDevice()
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 len = m_deviceBytes;
+    m_deviceBytes = 0;
+    return release(len);
+}
+
+OutboundBuffer::Crossing OutboundBuffer::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 len = 0;
+    for(const QByteArray &data : m_pending){
+        len += data.size();
+    }
+    m_pending.clear();
+    return release(len);
+}
+
+void OutboundBuffer::abort()
+{
+    m_mutex.lock();
+    m_abort = true;
+    m_cond.wakeAll();
+    m_mutex.unlock();
+}
+
+void OutboundBuffer::reset()
+{
+    QMutexLocker locker(&m_mutex);
+    m_abort = false;
+}
+
+OutboundBuffer::Crossing OutboundBuffer::release(qint64 len)
+{
+    m_outstanding -= len;
+    if(m_outstanding < 0){
+        m_outstanding = 0;
+    }
+
+    if(m_aboveHigh && m_outstanding <= m_lowWatermark){
+        m_aboveHigh = false;
+        if(m_waiters > 0){
+            m_cond.wakeAll();
+        }
+        return CrossLow;
+    }
+    return NoCrossing;
+}
+
+OutboundBuffer::Crossing OutboundBuffer::checkHigh()
+{
+    if(!m_aboveHigh && m_outstanding > m_highWatermark){
+        m_aboveHigh = true;
+        m_highWatermarkCount++;
+        return CrossHigh;
+    }
+    return NoCrossing;
+}
+
+qint64 OutboundBuffer::highWatermark()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_highWatermark;
+}
+
+qint64 OutboundBuffer::lowWatermark()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lowWatermark;
+}
+
+void OutboundBuffer::setWatermark(qint64 highWatermark, qint64 lowWatermark)
+{
+    QMutexLocker locker(&m_mutex);
+    m_highWatermark = highWatermark;
+    m_lowWatermark = lowWatermark < highWatermark ? lowWatermark : highWatermark;
+}
+
+OutboundPolicy OutboundBuffer::policy()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_policy;
+}
+
+void OutboundBuffer::setPolicy(const OutboundPolicy &policy)
+{
+    QMutexLocker locker(&m_mutex);
+    m_policy = policy;
+}
+
+unsigned long OutboundBuffer::blockTimeout()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_blockTimeout;
+}
+
+void OutboundBuffer::setBlockTimeout(unsigned long blockTimeout)
+{
+    QMutexLocker locker(&m_mutex);
+    m_blockTimeout = blockTimeout;
+}
+
+qint64 OutboundBuffer::outstandingBytes()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_outstanding;
+}
+
+quint64 OutboundBuffer::droppedFrames()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_droppedFrames;
+}
+
+quint64 OutboundBuffer::droppedBytes()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_droppedBytes;
+}
+
+quint64 OutboundBuffer::highWatermarkCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_highWatermarkCount;
+}
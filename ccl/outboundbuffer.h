@@ -0,0 +1,107 @@
+﻿#ifndef OUTBOUNDBUFFER_H
+#define OUTBOUNDBUFFER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
+#define OUTBOUND_DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define OUTBOUND_DEFAULT_LOW_WATERMARK (256 * 1024)
+#define OUTBOUND_DEFAULT_BLOCK_TIMEOUT 1000
+
+enum OutboundPolicy{
+    OutboundBlock,
+    OutboundDropOldest,
+    OutboundDropNewest
+};
+
+/**
+ * bounded outbound buffer of client, count bytes from write call until device written.
+ * 1.caller thread
+ *  call admit function before emit write signal, if return false, buffer is dropped.
+ *  1) OutboundBlock: above high watermark, wait until below low watermark or blockTimeout,
+ *     drop if timeout, never block in client thread.
+ *  2) OutboundDropNewest: above high watermark, drop new buffer.
+ *  3) OutboundDropOldest: always admit, oldest pending buffer is dropped in enqueue.
+ *  call tryAdmit function instead in coroutine, it never block, with OutboundBlock above high watermark
+ *  it return false and set isFull, buffer is not dropped, try again after low watermark.
+ * 2.client thread
+ *  1) call enqueue function add admitted buffer to pending list.
+ *  2) call takePending function when device buffer below high watermark, then handed function.
+ *  3) call written function in device bytesWritten, discard function if write failure,
+ *     resetDevice function if device closed.
+ * 3.watermark
+ *  admit, enqueue, written, discard return crossing, client emit its watermark signal.
+ */
+class OutboundBuffer
+{
+public:
+    enum Crossing{
+        NoCrossing,
+        CrossHigh,
+        CrossLow
+    };
+
+    explicit OutboundBuffer(qint64 highWatermark = OUTBOUND_DEFAULT_HIGH_WATERMARK,
+                            qint64 lowWatermark = OUTBOUND_DEFAULT_LOW_WATERMARK,
+                            OutboundPolicy policy = OutboundDropNewest);
+
+    bool admit(qint64 len,bool canBlock,Crossing * crossing);
+    bool tryAdmit(qint64 len,bool * isFull,Crossing * crossing);
+    Crossing enqueue(const QByteArray &data);
+
+    bool hasPending();
+    QByteArray takePending();
+    void handed(qint64 len);
+
+    Crossing written(qint64 len);
+    Crossing discard(qint64 len);
+    Crossing resetDevice();
+    Crossing clear();
+
+    void abort();
+    void reset();
+
+    qint64 highWatermark();
+    qint64 lowWatermark();
+    void setWatermark(qint64 highWatermark,qint64 lowWatermark);
+
+    OutboundPolicy policy();
+    void setPolicy(const OutboundPolicy &policy);
+
+    unsigned long blockTimeout();
+    void setBlockTimeout(unsigned long blockTimeout);
+
+    qint64 outstandingBytes();
+    quint64 droppedFrames();
+    quint64 droppedBytes();
+    quint64 highWatermarkCount();
+
+private:
+    bool admitLocked(qint64 len,Crossing * crossing);
+    Crossing release(qint64 len);
+    Crossing checkHigh();
+
+    qint64 m_highWatermark;
+    qint64 m_lowWatermark;
+    OutboundPolicy m_policy;
+    unsigned long m_blockTimeout;
+
+    qint64 m_outstanding;
+    qint64 m_deviceBytes;
+    bool m_aboveHigh;
+    bool m_abort;
+
+    QList<QByteArray> m_pending;
+
+    quint64 m_droppedFrames;
+    quint64 m_droppedBytes;
+    quint64 m_highWatermarkCount;
+
+    QMutex m_mutex;
+    QWaitCondition m_cond;
+    int m_waiters;
+};
+
+#endif // OUTBOUNDBUFFER_H
@@ -0,0 +1,634 @@
+﻿#include "outboundspool.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStringList>
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+
+#include "ccl/checksum.h"
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+OutboundSpool::OutboundSpool(const QString &dir, QObject *parent)
+    :QThread(parent),
+      m_dir(dir),
+      m_segmentSize(SPOOL_DEFAULT_SEGMENT_SIZE),
+      m_maxSize(SPOOL_DEFAULT_MAX_SIZE),
+      m_memoryLimit(SPOOL_DEFAULT_MEMORY_LIMIT),
+      m_batchBytes(SPOOL_DEFAULT_BATCH_BYTES),
+      m_flushInterval(SPOOL_DEFAULT_FLUSH_INTERVAL),
+      m_syncPolicy(SpoolSyncInterval),
+      m_syncInterval(SPOOL_DEFAULT_SYNC_INTERVAL),
+      m_readAhead(SPOOL_DEFAULT_READ_AHEAD),
+      m_waiting(false),
+      m_stop(false),
+      m_replay(false),
+      m_incomingBytes(0),
+      m_writingBytes(0),
+      m_readyBytes(0),
+      m_inflightAcked(0),
+      m_ackSegment(0),
+      m_ackOffset(0),
+      m_diskBytes(0),
+      m_writeSegment(1),
+      m_writeOffset(0),
+      m_dirty(false),
+      m_unread(false),
+      m_lastSync(0),
+      m_lastSave(0),
+      m_readSegment(1),
+      m_readOffset(0),
+      m_firstSegment(1),
+      m_savedSegment(0),
+      m_savedOffset(0)
+{
+
+}
+
+OutboundSpool::~OutboundSpool()
+{
+    if(isRunning()){
+        stop();
+    }
+}
+
+bool OutboundSpool::open()
+{
+    QDir dir(m_dir);
+    if(!dir.mkpath(".")){
+        m_errorString = QString("Create spool dir failure! Dir: %1").arg(m_dir);
+        qDebug()<<m_errorString;
+        return false;
+    }
+
+    quint64 cursorSegment = 0;
+    qint64 cursorOffset = 0;
+    QFile cursor(dir.filePath(SPOOL_CURSOR_FILE));
+    if(cursor.open(QIODevice::ReadOnly)){
+        QList<QByteArray> fields = cursor.readAll().trimmed().split(' ');
+        if(fields.size() == 2){
+            cursorSegment = fields.at(0).toULongLong();
+            cursorOffset = fields.at(1).toLongLong();
+        }
+    }
+
+    // segment name is zero padded number, name order is segment order
+    QStringList names = dir.entryList(QStringList()<<QString("*" SPOOL_SEGMENT_SUFFIX),
+                                      QDir::Files,QDir::Name);
+    quint64 firstSegment = 0;
+    quint64 lastSegment = 0;
+    qint64 diskBytes = 0;
+    for(int i = 0;i < names.size();i++){
+        const QString &name = names.at(i);
+        bool ok = false;
+        quint64 segment = name.left(name.size() - static_cast<int>(strlen(SPOOL_SEGMENT_SUFFIX))).toULongLong(&ok);
+        if(!ok || segment == 0){
+            continue;
+        }
+        if(segment < cursorSegment){
+            // replayed before last stop
+            QFile::remove(dir.filePath(name));
+            continue;
+        }
+        if(firstSegment == 0){
+            firstSegment = segment;
+        }
+        lastSegment = segment;
+        diskBytes += QFileInfo(dir.filePath(name)).size();
+    }
+
+    // never append to segment of last run, its tail may be torn
+    m_writeSegment = qMax(lastSegment,cursorSegment) + 1;
+    m_writeOffset = 0;
+    m_firstSegment = firstSegment > 0 ? firstSegment : m_writeSegment;
+    m_readSegment = m_firstSegment;
+    m_readOffset = m_readSegment == cursorSegment ? cursorOffset : 0;
+    m_unread = firstSegment > 0;
+    m_savedSegment = cursorSegment;
+    m_savedOffset = cursorOffset;
+
+    QMutexLocker locker(&m_mutex);
+    m_ackSegment = m_readSegment;
+    m_ackOffset = m_readOffset;
+    m_diskBytes = qMax(diskBytes - m_readOffset,static_cast<qint64>(0));
+    updateBacklog();
+    return true;
+}
+
+void OutboundSpool::stop()
+{
+    m_mutex.lock();
+    m_stop = true;
+    m_cond.wakeAll();
+    m_mutex.unlock();
+    wait();
+}
+
+QString OutboundSpool::dir() const
+{
+    return m_dir;
+}
+
+QString OutboundSpool::errorString() const
+{
+    return m_errorString;
+}
+
+void OutboundSpool::setSegmentSize(qint64 segmentSize)
+{
+    m_segmentSize = segmentSize;
+}
+
+qint64 OutboundSpool::segmentSize() const
+{
+    return m_segmentSize;
+}
+
+void OutboundSpool::setMaxSize(qint64 maxSize)
+{
+    m_maxSize = maxSize;
+}
+
+qint64 OutboundSpool::maxSize() const
+{
+    return m_maxSize;
+}
+
+void OutboundSpool::setMemoryLimit(qint64 memoryLimit)
+{
+    m_memoryLimit = memoryLimit;
+}
+
+qint64 OutboundSpool::memoryLimit() const
+{
+    return m_memoryLimit;
+}
+
+void OutboundSpool::setBatchLimits(int batchBytes, int flushInterval)
+{
+    m_batchBytes = batchBytes;
+    m_flushInterval = flushInterval < 0 ? 0 : flushInterval;
+}
+
+void OutboundSpool::setSyncPolicy(SpoolSyncPolicy policy, int syncInterval)
+{
+    m_syncPolicy = policy;
+    m_syncInterval = syncInterval;
+}
+
+SpoolSyncPolicy OutboundSpool::syncPolicy() const
+{
+    return m_syncPolicy;
+}
+
+void OutboundSpool::setReadAhead(qint64 readAhead)
+{
+    m_readAhead = readAhead;
+}
+
+bool OutboundSpool::append(const char *data, qint64 len)
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_stop || m_incomingBytes + m_writingBytes + len > m_memoryLimit){
+        // disk is behind, never wait for it
+        m_metrics.dropped.add();
+        m_metrics.droppedBytes.add(static_cast<quint64>(len));
+        return false;
+    }
+
+    m_incoming.append(QByteArray(data,static_cast<int>(len)));
+    m_incomingBytes += len;
+    updateBacklog();
+
+    // spool thread wake up by itself every flushInterval, only full batch wake it
+    if(m_waiting && (m_incomingBytes >= m_batchBytes || m_flushInterval == 0)){
+        m_cond.wakeOne();
+    }
+    return true;
+}
+
+void OutboundSpool::startReplay()
+{
+    QMutexLocker locker(&m_mutex);
+    m_replay = true;
+    if(m_waiting){
+        m_cond.wakeOne();
+    }
+}
+
+void OutboundSpool::stopReplay()
+{
+    QMutexLocker locker(&m_mutex);
+    m_replay = false;
+}
+
+qint64 OutboundSpool::take(qint64 maxBytes, QByteArray *out)
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 taken = 0;
+    while(!m_ready.isEmpty() && maxBytes > 0){
+        qint64 len = m_ready.first().data.size();
+        if(taken > 0 && taken + len > maxBytes){
+            break;
+        }
+
+        SpoolRecord record = m_ready.takeFirst();
+        out->append(record.data);
+        taken += len;
+        m_readyBytes -= len;
+        m_inflight.append(record);
+    }
+
+    // refill before it run out
+    if(m_waiting && m_replay && m_readyBytes < m_readAhead / 2){
+        m_cond.wakeOne();
+    }
+    return taken;
+}
+
+void OutboundSpool::acknowledge(qint64 len)
+{
+    QMutexLocker locker(&m_mutex);
+    m_inflightAcked += len;
+    while(!m_inflight.isEmpty() && m_inflightAcked >= m_inflight.first().data.size()){
+        SpoolRecord record = m_inflight.takeFirst();
+        qint64 size = record.data.size();
+        m_inflightAcked -= size;
+        m_ackSegment = record.segment;
+        m_ackOffset = record.end;
+        m_diskBytes -= SPOOL_RECORD_HEADER_SIZE + size;
+        m_metrics.replayedFrames.add();
+        m_metrics.replayedBytes.add(static_cast<quint64>(size));
+    }
+    if(m_inflight.isEmpty()){
+        m_inflightAcked = 0;
+    }
+    updateBacklog();
+}
+
+void OutboundSpool::rewind()
+{
+    QMutexLocker locker(&m_mutex);
+    while(!m_inflight.isEmpty()){
+        SpoolRecord record = m_inflight.takeLast();
+        m_readyBytes += record.data.size();
+        m_ready.prepend(record);
+    }
+    m_inflightAcked = 0;
+}
+
+qint64 OutboundSpool::backlogBytes()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_incomingBytes + m_writingBytes + m_diskBytes;
+}
+
+bool OutboundSpool::isEmpty()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_incomingBytes == 0 && m_writingBytes == 0 && m_diskBytes <= 0;
+}
+
+const SpoolMetrics *OutboundSpool::metrics() const
+{
+    return &m_metrics;
+}
+
+void OutboundSpool::run()
+{
+    QList<QByteArray> buffers;
+    m_lastSync = bufferMetaNow();
+    m_lastSave = m_lastSync;
+
+    forever{
+        m_mutex.lock();
+        bool readable = m_replay && m_unread && m_readyBytes < m_readAhead;
+        if(!m_stop && !readable && m_incomingBytes < m_batchBytes){
+            unsigned long timeout = m_flushInterval > 0 ?
+                        static_cast<unsigned long>(m_flushInterval) : static_cast<unsigned long>(m_syncInterval);
+            m_waiting = true;
+            m_cond.wait(&m_mutex,timeout);
+            m_waiting = false;
+        }
+        bool stop = m_stop;
+        bool replay = m_replay;
+        // counted in backlog until written
+        buffers.swap(m_incoming);
+        m_writingBytes = m_incomingBytes;
+        m_incomingBytes = 0;
+        m_mutex.unlock();
+
+        if(!buffers.isEmpty()){
+            writeBatch(buffers);
+            buffers.clear();
+            m_mutex.lock();
+            m_writingBytes = 0;
+            updateBacklog();
+            m_mutex.unlock();
+        }
+
+        qint64 now = bufferMetaNow();
+        if(m_syncPolicy == SpoolSyncInterval && now - m_lastSync >= m_syncInterval * Q_INT64_C(1000000)){
+            sync();
+        }
+        if(replay){
+            readAhead();
+        }
+        removeReplayed();
+        if(now - m_lastSave >= m_syncInterval * Q_INT64_C(1000000)){
+            saveCursor();
+        }
+
+        if(stop){
+            break;
+        }
+    }
+
+    closeWriteSegment();
+    m_readFile.close();
+    saveCursor();
+}
+
+void OutboundSpool::writeBatch(const QList<QByteArray> &buffers)
+{
+    m_mutex.lock();
+    qint64 diskBytes = m_diskBytes;
+    m_mutex.unlock();
+
+    m_batch.resize(0);
+    int frames = 0;
+    for(int i = 0;i < buffers.size();i++){
+        const QByteArray &data = buffers.at(i);
+        qint64 size = SPOOL_RECORD_HEADER_SIZE + data.size();
+        if(diskBytes + m_batch.size() + size > m_maxSize){
+            // disk full, newest is dropped, backlog on disk is kept
+            m_metrics.dropped.add();
+            m_metrics.droppedBytes.add(static_cast<quint64>(data.size()));
+            continue;
+        }
+
+        if(m_writeOffset + m_batch.size() + size > m_segmentSize && m_writeOffset + m_batch.size() > 0){
+            diskBytes += writeOut(frames);
+            frames = 0;
+            closeWriteSegment();
+            m_writeSegment++;
+            m_writeOffset = 0;
+        }
+
+        char header[SPOOL_RECORD_HEADER_SIZE];
+        qToBigEndian<quint32>(static_cast<quint32>(data.size()),header);
+        qToBigEndian<quint32>(Checksum::crc32(data.constData(),data.size()),header + 4);
+        m_batch.append(header,SPOOL_RECORD_HEADER_SIZE);
+        m_batch.append(data);
+        frames++;
+    }
+    writeOut(frames);
+
+    if(m_syncPolicy == SpoolSyncBatch){
+        sync();
+    }
+}
+
+qint64 OutboundSpool::writeOut(int frames)
+{
+    if(m_batch.isEmpty()){
+        return 0;
+    }
+
+    qint64 len = -1;
+    if(m_writeFile.isOpen() || openWriteSegment()){
+        // one write call per batch
+        len = m_writeFile.write(m_batch);
+    }
+
+    qint64 size = m_batch.size();
+    m_batch.resize(0);
+    if(len != size){
+        m_metrics.writeErrors.add();
+        m_metrics.dropped.add(static_cast<quint64>(frames));
+        m_metrics.droppedBytes.add(static_cast<quint64>(size - frames * SPOOL_RECORD_HEADER_SIZE));
+        qDebug()<<"Write spool segment failure! Error: "<<m_writeFile.errorString()<<
+                  " File: "<<m_writeFile.fileName();
+
+        // half written tail end the segment, reader skip it
+        if(len > 0){
+            closeWriteSegment();
+            m_writeSegment++;
+            m_writeOffset = 0;
+        }
+        return 0;
+    }
+
+    m_writeOffset += len;
+    m_dirty = true;
+    m_unread = true;
+    m_metrics.frames.add(static_cast<quint64>(frames));
+    m_metrics.bytes.add(static_cast<quint64>(len));
+
+    m_mutex.lock();
+    m_diskBytes += len;
+    m_mutex.unlock();
+    return len;
+}
+
+bool OutboundSpool::openWriteSegment()
+{
+    m_writeFile.setFileName(segmentPath(m_writeSegment));
+    if(!m_writeFile.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)){
+        m_errorString = QString("Open spool segment failure! File: %1 Error: %2")
+                .arg(m_writeFile.fileName()).arg(m_writeFile.errorString());
+        qDebug()<<m_errorString;
+        return false;
+    }
+    m_metrics.segments.add();
+    return true;
+}
+
+void OutboundSpool::closeWriteSegment()
+{
+    if(!m_writeFile.isOpen()){
+        return;
+    }
+    if(m_syncPolicy != SpoolSyncNone){
+        sync();
+    }
+    m_writeFile.close();
+    m_dirty = false;
+}
+
+void OutboundSpool::sync()
+{
+    m_lastSync = bufferMetaNow();
+    if(!m_dirty || !m_writeFile.isOpen()){
+        return;
+    }
+
+#if defined(Q_OS_LINUX)
+    // size change is flushed too, metadata like mtime is not needed
+    int ret = fdatasync(m_writeFile.handle());
+#elif defined(Q_OS_UNIX)
+    int ret = fsync(m_writeFile.handle());
+#else
+    int ret = m_writeFile.flush() ? 0 : -1;
+#endif
+    if(ret != 0){
+        m_metrics.writeErrors.add();
+        qDebug()<<"Sync spool segment failure! File: "<<m_writeFile.fileName();
+    }
+
+    qint64 now = bufferMetaNow();
+    m_metrics.syncs.add();
+    m_metrics.syncTime.add(static_cast<quint64>(now - m_lastSync));
+    m_lastSync = now;
+    m_dirty = false;
+}
+
+void OutboundSpool::readAhead()
+{
+    m_mutex.lock();
+    qint64 readyBytes = m_readyBytes;
+    m_mutex.unlock();
+
+    char header[SPOOL_RECORD_HEADER_SIZE];
+    while(readyBytes < m_readAhead){
+        if(!m_readFile.isOpen()){
+            if(m_readSegment == m_writeSegment && m_writeOffset <= m_readOffset){
+                m_unread = false;
+                return;
+            }
+            m_readFile.setFileName(segmentPath(m_readSegment));
+            if(!m_readFile.open(QIODevice::ReadOnly) || !m_readFile.seek(m_readOffset)){
+                m_readFile.close();
+                if(m_readSegment == m_writeSegment){
+                    m_unread = false;
+                    return;
+                }
+                // e.g. removed by hand
+                nextReadSegment(0);
+                continue;
+            }
+        }
+
+        // segment being written is read up to last whole batch
+        bool writing = m_readSegment == m_writeSegment;
+        qint64 limit = writing ? m_writeOffset : m_readFile.size();
+        if(m_readOffset + SPOOL_RECORD_HEADER_SIZE > limit){
+            if(writing){
+                m_unread = false;
+                return;
+            }
+            nextReadSegment(limit - m_readOffset);
+            continue;
+        }
+
+        if(m_readFile.read(header,SPOOL_RECORD_HEADER_SIZE) != SPOOL_RECORD_HEADER_SIZE){
+            nextReadSegment(limit - m_readOffset);
+            continue;
+        }
+        qint64 len = qFromBigEndian<quint32>(header);
+        quint32 crc = qFromBigEndian<quint32>(header + 4);
+        QByteArray data;
+        if(len <= SPOOL_MAX_RECORD_SIZE && m_readOffset + SPOOL_RECORD_HEADER_SIZE + len <= limit){
+            data = m_readFile.read(len);
+        }
+        if(data.size() != len || Checksum::crc32(data.constData(),len) != crc){
+            qDebug()<<"Corrupt spool record! File: "<<m_readFile.fileName()<<" Offset: "<<m_readOffset;
+            if(writing){
+                // never written by this run, skip to end of written byte
+                m_metrics.corrupt.add();
+                m_mutex.lock();
+                m_diskBytes -= limit - m_readOffset;
+                updateBacklog();
+                m_mutex.unlock();
+                m_readOffset = limit;
+                m_readFile.close();
+                m_unread = false;
+                return;
+            }
+            nextReadSegment(limit - m_readOffset);
+            continue;
+        }
+
+        m_readOffset += SPOOL_RECORD_HEADER_SIZE + len;
+        SpoolRecord record;
+        record.data = data;
+        record.segment = m_readSegment;
+        record.end = m_readOffset;
+
+        m_mutex.lock();
+        m_ready.append(record);
+        m_readyBytes += len;
+        readyBytes = m_readyBytes;
+        m_mutex.unlock();
+    }
+}
+
+void OutboundSpool::nextReadSegment(qint64 skipped)
+{
+    m_readFile.close();
+
+    QMutexLocker locker(&m_mutex);
+    if(skipped > 0){
+        // torn or corrupt tail never replayed
+        m_metrics.corrupt.add();
+        m_diskBytes -= skipped;
+        updateBacklog();
+    }
+
+    // nothing of old segment wait acknowledge, it can be removed
+    if(m_ready.isEmpty() && m_inflight.isEmpty() && m_ackSegment == m_readSegment){
+        m_ackSegment = m_readSegment + 1;
+        m_ackOffset = 0;
+    }
+    m_readSegment++;
+    m_readOffset = 0;
+}
+
+void OutboundSpool::removeReplayed()
+{
+    m_mutex.lock();
+    quint64 ackSegment = m_ackSegment;
+    m_mutex.unlock();
+
+    while(m_firstSegment < ackSegment){
+        QFile::remove(segmentPath(m_firstSegment));
+        m_firstSegment++;
+    }
+}
+
+void OutboundSpool::saveCursor()
+{
+    m_lastSave = bufferMetaNow();
+
+    m_mutex.lock();
+    quint64 segment = m_ackSegment;
+    qint64 offset = m_ackOffset;
+    m_mutex.unlock();
+    if(segment == m_savedSegment && offset == m_savedOffset){
+        return;
+    }
+
+    QSaveFile file(QDir(m_dir).filePath(SPOOL_CURSOR_FILE));
+    if(!file.open(QIODevice::WriteOnly) ||
+            file.write(QString("%1 %2\n").arg(segment).arg(offset).toLatin1()) < 0 ||
+            !file.commit()){
+        qDebug()<<"Save spool cursor failure! Error: "<<file.errorString()<<" Dir: "<<m_dir;
+        return;
+    }
+    m_savedSegment = segment;
+    m_savedOffset = offset;
+}
+
+void OutboundSpool::updateBacklog()
+{
+    m_metrics.backlog.set(m_incomingBytes + m_writingBytes + m_diskBytes);
+}
+
+QString OutboundSpool::segmentPath(quint64 segment) const
+{
+    return QDir(m_dir).filePath(QString("%1" SPOOL_SEGMENT_SUFFIX).arg(segment,16,10,QChar('0')));
+}
@@ -0,0 +1,199 @@
+﻿#ifndef OUTBOUNDSPOOL_H
+#define OUTBOUNDSPOOL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QByteArray>
+#include <QList>
+#include <QFile>
+#include <QString>
+
+#include "ccl/metrics.h"
+
+#define SPOOL_DEFAULT_SEGMENT_SIZE (16 * 1024 * 1024)
+#define SPOOL_DEFAULT_MAX_SIZE (Q_INT64_C(1024) * 1024 * 1024)
+#define SPOOL_DEFAULT_MEMORY_LIMIT (4 * 1024 * 1024)
+#define SPOOL_DEFAULT_BATCH_BYTES 65536
+#define SPOOL_DEFAULT_FLUSH_INTERVAL 20
+#define SPOOL_DEFAULT_SYNC_INTERVAL 1000
+#define SPOOL_DEFAULT_READ_AHEAD (256 * 1024)
+#define SPOOL_MAX_RECORD_SIZE (16 * 1024 * 1024)
+#define SPOOL_RECORD_HEADER_SIZE 8
+#define SPOOL_SEGMENT_SUFFIX ".spool"
+#define SPOOL_CURSOR_FILE "cursor"
+
+/**
+ * when written segment is made durable.
+ * 1.SpoolSyncNone: never fsync, os write back, fastest, lost on power failure not on crash.
+ * 2.SpoolSyncBatch: fsync after every batch, lose nothing acknowledged by append, slowest.
+ * 3.SpoolSyncInterval: fsync at most every syncInterval ms, lose up to syncInterval on power failure.
+ * segment is always synced before rotate, except SpoolSyncNone.
+ */
+enum SpoolSyncPolicy{
+    SpoolSyncNone,
+    SpoolSyncBatch,
+    SpoolSyncInterval
+};
+
+/**
+ * store and forward spool of outbound byte, e.g. TcpClient write while peer is down.
+ * 1.write
+ *  append function copy buffer into memory list and return, never touch disk, never block.
+ *  spool thread write gathered buffer in one write call every batchBytes or flushInterval ms,
+ *  to append only segment file in dir, segment is rotated at segmentSize.
+ *  record: len(4) crc32(4) payload, big endian, crc32 of payload.
+ *  buffer is dropped(counted) above memoryLimit in memory or maxSize on disk.
+ * 2.replay
+ *  after startReplay, spool thread read ahead up to readAhead byte of oldest record into memory,
+ *  take function hand them out, never touch disk.
+ *  acknowledge function confirm byte written, fully replayed segment is deleted.
+ *  rewind function put taken but not acknowledged record back, e.g. connection lost, replayed again.
+ * 3.restart
+ *  replay position is kept in cursor file at sync, spool continue from it after open.
+ *  record after cursor may be replayed twice after crash, at least once.
+ *  torn or corrupt record end its segment, counted in corrupt.
+ * 4.metrics
+ *  register metrics function with MetricsRegistry::addSpool.
+ * e.g.
+ *  OutboundSpool spool("/var/spool/hmi/plc1");
+ *  spool.setSyncPolicy(SpoolSyncInterval,1000);
+ *  if(spool.open()){
+ *      spool.start();
+ *      tcpClient->setSpool(&spool);
+ *  }
+ * Warning!!!
+ * one dir per spool. set option before start, stop spool after client is stopped.
+ */
+class OutboundSpool: public QThread
+{
+public:
+    explicit OutboundSpool(const QString &dir,QObject * parent = nullptr);
+    virtual ~OutboundSpool() override;
+
+    bool open();
+    void stop();
+
+    QString dir() const;
+    QString errorString() const;
+
+    void setSegmentSize(qint64 segmentSize);
+    qint64 segmentSize() const;
+
+    void setMaxSize(qint64 maxSize);
+    qint64 maxSize() const;
+
+    void setMemoryLimit(qint64 memoryLimit);
+    qint64 memoryLimit() const;
+
+    /**
+     * flushInterval in ms, 0 write every buffer at once.
+     */
+    void setBatchLimits(int batchBytes,int flushInterval);
+
+    /**
+     * syncInterval in ms, used by SpoolSyncInterval.
+     */
+    void setSyncPolicy(SpoolSyncPolicy policy,int syncInterval = SPOOL_DEFAULT_SYNC_INTERVAL);
+    SpoolSyncPolicy syncPolicy() const;
+
+    void setReadAhead(qint64 readAhead);
+
+    /**
+     * any thread, return false if dropped.
+     */
+    bool append(const char * data,qint64 len);
+
+    void startReplay();
+    void stopReplay();
+
+    /**
+     * append whole record to out up to maxBytes, at least one if maxBytes > 0, return byte taken.
+     */
+    qint64 take(qint64 maxBytes,QByteArray * out);
+    void acknowledge(qint64 len);
+    void rewind();
+
+    /**
+     * byte appended and not yet acknowledged, in memory and on disk.
+     */
+    qint64 backlogBytes();
+    bool isEmpty();
+
+    const SpoolMetrics * metrics() const;
+
+protected:
+    void run() override;
+
+private:
+    typedef struct SpoolRecord_TAG{
+        QByteArray data;
+        quint64 segment;
+        qint64 end;
+    }SpoolRecord;
+
+    void writeBatch(const QList<QByteArray> &buffers);
+    qint64 writeOut(int frames);
+    bool openWriteSegment();
+    void closeWriteSegment();
+    void sync();
+    void readAhead();
+    void nextReadSegment(qint64 skipped);
+    void removeReplayed();
+    void saveCursor();
+
+    /**
+     * call with mutex locked.
+     */
+    void updateBacklog();
+    QString segmentPath(quint64 segment) const;
+
+    QString m_dir;
+    QString m_errorString;
+
+    qint64 m_segmentSize;
+    qint64 m_maxSize;
+    qint64 m_memoryLimit;
+    int m_batchBytes;
+    int m_flushInterval;
+    SpoolSyncPolicy m_syncPolicy;
+    int m_syncInterval;
+    qint64 m_readAhead;
+
+    // shared with append, take, acknowledge
+    QMutex m_mutex;
+    QWaitCondition m_cond;
+    bool m_waiting;
+    bool m_stop;
+    bool m_replay;
+    QList<QByteArray> m_incoming;
+    qint64 m_incomingBytes;
+    qint64 m_writingBytes;
+    QList<SpoolRecord> m_ready;
+    qint64 m_readyBytes;
+    QList<SpoolRecord> m_inflight;
+    qint64 m_inflightAcked;
+    quint64 m_ackSegment;
+    qint64 m_ackOffset;
+    qint64 m_diskBytes;
+
+    // spool thread only
+    QFile m_writeFile;
+    quint64 m_writeSegment;
+    qint64 m_writeOffset;
+    bool m_dirty;
+    bool m_unread;
+    qint64 m_lastSync;
+    qint64 m_lastSave;
+    QFile m_readFile;
+    quint64 m_readSegment;
+    qint64 m_readOffset;
+    quint64 m_firstSegment;
+    quint64 m_savedSegment;
+    qint64 m_savedOffset;
+    QByteArray m_batch;
+
+    SpoolMetrics m_metrics;
+};
+
+#endif // OUTBOUNDSPOOL_H
@@ -0,0 +1,581 @@
+﻿#include "pollscheduler.h"
+#include <QMutexLocker>
+#include <algorithm>
+#include <cstring>
+
+PollScheduler::PollScheduler(QObject *parent)
+    :QObject(parent),
+      m_handle(std::make_shared<Handle>()),
+      m_pollSerial(0),
+      m_running(false),
+      m_statsInterval(POLL_DEFAULT_STATS_INTERVAL),
+      m_statsTime(0)
+{
+    m_handle->scheduler = this;
+
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer,&QTimer::timeout,this,&PollScheduler::tickSlot);
+
+    connect(this,&PollScheduler::startSignal,this,&PollScheduler::startSlot);
+    connect(this,&PollScheduler::stopSignal,this,&PollScheduler::stopSlot);
+    connect(this,&PollScheduler::scheduleSignal,this,&PollScheduler::tickSlot);
+}
+
+PollScheduler::~PollScheduler()
+{
+    // wait running request callback, later one see null scheduler
+    m_handle->mutex.lock();
+    m_handle->scheduler = nullptr;
+    m_handle->mutex.unlock();
+}
+
+void PollScheduler::start()
+{
+    m_mutex.lock();
+    m_running = true;
+    m_statsTime = m_wheel.now();
+    // due time restart from now
+    rebuild();
+    m_mutex.unlock();
+
+    emit startSignal();
+}
+
+void PollScheduler::stop()
+{
+    m_mutex.lock();
+    m_running = false;
+    m_mutex.unlock();
+
+    emit stopSignal();
+}
+
+void PollScheduler::addDevice(int device, RequestEngine *engine, const PollProtocol &protocol)
+{
+    QMutexLocker locker(&m_mutex);
+    Device dev;
+    dev.engine = engine;
+    dev.protocol = protocol;
+    dev.capacity = 0;
+    dev.bytes = 0;
+    memset(&dev.stats,0,sizeof(dev.stats));
+    m_devices.insert(device,dev);
+}
+
+void PollScheduler::removeDevice(int device)
+{
+    m_mutex.lock();
+    m_devices.remove(device);
+    QList<int> pollIds;
+    for(const Poll &poll : m_polls){
+        if(poll.device == device){
+            pollIds.append(poll.id);
+        }
+    }
+    for(int pollId : pollIds){
+        m_polls.remove(pollId);
+    }
+    // drop batch of device only, other batch keep phase
+    for(int i = 0;i < m_batches.size();){
+        std::shared_ptr<Batch> batch = m_batches.at(i);
+        if(batch->batch.device == device){
+            batch->stale = true;
+            m_wheel.cancel(batch->timerId);
+            m_batches.removeAt(i);
+        }else{
+            i++;
+        }
+    }
+    m_mutex.unlock();
+
+    emit scheduleSignal();
+}
+
+void PollScheduler::setLinkCapacity(int device, double bytesPerSecond)
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_devices.contains(device)){
+        m_devices[device].capacity = bytesPerSecond;
+    }
+}
+
+int PollScheduler::addPoll(int device,
+                           quint32 address,
+                           quint32 count,
+                           int period,
+                           const PollCallback &callback)
+{
+    m_mutex.lock();
+    if(!m_devices.contains(device)){
+        m_mutex.unlock();
+        return -1;
+    }
+
+    Poll poll;
+    poll.id = ++m_pollSerial;
+    poll.device = device;
+    poll.address = address;
+    poll.count = count;
+    poll.period = period > POLL_MIN_PERIOD ? period : POLL_MIN_PERIOD;
+    poll.callback = callback;
+    memset(&poll.stats,0,sizeof(poll.stats));
+    m_polls.insert(poll.id,poll);
+    rebuild(poll.device,poll.period);
+    m_mutex.unlock();
+
+    emit scheduleSignal();
+    return poll.id;
+}
+
+void PollScheduler::removePoll(int pollId)
+{
+    m_mutex.lock();
+    if(m_polls.contains(pollId)){
+        Poll poll = m_polls.take(pollId);
+        rebuild(poll.device,poll.period);
+    }
+    m_mutex.unlock();
+
+    emit scheduleSignal();
+}
+
+int PollScheduler::batchCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_batches.size();
+}
+
+PollStats PollScheduler::pollStats(int pollId)
+{
+    QMutexLocker locker(&m_mutex);
+    PollStats stats;
+    memset(&stats,0,sizeof(stats));
+    if(m_polls.contains(pollId)){
+        stats = m_polls[pollId].stats;
+    }
+    return stats;
+}
+
+PollDeviceStats PollScheduler::deviceStats(int device)
+{
+    QMutexLocker locker(&m_mutex);
+    PollDeviceStats stats;
+    memset(&stats,0,sizeof(stats));
+    if(m_devices.contains(device)){
+        stats = m_devices[device].stats;
+    }
+    return stats;
+}
+
+int PollScheduler::statsInterval()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_statsInterval;
+}
+
+void PollScheduler::setStatsInterval(int statsInterval)
+{
+    QMutexLocker locker(&m_mutex);
+    m_statsInterval = statsInterval > 0 ? statsInterval : POLL_DEFAULT_STATS_INTERVAL;
+}
+
+PollProtocol PollScheduler::modbusTcpProtocol(quint8 unitId, quint8 function)
+{
+    PollProtocol protocol;
+    protocol.buildRequest = [unitId,function](const PollBatch &batch,quint16 transactionId){
+        QByteArray frame(12,0);
+        frame[0] = static_cast<char>(transactionId >> 8);
+        frame[1] = static_cast<char>(transactionId);
+        frame[5] = 6;
+        frame[6] = static_cast<char>(unitId);
+        frame[7] = static_cast<char>(function);
+        frame[8] = static_cast<char>(batch.address >> 8);
+        frame[9] = static_cast<char>(batch.address);
+        frame[10] = static_cast<char>(batch.count >> 8);
+        frame[11] = static_cast<char>(batch.count);
+        return frame;
+    };
+    protocol.itemData = [](const QByteArray &response,const PollBatch &batch,
+            quint32 address,quint32 count){
+        // mbap(7) function(1) byte count(1) register
+        if(response.size() < 9 || (static_cast<quint8>(response.at(7)) & 0x80)){
+            return QByteArray();
+        }
+        int offset = 9 + static_cast<int>(address - batch.address) * 2;
+        int len = static_cast<int>(count) * 2;
+        if(offset + len > response.size()){
+            return QByteArray();
+        }
+        return response.mid(offset,len);
+    };
+    protocol.maxBatchCount = POLL_DEFAULT_MAX_BATCH_COUNT;
+    protocol.maxGap = POLL_DEFAULT_MAX_GAP;
+    return protocol;
+}
+
+void PollScheduler::startSlot()
+{
+    tickSlot();
+}
+
+void PollScheduler::stopSlot()
+{
+    m_timer->stop();
+}
+
+void PollScheduler::tickSlot()
+{
+    QList<Send> sends;
+    MissList misses;
+    QList<std::pair<int,PollDeviceStats>> stats;
+
+    m_mutex.lock();
+    if(!m_running){
+        m_mutex.unlock();
+        return;
+    }
+
+    m_wheel.advance();
+    sends.swap(m_sends);
+    misses.swap(m_misses);
+    updateStats(&stats);
+
+    // sleep until next due or next stats
+    qint64 next = m_wheel.nextExpire();
+    qint64 statsNext = static_cast<qint64>(m_statsTime + static_cast<quint64>(m_statsInterval)) -
+            static_cast<qint64>(m_wheel.now());
+    if(next < 0 || statsNext < next){
+        next = statsNext > 0 ? statsNext : 0;
+    }
+    m_mutex.unlock();
+
+    m_timer->start(static_cast<int>(next));
+
+    for(const Send &send : sends){
+        std::shared_ptr<Batch> batch = send.batch;
+        std::weak_ptr<Handle> weak = m_handle;
+        send.engine->request(send.frame,[weak,batch](const RequestResult &result){
+            std::shared_ptr<Handle> handle = weak.lock();
+            if(!handle){
+                return;
+            }
+            QMutexLocker locker(&handle->mutex);
+            if(handle->scheduler){
+                handle->scheduler->complete(batch,result);
+            }
+        },static_cast<unsigned long>(batch->batch.period));
+    }
+    emitMisses(misses);
+    for(const std::pair<int,PollDeviceStats> &device : stats){
+        emit utilizationUpdated(device.first,device.second.utilization,device.second.bytesPerSecond);
+    }
+}
+
+void PollScheduler::rebuild()
+{
+    for(const std::shared_ptr<Batch> &batch : m_batches){
+        batch->stale = true;
+        m_wheel.cancel(batch->timerId);
+    }
+    m_batches.clear();
+
+    QList<const Poll *> polls;
+    for(const Poll &poll : m_polls){
+        polls.append(&poll);
+    }
+    m_batches = merge(polls);
+
+    // spread batch of same period in the period
+    quint64 now = m_wheel.now();
+    for(int i = 0;i < m_batches.size();){
+        quint64 period = static_cast<quint64>(m_batches.at(i)->batch.period);
+        int count = 1;
+        while(i + count < m_batches.size() &&
+              static_cast<quint64>(m_batches.at(i + count)->batch.period) == period){
+            count++;
+        }
+
+        for(int j = 0;j < count;j++){
+            const std::shared_ptr<Batch> &item = m_batches.at(i + j);
+            quint64 phase = period * static_cast<quint64>(j) / static_cast<quint64>(count);
+            item->due = now - now % period + phase;
+            if(item->due <= now){
+                item->due += period;
+            }
+            if(m_running){
+                schedule(item);
+            }
+        }
+        i += count;
+    }
+}
+
+void PollScheduler::rebuild(int device, int period)
+{
+    QList<quint64> dues;
+    for(int i = 0;i < m_batches.size();){
+        std::shared_ptr<Batch> batch = m_batches.at(i);
+        if(batch->batch.device == device && batch->batch.period == period){
+            batch->stale = true;
+            m_wheel.cancel(batch->timerId);
+            dues.append(batch->due);
+            m_batches.removeAt(i);
+        }else{
+            i++;
+        }
+    }
+
+    QList<const Poll *> polls;
+    for(const Poll &poll : m_polls){
+        if(poll.device == device && poll.period == period){
+            polls.append(&poll);
+        }
+    }
+    QList<std::shared_ptr<Batch>> batches = merge(polls);
+
+    // keep due time of old batch, only extra batch take a new phase
+    quint64 now = m_wheel.now();
+    for(int i = 0;i < batches.size();i++){
+        const std::shared_ptr<Batch> &batch = batches.at(i);
+        batch->due = i < dues.size() ? dues.at(i) : freeDue(static_cast<quint64>(period),now);
+        m_batches.append(batch);
+        if(m_running){
+            schedule(batch);
+        }
+    }
+}
+
+QList<std::shared_ptr<PollScheduler::Batch>> PollScheduler::merge(QList<const Poll *> polls)
+{
+    std::sort(polls.begin(),polls.end(),[](const Poll * a,const Poll * b){
+        if(a->period != b->period){
+            return a->period < b->period;
+        }
+        if(a->device != b->device){
+            return a->device < b->device;
+        }
+        return a->address < b->address;
+    });
+
+    // merge poll of same period and device with near address
+    QList<std::shared_ptr<Batch>> batches;
+    std::shared_ptr<Batch> batch;
+    for(const Poll * poll : polls){
+        const PollProtocol &protocol = m_devices[poll->device].protocol;
+        if(batch && batch->batch.period == poll->period && batch->batch.device == poll->device){
+            quint32 end = batch->batch.address + batch->batch.count;
+            quint32 newEnd = qMax(end,poll->address + poll->count);
+            if(poll->address <= end + protocol.maxGap &&
+                    newEnd - batch->batch.address <= protocol.maxBatchCount){
+                batch->batch.count = newEnd - batch->batch.address;
+                batch->pollIds.append(poll->id);
+                continue;
+            }
+        }
+
+        batch = std::make_shared<Batch>();
+        batch->batch.device = poll->device;
+        batch->batch.period = poll->period;
+        batch->batch.address = poll->address;
+        batch->batch.count = poll->count;
+        batch->pollIds.append(poll->id);
+        batch->due = 0;
+        batch->sendDue = 0;
+        batch->timerId = 0;
+        batch->outstanding = false;
+        batch->missed = false;
+        batch->stale = false;
+        batches.append(batch);
+    }
+    return batches;
+}
+
+quint64 PollScheduler::freeDue(quint64 period, quint64 now) const
+{
+    QList<quint64> phases;
+    for(const std::shared_ptr<Batch> &batch : m_batches){
+        if(static_cast<quint64>(batch->batch.period) == period){
+            phases.append(batch->due % period);
+        }
+    }
+    std::sort(phases.begin(),phases.end());
+
+    // middle of largest gap between phase, wrap at period
+    quint64 phase = 0;
+    if(!phases.isEmpty()){
+        quint64 gap = phases.first() + period - phases.last();
+        phase = (phases.last() + gap / 2) % period;
+        for(int i = 1;i < phases.size();i++){
+            if(phases.at(i) - phases.at(i - 1) > gap){
+                gap = phases.at(i) - phases.at(i - 1);
+                phase = phases.at(i - 1) + gap / 2;
+            }
+        }
+    }
+
+    quint64 due = now - now % period + phase;
+    if(due <= now){
+        due += period;
+    }
+    return due;
+}
+
+void PollScheduler::schedule(const std::shared_ptr<Batch> &batch)
+{
+    std::weak_ptr<Batch> weak = batch;
+    batch->timerId = m_wheel.scheduleAt(batch->due,[this,weak](){
+        std::shared_ptr<Batch> due = weak.lock();
+        if(due){
+            fire(due);
+        }
+    });
+}
+
+void PollScheduler::fire(const std::shared_ptr<Batch> &batch)
+{
+    if(batch->stale || !m_devices.contains(batch->batch.device)){
+        return;
+    }
+
+    quint64 now = m_wheel.now();
+    quint64 period = static_cast<quint64>(batch->batch.period);
+    Device &device = m_devices[batch->batch.device];
+    if(batch->outstanding){
+        // previous request overrun its period, its response is not counted again
+        miss(batch,static_cast<qint64>(now - batch->sendDue - period),true,false);
+        batch->missed = true;
+    }else{
+        Send send;
+        send.batch = batch;
+        send.engine = device.engine;
+        send.frame = device.protocol.buildRequest(batch->batch,device.engine->nextTransactionId());
+        device.bytes += static_cast<quint64>(send.frame.size());
+        m_sends.append(send);
+
+        batch->outstanding = true;
+        batch->missed = false;
+        batch->sendDue = batch->due;
+    }
+
+    // absolute due time, skip due time already passed
+    batch->due += period;
+    while(batch->due <= now){
+        miss(batch,static_cast<qint64>(now - batch->due),true,false);
+        batch->due += period;
+    }
+    schedule(batch);
+}
+
+void PollScheduler::complete(const std::shared_ptr<Batch> &batch, const RequestResult &result)
+{
+    QList<std::pair<PollCallback,std::pair<int,QByteArray>>> callbacks;
+    MissList misses;
+
+    m_mutex.lock();
+    batch->outstanding = false;
+
+    quint64 now = m_wheel.now();
+    quint64 deadline = batch->sendDue + static_cast<quint64>(batch->batch.period);
+    if(m_devices.contains(batch->batch.device)){
+        Device &device = m_devices[batch->batch.device];
+        device.bytes += static_cast<quint64>(result.response.size());
+        device.stats.polls++;
+    }
+
+    if(result.status != RequestSuccess || now > deadline){
+        miss(batch,static_cast<qint64>(now - deadline),!batch->missed,
+             result.status == RequestTimeout);
+    }
+
+    const PollProtocol * protocol = m_devices.contains(batch->batch.device) ?
+                &m_devices[batch->batch.device].protocol : nullptr;
+    for(int pollId : batch->pollIds){
+        if(!m_polls.contains(pollId)){
+            continue;
+        }
+
+        Poll &poll = m_polls[pollId];
+        poll.stats.polls++;
+        poll.stats.lastLatency = result.elapsed;
+        poll.stats.maxLatency = qMax(poll.stats.maxLatency,result.elapsed);
+
+        QByteArray data;
+        if(result.status == RequestSuccess && protocol){
+            data = protocol->itemData(result.response,batch->batch,poll.address,poll.count);
+        }
+        if(poll.callback){
+            callbacks.append(std::make_pair(poll.callback,std::make_pair(pollId,data)));
+        }
+    }
+    misses.swap(m_misses);
+    m_mutex.unlock();
+
+    for(const std::pair<PollCallback,std::pair<int,QByteArray>> &callback : callbacks){
+        callback.first(callback.second.first,result.status,callback.second.second);
+    }
+    emitMisses(misses);
+}
+
+void PollScheduler::miss(const std::shared_ptr<Batch> &batch,
+                         qint64 lateness,
+                         bool deadline,
+                         bool timeout)
+{
+    if(lateness < 0){
+        lateness = 0;
+    }
+
+    if(m_devices.contains(batch->batch.device)){
+        Device &device = m_devices[batch->batch.device];
+        if(deadline){
+            device.stats.deadlineMisses++;
+        }
+        if(timeout){
+            device.stats.timeouts++;
+        }
+    }
+
+    for(int pollId : batch->pollIds){
+        if(!m_polls.contains(pollId)){
+            continue;
+        }
+
+        Poll &poll = m_polls[pollId];
+        if(timeout){
+            poll.stats.timeouts++;
+        }
+        if(deadline){
+            poll.stats.deadlineMisses++;
+            m_misses.append(std::make_pair(pollId,lateness));
+        }
+    }
+}
+
+void PollScheduler::updateStats(QList<std::pair<int, PollDeviceStats>> *stats)
+{
+    quint64 now = m_wheel.now();
+    quint64 elapsed = now - m_statsTime;
+    if(elapsed < static_cast<quint64>(m_statsInterval)){
+        return;
+    }
+    m_statsTime = now;
+
+    for(QHash<int,Device>::iterator it = m_devices.begin();it != m_devices.end();++it){
+        Device &device = it.value();
+        device.stats.bytesPerSecond = static_cast<double>(device.bytes) * 1000.0 /
+                static_cast<double>(elapsed);
+        device.stats.utilization = device.capacity > 0 ?
+                    device.stats.bytesPerSecond / device.capacity : 0;
+        device.bytes = 0;
+        stats->append(std::make_pair(it.key(),device.stats));
+    }
+}
+
+void PollScheduler::emitMisses(const MissList &misses)
+{
+    for(const std::pair<int,qint64> &miss : misses){
+        emit deadlineMissed(miss.first,miss.second);
+    }
+}
@@ -0,0 +1,202 @@
+﻿#ifndef POLLSCHEDULER_H
+#define POLLSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <functional>
+#include <memory>
+
+#include "ccl/timerwheel.h"
+#include "ccl/requestengine.h"
+
+#define POLL_DEFAULT_MAX_BATCH_COUNT 125
+#define POLL_DEFAULT_MAX_GAP 8
+#define POLL_DEFAULT_STATS_INTERVAL 1000
+#define POLL_MIN_PERIOD 1
+
+typedef struct PollBatch_TAG{
+    int device;
+    int period;
+    quint32 address;
+    quint32 count;
+}PollBatch;
+
+/**
+ * protocol of poll device.
+ * 1.buildRequest: build request frame read batch, transactionId from request engine.
+ * 2.itemData: cut item data from batch response, return empty if response is exception.
+ * 3.maxBatchCount: max count read by one request.
+ * 4.maxGap: item with address gap less than maxGap is merged, gap is read and dropped.
+ */
+typedef struct PollProtocol_TAG{
+    std::function<QByteArray(const PollBatch &batch,quint16 transactionId)> buildRequest;
+    std::function<QByteArray(const QByteArray &response,const PollBatch &batch,
+                             quint32 address,quint32 count)> itemData;
+    quint32 maxBatchCount;
+    quint32 maxGap;
+}PollProtocol;
+
+typedef struct PollStats_TAG{
+    quint64 polls;
+    quint64 deadlineMisses;
+    quint64 timeouts;
+    qint64 lastLatency;
+    qint64 maxLatency;
+}PollStats;
+
+typedef struct PollDeviceStats_TAG{
+    quint64 polls;
+    quint64 deadlineMisses;
+    quint64 timeouts;
+    double bytesPerSecond;
+    double utilization;
+}PollDeviceStats;
+
+typedef std::function<void(int pollId,RequestStatus status,const QByteArray &data)> PollCallback;
+
+/**
+ * cyclic poll of device register, one RequestEngine per device.
+ * 1.device
+ *  call addDevice function with request engine and protocol,
+ *  call setLinkCapacity function with link byte per second for utilization(serial: baud / 10).
+ * 2.poll
+ *  call addPoll function with device, address, count and period, return poll id.
+ *  poll of same device and period is merged to batch, one request per batch per period.
+ * 3.schedule
+ *  batch due time is absolute, never drift. batch of same period is spread in the period
+ *  by phase, avoid burst at period boundary.
+ *  add or remove poll only merge batch of its device and period again, other batch keep phase,
+ *  new batch take phase in largest gap of its period.
+ * 4.deadline
+ *  response must arrive before next due time of its batch, else deadline miss.
+ *  due time with outstanding request is skipped and counted as deadline miss,
+ *  late response of that request is not counted again.
+ *  deadlineMissed signal is emitted for every poll of missed batch.
+ * 5.utilization
+ *  utilizationUpdated signal is emitted every stats interval for every device.
+ * Warning!!!
+ * 1.poll callback is called in the thread that feed response of request engine, must not block.
+ * 2.move scheduler to a thread with event loop, call start function.
+ * 3.poll callback must not delete scheduler, scheduler delete wait running poll callback.
+ */
+class PollScheduler: public QObject
+{
+    Q_OBJECT
+public:
+    explicit PollScheduler(QObject * parent = nullptr);
+    virtual ~PollScheduler() override;
+
+    void start();
+    void stop();
+
+    void addDevice(int device,RequestEngine * engine,const PollProtocol &protocol);
+    void removeDevice(int device);
+    void setLinkCapacity(int device,double bytesPerSecond);
+
+    int addPoll(int device,quint32 address,quint32 count,int period,const PollCallback &callback);
+    void removePoll(int pollId);
+
+    int batchCount();
+    PollStats pollStats(int pollId);
+    PollDeviceStats deviceStats(int device);
+
+    int statsInterval();
+    void setStatsInterval(int statsInterval);
+
+    /**
+     * modbus tcp read holding register(0x03) or input register(0x04).
+     */
+    static PollProtocol modbusTcpProtocol(quint8 unitId,quint8 function = 0x03);
+
+signals:
+    void startSignal();
+    void stopSignal();
+    void scheduleSignal();
+
+    void deadlineMissed(int pollId,qint64 lateness);
+    void utilizationUpdated(int device,double utilization,double bytesPerSecond);
+
+private slots:
+    void startSlot();
+    void stopSlot();
+    void tickSlot();
+
+private:
+    struct Poll{
+        int id;
+        int device;
+        quint32 address;
+        quint32 count;
+        int period;
+        PollCallback callback;
+        PollStats stats;
+    };
+
+    struct Batch{
+        PollBatch batch;
+        QList<int> pollIds;
+        quint64 due;
+        quint64 sendDue;
+        quint64 timerId;
+        bool outstanding;
+        // deadline of outstanding request counted by fire
+        bool missed;
+        bool stale;
+    };
+
+    struct Device{
+        RequestEngine * engine;
+        PollProtocol protocol;
+        double capacity;
+        quint64 bytes;
+        PollDeviceStats stats;
+    };
+
+    struct Send{
+        std::shared_ptr<Batch> batch;
+        RequestEngine * engine;
+        QByteArray frame;
+    };
+
+    // request callback hold weak handle, response after scheduler delete is dropped
+    struct Handle{
+        QMutex mutex;
+        PollScheduler * scheduler;
+    };
+
+    typedef QList<std::pair<int,qint64>> MissList;
+
+    void rebuild();
+    void rebuild(int device,int period);
+    QList<std::shared_ptr<Batch>> merge(QList<const Poll *> polls);
+    quint64 freeDue(quint64 period,quint64 now) const;
+    void schedule(const std::shared_ptr<Batch> &batch);
+    void fire(const std::shared_ptr<Batch> &batch);
+    void complete(const std::shared_ptr<Batch> &batch,const RequestResult &result);
+    void miss(const std::shared_ptr<Batch> &batch,qint64 lateness,bool deadline,bool timeout);
+    void updateStats(QList<std::pair<int,PollDeviceStats>> * stats);
+    void emitMisses(const MissList &misses);
+
+    QHash<int,Device> m_devices;
+    QHash<int,Poll> m_polls;
+    QList<std::shared_ptr<Batch>> m_batches;
+
+    TimerWheel m_wheel;
+    QTimer * m_timer;
+    QList<Send> m_sends;
+    MissList m_misses;
+    std::shared_ptr<Handle> m_handle;
+
+    int m_pollSerial;
+    bool m_running;
+    int m_statsInterval;
+    quint64 m_statsTime;
+
+    QMutex m_mutex;
+};
+
+#endif // POLLSCHEDULER_H
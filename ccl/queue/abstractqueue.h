@@ -1,18 +1,31 @@
 ﻿#ifndef ABSTRACTQUEUE_H
 #define ABSTRACTQUEUE_H
 
+#include <climits>
+#include <functional>
+
 /**
  * multi thread read and write queue
  * 1.write
  *  1) call peekWriteable function acquire buffer, if return nullptr, get buffer failure!
+ *     default timeout is ULONG_MAX, wait forever.
  *  2) call push function finish your write, if peekWriteable return nullptr, not call push function.
  * 2.read
  *  1) call peekReadable function acquire buffer, if return nullptr, get buffer failure!
  *  2) call next function finish your read, if peekReadable return nullptr, not call next function.
  * 3.abort
  *  1) call abort function abort your queue, call isAbort function check queue is abort.
+ *  2) call reset function clear abort when no reader and writer, queue can be used again.
+ *     buffer pushed before abort is kept. return false if queue can not be reused.
+ * 4.drain
+ *  call readableCount function get count of buffer pushed and not yet read,
+ *  wait it reach 0 before abort if reader must see every buffer.
+ * 5.notify
+ *  call setReadableNotifier function set function called after every push and abort,
+ *  in writer thread, e.g. resume reader coroutine. set before start, it must not block.
+ *  ShmQueue notify in producer process only.
  * Warning!!!
- * 1.if queue is abort, peekWriteable will return nullptr.
+ * 1.if queue is abort or write timeout, peekWriteable will return nullptr.
  * 2.if queue is abort or read timeout, peekReadable will return nullptr.
  */
 template <typename T>
@@ -25,11 +38,27 @@ public:
     virtual T * peekReadable(unsigned long timeout) = 0;
     virtual void next(T * data) = 0;
 
-    virtual T * peekWriteable() = 0;
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) = 0;
     virtual void push(T * data) = 0;
 
     virtual void abort() = 0;
     virtual bool isAbort() = 0;
+    virtual bool reset() = 0;
+
+    virtual int readableCount() = 0;
+
+    void setReadableNotifier(const std::function<void()> &notifier);
+
+protected:
+    inline void notifyReadable()
+    {
+        if(m_readableNotifier){
+            m_readableNotifier();
+        }
+    }
+
+private:
+    std::function<void()> m_readableNotifier;
 };
 
 template<typename T>
@@ -44,4 +73,10 @@ AbstractQueue<T>::~AbstractQueue()
 
 }
 
+template<typename T>
+void AbstractQueue<T>::setReadableNotifier(const std::function<void()> &notifier)
+{
+    m_readableNotifier = notifier;
+}
+
 #endif // ABSTRACTQUEUE_H
@@ -0,0 +1,239 @@
+﻿#ifndef BYTEBUDGETQUEUE_H
+#define BYTEBUDGETQUEUE_H
+
+#include "abstractqueue.h"
+#include "bytequeue.h"
+#include "../buffermeta.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QList>
+#include <QHash>
+#include <QDebug>
+#include <cstring>
+
+/**
+ * pack field of T beside payload into record header, and back.
+ * default is for T with buffer, len and meta member, e.g. TCPBuffer, SerialPortBuffer.
+ * specialize it for T with more field, e.g. UDPBuffer in udpclient.h.
+ */
+template <typename T>
+struct ByteBudgetTraits{
+    static constexpr int headerSize = sizeof(BufferMeta);
+
+    static void pack(const T &buffer,char * header)
+    {
+        memcpy(header,&buffer.meta,sizeof(BufferMeta));
+    }
+
+    static void unpack(const char * header,T * buffer)
+    {
+        memcpy(&buffer->meta,header,sizeof(BufferMeta));
+    }
+};
+
+/**
+ * AbstractQueue of T on ByteQueue, capacity is byte budget, e.g. at most 4 MB for a link.
+ * 1.write
+ *  peekWriteable reserve a record of header and whole buffer, wait or drop oldest by policy
+ *  if budget run out. push copy header and len bytes of payload into it,
+ *  unused tail is given back, budget hold exact bytes of every buffer.
+ * 2.read
+ *  peekReadable copy record out and free it at once, next give buffer back.
+ * 3.memory
+ *  budget plus one staging T per buffer peeked at the same time, e.g. one per writer and reader,
+ *  staging T is allocated at first use and reused.
+ * e.g.
+ *  ByteBudgetQueue<TCPBuffer> tcpQueue(4 * 1024 * 1024);
+ *  TcpClient * client = new TcpClient("127.0.0.1",8765,&tcpQueue);
+ * Warning!!!
+ * 1.payload is copied once in and once out, use WaitQueue if memory is not the limit.
+ * 2.next and push only take buffer peeked from this queue, once, other one is rejected.
+ */
+template <typename T>
+class ByteBudgetQueue: public AbstractQueue<T>{
+
+public:
+    explicit ByteBudgetQueue(qint64 budget = BYTE_DEFAULT_QUEUE_BUDGET,
+                             ByteQueueOverflowPolicy policy = ByteQueueWait,
+                             unsigned long dropTimeout = BYTE_DEFAULT_DROP_TIME_OUT);
+    ~ByteBudgetQueue();
+
+    virtual T * peekReadable(unsigned long timeout) override;
+    virtual void next(T * data) override;
+
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) override;
+    virtual void push(T * data) override;
+
+    virtual void abort() override;
+    virtual bool isAbort() override;
+    virtual bool reset() override;
+
+    virtual int readableCount() override;
+
+    ByteQueue * byteQueue();
+
+private:
+    T * takeStaging(char * record);
+    char * takeRecord(T * data);
+    void giveStaging(T * data);
+
+    ByteQueue m_queue;
+
+    QMutex m_mutex;
+    QList<T *> m_free;
+    QList<T *> m_all;
+    QHash<T *,char *> m_records;
+};
+
+template<typename T>
+ByteBudgetQueue<T>::ByteBudgetQueue(qint64 budget,
+                                    ByteQueueOverflowPolicy policy,
+                                    unsigned long dropTimeout)
+    :m_queue(budget,policy,dropTimeout)
+{
+
+}
+
+template<typename T>
+ByteBudgetQueue<T>::~ByteBudgetQueue()
+{
+    for(T * staging : m_all){
+        delete staging;
+    }
+}
+
+template<typename T>
+T *ByteBudgetQueue<T>::peekReadable(unsigned long timeout)
+{
+    qint64 len = 0;
+    char * record = m_queue.peekReadable(timeout,&len);
+    if(!record){
+        return nullptr;
+    }
+
+    T * data = takeStaging(nullptr);
+    ByteBudgetTraits<T>::unpack(record,data);
+    data->len = len - ByteBudgetTraits<T>::headerSize;
+    memcpy(data->buffer,record + ByteBudgetTraits<T>::headerSize,static_cast<size_t>(data->len));
+
+    // record is copied, free budget before buffer is parsed
+    m_queue.next(record);
+    return data;
+}
+
+template<typename T>
+void ByteBudgetQueue<T>::next(T *data)
+{
+    giveStaging(data);
+}
+
+template<typename T>
+T *ByteBudgetQueue<T>::peekWriteable(unsigned long timeout)
+{
+    // len is known after write, reserve for whole buffer, push give the rest back
+    char * record = m_queue.peekWriteable(ByteBudgetTraits<T>::headerSize + sizeof(T::buffer),timeout);
+    if(!record){
+        return nullptr;
+    }
+
+    return takeStaging(record);
+}
+
+template<typename T>
+void ByteBudgetQueue<T>::push(T *data)
+{
+    if(!data){
+        return;
+    }
+
+    char * record = takeRecord(data);
+    if(record){
+        qint64 len = qBound(static_cast<qint64>(0),data->len,static_cast<qint64>(sizeof(data->buffer)));
+        ByteBudgetTraits<T>::pack(*data,record);
+        memcpy(record + ByteBudgetTraits<T>::headerSize,data->buffer,static_cast<size_t>(len));
+        m_queue.push(record,ByteBudgetTraits<T>::headerSize + len);
+    }
+
+    // give back after copy, reader may take it at once
+    giveStaging(data);
+    if(record){
+        this->notifyReadable();
+    }
+}
+
+template<typename T>
+void ByteBudgetQueue<T>::abort()
+{
+    m_queue.abort();
+    this->notifyReadable();
+}
+
+template<typename T>
+bool ByteBudgetQueue<T>::isAbort()
+{
+    return m_queue.isAbort();
+}
+
+template<typename T>
+bool ByteBudgetQueue<T>::reset()
+{
+    return m_queue.reset();
+}
+
+template<typename T>
+int ByteBudgetQueue<T>::readableCount()
+{
+    return m_queue.readableCount();
+}
+
+template<typename T>
+ByteQueue *ByteBudgetQueue<T>::byteQueue()
+{
+    return &m_queue;
+}
+
+template<typename T>
+T *ByteBudgetQueue<T>::takeStaging(char *record)
+{
+    QMutexLocker locker(&m_mutex);
+    T * staging = nullptr;
+    if(!m_free.isEmpty()){
+        staging = m_free.takeLast();
+    }else{
+        // first time so many buffer peeked at once
+        staging = new T();
+        m_all.append(staging);
+    }
+    if(record){
+        m_records.insert(staging,record);
+    }
+    return staging;
+}
+
+template<typename T>
+char *ByteBudgetQueue<T>::takeRecord(T *data)
+{
+    // reserved record of writer
+    QMutexLocker locker(&m_mutex);
+    return m_records.take(data);
+}
+
+template<typename T>
+void ByteBudgetQueue<T>::giveStaging(T *data)
+{
+    if(!data){
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    // foreign buffer or buffer given back twice would hand one staging T to two user
+    bool owned = m_all.contains(data) && !m_free.contains(data);
+    Q_ASSERT_X(owned,"ByteBudgetQueue","buffer not peeked from this queue or given back twice");
+    if(!owned){
+        qDebug()<<"Buffer not peeked from ByteBudgetQueue or given back twice!";
+        return;
+    }
+    m_free.append(data);
+}
+
+#endif // BYTEBUDGETQUEUE_H
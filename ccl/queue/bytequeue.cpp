@@ -0,0 +1,315 @@
+﻿#include "bytequeue.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#define BYTE_RECORD_ALIGN 16
+
+static quint64 alignRecord(quint64 size)
+{
+    return (size + BYTE_RECORD_ALIGN - 1) & ~static_cast<quint64>(BYTE_RECORD_ALIGN - 1);
+}
+
+ByteQueue::ByteQueue(qint64 budget,
+                     ByteQueueOverflowPolicy policy,
+                     unsigned long dropTimeout)
+    :m_capacity(0),
+      m_ring(nullptr),
+      m_head(0),
+      m_readIdx(0),
+      m_tail(0),
+      m_policy(policy),
+      m_dropTimeout(dropTimeout),
+      m_droppedCount(0),
+      m_readableCount(0),
+      m_abort(false),
+      m_readWaiters(0),
+      m_writeWaiters(0)
+{
+    m_capacity = alignRecord(budget > 0 ? static_cast<quint64>(budget) : 0);
+    if(m_capacity < 2 * sizeof(RecordHeader)){
+        m_capacity = 2 * sizeof(RecordHeader);
+    }
+    m_ring = new quint64[m_capacity / sizeof(quint64)]();
+}
+
+ByteQueue::~ByteQueue()
+{
+    delete [] m_ring;
+}
+
+char *ByteQueue::peekReadable(unsigned long timeout, qint64 *len)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker locker(&m_mutex);
+    forever{
+        if(reclaim() && m_writeWaiters > 0){
+            m_writeCond.wakeAll();
+        }
+
+        if(m_abort){
+            return nullptr;
+        }
+
+        if(m_readIdx < m_head && recordAt(m_readIdx)->state == Committed){
+            break;
+        }
+
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
+            // timeout
+            return nullptr;
+        }
+
+        m_readWaiters++;
+        bool isWake = m_readCond.wait(&m_mutex,remaining);
+        m_readWaiters--;
+        if(!isWake){
+            // timeout
+            return nullptr;
+        }
+    }
+
+    // detach read record
+    RecordHeader * record = recordAt(m_readIdx);
+    record->state = Reading;
+    m_readIdx += record->size;
+    m_readableCount--;
+
+    if(len){
+        *len = record->len;
+    }
+    return reinterpret_cast<char *>(record + 1);
+}
+
+void ByteQueue::next(char *data)
+{
+    if(!data){
+        return;
+    }
+
+    m_mutex.lock();
+
+    recordOf(data)->state = Consumed;
+
+    // only wake writer when bytes freed and someone is waiting, wake after unlock
+    bool isWake = reclaim() && m_writeWaiters > 0;
+    m_mutex.unlock();
+    if(isWake){
+        m_writeCond.wakeAll();
+    }
+}
+
+char *ByteQueue::peekWriteable(qint64 size, unsigned long timeout)
+{
+    if(size < 0){
+        return nullptr;
+    }
+
+    quint64 need = alignRecord(sizeof(RecordHeader) + static_cast<quint64>(size));
+    if(need > m_capacity){
+        qDebug()<<"Reserve size is greater than budget! Size: "<<size<<
+                  " Budget: "<<budget();
+        return nullptr;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker locker(&m_mutex);
+    quint64 pad = 0;
+    while(!m_abort){
+        quint64 offset = m_head % m_capacity;
+        pad = m_capacity - offset < need ? m_capacity - offset : 0;
+        if(pad > 0 && m_head == m_tail){
+            // queue is empty, restart from ring begin
+            m_head += pad;
+            m_readIdx = m_head;
+            m_tail = m_head;
+            pad = 0;
+        }
+
+        if(m_capacity - (m_head - m_tail) >= pad + need){
+            break;
+        }
+
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
+            // timeout
+            return nullptr;
+        }
+
+        if(m_policy == ByteQueueDropOldest){
+            // drop deadline count from call, not restart by wakeup
+            unsigned long dropRemaining = queueRemainingTime(m_dropTimeout,timer);
+            if(dropRemaining == 0){
+                if(dropOldest()){
+                    continue;
+                }
+                // all unread record is reserved or hold by reader, wait them
+                dropRemaining = remaining;
+            }
+            remaining = qMin(remaining,dropRemaining);
+        }
+
+        m_writeWaiters++;
+        m_writeCond.wait(&m_mutex,remaining);
+        m_writeWaiters--;
+    }
+
+    if(m_abort){
+        return nullptr;
+    }
+
+    if(pad > 0){
+        // record can not wrap, fill ring end with padding record
+        RecordHeader * padding = recordAt(m_head);
+        padding->size = static_cast<quint32>(pad);
+        padding->len = 0;
+        padding->state = Padding;
+        m_head += pad;
+    }
+
+    // reserve write record
+    RecordHeader * record = recordAt(m_head);
+    record->size = static_cast<quint32>(need);
+    record->len = 0;
+    record->state = Reserved;
+    m_head += need;
+
+    return reinterpret_cast<char *>(record + 1);
+}
+
+void ByteQueue::push(char *data, qint64 len)
+{
+    if(!data){
+        return;
+    }
+
+    m_mutex.lock();
+
+    RecordHeader * record = recordOf(data);
+    bool isShrink = false;
+    if(len <= 0){
+        // cancel reserve
+        record->state = Consumed;
+    }else{
+        qint64 maxLen = static_cast<qint64>(record->size - sizeof(RecordHeader));
+        record->len = static_cast<quint32>(len > maxLen ? maxLen : len);
+        record->state = Committed;
+        m_readableCount++;
+
+        // newest record, nothing reserved after it, give unused tail back
+        quint64 size = alignRecord(sizeof(RecordHeader) + record->len);
+        if(size < record->size && recordAt(m_head - record->size) == record){
+            m_head -= record->size - size;
+            record->size = static_cast<quint32>(size);
+            isShrink = true;
+        }
+    }
+
+    bool isWakeWriter = (reclaim() || isShrink) && m_writeWaiters > 0;
+    bool isWakeReader = m_readWaiters > 0;
+    m_mutex.unlock();
+    if(isWakeReader){
+        m_readCond.wakeOne();
+    }
+    if(isWakeWriter){
+        m_writeCond.wakeAll();
+    }
+}
+
+void ByteQueue::abort()
+{
+    m_mutex.lock();
+    m_abort = true;
+    m_readCond.wakeAll();
+    m_writeCond.wakeAll();
+    m_mutex.unlock();
+}
+
+bool ByteQueue::isAbort()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_abort;
+}
+
+bool ByteQueue::reset()
+{
+    QMutexLocker locker(&m_mutex);
+    m_abort = false;
+    return true;
+}
+
+int ByteQueue::readableCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_readableCount;
+}
+
+qint64 ByteQueue::budget() const
+{
+    return static_cast<qint64>(m_capacity);
+}
+
+qint64 ByteQueue::usedBytes()
+{
+    QMutexLocker locker(&m_mutex);
+    return static_cast<qint64>(m_head - m_tail);
+}
+
+quint64 ByteQueue::droppedCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_droppedCount;
+}
+
+ByteQueue::RecordHeader *ByteQueue::recordAt(quint64 offset) const
+{
+    return reinterpret_cast<RecordHeader *>(reinterpret_cast<char *>(m_ring) +
+                                            offset % m_capacity);
+}
+
+ByteQueue::RecordHeader *ByteQueue::recordOf(char *data)
+{
+    return reinterpret_cast<RecordHeader *>(data) - 1;
+}
+
+bool ByteQueue::dropOldest()
+{
+    // oldest unread record, nothing to drop if it is reserved or queue is empty
+    if(m_readIdx >= m_head || recordAt(m_readIdx)->state != Committed){
+        return false;
+    }
+
+    recordAt(m_readIdx)->state = Consumed;
+    m_droppedCount++;
+    m_readableCount--;
+    reclaim();
+    return true;
+}
+
+bool ByteQueue::reclaim()
+{
+    // skip padding and canceled record
+    while(m_readIdx < m_head){
+        RecordHeader * record = recordAt(m_readIdx);
+        if(record->state != Consumed && record->state != Padding){
+            break;
+        }
+        m_readIdx += record->size;
+    }
+
+    // free consumed record
+    quint64 tail = m_tail;
+    while(m_tail < m_readIdx){
+        RecordHeader * record = recordAt(m_tail);
+        if(record->state != Consumed && record->state != Padding){
+            break;
+        }
+        m_tail += record->size;
+    }
+    return m_tail != tail;
+}
@@ -0,0 +1,107 @@
+﻿#ifndef BYTEQUEUE_H
+#define BYTEQUEUE_H
+
+#include "waitstrategy.h"
+#include <QMutex>
+#include <QWaitCondition>
+#include <climits>
+
+#define BYTE_DEFAULT_QUEUE_BUDGET (4 * 1024 * 1024)
+#define BYTE_DEFAULT_DROP_TIME_OUT 500
+
+enum ByteQueueOverflowPolicy{
+    ByteQueueWait,
+    ByteQueueDropOldest
+};
+
+/**
+ * multi thread read and write queue of variable length buffer,
+ * capacity is byte budget, not slot count.
+ * 1.write
+ *  1) call peekWriteable function reserve size bytes, if return nullptr, reserve failure!
+ *  2) call push function commit len bytes, len must not greater than reserved size.
+ *     push len 0 will cancel the reserve.
+ *     reserve max size and commit what is written, e.g. socket read, unused tail of newest
+ *     record is given back at once, only exact bytes stay in budget.
+ * 2.read
+ *  1) call peekReadable function acquire buffer and buffer len, if return nullptr, get buffer failure!
+ *  2) call next function finish your read.
+ * 3.abort
+ *  1) call abort function abort your queue, call isAbort function check queue is abort.
+ *  2) call reset function clear abort, buffer pushed before abort is kept.
+ * 4.link
+ *  ByteBudgetQueue adapt it to AbstractQueue, so client and parse thread use it as other queue.
+ * Warning!!!
+ * 1.buffer is read in reserve order, a slow writer will block reader until it push.
+ * 2.if budget overflow:
+ *  1) ByteQueueWait: writer wait until reader free enough bytes or timeout.
+ *  2) ByteQueueDropOldest: writer wait dropTimeout, then drop oldest unread buffer.
+ * 3.reserve size greater than budget will always failure.
+ */
+class ByteQueue
+{
+public:
+    explicit ByteQueue(qint64 budget = BYTE_DEFAULT_QUEUE_BUDGET,
+                       ByteQueueOverflowPolicy policy = ByteQueueWait,
+                       unsigned long dropTimeout = BYTE_DEFAULT_DROP_TIME_OUT);
+    ~ByteQueue();
+
+    char * peekReadable(unsigned long timeout,qint64 * len);
+    void next(char * data);
+
+    char * peekWriteable(qint64 size,unsigned long timeout = ULONG_MAX);
+    void push(char * data,qint64 len);
+
+    void abort();
+    bool isAbort();
+    bool reset();
+
+    int readableCount();
+
+    qint64 budget() const;
+    qint64 usedBytes();
+    quint64 droppedCount();
+
+private:
+    struct RecordHeader{
+        quint32 size;
+        quint32 len;
+        quint32 state;
+        quint32 reserved;
+    };
+
+    enum RecordState{
+        Reserved,
+        Committed,
+        Reading,
+        Consumed,
+        Padding
+    };
+
+    RecordHeader * recordAt(quint64 offset) const;
+    static RecordHeader * recordOf(char * data);
+    bool dropOldest();
+    bool reclaim();
+
+    quint64 m_capacity;
+    quint64 * m_ring;
+
+    // monotonic offset, ring offset is offset % m_capacity
+    quint64 m_head;
+    quint64 m_readIdx;
+    quint64 m_tail;
+
+    ByteQueueOverflowPolicy m_policy;
+    unsigned long m_dropTimeout;
+    quint64 m_droppedCount;
+    int m_readableCount;
+    bool m_abort;
+
+    QMutex m_mutex;
+    QWaitCondition m_readCond;
+    QWaitCondition m_writeCond;
+    int m_readWaiters;
+    int m_writeWaiters;
+};
+
+#endif // BYTEQUEUE_H
@@ -2,10 +2,13 @@
 #define DROPQUEUE_H
 
 #include "abstractqueue.h"
-#include <QMap>
+#include "slaballocator.h"
+#include "waitstrategy.h"
+#include "../trace.h"
 #include <QMutex>
 #include <QMutexLocker>
 #include <QWaitCondition>
+#include <new>
 
 #define DROP_DEFAULT_QUEUE_MAX_SIZE 20
 #define DROP_DEFAULT_TIME_OUT 500
@@ -18,47 +21,78 @@ struct DropNode{
 };
 
 /**
- * if buffer overflow, will drop oldest data.
+ * if buffer overflow, writer wait dropTimeout, then drop oldest data.
  */
 template <typename T>
 class DropQueue: public AbstractQueue<T>{
 
 public:
     explicit DropQueue();
-    explicit DropQueue(unsigned int maxSize,unsigned long dropTimeout);
+    explicit DropQueue(unsigned int maxSize,unsigned long dropTimeout,
+                       QueueWaitStrategy waitStrategy = BlockingWait,
+                       int poolFlags = SlabDefault);
+    ~DropQueue();
 
     virtual T * peekReadable(unsigned long timeout) override;
     virtual void next(T * data) override;
 
-    virtual T * peekWriteable() override;
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) override;
     virtual void push(T * data) override;
 
     virtual void abort() override;
     virtual bool isAbort() override;
+    virtual bool reset() override;
+
+    virtual int readableCount() override;
+
+    QueueWaitStrategy waitStrategy() const;
+    void setWaitStrategy(const QueueWaitStrategy &waitStrategy);
+    void setSpinCount(int minSpinCount,int maxSpinCount);
+
+    bool bindToCurrentNode();
 
 private:
+    DropNode<T> * nodeOf(T * data) const;
+    bool dropOldest();
+
+    SlabAllocator m_slab;
     DropNode<T> * m_wIdx;
     DropNode<T> * m_rIdx;
 
     unsigned int m_maxSize;
     unsigned long m_dropTimeout;
-    bool m_abort;
+    QAtomicInt m_abort;
+
+    QueueWaitStrategy m_waitStrategy;
+    QueueSpinner m_readSpinner;
+    QueueSpinner m_writeSpinner;
+    QAtomicInt m_readableCount;
+    QAtomicInt m_writeableCount;
 
-    QMap<T*,DropNode<T>*> m_map;
     QMutex m_mutex;
-    QWaitCondition m_cond;
+    QWaitCondition m_readCond;
+    QWaitCondition m_writeCond;
+    int m_readWaiters;
+    int m_writeWaiters;
 };
 
 template<typename T>
 DropQueue<T>::DropQueue()
-    :m_wIdx(nullptr),
+    :m_slab(sizeof(DropNode<T>),DROP_DEFAULT_QUEUE_MAX_SIZE + 2),
+      m_wIdx(nullptr),
       m_rIdx(nullptr),
       m_maxSize(DROP_DEFAULT_QUEUE_MAX_SIZE),
       m_dropTimeout(DROP_DEFAULT_TIME_OUT),
-      m_abort(false)
+      m_abort(0),
+      m_waitStrategy(BlockingWait),
+      m_readableCount(0),
+      m_writeableCount(static_cast<int>(m_maxSize)),
+      m_readWaiters(0),
+      m_writeWaiters(0)
 {
-    m_wIdx = new DropNode<T>();
-    m_rIdx = new DropNode<T>();
+    // node 0 and 1 is write and read index, others is buffer node
+    m_wIdx = new (m_slab.at(0)) DropNode<T>();
+    m_rIdx = new (m_slab.at(1)) DropNode<T>();
     m_wIdx->pre = m_rIdx;
     m_wIdx->next = m_rIdx;
     m_rIdx->next = m_wIdx;
@@ -66,55 +100,96 @@ DropQueue<T>::DropQueue()
 
     DropNode<T> * node = nullptr;
     for(unsigned int i = 0;i< m_maxSize;i++){
-        node = new DropNode<T>();
+        node = new (m_slab.at(i + 2)) DropNode<T>();
         node->pre = m_wIdx;
         node->next = m_wIdx->next;
         node->pre->next = node;
         node->next->pre = node;
-
-        m_map.insert(&node->data,node);
     }
 }
 
 template<typename T>
-DropQueue<T>::DropQueue(unsigned int maxSize, unsigned long dropTimeout)
-    :m_wIdx(nullptr),
+DropQueue<T>::DropQueue(unsigned int maxSize, unsigned long dropTimeout,
+                        QueueWaitStrategy waitStrategy,
+                        int poolFlags)
+    :m_slab(sizeof(DropNode<T>),maxSize + 2,poolFlags),
+      m_wIdx(nullptr),
       m_rIdx(nullptr),
       m_maxSize(maxSize),
       m_dropTimeout(dropTimeout),
-      m_abort(false)
+      m_abort(0),
+      m_waitStrategy(waitStrategy),
+      m_readableCount(0),
+      m_writeableCount(static_cast<int>(m_maxSize)),
+      m_readWaiters(0),
+      m_writeWaiters(0)
 {
-    m_wIdx = new DropNode<T>();
-    m_rIdx = new DropNode<T>();
+    // node 0 and 1 is write and read index, others is buffer node
+    m_wIdx = new (m_slab.at(0)) DropNode<T>();
+    m_rIdx = new (m_slab.at(1)) DropNode<T>();
     m_wIdx->pre = m_rIdx;
     m_wIdx->next = m_rIdx;
     m_rIdx->next = m_wIdx;
     m_rIdx->pre = m_wIdx;
 
     DropNode<T> * node = nullptr;
-    for(int i = 0;i< m_maxSize;i++){
-        node = new DropNode<T>();
+    for(unsigned int i = 0;i< m_maxSize;i++){
+        node = new (m_slab.at(i + 2)) DropNode<T>();
         node->pre = m_wIdx;
         node->next = m_wIdx->next;
         node->pre->next = node;
         node->next->pre = node;
+    }
+}
 
-        m_map.insert(&node->data,node);
+template<typename T>
+DropQueue<T>::~DropQueue()
+{
+    for(size_t i = 0;i < m_slab.count();i++){
+        static_cast<DropNode<T> *>(m_slab.at(i))->~DropNode<T>();
     }
 }
 
 template<typename T>
 T *DropQueue<T>::peekReadable(unsigned long timeout)
 {
+    CCL_TRACE_SCOPE("DropQueue::peekReadable");
+
+    // SlabConsumerNode: first read bind pool to reader numa node
+    m_slab.bindOnConsumer();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_readableCount.loadAcquire() > 0 || m_abort.loadAcquire();
+    };
+    m_readSpinner.wait(ready,m_waitStrategy,timeout);
+
     QMutexLocker locker(&m_mutex);
-    while(m_rIdx->next == m_wIdx && !m_abort){
-        if(!m_cond.wait(&m_mutex,timeout)){
+    while(m_rIdx->next == m_wIdx && !m_abort.loadAcquire()){
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
             // timeout
             return nullptr;
         }
+
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            locker.unlock();
+            m_readSpinner.wait(ready,m_waitStrategy,remaining);
+            locker.relock();
+        }else{
+            m_readWaiters++;
+            bool isWake = m_readCond.wait(&m_mutex,remaining);
+            m_readWaiters--;
+            if(!isWake){
+                // timeout
+                return nullptr;
+            }
+        }
     }
 
-    if(m_abort){
+    if(m_abort.loadAcquire()){
         return nullptr;
     }
 
@@ -124,6 +199,7 @@ T *DropQueue<T>::peekReadable(unsigned long timeout)
     readNode->next->pre = readNode->pre;
     readNode->next = nullptr;
     readNode->pre = nullptr;
+    m_readableCount.fetchAndAddRelease(-1);
 
     return &readNode->data;
 }
@@ -131,36 +207,74 @@ T *DropQueue<T>::peekReadable(unsigned long timeout)
 template<typename T>
 void DropQueue<T>::next(T *data)
 {
-    if(!m_map.contains(data)){
+    DropNode<T> *readNode = nodeOf(data);
+    if(!readNode){
         return;
     }
 
     m_mutex.lock();
 
     // insert read node
-    DropNode<T> *readNode = m_map[data];
     readNode->pre = m_rIdx->pre;
     readNode->next = m_rIdx;
     readNode->pre->next = readNode;
     readNode->next->pre = readNode;
     readNode = nullptr;
+    m_writeableCount.fetchAndAddRelease(1);
 
-    m_cond.wakeOne();
+    // only wake writer when someone is waiting, wake after unlock
+    bool isWake = m_writeWaiters > 0;
     m_mutex.unlock();
+    if(isWake){
+        CCL_TRACE_INSTANT("DropQueue::wakeWriter");
+        m_writeCond.wakeOne();
+    }
 }
 
 template<typename T>
-T *DropQueue<T>::peekWriteable()
+T *DropQueue<T>::peekWriteable(unsigned long timeout)
 {
+    CCL_TRACE_SCOPE("DropQueue::peekWriteable");
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_writeableCount.loadAcquire() > 0 || m_abort.loadAcquire();
+    };
+    m_writeSpinner.wait(ready,m_waitStrategy,qMin(timeout,m_dropTimeout));
+
     QMutexLocker locker(&m_mutex);
-    while(m_wIdx->next == m_rIdx && !m_abort){
-        if(!m_cond.wait(&m_mutex,m_dropTimeout)){
+    while(m_wIdx->next == m_rIdx && !m_abort.loadAcquire()){
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
             // timeout
-            m_rIdx = m_rIdx->next;
+            return nullptr;
+        }
+
+        // drop deadline count from call, not restart by wakeup
+        unsigned long dropRemaining = queueRemainingTime(m_dropTimeout,timer);
+        if(dropRemaining == 0){
+            if(dropOldest()){
+                continue;
+            }
+            // all readable node is hold by reader, wait reader call next function
+            dropRemaining = remaining;
+        }
+
+        unsigned long waitTime = qMin(remaining,dropRemaining);
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            locker.unlock();
+            m_writeSpinner.wait(ready,m_waitStrategy,waitTime);
+            locker.relock();
+        }else{
+            m_writeWaiters++;
+            m_writeCond.wait(&m_mutex,waitTime);
+            m_writeWaiters--;
         }
     }
 
-    if(m_abort){
+    if(m_abort.loadAcquire()){
         return nullptr;
     }
 
@@ -170,6 +284,7 @@ T *DropQueue<T>::peekWriteable()
     writeNode->next->pre = writeNode->pre;
     writeNode->pre = nullptr;
     writeNode->next = nullptr;
+    m_writeableCount.fetchAndAddRelease(-1);
 
     return &writeNode->data;
 }
@@ -177,38 +292,127 @@ T *DropQueue<T>::peekWriteable()
 template<typename T>
 void DropQueue<T>::push(T *data)
 {
-    if(!m_map.contains(data)){
+    DropNode<T> * writeNode = nodeOf(data);
+    if(!writeNode){
         return;
     }
 
     m_mutex.lock();
 
     // insert write node
-    DropNode<T> * writeNode = m_map[data];
     writeNode->pre = m_wIdx->pre;
     writeNode->next = m_wIdx;
     writeNode->pre->next = writeNode;
     writeNode->next->pre = writeNode;
     writeNode = nullptr;
+    m_readableCount.fetchAndAddRelease(1);
 
-    m_cond.wakeOne();
+    // only wake reader when someone is waiting, wake after unlock
+    bool isWake = m_readWaiters > 0;
     m_mutex.unlock();
+    if(isWake){
+        CCL_TRACE_INSTANT("DropQueue::wakeReader");
+        m_readCond.wakeOne();
+    }
+    this->notifyReadable();
 }
 
 template<typename T>
 void DropQueue<T>::abort()
 {
     m_mutex.lock();
-    m_abort = true;
-    m_cond.wakeAll();
+    m_abort.storeRelease(1);
+    m_readCond.wakeAll();
+    m_writeCond.wakeAll();
     m_mutex.unlock();
+    this->notifyReadable();
+}
+
+template<typename T>
+bool DropQueue<T>::dropOldest()
+{
+    // oldest readable node, nothing to drop if reader hold all node
+    DropNode<T> * dropNode = m_rIdx->next;
+    if(dropNode == m_wIdx){
+        return false;
+    }
+
+    // detach drop node from readable list
+    dropNode->pre->next = dropNode->next;
+    dropNode->next->pre = dropNode->pre;
+
+    // insert drop node to writeable list
+    dropNode->pre = m_rIdx->pre;
+    dropNode->next = m_rIdx;
+    dropNode->pre->next = dropNode;
+    dropNode->next->pre = dropNode;
+
+    m_readableCount.fetchAndAddRelease(-1);
+    m_writeableCount.fetchAndAddRelease(1);
+    return true;
 }
 
 template<typename T>
 bool DropQueue<T>::isAbort()
 {
-    QMutexLocker locker(&m_mutex);
-    return m_abort;
+    return m_abort.loadAcquire();
+}
+
+template<typename T>
+bool DropQueue<T>::reset()
+{
+    m_mutex.lock();
+    m_abort.storeRelease(0);
+    m_mutex.unlock();
+    return true;
+}
+
+template<typename T>
+int DropQueue<T>::readableCount()
+{
+    return m_readableCount.loadAcquire();
+}
+
+template<typename T>
+QueueWaitStrategy DropQueue<T>::waitStrategy() const
+{
+    return m_waitStrategy;
+}
+
+template<typename T>
+void DropQueue<T>::setWaitStrategy(const QueueWaitStrategy &waitStrategy)
+{
+    m_waitStrategy = waitStrategy;
+}
+
+template<typename T>
+void DropQueue<T>::setSpinCount(int minSpinCount, int maxSpinCount)
+{
+    m_readSpinner.setSpinCount(minSpinCount,maxSpinCount);
+    m_writeSpinner.setSpinCount(minSpinCount,maxSpinCount);
+}
+
+template<typename T>
+bool DropQueue<T>::bindToCurrentNode()
+{
+    return m_slab.bindToCurrentNode();
+}
+
+template<typename T>
+DropNode<T> *DropQueue<T>::nodeOf(T *data) const
+{
+    if(!m_slab.contains(data)){
+        return nullptr;
+    }
+
+    // node 0 and 1 is write and read index, not buffer
+    size_t index = m_slab.indexOf(data);
+    if(index < 2){
+        return nullptr;
+    }
+
+    DropNode<T> * node = static_cast<DropNode<T> *>(m_slab.at(index));
+    return &node->data == data ? node : nullptr;
 }
 
 #endif // DROPQUEUE_H
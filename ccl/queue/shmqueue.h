@@ -0,0 +1,509 @@
+﻿#ifndef SHMQUEUE_H
+#define SHMQUEUE_H
+
+#include "abstractqueue.h"
+#include "waitstrategy.h"
+#include <QByteArray>
+#include <QDebug>
+#include <QString>
+#include <atomic>
+#include <climits>
+#include <new>
+#include <type_traits>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_DEFAULT_QUEUE_MAX_SIZE 64
+#define SHM_QUEUE_MAGIC 0x51484d53
+#define SHM_QUEUE_VERSION 1
+#define SHM_LIVENESS_INTERVAL 200
+
+enum ShmQueueRole{
+    ShmQueueProducer,
+    ShmQueueConsumer
+};
+
+struct ShmQueueHeader{
+    quint32 magic;
+    quint32 version;
+    quint32 slotSize;
+    quint32 capacity;
+    std::atomic<quint32> abort;
+    std::atomic<qint32> producerPid;
+    std::atomic<qint32> consumerPid;
+
+    alignas(64) std::atomic<quint32> head;
+    std::atomic<quint32> readWaiters;
+
+    alignas(64) std::atomic<quint32> tail;
+    std::atomic<quint32> writeWaiters;
+};
+
+/**
+ * single producer, single consumer queue in posix shared memory, for out of process consumer.
+ * 1.producer create shared memory name, consumer open it, producer must start first.
+ * 2.TcpClient, SerialPortClient write buffer to shared memory directly,
+ *   consumer process read buffer in place, no copy.
+ * 3.waiter sleep on futex in shared memory, wake by other process.
+ * 4.abort
+ *  1) abort function and producer destruct will abort queue in both process.
+ *  2) if peer process crash, waiter will find it in SHM_LIVENESS_INTERVAL ms and abort queue.
+ *     consumer started again before it attach in place of the dead one.
+ *  3) queue can not be reuse after abort, create a new queue to attach again, reset return false.
+ * Warning!!!
+ * 1.T must be trivially copyable, UDPBuffer is not supported.
+ * 2.only one buffer can be peeked at same time, call next or push before peek again.
+ * 3.producer call next function with writeable buffer will cancel the write.
+ * 4.linux only.
+ */
+template <typename T>
+class ShmQueue: public AbstractQueue<T>{
+
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "ShmQueue only support trivially copyable buffer");
+    static_assert(sizeof(std::atomic<quint32>) == sizeof(quint32) && ATOMIC_INT_LOCK_FREE == 2,
+                  "futex need lock free 32 bit atomic");
+
+public:
+    explicit ShmQueue(const QString &name,
+                      ShmQueueRole role,
+                      unsigned int maxSize = SHM_DEFAULT_QUEUE_MAX_SIZE,
+                      QueueWaitStrategy waitStrategy = BlockingWait);
+    ~ShmQueue();
+
+    virtual T * peekReadable(unsigned long timeout) override;
+    virtual void next(T * data) override;
+
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) override;
+    virtual void push(T * data) override;
+
+    virtual void abort() override;
+    virtual bool isAbort() override;
+    virtual bool reset() override;
+
+    virtual int readableCount() override;
+
+    bool isValid() const;
+    QString errorString() const;
+
+    QString name() const;
+    ShmQueueRole role() const;
+
+private:
+    T * slotAt(quint32 index) const;
+    bool isPeerAlive();
+    void setErrorString(const QString &errorString);
+
+    static size_t slotStride();
+    static size_t headerSize();
+    static long futexWait(std::atomic<quint32> * addr,quint32 expected,unsigned long timeout);
+    static void futexWake(std::atomic<quint32> * addr,int count);
+
+    QString m_name;
+    ShmQueueRole m_role;
+    QueueWaitStrategy m_waitStrategy;
+    QueueSpinner m_spinner;
+    QString m_errorString;
+
+    ShmQueueHeader * m_header;
+    char * m_slots;
+    size_t m_size;
+};
+
+template<typename T>
+ShmQueue<T>::ShmQueue(const QString &name,
+                      ShmQueueRole role,
+                      unsigned int maxSize,
+                      QueueWaitStrategy waitStrategy)
+    :m_name(name.startsWith('/') ? name : QString('/') + name),
+      m_role(role),
+      m_waitStrategy(waitStrategy),
+      m_header(nullptr),
+      m_slots(nullptr),
+      m_size(0)
+{
+    QByteArray shmName = m_name.toLocal8Bit();
+    int fd = -1;
+
+    if(m_role == ShmQueueProducer){
+        if(maxSize == 0){
+            setErrorString("Max size is zero!");
+            return;
+        }
+
+        // producer always create new shared memory, old consumer still see old one abort
+        shm_unlink(shmName.constData());
+        fd = shm_open(shmName.constData(),O_CREAT | O_EXCL | O_RDWR,0600);
+        if(fd < 0){
+            setErrorString(QString("Create shared memory failure! Error: ") + strerror(errno));
+            return;
+        }
+
+        m_size = headerSize() + slotStride() * maxSize;
+        if(ftruncate(fd,static_cast<off_t>(m_size)) != 0){
+            setErrorString(QString("Resize shared memory failure! Error: ") + strerror(errno));
+            ::close(fd);
+            shm_unlink(shmName.constData());
+            return;
+        }
+    }else{
+        fd = shm_open(shmName.constData(),O_RDWR,0600);
+        if(fd < 0){
+            setErrorString(QString("Open shared memory failure! Error: ") + strerror(errno));
+            return;
+        }
+
+        struct stat st;
+        if(fstat(fd,&st) != 0 || static_cast<size_t>(st.st_size) < headerSize()){
+            setErrorString("Shared memory is not initialized!");
+            ::close(fd);
+            return;
+        }
+        m_size = static_cast<size_t>(st.st_size);
+    }
+
+    void * ptr = mmap(nullptr,m_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(ptr == MAP_FAILED){
+        setErrorString(QString("Map shared memory failure! Error: ") + strerror(errno));
+        m_size = 0;
+        return;
+    }
+
+    m_header = static_cast<ShmQueueHeader *>(ptr);
+    m_slots = static_cast<char *>(ptr) + headerSize();
+
+    if(m_role == ShmQueueProducer){
+        new (m_header) ShmQueueHeader();
+        m_header->version = SHM_QUEUE_VERSION;
+        m_header->slotSize = static_cast<quint32>(sizeof(T));
+        m_header->capacity = maxSize;
+        m_header->abort.store(0);
+        m_header->producerPid.store(getpid());
+        m_header->consumerPid.store(0);
+        m_header->head.store(0);
+        m_header->readWaiters.store(0);
+        m_header->tail.store(0);
+        m_header->writeWaiters.store(0);
+
+        // publish header last
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = SHM_QUEUE_MAGIC;
+    }else{
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(m_header->magic != SHM_QUEUE_MAGIC ||
+                m_header->version != SHM_QUEUE_VERSION ||
+                m_header->slotSize != sizeof(T) ||
+                m_size < headerSize() + slotStride() * m_header->capacity){
+            setErrorString("Shared memory layout is not match!");
+            munmap(m_header,m_size);
+            m_header = nullptr;
+            m_slots = nullptr;
+            m_size = 0;
+            return;
+        }
+
+        // pid of crashed consumer is never cleared, take its place
+        qint32 expected = 0;
+        bool attached = false;
+        while(!attached){
+            attached = m_header->consumerPid.compare_exchange_strong(expected,getpid());
+            if(attached || (kill(expected,0) == 0 || errno != ESRCH)){
+                break;
+            }
+            qDebug()<<"ShmQueue consumer "<<expected<<" is dead, attach instead. Name: "<<m_name;
+        }
+        if(!attached){
+            setErrorString("Shared memory already has consumer!");
+            munmap(m_header,m_size);
+            m_header = nullptr;
+            m_slots = nullptr;
+            m_size = 0;
+            return;
+        }
+    }
+}
+
+template<typename T>
+ShmQueue<T>::~ShmQueue()
+{
+    if(!m_header){
+        return;
+    }
+
+    if(m_role == ShmQueueProducer){
+        abort();
+        shm_unlink(m_name.toLocal8Bit().constData());
+    }else{
+        m_header->consumerPid.store(0);
+        futexWake(&m_header->tail,INT_MAX);
+    }
+    munmap(m_header,m_size);
+}
+
+template<typename T>
+T *ShmQueue<T>::peekReadable(unsigned long timeout)
+{
+    if(!m_header || m_role != ShmQueueConsumer){
+        return nullptr;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_header->head.load(std::memory_order_acquire) !=
+                m_header->tail.load(std::memory_order_relaxed) ||
+                m_header->abort.load(std::memory_order_acquire);
+    };
+    m_spinner.wait(ready,m_waitStrategy,timeout);
+
+    forever{
+        if(m_header->abort.load()){
+            return nullptr;
+        }
+
+        quint32 head = m_header->head.load();
+        quint32 tail = m_header->tail.load(std::memory_order_relaxed);
+        if(head != tail){
+            return slotAt(tail);
+        }
+
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
+            // timeout
+            return nullptr;
+        }
+
+        unsigned long waitTime = qMin(remaining,static_cast<unsigned long>(SHM_LIVENESS_INTERVAL));
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            m_spinner.wait(ready,m_waitStrategy,waitTime);
+        }else{
+            // announce waiter before check again, producer check waiter after publish head
+            m_header->readWaiters.fetch_add(1);
+            if(m_header->head.load() == head && !m_header->abort.load()){
+                futexWait(&m_header->head,head,waitTime);
+            }
+            m_header->readWaiters.fetch_sub(1);
+        }
+
+        if(m_header->head.load() == head && !isPeerAlive()){
+            qDebug()<<"Shared memory producer is dead! Abort queue: "<<m_name;
+            abort();
+        }
+    }
+}
+
+template<typename T>
+void ShmQueue<T>::next(T *data)
+{
+    if(!m_header || m_role != ShmQueueConsumer){
+        // producer cancel write
+        return;
+    }
+
+    quint32 tail = m_header->tail.load(std::memory_order_relaxed);
+    if(data != slotAt(tail) || m_header->head.load() == tail){
+        return;
+    }
+
+    m_header->tail.store(tail + 1);
+    if(m_header->writeWaiters.load() > 0){
+        futexWake(&m_header->tail,1);
+    }
+}
+
+template<typename T>
+T *ShmQueue<T>::peekWriteable(unsigned long timeout)
+{
+    if(!m_header || m_role != ShmQueueProducer){
+        return nullptr;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_header->head.load(std::memory_order_relaxed) -
+                m_header->tail.load(std::memory_order_acquire) < m_header->capacity ||
+                m_header->abort.load(std::memory_order_acquire);
+    };
+    m_spinner.wait(ready,m_waitStrategy,timeout);
+
+    forever{
+        if(m_header->abort.load()){
+            return nullptr;
+        }
+
+        quint32 head = m_header->head.load(std::memory_order_relaxed);
+        quint32 tail = m_header->tail.load();
+        if(head - tail < m_header->capacity){
+            return slotAt(head);
+        }
+
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
+            // timeout
+            return nullptr;
+        }
+
+        unsigned long waitTime = qMin(remaining,static_cast<unsigned long>(SHM_LIVENESS_INTERVAL));
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            m_spinner.wait(ready,m_waitStrategy,waitTime);
+        }else{
+            // announce waiter before check again, consumer check waiter after publish tail
+            m_header->writeWaiters.fetch_add(1);
+            if(m_header->tail.load() == tail && !m_header->abort.load()){
+                futexWait(&m_header->tail,tail,waitTime);
+            }
+            m_header->writeWaiters.fetch_sub(1);
+        }
+
+        if(m_header->tail.load() == tail && !isPeerAlive()){
+            qDebug()<<"Shared memory consumer is dead! Abort queue: "<<m_name;
+            abort();
+        }
+    }
+}
+
+template<typename T>
+void ShmQueue<T>::push(T *data)
+{
+    if(!m_header || m_role != ShmQueueProducer){
+        return;
+    }
+
+    quint32 head = m_header->head.load(std::memory_order_relaxed);
+    if(data != slotAt(head) || head - m_header->tail.load() >= m_header->capacity){
+        return;
+    }
+
+    m_header->head.store(head + 1);
+    if(m_header->readWaiters.load() > 0){
+        futexWake(&m_header->head,1);
+    }
+    this->notifyReadable();
+}
+
+template<typename T>
+void ShmQueue<T>::abort()
+{
+    if(!m_header){
+        return;
+    }
+
+    m_header->abort.store(1);
+    futexWake(&m_header->head,INT_MAX);
+    futexWake(&m_header->tail,INT_MAX);
+    this->notifyReadable();
+}
+
+template<typename T>
+bool ShmQueue<T>::isAbort()
+{
+    return !m_header || m_header->abort.load();
+}
+
+template<typename T>
+bool ShmQueue<T>::reset()
+{
+    // peer process may have seen abort and gone
+    return false;
+}
+
+template<typename T>
+int ShmQueue<T>::readableCount()
+{
+    if(!m_header){
+        return 0;
+    }
+    return static_cast<int>(m_header->head.load() - m_header->tail.load());
+}
+
+template<typename T>
+bool ShmQueue<T>::isValid() const
+{
+    return m_header != nullptr;
+}
+
+template<typename T>
+QString ShmQueue<T>::errorString() const
+{
+    return m_errorString;
+}
+
+template<typename T>
+QString ShmQueue<T>::name() const
+{
+    return m_name;
+}
+
+template<typename T>
+ShmQueueRole ShmQueue<T>::role() const
+{
+    return m_role;
+}
+
+template<typename T>
+T *ShmQueue<T>::slotAt(quint32 index) const
+{
+    return reinterpret_cast<T *>(m_slots + slotStride() * (index % m_header->capacity));
+}
+
+template<typename T>
+bool ShmQueue<T>::isPeerAlive()
+{
+    qint32 pid = m_role == ShmQueueProducer ?
+                m_header->consumerPid.load() : m_header->producerPid.load();
+    if(pid <= 0){
+        // consumer not attach yet, or detached normally
+        return true;
+    }
+    return kill(pid,0) == 0 || errno != ESRCH;
+}
+
+template<typename T>
+void ShmQueue<T>::setErrorString(const QString &errorString)
+{
+    m_errorString = errorString;
+    qDebug()<<"ShmQueue error: "<<errorString<<" Name: "<<m_name;
+}
+
+template<typename T>
+size_t ShmQueue<T>::slotStride()
+{
+    return (sizeof(T) + 63) / 64 * 64;
+}
+
+template<typename T>
+size_t ShmQueue<T>::headerSize()
+{
+    return (sizeof(ShmQueueHeader) + 63) / 64 * 64;
+}
+
+template<typename T>
+long ShmQueue<T>::futexWait(std::atomic<quint32> *addr, quint32 expected, unsigned long timeout)
+{
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(timeout / 1000);
+    ts.tv_nsec = static_cast<long>(timeout % 1000) * 1000000;
+    return syscall(SYS_futex,reinterpret_cast<quint32 *>(addr),FUTEX_WAIT,expected,
+                   timeout == ULONG_MAX ? nullptr : &ts,nullptr,0);
+}
+
+template<typename T>
+void ShmQueue<T>::futexWake(std::atomic<quint32> *addr, int count)
+{
+    syscall(SYS_futex,reinterpret_cast<quint32 *>(addr),FUTEX_WAKE,count,nullptr,nullptr,0);
+}
+
+#endif // SHMQUEUE_H
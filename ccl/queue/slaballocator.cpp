@@ -0,0 +1,191 @@
+﻿#include "slaballocator.h"
+#include <QDebug>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static size_t alignUp(size_t size,size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+static size_t pageSize()
+{
+#ifdef Q_OS_LINUX
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+#else
+    return 4096;
+#endif
+}
+
+SlabAllocator::SlabAllocator(size_t elementSize, size_t count, int flags)
+    :m_base(nullptr),
+      m_count(count),
+      m_stride(alignUp(elementSize > 0 ? elementSize : 1,SLAB_CACHE_LINE_SIZE)),
+      m_size(0),
+      m_mapped(false),
+      m_hugePage(false),
+      m_bindPending(0)
+{
+    size_t bytes = m_stride * (m_count > 0 ? m_count : 1);
+
+#ifdef Q_OS_LINUX
+    // consumer fault in on its node, not here
+    bool isPrefault = (flags & SlabPrefault) && !(flags & SlabConsumerNode);
+    int populate = isPrefault ? MAP_POPULATE : 0;
+
+    if(flags & SlabHugeTLB){
+        m_size = alignUp(bytes,SLAB_HUGE_PAGE_SIZE);
+        void * ptr = mmap(nullptr,m_size,PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate,-1,0);
+        if(ptr != MAP_FAILED){
+            m_base = static_cast<char *>(ptr);
+            m_mapped = true;
+            m_hugePage = true;
+        }else{
+            qDebug()<<"Map huge tlb page failure! Fallback to normal page. Size: "<<m_size;
+        }
+    }
+
+    if(!m_base && (flags & SlabTransparentHugePage)){
+        // over map, then trim to huge page boundary, kernel only back aligned range
+        m_size = alignUp(bytes,SLAB_HUGE_PAGE_SIZE);
+        size_t mapSize = m_size + SLAB_HUGE_PAGE_SIZE;
+        void * ptr = mmap(nullptr,mapSize,PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+        if(ptr != MAP_FAILED){
+            char * begin = static_cast<char *>(ptr);
+            char * aligned = reinterpret_cast<char *>(
+                        alignUp(reinterpret_cast<size_t>(begin),SLAB_HUGE_PAGE_SIZE));
+            if(aligned > begin){
+                munmap(begin,static_cast<size_t>(aligned - begin));
+            }
+            size_t tail = mapSize - static_cast<size_t>(aligned - begin) - m_size;
+            if(tail > 0){
+                munmap(aligned + m_size,tail);
+            }
+
+            m_base = aligned;
+            m_mapped = true;
+            m_hugePage = madvise(m_base,m_size,MADV_HUGEPAGE) == 0;
+            if(!m_hugePage){
+                qDebug()<<"Advise transparent huge page failure! Size: "<<m_size;
+            }
+            if(isPrefault){
+                std::memset(m_base,0,m_size);
+            }
+        }
+    }
+
+    if(!m_base){
+        m_size = alignUp(bytes,pageSize());
+        void * ptr = mmap(nullptr,m_size,PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | populate,-1,0);
+        if(ptr != MAP_FAILED){
+            m_base = static_cast<char *>(ptr);
+            m_mapped = true;
+        }
+    }
+
+    if(m_mapped && (flags & SlabConsumerNode)){
+        m_bindPending.storeRelease(1);
+    }
+#endif
+
+    if(!m_base){
+        m_size = alignUp(bytes,pageSize());
+        m_base = static_cast<char *>(qMallocAligned(m_size,SLAB_CACHE_LINE_SIZE));
+        Q_CHECK_PTR(m_base);
+        if(flags & SlabPrefault){
+            std::memset(m_base,0,m_size);
+        }
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+#ifdef Q_OS_LINUX
+    if(m_mapped){
+        munmap(m_base,m_size);
+        return;
+    }
+#endif
+    qFreeAligned(m_base);
+}
+
+size_t SlabAllocator::count() const
+{
+    return m_count;
+}
+
+size_t SlabAllocator::stride() const
+{
+    return m_stride;
+}
+
+size_t SlabAllocator::size() const
+{
+    return m_size;
+}
+
+bool SlabAllocator::isHugePage() const
+{
+    return m_hugePage;
+}
+
+bool SlabAllocator::bindToCurrentNode()
+{
+#ifdef Q_OS_LINUX
+    if(!m_mapped){
+        return false;
+    }
+
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if(syscall(SYS_getcpu,&cpu,&node,nullptr) != 0){
+        qDebug()<<"Get current numa node failure!";
+        return false;
+    }
+
+    // prefer calling thread node, move page already touched by other node
+    unsigned long nodeMask[4] = {0};
+    const unsigned long maxNode = sizeof(nodeMask) * 8;
+    if(node >= maxNode){
+        return false;
+    }
+    nodeMask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+
+    if(syscall(SYS_mbind,m_base,m_size,MPOL_PREFERRED,nodeMask,maxNode,MPOL_MF_MOVE) != 0){
+        qDebug()<<"Bind slab to numa node failure! Node: "<<node;
+        return false;
+    }
+
+    prefault();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SlabAllocator::prefault()
+{
+    // write one byte every page, read only map zero page.
+    // element may be used by other thread, atomic or 0 keep the value
+    size_t step = m_hugePage ? SLAB_HUGE_PAGE_SIZE : pageSize();
+    for(size_t offset = 0;offset < m_size;offset += step){
+#if defined(Q_CC_GNU) || defined(Q_CC_CLANG)
+        __atomic_fetch_or(m_base + offset,static_cast<char>(0),__ATOMIC_RELAXED);
+#else
+        volatile char * p = m_base + offset;
+        *p = *p;
+#endif
+    }
+}
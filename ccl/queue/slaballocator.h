@@ -0,0 +1,89 @@
+﻿#ifndef SLABALLOCATOR_H
+#define SLABALLOCATOR_H
+
+#include <QtGlobal>
+#include <QAtomicInt>
+#include <cstddef>
+
+#define SLAB_CACHE_LINE_SIZE 64
+
+enum SlabFlag{
+    SlabDefault = 0x0,
+    SlabTransparentHugePage = 0x1,
+    SlabHugeTLB = 0x2,
+    SlabPrefault = 0x4,
+    SlabConsumerNode = 0x8
+};
+
+/**
+ * one contiguous, cache line aligned region for count element.
+ * 1.flags
+ *  1) SlabTransparentHugePage: advise kernel back region with transparent huge page.
+ *  2) SlabHugeTLB: map region on explicit huge page, fallback to normal page if failure.
+ *  3) SlabPrefault: fault in all page at allocate.
+ *  4) SlabConsumerNode: not fault in at allocate, first bindOnConsumer call bind region to
+ *     numa node of calling thread and fault in there, WaitQueue and DropQueue call it
+ *     at first peekReadable.
+ * 2.numa
+ *  memory is first touched by the allocating thread, call bindToCurrentNode function
+ *  in consumer thread to move region to consumer numa node, page already touched is moved.
+ * Warning!!!
+ * 1.element is not constructed, use placement new.
+ * 2.huge page and numa is only supported on linux, other platform use aligned malloc.
+ */
+class SlabAllocator
+{
+public:
+    explicit SlabAllocator(size_t elementSize,size_t count,int flags = SlabDefault);
+    ~SlabAllocator();
+
+    void * at(size_t index) const;
+    size_t indexOf(const void * ptr) const;
+    bool contains(const void * ptr) const;
+
+    size_t count() const;
+    size_t stride() const;
+    size_t size() const;
+    bool isHugePage() const;
+
+    bool bindToCurrentNode();
+    void bindOnConsumer();
+    void prefault();
+
+private:
+    Q_DISABLE_COPY(SlabAllocator)
+
+    char * m_base;
+    size_t m_count;
+    size_t m_stride;
+    size_t m_size;
+    bool m_mapped;
+    bool m_hugePage;
+    QAtomicInt m_bindPending;
+};
+
+inline void *SlabAllocator::at(size_t index) const
+{
+    return m_base + index * m_stride;
+}
+
+inline size_t SlabAllocator::indexOf(const void *ptr) const
+{
+    return static_cast<size_t>(static_cast<const char *>(ptr) - m_base) / m_stride;
+}
+
+inline void SlabAllocator::bindOnConsumer()
+{
+    // only first call bind, others is one load
+    if(m_bindPending.loadAcquire() && m_bindPending.testAndSetOrdered(1,0)){
+        bindToCurrentNode();
+    }
+}
+
+inline bool SlabAllocator::contains(const void *ptr) const
+{
+    const char * p = static_cast<const char *>(ptr);
+    return p >= m_base && p < m_base + m_count * m_stride;
+}
+
+#endif // SLABALLOCATOR_H
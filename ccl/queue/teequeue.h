@@ -0,0 +1,168 @@
+﻿#ifndef TEEQUEUE_H
+#define TEEQUEUE_H
+
+#include "abstractqueue.h"
+#include "bytebudgetqueue.h"
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <cstring>
+
+#define TEE_DEFAULT_SECONDARY_TIME_OUT 0
+
+/**
+ * AbstractQueue of one writer and two reader, e.g. parse thread and CompressionThread read one link.
+ * 1.write
+ *  peekWriteable take buffer of primary queue, push copy it into secondary queue, then push primary.
+ *  payload is copied len bytes, field beside it by ByteBudgetTraits<T>.
+ * 2.read
+ *  peekReadable, next and readableCount is primary queue, secondary queue is read by its own reader.
+ * 3.secondary never slow primary
+ *  copy wait secondaryTimeout ms for secondary buffer at most(default 0), buffer not copied
+ *  is counted by secondaryDropped. DropQueue as secondary drop its oldest instead.
+ * 4.abort abort both queue, reset reset both.
+ * e.g.
+ *  WaitQueue<TCPBuffer> parseQueue;
+ *  DropQueue<TCPBuffer> archiveQueue;
+ *  TeeQueue<TCPBuffer> tcpQueue(&parseQueue,&archiveQueue);
+ *  TcpClient * client = new TcpClient("127.0.0.1",8765,&tcpQueue);
+ *  parse thread read tcpQueue, CompressionThread read archiveQueue.
+ * Warning!!!
+ * tee keep pointer of both queue, delete them after tee.
+ */
+template <typename T>
+class TeeQueue: public AbstractQueue<T>{
+
+public:
+    explicit TeeQueue(AbstractQueue<T> * primary,
+                      AbstractQueue<T> * secondary,
+                      unsigned long secondaryTimeout = TEE_DEFAULT_SECONDARY_TIME_OUT);
+
+    virtual T * peekReadable(unsigned long timeout) override;
+    virtual void next(T * data) override;
+
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) override;
+    virtual void push(T * data) override;
+
+    virtual void abort() override;
+    virtual bool isAbort() override;
+    virtual bool reset() override;
+
+    virtual int readableCount() override;
+
+    AbstractQueue<T> * primary();
+    AbstractQueue<T> * secondary();
+
+    /**
+     * buffer not copied, secondary queue full for secondaryTimeout or abort.
+     */
+    quint64 secondaryDropped() const;
+
+private:
+    AbstractQueue<T> * m_primary;
+    AbstractQueue<T> * m_secondary;
+    unsigned long m_secondaryTimeout;
+
+    QAtomicInteger<quint64> m_secondaryDropped;
+};
+
+template<typename T>
+TeeQueue<T>::TeeQueue(AbstractQueue<T> *primary,
+                      AbstractQueue<T> *secondary,
+                      unsigned long secondaryTimeout)
+    :m_primary(primary),
+      m_secondary(secondary),
+      m_secondaryTimeout(secondaryTimeout),
+      m_secondaryDropped(0)
+{
+
+}
+
+template<typename T>
+T *TeeQueue<T>::peekReadable(unsigned long timeout)
+{
+    return m_primary->peekReadable(timeout);
+}
+
+template<typename T>
+void TeeQueue<T>::next(T *data)
+{
+    m_primary->next(data);
+}
+
+template<typename T>
+T *TeeQueue<T>::peekWriteable(unsigned long timeout)
+{
+    return m_primary->peekWriteable(timeout);
+}
+
+template<typename T>
+void TeeQueue<T>::push(T *data)
+{
+    if(!data){
+        return;
+    }
+
+    // copy before push, primary reader may take and reuse it at once
+    T * copy = m_secondary->peekWriteable(m_secondaryTimeout);
+    if(copy){
+        char header[ByteBudgetTraits<T>::headerSize];
+        ByteBudgetTraits<T>::pack(*data,header);
+        ByteBudgetTraits<T>::unpack(header,copy);
+        copy->len = qBound(static_cast<qint64>(0),data->len,static_cast<qint64>(sizeof(data->buffer)));
+        memcpy(copy->buffer,data->buffer,static_cast<size_t>(copy->len));
+        m_secondary->push(copy);
+    }else{
+        m_secondaryDropped.fetchAndAddRelaxed(1);
+    }
+
+    m_primary->push(data);
+    this->notifyReadable();
+}
+
+template<typename T>
+void TeeQueue<T>::abort()
+{
+    m_primary->abort();
+    m_secondary->abort();
+    this->notifyReadable();
+}
+
+template<typename T>
+bool TeeQueue<T>::isAbort()
+{
+    return m_primary->isAbort();
+}
+
+template<typename T>
+bool TeeQueue<T>::reset()
+{
+    bool primary = m_primary->reset();
+    bool secondary = m_secondary->reset();
+    return primary && secondary;
+}
+
+template<typename T>
+int TeeQueue<T>::readableCount()
+{
+    return m_primary->readableCount();
+}
+
+template<typename T>
+AbstractQueue<T> *TeeQueue<T>::primary()
+{
+    return m_primary;
+}
+
+template<typename T>
+AbstractQueue<T> *TeeQueue<T>::secondary()
+{
+    return m_secondary;
+}
+
+template<typename T>
+quint64 TeeQueue<T>::secondaryDropped() const
+{
+    return m_secondaryDropped.load();
+}
+
+#endif // TEEQUEUE_H
@@ -2,9 +2,12 @@
 #define WAITQUEUE_H
 
 #include "abstractqueue.h"
-#include <QMap>
+#include "slaballocator.h"
+#include "waitstrategy.h"
+#include "../trace.h"
 #include <QMutex>
 #include <QWaitCondition>
+#include <new>
 
 #define WAIT_DEFAULT_QUEUE_MAX_SIZE 20
 
@@ -23,40 +26,69 @@ class WaitQueue: public AbstractQueue<T>{
 
 public:
     explicit WaitQueue();
-    explicit WaitQueue(unsigned long maxSize);
+    explicit WaitQueue(unsigned long maxSize,
+                       QueueWaitStrategy waitStrategy = BlockingWait,
+                       int poolFlags = SlabDefault);
     ~WaitQueue();
 
     virtual T * peekReadable(unsigned long timeout) override;
     virtual void next(T * data) override;
 
-    virtual T * peekWriteable() override;
+    virtual T * peekWriteable(unsigned long timeout = ULONG_MAX) override;
     virtual void push(T * data) override;
 
     virtual void abort() override;
     virtual bool isAbort() override;
+    virtual bool reset() override;
+
+    virtual int readableCount() override;
+
+    QueueWaitStrategy waitStrategy() const;
+    void setWaitStrategy(const QueueWaitStrategy &waitStrategy);
+    void setSpinCount(int minSpinCount,int maxSpinCount);
+
+    bool bindToCurrentNode();
 
 private:
+    WaitNode<T> * nodeOf(T * data) const;
+
+    SlabAllocator m_slab;
     WaitNode<T> * m_wIdx;
     WaitNode<T> * m_rIdx;
 
     unsigned int m_maxSize;
-    bool m_abort;
+    QAtomicInt m_abort;
+
+    QueueWaitStrategy m_waitStrategy;
+    QueueSpinner m_readSpinner;
+    QueueSpinner m_writeSpinner;
+    QAtomicInt m_readableCount;
+    QAtomicInt m_writeableCount;
 
-    QMap<T*,WaitNode<T>*> m_map;
     QMutex m_mutex;
-    QWaitCondition m_cond;
+    QWaitCondition m_readCond;
+    QWaitCondition m_writeCond;
+    int m_readWaiters;
+    int m_writeWaiters;
 };
 
 
 template<typename T>
 WaitQueue<T>::WaitQueue()
-    :m_wIdx(nullptr),
+    :m_slab(sizeof(WaitNode<T>),WAIT_DEFAULT_QUEUE_MAX_SIZE + 2),
+      m_wIdx(nullptr),
       m_rIdx(nullptr),
       m_maxSize(WAIT_DEFAULT_QUEUE_MAX_SIZE),
-      m_abort(false)
+      m_abort(0),
+      m_waitStrategy(BlockingWait),
+      m_readableCount(0),
+      m_writeableCount(static_cast<int>(m_maxSize)),
+      m_readWaiters(0),
+      m_writeWaiters(0)
 {
-    m_wIdx = new WaitNode<T>();
-    m_rIdx = new WaitNode<T>();
+    // node 0 and 1 is write and read index, others is buffer node
+    m_wIdx = new (m_slab.at(0)) WaitNode<T>();
+    m_rIdx = new (m_slab.at(1)) WaitNode<T>();
     m_wIdx->pre = m_rIdx;
     m_wIdx->next = m_rIdx;
     m_rIdx->next = m_wIdx;
@@ -64,25 +96,32 @@ WaitQueue<T>::WaitQueue()
 
     WaitNode<T> * node = nullptr;
     for(unsigned int i = 0;i< m_maxSize;i++){
-        node = new WaitNode<T>();
+        node = new (m_slab.at(i + 2)) WaitNode<T>();
         node->pre = m_wIdx;
         node->next = m_wIdx->next;
         node->pre->next = node;
         node->next->pre = node;
-
-        m_map.insert(&node->data,node);
     }
 }
 
 template<typename T>
-WaitQueue<T>::WaitQueue(unsigned long maxSize)
-    :m_wIdx(nullptr),
+WaitQueue<T>::WaitQueue(unsigned long maxSize,
+                        QueueWaitStrategy waitStrategy,
+                        int poolFlags)
+    :m_slab(sizeof(WaitNode<T>),maxSize + 2,poolFlags),
+      m_wIdx(nullptr),
       m_rIdx(nullptr),
       m_maxSize(maxSize),
-      m_abort(false)
+      m_abort(0),
+      m_waitStrategy(waitStrategy),
+      m_readableCount(0),
+      m_writeableCount(static_cast<int>(m_maxSize)),
+      m_readWaiters(0),
+      m_writeWaiters(0)
 {
-    m_wIdx = new WaitNode<T>();
-    m_rIdx = new WaitNode<T>();
+    // node 0 and 1 is write and read index, others is buffer node
+    m_wIdx = new (m_slab.at(0)) WaitNode<T>();
+    m_rIdx = new (m_slab.at(1)) WaitNode<T>();
     m_wIdx->pre = m_rIdx;
     m_wIdx->next = m_rIdx;
     m_rIdx->next = m_wIdx;
@@ -90,34 +129,62 @@ WaitQueue<T>::WaitQueue(unsigned long maxSize)
 
     WaitNode<T> * node = nullptr;
     for(unsigned int i = 0;i< m_maxSize;i++){
-        node = new WaitNode<T>();
+        node = new (m_slab.at(i + 2)) WaitNode<T>();
         node->pre = m_wIdx;
         node->next = m_wIdx->next;
         node->pre->next = node;
         node->next->pre = node;
-
-        m_map.insert(&node->data,node);
     }
 }
 
 template<typename T>
 WaitQueue<T>::~WaitQueue()
 {
-
+    for(size_t i = 0;i < m_slab.count();i++){
+        static_cast<WaitNode<T> *>(m_slab.at(i))->~WaitNode<T>();
+    }
 }
 
 template<typename T>
 T *WaitQueue<T>::peekReadable(unsigned long timeout)
 {
+    CCL_TRACE_SCOPE("WaitQueue::peekReadable");
+
+    // SlabConsumerNode: first read bind pool to reader numa node
+    m_slab.bindOnConsumer();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_readableCount.loadAcquire() > 0 || m_abort.loadAcquire();
+    };
+    m_readSpinner.wait(ready,m_waitStrategy,timeout);
+
     QMutexLocker locker(&m_mutex);
-    while(m_rIdx->next == m_wIdx && !m_abort){
-        if(!m_cond.wait(&m_mutex,timeout)){
+    while(m_rIdx->next == m_wIdx && !m_abort.loadAcquire()){
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
             // timeout
             return nullptr;
         }
+
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            locker.unlock();
+            m_readSpinner.wait(ready,m_waitStrategy,remaining);
+            locker.relock();
+        }else{
+            m_readWaiters++;
+            bool isWake = m_readCond.wait(&m_mutex,remaining);
+            m_readWaiters--;
+            if(!isWake){
+                // timeout
+                return nullptr;
+            }
+        }
     }
 
-    if(m_abort){
+    if(m_abort.loadAcquire()){
         return nullptr;
     }
 
@@ -127,6 +194,7 @@ T *WaitQueue<T>::peekReadable(unsigned long timeout)
     readNode->next->pre = readNode->pre;
     readNode->next = nullptr;
     readNode->pre = nullptr;
+    m_readableCount.fetchAndAddRelease(-1);
 
     return &readNode->data;
 }
@@ -134,33 +202,67 @@ T *WaitQueue<T>::peekReadable(unsigned long timeout)
 template<typename T>
 void WaitQueue<T>::next(T *data)
 {
-    if(!m_map.contains(data)){
+    WaitNode<T> *readNode = nodeOf(data);
+    if(!readNode){
         return;
     }
 
     m_mutex.lock();
 
     // insert read node
-    WaitNode<T> *readNode = m_map.value(data);
     readNode->pre = m_rIdx->pre;
     readNode->next = m_rIdx;
     readNode->pre->next = readNode;
     readNode->next->pre = readNode;
     readNode = nullptr;
+    m_writeableCount.fetchAndAddRelease(1);
 
-    m_cond.wakeOne();
+    // only wake writer when someone is waiting, wake after unlock
+    bool isWake = m_writeWaiters > 0;
     m_mutex.unlock();
+    if(isWake){
+        CCL_TRACE_INSTANT("WaitQueue::wakeWriter");
+        m_writeCond.wakeOne();
+    }
 }
 
 template<typename T>
-T *WaitQueue<T>::peekWriteable()
+T *WaitQueue<T>::peekWriteable(unsigned long timeout)
 {
+    CCL_TRACE_SCOPE("WaitQueue::peekWriteable");
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto ready = [this](){
+        return m_writeableCount.loadAcquire() > 0 || m_abort.loadAcquire();
+    };
+    m_writeSpinner.wait(ready,m_waitStrategy,timeout);
+
     QMutexLocker locker(&m_mutex);
-    while(m_wIdx->next == m_rIdx && !m_abort){
-        m_cond.wait(&m_mutex);
+    while(m_wIdx->next == m_rIdx && !m_abort.loadAcquire()){
+        unsigned long remaining = queueRemainingTime(timeout,timer);
+        if(remaining == 0){
+            // timeout
+            return nullptr;
+        }
+
+        if(QueueSpinner::isSpinOnly(m_waitStrategy)){
+            locker.unlock();
+            m_writeSpinner.wait(ready,m_waitStrategy,remaining);
+            locker.relock();
+        }else{
+            m_writeWaiters++;
+            bool isWake = m_writeCond.wait(&m_mutex,remaining);
+            m_writeWaiters--;
+            if(!isWake){
+                // timeout
+                return nullptr;
+            }
+        }
     }
 
-    if(m_abort){
+    if(m_abort.loadAcquire()){
         return nullptr;
     }
 
@@ -170,6 +272,7 @@ T *WaitQueue<T>::peekWriteable()
     writeNode->next->pre = writeNode->pre;
     writeNode->pre = nullptr;
     writeNode->next = nullptr;
+    m_writeableCount.fetchAndAddRelease(-1);
 
     return &writeNode->data;
 }
@@ -177,38 +280,103 @@ T *WaitQueue<T>::peekWriteable()
 template<typename T>
 void WaitQueue<T>::push(T *data)
 {
-    if(!m_map.contains(data)){
+    WaitNode<T> * writeNode = nodeOf(data);
+    if(!writeNode){
         return;
     }
 
     m_mutex.lock();
 
     // insert write node
-    WaitNode<T> * writeNode = m_map[data];
     writeNode->pre = m_wIdx->pre;
     writeNode->next = m_wIdx;
     writeNode->pre->next = writeNode;
     writeNode->next->pre = writeNode;
     writeNode = nullptr;
+    m_readableCount.fetchAndAddRelease(1);
 
-    m_cond.wakeOne();
+    // only wake reader when someone is waiting, wake after unlock
+    bool isWake = m_readWaiters > 0;
     m_mutex.unlock();
+    if(isWake){
+        CCL_TRACE_INSTANT("WaitQueue::wakeReader");
+        m_readCond.wakeOne();
+    }
+    this->notifyReadable();
 }
 
 template<typename T>
 void WaitQueue<T>::abort()
 {
     m_mutex.lock();
-    m_abort = true;
-    m_cond.wakeAll();
+    m_abort.storeRelease(1);
+    m_readCond.wakeAll();
+    m_writeCond.wakeAll();
     m_mutex.unlock();
+    this->notifyReadable();
 }
 
 template<typename T>
 bool WaitQueue<T>::isAbort()
 {
-    QMutexLocker locker(&m_mutex);
-    return m_abort;
+    return m_abort.loadAcquire();
+}
+
+template<typename T>
+bool WaitQueue<T>::reset()
+{
+    m_mutex.lock();
+    m_abort.storeRelease(0);
+    m_mutex.unlock();
+    return true;
+}
+
+template<typename T>
+int WaitQueue<T>::readableCount()
+{
+    return m_readableCount.loadAcquire();
+}
+
+template<typename T>
+QueueWaitStrategy WaitQueue<T>::waitStrategy() const
+{
+    return m_waitStrategy;
+}
+
+template<typename T>
+void WaitQueue<T>::setWaitStrategy(const QueueWaitStrategy &waitStrategy)
+{
+    m_waitStrategy = waitStrategy;
+}
+
+template<typename T>
+void WaitQueue<T>::setSpinCount(int minSpinCount, int maxSpinCount)
+{
+    m_readSpinner.setSpinCount(minSpinCount,maxSpinCount);
+    m_writeSpinner.setSpinCount(minSpinCount,maxSpinCount);
+}
+
+template<typename T>
+bool WaitQueue<T>::bindToCurrentNode()
+{
+    return m_slab.bindToCurrentNode();
+}
+
+template<typename T>
+WaitNode<T> *WaitQueue<T>::nodeOf(T *data) const
+{
+    if(!m_slab.contains(data)){
+        return nullptr;
+    }
+
+    // node 0 and 1 is write and read index, not buffer
+    size_t index = m_slab.indexOf(data);
+    if(index < 2){
+        return nullptr;
+    }
+
+    WaitNode<T> * node = static_cast<WaitNode<T> *>(m_slab.at(index));
+    return &node->data == data ? node : nullptr;
 }
 
 #endif // WAITQUEUE_H
@@ -0,0 +1,158 @@
+﻿#ifndef WAITSTRATEGY_H
+#define WAITSTRATEGY_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QThread>
+#include <climits>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#define WAIT_DEFAULT_MIN_SPIN_COUNT 16
+#define WAIT_DEFAULT_MAX_SPIN_COUNT 4096
+#define WAIT_DEFAULT_YIELD_SPIN_COUNT 128
+
+/**
+ * how queue wait for readable or writeable buffer.
+ * 1.BlockingWait: sleep on wait condition at once, lowest cpu usage.
+ * 2.BusySpinWait: spin until buffer ready or timeout, lowest latency, burn one core.
+ * 3.SpinYieldWait: spin a little, then yield cpu until buffer ready or timeout.
+ * 4.SpinBlockWait: spin adaptive count, then sleep on wait condition.
+ *   spin count grow when spin success, and shrink when fall into sleep.
+ */
+enum QueueWaitStrategy{
+    BlockingWait,
+    BusySpinWait,
+    SpinYieldWait,
+    SpinBlockWait
+};
+
+inline void queueCpuRelax()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__arm__))
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * remaining time of timeout, ULONG_MAX mean wait forever.
+ */
+inline unsigned long queueRemainingTime(unsigned long timeout, const QElapsedTimer &timer)
+{
+    if(timeout == ULONG_MAX){
+        return ULONG_MAX;
+    }
+
+    qint64 elapsed = timer.elapsed();
+    if(elapsed >= static_cast<qint64>(timeout)){
+        return 0;
+    }
+    return timeout - static_cast<unsigned long>(elapsed);
+}
+
+/**
+ * lock free wait phase of queue, call before lock queue mutex.
+ * ready is a function return true if buffer ready or queue abort.
+ */
+class QueueSpinner
+{
+public:
+    QueueSpinner()
+        :m_minSpinCount(WAIT_DEFAULT_MIN_SPIN_COUNT),
+          m_maxSpinCount(WAIT_DEFAULT_MAX_SPIN_COUNT),
+          m_spinCount(WAIT_DEFAULT_MIN_SPIN_COUNT)
+    {
+
+    }
+
+    void setSpinCount(int minSpinCount, int maxSpinCount)
+    {
+        m_minSpinCount = minSpinCount < 0 ? 0 : minSpinCount;
+        m_maxSpinCount = maxSpinCount < m_minSpinCount ? m_minSpinCount : maxSpinCount;
+        m_spinCount.store(m_minSpinCount);
+    }
+
+    int spinCount() const
+    {
+        return m_spinCount.load();
+    }
+
+    template<typename Ready>
+    bool wait(Ready ready, QueueWaitStrategy strategy, unsigned long timeout)
+    {
+        switch (strategy) {
+        case BusySpinWait:
+            return spinUntil(ready, timeout, false);
+        case SpinYieldWait:
+            return spinUntil(ready, timeout, true);
+        case SpinBlockWait:
+            return adaptiveSpin(ready);
+        default:
+            return ready();
+        }
+    }
+
+    /**
+     * BusySpinWait and SpinYieldWait never sleep on wait condition.
+     */
+    static bool isSpinOnly(QueueWaitStrategy strategy)
+    {
+        return strategy == BusySpinWait || strategy == SpinYieldWait;
+    }
+
+private:
+    template<typename Ready>
+    bool adaptiveSpin(Ready ready)
+    {
+        int spinCount = m_spinCount.load();
+        for(int i = 0;i < spinCount;i++){
+            if(ready()){
+                // spin success, spin longer next time
+                int count = spinCount + (m_maxSpinCount - spinCount) / 8 + 1;
+                m_spinCount.store(count > m_maxSpinCount ? m_maxSpinCount : count);
+                return true;
+            }
+            queueCpuRelax();
+        }
+
+        // spin failure, will sleep on wait condition, spin shorter next time
+        int count = spinCount - spinCount / 8 - 1;
+        m_spinCount.store(count < m_minSpinCount ? m_minSpinCount : count);
+        return ready();
+    }
+
+    template<typename Ready>
+    bool spinUntil(Ready ready, unsigned long timeout, bool yield)
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        int spin = 0;
+        while(!ready()){
+            if(yield && spin >= WAIT_DEFAULT_YIELD_SPIN_COUNT){
+                QThread::yieldCurrentThread();
+            }else{
+                spin++;
+                queueCpuRelax();
+            }
+
+            // check timeout every 64 spin, QElapsedTimer is not free
+            if((spin & 63) == 0 && queueRemainingTime(timeout,timer) == 0){
+                return ready();
+            }
+        }
+        return true;
+    }
+
+    int m_minSpinCount;
+    int m_maxSpinCount;
+    QAtomicInt m_spinCount;
+};
+
+#endif // WAITSTRATEGY_H
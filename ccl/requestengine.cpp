@@ -0,0 +1,453 @@
+﻿#include "requestengine.h"
+#include <QMutexLocker>
+#include <QDebug>
+#include <cstring>
+
+RequestEngine::RequestEngine(const RequestSender &sender,
+                             const FrameLengthFunction &frameLength,
+                             const TransactionIdExtractor &extractor,
+                             int window,
+                             QObject *parent)
+    :QObject(parent),
+      m_sender(sender),
+      m_frameLength(frameLength),
+      m_extractor(extractor),
+      m_window(window > 0 ? window : REQUEST_DEFAULT_WINDOW),
+      m_flushing(false),
+      m_serial(0),
+      m_transactionId(0),
+      m_running(false),
+      m_completedCount(0),
+      m_timeoutCount(0),
+      m_unmatchedCount(0)
+{
+    m_timer = new QTimer(this);
+    connect(m_timer,&QTimer::timeout,this,&RequestEngine::tickSlot);
+
+    connect(this,&RequestEngine::startSignal,this,&RequestEngine::startSlot);
+    connect(this,&RequestEngine::stopSignal,this,&RequestEngine::stopSlot);
+}
+
+RequestEngine::~RequestEngine()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_running = false;
+    abortAll(&completions);
+    m_mutex.unlock();
+    finish(completions);
+}
+
+void RequestEngine::start()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_running = true;
+    sendWaiting(&completions);
+    m_mutex.unlock();
+    finish(completions);
+    flushSending();
+
+    emit startSignal();
+}
+
+void RequestEngine::stop()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_running = false;
+    abortAll(&completions);
+    m_rxBuffer.clear();
+    m_mutex.unlock();
+    finish(completions);
+
+    emit stopSignal();
+}
+
+std::future<RequestResult> RequestEngine::request(const QByteArray &frame, unsigned long timeout)
+{
+    std::shared_ptr<std::promise<RequestResult>> promise =
+            std::make_shared<std::promise<RequestResult>>();
+    std::future<RequestResult> future = promise->get_future();
+
+    request(frame,[promise](const RequestResult &result){
+        promise->set_value(result);
+    },timeout);
+    return future;
+}
+
+void RequestEngine::request(const QByteArray &frame,
+                            const RequestCallback &callback,
+                            unsigned long timeout)
+{
+    std::shared_ptr<Request> request = std::make_shared<Request>();
+    request->transactionId = 0;
+    request->hasId = m_extractor &&
+            m_extractor(frame.constData(),frame.size(),&request->transactionId);
+    request->frame = frame;
+    request->timeout = timeout;
+    request->callback = callback;
+    request->timerId = 0;
+    request->late = false;
+
+    CompletionList completions;
+    m_mutex.lock();
+    request->serial = ++m_serial;
+    m_waiting.append(request);
+    sendWaiting(&completions);
+    m_mutex.unlock();
+    finish(completions);
+    flushSending();
+}
+
+void RequestEngine::feed(const char *data, qint64 len)
+{
+    if(len <= 0){
+        return;
+    }
+
+    CompletionList completions;
+    m_mutex.lock();
+    m_rxBuffer.append(data,static_cast<int>(len));
+
+    while(!m_rxBuffer.isEmpty()){
+        qint64 frameLen = m_frameLength(m_rxBuffer.constData(),m_rxBuffer.size());
+        if(frameLen < 0){
+            // resync, skip one byte
+            m_rxBuffer.remove(0,1);
+            continue;
+        }
+        if(frameLen == 0 || frameLen > m_rxBuffer.size()){
+            if(m_rxBuffer.size() > REQUEST_DEFAULT_MAX_FRAME_SIZE){
+                qDebug()<<"Response frame too long, drop "<<m_rxBuffer.size()<<" bytes";
+                m_rxBuffer.clear();
+                m_unmatchedCount++;
+            }
+            break;
+        }
+
+        QByteArray frame = m_rxBuffer.left(static_cast<int>(frameLen));
+        m_rxBuffer.remove(0,static_cast<int>(frameLen));
+
+        std::shared_ptr<Request> request;
+        if(m_extractor){
+            quint32 transactionId = 0;
+            if(m_extractor(frame.constData(),frame.size(),&transactionId)){
+                request = m_outstandingIds.value(transactionId);
+            }
+        }else if(!m_outstanding.isEmpty()){
+            request = m_outstanding.first();
+            if(request->late){
+                // late response of timeout request, free its slot
+                dropLate(request);
+                m_unmatchedCount++;
+                continue;
+            }
+        }
+
+        if(!request){
+            // late response of timeout request, or garbage
+            m_unmatchedCount++;
+            continue;
+        }
+        complete(request,RequestSuccess,frame,&completions);
+    }
+
+    sendWaiting(&completions);
+    m_mutex.unlock();
+    finish(completions);
+    flushSending();
+}
+
+int RequestEngine::window()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_window;
+}
+
+void RequestEngine::setWindow(int window)
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_window = window > 0 ? window : REQUEST_DEFAULT_WINDOW;
+    sendWaiting(&completions);
+    m_mutex.unlock();
+    finish(completions);
+    flushSending();
+}
+
+int RequestEngine::outstandingCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_outstanding.size();
+}
+
+int RequestEngine::waitingCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_waiting.size();
+}
+
+quint64 RequestEngine::completedCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_completedCount;
+}
+
+quint64 RequestEngine::timeoutCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_timeoutCount;
+}
+
+quint64 RequestEngine::unmatchedCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_unmatchedCount;
+}
+
+quint16 RequestEngine::nextTransactionId()
+{
+    QMutexLocker locker(&m_mutex);
+    return ++m_transactionId;
+}
+
+RequestSender RequestEngine::tcpSender(TcpClient *client)
+{
+    return [client](const QByteArray &request){
+        // split frame may be cut by a failure, peer would see a partial frame
+        if(request.size() > TCP_DEFAULT_BUF_SIZE){
+            qDebug()<<"Request frame too long! Size: "<<request.size();
+            return false;
+        }
+
+        TCPBuffer buffer;
+        buffer.len = request.size();
+        memcpy(buffer.buffer,request.constData(),static_cast<size_t>(buffer.len));
+        return client->write(buffer);
+    };
+}
+
+RequestSender RequestEngine::serialPortSender(SerialPortClient *client)
+{
+    return [client](const QByteArray &request){
+        // split frame may be cut by a failure, peer would see a partial frame
+        if(request.size() > SERIALPORT_DEFAULT_BUF_SIZE){
+            qDebug()<<"Request frame too long! Size: "<<request.size();
+            return false;
+        }
+
+        SerialPortBuffer buffer;
+        buffer.len = request.size();
+        memcpy(buffer.buffer,request.constData(),static_cast<size_t>(buffer.len));
+        return client->write(buffer);
+    };
+}
+
+qint64 RequestEngine::modbusTcpFrameLength(const char *data, qint64 len)
+{
+    if(len < 6){
+        return 0;
+    }
+
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    // protocol id must be 0, length is unit id and pdu
+    if(p[2] != 0 || p[3] != 0){
+        return -1;
+    }
+    qint64 length = (p[4] << 8) | p[5];
+    if(length < 2 || length > 254){
+        return -1;
+    }
+    return 6 + length;
+}
+
+bool RequestEngine::modbusTcpTransactionId(const char *data, qint64 len, quint32 *transactionId)
+{
+    if(len < 2){
+        return false;
+    }
+
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    *transactionId = static_cast<quint32>((p[0] << 8) | p[1]);
+    return true;
+}
+
+void RequestEngine::startSlot()
+{
+    m_timer->start(REQUEST_DEFAULT_TICK);
+}
+
+void RequestEngine::stopSlot()
+{
+    m_timer->stop();
+}
+
+void RequestEngine::tickSlot()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_wheel.advance();
+    completions.swap(m_expired);
+    sendWaiting(&completions);
+    m_mutex.unlock();
+    finish(completions);
+    flushSending();
+}
+
+void RequestEngine::sendWaiting(CompletionList *completions)
+{
+    if(!m_running){
+        return;
+    }
+
+    for(int i = 0;i < m_waiting.size() && m_outstanding.size() < m_window;){
+        std::shared_ptr<Request> request = m_waiting.at(i);
+        if(request->hasId && m_outstandingIds.contains(request->transactionId)){
+            // same id is outstanding, keep order of this id
+            i++;
+            continue;
+        }
+        m_waiting.removeAt(i);
+
+        // outstanding before sent, response may arrive before sender return
+        request->elapsed.start();
+        std::weak_ptr<Request> weak = request;
+        request->timerId = m_wheel.schedule(request->timeout,[this,weak](){
+            std::shared_ptr<Request> expired = weak.lock();
+            if(expired){
+                complete(expired,RequestTimeout,QByteArray(),&m_expired);
+            }
+        });
+
+        m_outstanding.append(request);
+        if(request->hasId){
+            m_outstandingIds.insert(request->transactionId,request);
+        }
+        m_sending.append(request);
+    }
+}
+
+void RequestEngine::flushSending()
+{
+    m_mutex.lock();
+    if(m_flushing){
+        // other thread is sending, it send our request in order
+        m_mutex.unlock();
+        return;
+    }
+
+    m_flushing = true;
+    while(!m_sending.isEmpty()){
+        QList<std::shared_ptr<Request>> sending;
+        sending.swap(m_sending);
+        m_mutex.unlock();
+
+        // sender may block, never call it with engine lock held
+        QList<std::shared_ptr<Request>> failures;
+        for(const std::shared_ptr<Request> &request : sending){
+            if(!m_sender(request->frame)){
+                failures.append(request);
+            }
+        }
+
+        CompletionList completions;
+        m_mutex.lock();
+        for(const std::shared_ptr<Request> &request : failures){
+            if(!m_outstanding.contains(request)){
+                continue;
+            }
+            if(request->late){
+                // timeout before sender return, not sent so no late response
+                dropLate(request);
+            }else{
+                complete(request,RequestSendFailure,QByteArray(),&completions);
+            }
+        }
+        sendWaiting(&completions);
+        if(!completions.isEmpty()){
+            m_mutex.unlock();
+            finish(completions);
+            m_mutex.lock();
+        }
+    }
+    m_flushing = false;
+    m_mutex.unlock();
+}
+
+void RequestEngine::complete(const std::shared_ptr<Request> &request,
+                             RequestStatus status,
+                             const QByteArray &response,
+                             CompletionList *completions)
+{
+    if(status == RequestTimeout && !m_extractor && m_outstanding.contains(request)){
+        // in order link, late response still come before next one, keep slot until it arrive
+        request->late = true;
+        std::weak_ptr<Request> weak = request;
+        request->timerId = m_wheel.schedule(request->timeout,[this,weak](){
+            std::shared_ptr<Request> late = weak.lock();
+            if(late){
+                dropLate(late);
+            }
+        });
+    }else if(m_outstanding.removeOne(request)){
+        if(request->hasId){
+            m_outstandingIds.remove(request->transactionId);
+        }
+        if(status != RequestTimeout){
+            m_wheel.cancel(request->timerId);
+        }
+    }else{
+        m_waiting.removeOne(request);
+    }
+
+    if(status == RequestSuccess){
+        m_completedCount++;
+    }else if(status == RequestTimeout){
+        m_timeoutCount++;
+    }
+
+    RequestResult result;
+    result.status = status;
+    result.transactionId = request->transactionId;
+    result.response = response;
+    result.elapsed = request->elapsed.isValid() ? request->elapsed.elapsed() : 0;
+    completions->append(std::make_pair(request,result));
+}
+
+void RequestEngine::finish(const CompletionList &completions)
+{
+    for(const std::pair<std::shared_ptr<Request>,RequestResult> &completion : completions){
+        if(completion.first->callback){
+            completion.first->callback(completion.second);
+        }
+    }
+}
+
+void RequestEngine::dropLate(const std::shared_ptr<Request> &request)
+{
+    if(m_outstanding.removeOne(request)){
+        m_wheel.cancel(request->timerId);
+    }
+}
+
+void RequestEngine::abortAll(CompletionList *completions)
+{
+    while(!m_outstanding.isEmpty()){
+        std::shared_ptr<Request> request = m_outstanding.first();
+        if(request->late){
+            // already completed by timeout
+            dropLate(request);
+        }else{
+            complete(request,RequestAborted,QByteArray(),completions);
+        }
+    }
+    while(!m_waiting.isEmpty()){
+        // copy, complete remove it from list
+        std::shared_ptr<Request> request = m_waiting.first();
+        complete(request,RequestAborted,QByteArray(),completions);
+    }
+    m_sending.clear();
+    completions->append(m_expired);
+    m_expired.clear();
+}
@@ -0,0 +1,240 @@
+﻿#ifndef REQUESTENGINE_H
+#define REQUESTENGINE_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "ccl/timerwheel.h"
+#include "ccl/tcpclient.h"
+#include "ccl/serialportclient.h"
+#include "ccl/queue/abstractqueue.h"
+
+#define REQUEST_DEFAULT_WINDOW 1
+#define REQUEST_DEFAULT_TIMEOUT 1000
+#define REQUEST_DEFAULT_TICK 5
+#define REQUEST_DEFAULT_MAX_FRAME_SIZE 4096
+
+enum RequestStatus{
+    RequestSuccess,
+    RequestTimeout,
+    RequestAborted,
+    RequestSendFailure,
+    RequestInvalidResponse
+};
+
+typedef struct RequestResult_TAG{
+    RequestStatus status;
+    quint32 transactionId;
+    QByteArray response;
+    qint64 elapsed;
+}RequestResult;
+
+typedef std::function<void(const RequestResult &result)> RequestCallback;
+
+/**
+ * send one request frame to link, return false if request is not sent.
+ * it is called without engine lock, by one thread at a time in request order,
+ * it may block(e.g. OutboundBlock client), but must not wait response.
+ */
+typedef std::function<bool(const QByteArray &request)> RequestSender;
+
+/**
+ * frame length of response in buffered bytes.
+ * return > 0: frame length, return 0: need more bytes, return < 0: garbage, skip one byte.
+ */
+typedef std::function<qint64(const char * data,qint64 len)> FrameLengthFunction;
+
+/**
+ * extract transaction id of request or response frame, return false if frame has no id.
+ */
+typedef std::function<bool(const char * data,qint64 len,quint32 * transactionId)> TransactionIdExtractor;
+
+/**
+ * correlate request and response over TcpClient or SerialPortClient, pipeline request in window.
+ * 1.request
+ *  call request function with complete request frame, get std::future or callback result.
+ *  at most window request is outstanding, the others wait in engine and are sent when
+ *  response or timeout free the window.
+ * 2.response
+ *  call feed function with received bytes(ResponseThread do it from client queue),
+ *  frame length function split response frame, transaction id extractor match it to request.
+ *  without extractor, response match the oldest outstanding request(in order link, e.g. modbus rtu).
+ * 3.timeout
+ *  every request has own timeout from send, checked by timer wheel in engine thread.
+ *  without extractor, timeout request keep its window slot one more timeout as late slot,
+ *  its late response is dropped there and never match next request.
+ * 4.start and stop
+ *  move engine to a thread, call start function. stop function abort all request.
+ * Warning!!!
+ * 1.callback is called in the thread that feed response or in engine thread for timeout,
+ *   it must not block.
+ * 2.request frame and response frame must carry same transaction id if extractor is used,
+ *   a duplicate outstanding id is sent after the previous one complete.
+ */
+class RequestEngine: public QObject
+{
+    Q_OBJECT
+public:
+    explicit RequestEngine(const RequestSender &sender,
+                           const FrameLengthFunction &frameLength,
+                           const TransactionIdExtractor &extractor = TransactionIdExtractor(),
+                           int window = REQUEST_DEFAULT_WINDOW,
+                           QObject * parent = nullptr);
+    virtual ~RequestEngine() override;
+
+    void start();
+    void stop();
+
+    std::future<RequestResult> request(const QByteArray &frame,
+                                       unsigned long timeout = REQUEST_DEFAULT_TIMEOUT);
+    void request(const QByteArray &frame,
+                 const RequestCallback &callback,
+                 unsigned long timeout = REQUEST_DEFAULT_TIMEOUT);
+
+    void feed(const char * data,qint64 len);
+
+    int window();
+    void setWindow(int window);
+
+    int outstandingCount();
+    int waitingCount();
+
+    quint64 completedCount();
+    quint64 timeoutCount();
+    quint64 unmatchedCount();
+
+    quint16 nextTransactionId();
+
+    /**
+     * frame must fit one client buffer, longer frame is send failure, never sent in part.
+     */
+    static RequestSender tcpSender(TcpClient * client);
+    static RequestSender serialPortSender(SerialPortClient * client);
+
+    /**
+     * modbus tcp: mbap header, transaction id is byte 0-1, length is byte 4-5.
+     */
+    static qint64 modbusTcpFrameLength(const char * data,qint64 len);
+    static bool modbusTcpTransactionId(const char * data,qint64 len,quint32 * transactionId);
+
+signals:
+    void startSignal();
+    void stopSignal();
+
+private slots:
+    void startSlot();
+    void stopSlot();
+
+    void tickSlot();
+
+private:
+    struct Request{
+        quint64 serial;
+        quint32 transactionId;
+        bool hasId;
+        QByteArray frame;
+        unsigned long timeout;
+        RequestCallback callback;
+        quint64 timerId;
+        QElapsedTimer elapsed;
+        // timeout without extractor, wait late response in window
+        bool late;
+    };
+
+    typedef QList<std::pair<std::shared_ptr<Request>,RequestResult>> CompletionList;
+
+    void sendWaiting(CompletionList * completions);
+    void flushSending();
+    void complete(const std::shared_ptr<Request> &request,RequestStatus status,
+                  const QByteArray &response,CompletionList * completions);
+    void finish(const CompletionList &completions);
+    void dropLate(const std::shared_ptr<Request> &request);
+    void abortAll(CompletionList * completions);
+
+    RequestSender m_sender;
+    FrameLengthFunction m_frameLength;
+    TransactionIdExtractor m_extractor;
+    int m_window;
+
+    QList<std::shared_ptr<Request>> m_waiting;
+    QList<std::shared_ptr<Request>> m_outstanding;
+    QHash<quint32,std::shared_ptr<Request>> m_outstandingIds;
+
+    // outstanding request not yet handed to sender, flushed by one thread
+    QList<std::shared_ptr<Request>> m_sending;
+    bool m_flushing;
+
+    QByteArray m_rxBuffer;
+
+    TimerWheel m_wheel;
+    QTimer * m_timer;
+    CompletionList m_expired;
+
+    quint64 m_serial;
+    quint16 m_transactionId;
+    bool m_running;
+
+    quint64 m_completedCount;
+    quint64 m_timeoutCount;
+    quint64 m_unmatchedCount;
+
+    QMutex m_mutex;
+};
+
+/**
+ * read client queue and feed request engine.
+ * T must be buffer with buffer and len member, e.g. TCPBuffer, SerialPortBuffer.
+ * Engine must have feed(data,len) function, e.g. RequestEngine, SerialBus.
+ */
+template<typename T,typename Engine = RequestEngine>
+class ResponseThread: public QThread
+{
+public:
+    ResponseThread(AbstractQueue<T> * queue,Engine * engine,QObject * parent = nullptr);
+
+protected:
+    void run() override;
+
+private:
+    AbstractQueue<T> * m_queue;
+    Engine * m_engine;
+};
+
+template<typename T,typename Engine>
+ResponseThread<T,Engine>::ResponseThread(AbstractQueue<T> *queue,
+                                         Engine *engine,
+                                         QObject *parent)
+    :QThread(parent),
+      m_queue(queue),
+      m_engine(engine)
+{
+
+}
+
+template<typename T,typename Engine>
+void ResponseThread<T,Engine>::run()
+{
+    while(!isInterruptionRequested()){
+        T * buffer = m_queue->peekReadable(REQUEST_DEFAULT_TIMEOUT);
+        if(!buffer){
+            if(m_queue->isAbort()){
+                break;
+            }
+            continue;
+        }
+
+        m_engine->feed(buffer->buffer,buffer->len);
+        m_queue->next(buffer);
+    }
+}
+
+#endif // REQUESTENGINE_H
@@ -0,0 +1,429 @@
+﻿#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <QtGlobal>
+#include <QtEndian>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * compile time layout of protocol frame, decode and encode straight in queue buffer.
+ * 1.frame is a list of element type, offset of every element is known at compile time,
+ *   get and set compile to one load or store with byte swap, no allocation, no copy.
+ * 2.element:
+ *   SchemaField<T,Order>: integer or floating point, default big endian(network order).
+ *   SchemaBits<T,Order,Width...>: integer word split into bit field, first width is lowest bit.
+ *   SchemaBytes<N>: N raw byte, padding or string, read give pointer to first byte.
+ *   SchemaArray<N,E>: N element E, repeated group if E is a SchemaFrame.
+ *   SchemaRepeated<Index,E,Unit>: element E repeated, count is value of field Index before it,
+ *   in item or in byte. it must be the last element of frame.
+ *   SchemaFrame<...>: nested group.
+ * 3.frame:
+ *   Frame::size: byte count of fixed part. Frame::length(data): byte count with repeated part.
+ *   Frame::fits(data,len): check len before read, no other bound check is done.
+ *   Frame::get<I>(data), Frame::set<I>(data,value): element I.
+ *   Frame::bits<I,J>(data), Frame::setBits<I,J>(data,value): bit field J of element I.
+ *   Frame::setAt<I>(data,index,value), Frame::pointer<I>(data,index): item of array element I.
+ * e.g. modbus tcp read holding register response:
+ *   typedef SchemaFrame<SchemaField<quint16>,SchemaField<quint16>,SchemaField<quint16>,
+ *                       SchemaField<quint8>,SchemaField<quint8>,SchemaField<quint8>,
+ *                       SchemaRepeated<5,SchemaField<quint16>,SchemaCountByte>> ReadResponse;
+ *   if(ReadResponse::fits(buffer->buffer,buffer->len)){
+ *       SchemaArrayView<SchemaField<quint16>> registers = ReadResponse::get<6>(buffer->buffer);
+ *       quint16 first = registers.at(0);
+ *   }
+ * Warning!!!
+ * 1.read only after fits return true, frame from wire may be short.
+ * 2.c++17(inline static constexpr member), element index is a compile time constant.
+ */
+
+enum SchemaByteOrder{
+    SchemaLittleEndian,
+    SchemaBigEndian
+};
+
+enum SchemaCountUnit{
+    SchemaCountItem,
+    SchemaCountByte
+};
+
+template<int Size> struct SchemaUnsigned;
+template<> struct SchemaUnsigned<1>{ typedef quint8 type; };
+template<> struct SchemaUnsigned<2>{ typedef quint16 type; };
+template<> struct SchemaUnsigned<4>{ typedef quint32 type; };
+template<> struct SchemaUnsigned<8>{ typedef quint64 type; };
+
+template<typename T,SchemaByteOrder Order>
+inline T schemaLoad(const char * data)
+{
+    typedef typename SchemaUnsigned<sizeof(T)>::type Raw;
+    Raw raw = Order == SchemaBigEndian ? qFromBigEndian<Raw>(data) : qFromLittleEndian<Raw>(data);
+    T value;
+    memcpy(&value,&raw,sizeof(T));
+    return value;
+}
+
+template<typename T,SchemaByteOrder Order>
+inline void schemaStore(char * data,T value)
+{
+    typedef typename SchemaUnsigned<sizeof(T)>::type Raw;
+    Raw raw;
+    memcpy(&raw,&value,sizeof(T));
+    if(Order == SchemaBigEndian){
+        qToBigEndian<Raw>(raw,data);
+    }else{
+        qToLittleEndian<Raw>(raw,data);
+    }
+}
+
+template<typename T,SchemaByteOrder Order = SchemaBigEndian>
+struct SchemaField
+{
+    static_assert(std::is_arithmetic<T>::value,"schema field must be integer or floating point");
+
+    typedef T value_type;
+    static constexpr int size = sizeof(T);
+    static constexpr bool dynamic = false;
+
+    static T read(const char * data)
+    {
+        return schemaLoad<T,Order>(data);
+    }
+
+    static void write(char * data,T value)
+    {
+        schemaStore<T,Order>(data,value);
+    }
+};
+
+template<int N>
+struct SchemaBytes
+{
+    typedef const char * value_type;
+    static constexpr int size = N;
+    static constexpr bool dynamic = false;
+
+    static const char * read(const char * data)
+    {
+        return data;
+    }
+
+    static void write(char * data,const char * value)
+    {
+        memcpy(data,value,N);
+    }
+};
+
+template<int... Width> struct SchemaWidthSum;
+template<> struct SchemaWidthSum<>{ static constexpr int value = 0; };
+template<int Head,int... Tail> struct SchemaWidthSum<Head,Tail...>
+{
+    static constexpr int value = Head + SchemaWidthSum<Tail...>::value;
+};
+
+// shift and width of bit field J
+template<int J,int... Width> struct SchemaBitAt;
+template<int Head,int... Tail> struct SchemaBitAt<0,Head,Tail...>
+{
+    static constexpr int shift = 0;
+    static constexpr int width = Head;
+};
+template<int J,int Head,int... Tail> struct SchemaBitAt<J,Head,Tail...>
+{
+    static constexpr int shift = Head + SchemaBitAt<J - 1,Tail...>::shift;
+    static constexpr int width = SchemaBitAt<J - 1,Tail...>::width;
+};
+
+template<typename T,SchemaByteOrder Order,int... Width>
+struct SchemaBits: public SchemaField<T,Order>
+{
+    static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
+                  "schema bits word must be unsigned integer");
+    static_assert(SchemaWidthSum<Width...>::value <= static_cast<int>(sizeof(T) * 8),
+                  "schema bits wider than word");
+
+    template<int J>
+    static T extract(T word)
+    {
+        typedef SchemaBitAt<J,Width...> Bit;
+        return static_cast<T>((word >> Bit::shift) & mask<J>());
+    }
+
+    template<int J>
+    static T insert(T word,T value)
+    {
+        typedef SchemaBitAt<J,Width...> Bit;
+        T bitMask = static_cast<T>(mask<J>() << Bit::shift);
+        return static_cast<T>((word & ~bitMask) | ((value << Bit::shift) & bitMask));
+    }
+
+    template<int J>
+    static T mask()
+    {
+        typedef SchemaBitAt<J,Width...> Bit;
+        return Bit::width >= static_cast<int>(sizeof(T) * 8) ?
+                    static_cast<T>(~T(0)) : static_cast<T>((quint64(1) << Bit::width) - 1);
+    }
+};
+
+/**
+ * view of repeated element, item is decoded when read.
+ */
+template<typename E>
+class SchemaArrayView
+{
+public:
+    SchemaArrayView(const char * data,int count)
+        :m_data(data),
+          m_count(count)
+    {
+
+    }
+
+    int count() const
+    {
+        return m_count;
+    }
+
+    typename E::value_type at(int index) const
+    {
+        return E::read(m_data + index * E::size);
+    }
+
+    typename E::value_type operator[](int index) const
+    {
+        return at(index);
+    }
+
+    const char * data() const
+    {
+        return m_data;
+    }
+
+private:
+    const char * m_data;
+    int m_count;
+};
+
+template<int N,typename E>
+struct SchemaArray
+{
+    static_assert(!E::dynamic,"schema array element must be fixed size");
+
+    typedef E element_type;
+    typedef SchemaArrayView<E> value_type;
+    static constexpr int size = N * E::size;
+    static constexpr bool dynamic = false;
+
+    static value_type read(const char * data)
+    {
+        return value_type(data,N);
+    }
+};
+
+template<int Index,typename E,SchemaCountUnit Unit = SchemaCountItem>
+struct SchemaRepeated
+{
+    static_assert(!E::dynamic,"schema repeated element must be fixed size");
+
+    typedef E element_type;
+    typedef SchemaArrayView<E> value_type;
+    static constexpr int size = 0;
+    static constexpr bool dynamic = true;
+};
+
+template<int I,typename... E> struct SchemaElementAt;
+template<typename Head,typename... Tail> struct SchemaElementAt<0,Head,Tail...>
+{
+    typedef Head type;
+    static constexpr int offset = 0;
+};
+template<int I,typename Head,typename... Tail> struct SchemaElementAt<I,Head,Tail...>
+{
+    typedef typename SchemaElementAt<I - 1,Tail...>::type type;
+    static constexpr int offset = Head::size + SchemaElementAt<I - 1,Tail...>::offset;
+};
+
+template<typename... E> struct SchemaSizeSum;
+template<> struct SchemaSizeSum<>{ static constexpr int value = 0; };
+template<typename Head,typename... Tail> struct SchemaSizeSum<Head,Tail...>
+{
+    static constexpr int value = Head::size + SchemaSizeSum<Tail...>::value;
+};
+
+template<typename... E> struct SchemaOnlyLastDynamic;
+template<> struct SchemaOnlyLastDynamic<>{ static constexpr bool value = true; };
+template<typename Last> struct SchemaOnlyLastDynamic<Last>{ static constexpr bool value = true; };
+template<typename Head,typename Next,typename... Tail> struct SchemaOnlyLastDynamic<Head,Next,Tail...>
+{
+    static constexpr bool value = !Head::dynamic && SchemaOnlyLastDynamic<Next,Tail...>::value;
+};
+
+template<typename F> class SchemaRecord;
+
+template<typename... E>
+struct SchemaFrame
+{
+    static_assert(sizeof...(E) > 0,"schema frame must have element");
+    static_assert(SchemaOnlyLastDynamic<E...>::value,"only last element of schema frame can be repeated");
+
+    typedef SchemaElementAt<sizeof...(E) - 1,E...> Last;
+    typedef SchemaRecord<SchemaFrame> value_type;
+    static constexpr int size = SchemaSizeSum<E...>::value;
+    static constexpr bool dynamic = Last::type::dynamic;
+
+    template<int I>
+    struct Element
+    {
+        static_assert(I >= 0 && I < static_cast<int>(sizeof...(E)),"schema element index out of range");
+
+        typedef typename SchemaElementAt<I,E...>::type type;
+        typedef typename type::value_type value_type;
+        static constexpr int offset = SchemaElementAt<I,E...>::offset;
+    };
+
+    static value_type read(const char * data);
+
+    static qint64 length(const char * data)
+    {
+        return size + repeatedLength(data,static_cast<const typename Last::type *>(nullptr));
+    }
+
+    static bool fits(const char * data,qint64 len)
+    {
+        return len >= size && len >= length(data);
+    }
+
+    template<int I>
+    static typename Element<I>::value_type get(const char * data)
+    {
+        return readElement(data + Element<I>::offset,data,
+                           static_cast<const typename Element<I>::type *>(nullptr));
+    }
+
+    template<int I>
+    static void set(char * data,typename Element<I>::value_type value)
+    {
+        Element<I>::type::write(data + Element<I>::offset,value);
+    }
+
+    template<int I,int J>
+    static typename Element<I>::value_type bits(const char * data)
+    {
+        return Element<I>::type::template extract<J>(get<I>(data));
+    }
+
+    template<int I,int J>
+    static void setBits(char * data,typename Element<I>::value_type value)
+    {
+        typedef typename Element<I>::type Word;
+        set<I>(data,Word::template insert<J>(get<I>(data),value));
+    }
+
+    template<int I>
+    static char * pointer(char * data,int index = 0)
+    {
+        return data + Element<I>::offset + index * itemSize(static_cast<const typename Element<I>::type *>(nullptr));
+    }
+
+    template<int I>
+    static void setAt(char * data,int index,typename Element<I>::type::element_type::value_type value)
+    {
+        Element<I>::type::element_type::write(pointer<I>(data,index),value);
+    }
+
+private:
+    template<typename T>
+    static typename T::value_type readElement(const char * element,const char *,const T *)
+    {
+        return T::read(element);
+    }
+
+    template<int Index,typename T,SchemaCountUnit Unit>
+    static SchemaArrayView<T> readElement(const char * element,const char * data,
+                                          const SchemaRepeated<Index,T,Unit> *)
+    {
+        return SchemaArrayView<T>(element,repeatedCount<Index,T,Unit>(data));
+    }
+
+    template<int Index,typename T,SchemaCountUnit Unit>
+    static int repeatedCount(const char * data)
+    {
+        static_assert(std::is_integral<typename Element<Index>::value_type>::value,
+                      "schema repeated count must be integer field");
+        int count = static_cast<int>(get<Index>(data));
+        return Unit == SchemaCountByte ? count / T::size : count;
+    }
+
+    template<typename T>
+    static qint64 repeatedLength(const char *,const T *)
+    {
+        return 0;
+    }
+
+    template<int Index,typename T,SchemaCountUnit Unit>
+    static qint64 repeatedLength(const char * data,const SchemaRepeated<Index,T,Unit> *)
+    {
+        return static_cast<qint64>(repeatedCount<Index,T,Unit>(data)) * T::size;
+    }
+
+    template<typename T>
+    static int itemSize(const T *)
+    {
+        return T::size;
+    }
+
+    template<int N,typename T>
+    static int itemSize(const SchemaArray<N,T> *)
+    {
+        return T::size;
+    }
+
+    template<int Index,typename T,SchemaCountUnit Unit>
+    static int itemSize(const SchemaRepeated<Index,T,Unit> *)
+    {
+        return T::size;
+    }
+};
+
+/**
+ * nested group read from array or frame.
+ */
+template<typename F>
+class SchemaRecord
+{
+public:
+    explicit SchemaRecord(const char * data)
+        :m_data(data)
+    {
+
+    }
+
+    template<int I>
+    typename F::template Element<I>::value_type get() const
+    {
+        return F::template get<I>(m_data);
+    }
+
+    template<int I,int J>
+    typename F::template Element<I>::value_type bits() const
+    {
+        return F::template bits<I,J>(m_data);
+    }
+
+    const char * data() const
+    {
+        return m_data;
+    }
+
+private:
+    const char * m_data;
+};
+
+template<typename... E>
+inline typename SchemaFrame<E...>::value_type SchemaFrame<E...>::read(const char *data)
+{
+    return value_type(data);
+}
+
+#endif // SCHEMA_H
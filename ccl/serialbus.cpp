@@ -0,0 +1,674 @@
+﻿#include "serialbus.h"
+#include <QMutexLocker>
+#include <QDebug>
+#include <cstring>
+
+SerialBus::SerialBus(SerialPortClient *client,
+                     const FrameLengthFunction &frameLength,
+                     QObject *parent)
+    :QObject(parent),
+      m_sender(RequestEngine::serialPortSender(client)),
+      m_frameLength(frameLength),
+      m_timing(timing(client->baudRate(),client->dataBits(),client->parity(),client->stopBits())),
+      m_defaultTimeout(SERIALBUS_DEFAULT_TIMEOUT),
+      m_turnaroundDelay(static_cast<qint64>(SERIALBUS_DEFAULT_TURNAROUND) * 1000000),
+      m_maxFailures(SERIALBUS_DEFAULT_MAX_FAILURES),
+      m_backoff(static_cast<qint64>(SERIALBUS_DEFAULT_BACKOFF) * 1000000),
+      m_next(0),
+      m_waitingCount(0),
+      m_writePending(0),
+      m_wireEnd(0),
+      m_lastRxTime(0),
+      m_readyTime(0),
+      m_running(false),
+      m_schedulePending(false),
+      m_statsTime(bufferMetaNow())
+{
+    memset(&m_stats,0,sizeof(m_stats));
+
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer,&QTimer::timeout,this,&SerialBus::tickSlot);
+
+    // direct, written time is taken in client thread, not after a queued hop
+    connect(client,&SerialPortClient::bytesWritten,this,[this](qint64 bytes){
+        written(bytes);
+    },Qt::DirectConnection);
+
+    connect(this,&SerialBus::startSignal,this,&SerialBus::startSlot);
+    connect(this,&SerialBus::stopSignal,this,&SerialBus::stopSlot);
+    // queued, request in callback must not enter tickSlot again
+    connect(this,&SerialBus::scheduleSignal,this,&SerialBus::tickSlot,Qt::QueuedConnection);
+}
+
+SerialBus::~SerialBus()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_running = false;
+    abortAll(&completions);
+    m_mutex.unlock();
+    finish(completions,StateList());
+}
+
+void SerialBus::start()
+{
+    m_mutex.lock();
+    m_running = true;
+    m_readyTime = bufferMetaNow();
+    m_schedulePending = false;
+    m_mutex.unlock();
+
+    emit startSignal();
+}
+
+void SerialBus::stop()
+{
+    CompletionList completions;
+    m_mutex.lock();
+    m_running = false;
+    abortAll(&completions);
+    m_rxBuffer.clear();
+    m_mutex.unlock();
+    finish(completions,StateList());
+
+    emit stopSignal();
+}
+
+std::future<RequestResult> SerialBus::request(int slave, const QByteArray &frame, unsigned long timeout)
+{
+    std::shared_ptr<std::promise<RequestResult>> promise =
+            std::make_shared<std::promise<RequestResult>>();
+    std::future<RequestResult> future = promise->get_future();
+
+    request(slave,frame,[promise](const RequestResult &result){
+        promise->set_value(result);
+    },timeout);
+    return future;
+}
+
+void SerialBus::request(int slave,
+                        const QByteArray &frame,
+                        const RequestCallback &callback,
+                        unsigned long timeout)
+{
+    std::shared_ptr<Request> request = std::make_shared<Request>();
+    request->slave = slave;
+    request->frame = frame;
+    request->timeout = timeout;
+    request->callback = callback;
+    request->sendTime = 0;
+    request->txEnd = 0;
+    request->deadline = 0;
+
+    QMutexLocker locker(&m_mutex);
+    this->slave(slave).waiting.append(request);
+    m_waitingCount++;
+    schedule();
+}
+
+void SerialBus::feed(const char *data, qint64 len, qint64 recvTime)
+{
+    if(len <= 0){
+        return;
+    }
+
+    CompletionList completions;
+    StateList states;
+    m_mutex.lock();
+    m_stats.rxBytes += static_cast<quint64>(len);
+    m_stats.wireTime += len * m_timing.charTime;
+    m_lastRxTime = recvTime;
+    // any byte on bus, even late response, hold the bus for interFrameDelay
+    m_readyTime = qMax(m_readyTime,recvTime + m_timing.interFrameDelay);
+
+    if(!m_current){
+        m_stats.unmatchedBytes += static_cast<quint64>(len);
+    }else{
+        m_rxBuffer.append(data,static_cast<int>(len));
+
+        qint64 frameLen = expectedLength();
+        if(frameLen > 0 && frameLen <= m_rxBuffer.size()){
+            // byte after frame in same transaction is garbage
+            m_stats.unmatchedBytes += static_cast<quint64>(m_rxBuffer.size() - frameLen);
+            m_rxBuffer.truncate(static_cast<int>(frameLen));
+            endFrame(recvTime,&completions,&states);
+        }else if(m_rxBuffer.size() > REQUEST_DEFAULT_MAX_FRAME_SIZE){
+            qDebug()<<"Response frame too long, drop "<<m_rxBuffer.size()<<" bytes";
+            endFrame(recvTime,&completions,&states);
+        }
+    }
+
+    schedule();
+    m_mutex.unlock();
+    finish(completions,states);
+}
+
+void SerialBus::written(qint64 bytes, qint64 writtenTime)
+{
+    if(bytes <= 0){
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    // driver send byte after byte before it, wire is busy until last end
+    m_wireEnd = qMax(m_wireEnd,writtenTime) + bytes * m_timing.charTime;
+    if(!m_writing){
+        return;
+    }
+    m_writePending -= bytes;
+    if(m_writePending > 0){
+        return;
+    }
+
+    std::shared_ptr<Request> request = m_writing;
+    m_writing.reset();
+    m_writePending = 0;
+    request->txEnd = m_wireEnd;
+    if(request->slave == SERIALBUS_BROADCAST){
+        m_readyTime = qMax(m_readyTime,request->txEnd + qMax(m_turnaroundDelay,m_timing.interFrameDelay));
+    }else{
+        m_readyTime = qMax(m_readyTime,request->txEnd + m_timing.interFrameDelay);
+        if(m_current == request){
+            request->deadline = request->txEnd + static_cast<qint64>(request->timeout) * 1000000;
+        }
+    }
+    schedule();
+}
+
+SerialBusTiming SerialBus::timing()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_timing;
+}
+
+void SerialBus::setTiming(const SerialBusTiming &timing)
+{
+    QMutexLocker locker(&m_mutex);
+    m_timing = timing;
+}
+
+void SerialBus::setSlaveTimeout(int slave, unsigned long timeout)
+{
+    QMutexLocker locker(&m_mutex);
+    this->slave(slave).timeout = timeout;
+}
+
+void SerialBus::setDefaultTimeout(unsigned long timeout)
+{
+    QMutexLocker locker(&m_mutex);
+    m_defaultTimeout = timeout > 0 ? timeout : SERIALBUS_DEFAULT_TIMEOUT;
+}
+
+void SerialBus::setTurnaroundDelay(unsigned long turnaroundDelay)
+{
+    QMutexLocker locker(&m_mutex);
+    m_turnaroundDelay = static_cast<qint64>(turnaroundDelay) * 1000000;
+}
+
+void SerialBus::setFailurePolicy(int maxFailures, unsigned long backoff)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxFailures = maxFailures > 0 ? maxFailures : SERIALBUS_DEFAULT_MAX_FAILURES;
+    m_backoff = static_cast<qint64>(backoff) * 1000000;
+}
+
+void SerialBus::setFrameValidator(const FrameValidator &frameValidator)
+{
+    QMutexLocker locker(&m_mutex);
+    m_frameValidator = frameValidator;
+}
+
+int SerialBus::waitingCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_waitingCount;
+}
+
+SerialBusSlaveStats SerialBus::slaveStats(int slave)
+{
+    QMutexLocker locker(&m_mutex);
+    SerialBusSlaveStats stats;
+    memset(&stats,0,sizeof(stats));
+    if(m_slaves.contains(slave)){
+        stats = m_slaves[slave].stats;
+    }
+    return stats;
+}
+
+SerialBusStats SerialBus::stats()
+{
+    QMutexLocker locker(&m_mutex);
+    SerialBusStats stats = m_stats;
+    qint64 elapsed = bufferMetaNow() - m_statsTime;
+    stats.utilization = elapsed > 0 ? static_cast<double>(stats.wireTime) / elapsed : 0;
+    return stats;
+}
+
+void SerialBus::resetStats()
+{
+    QMutexLocker locker(&m_mutex);
+    memset(&m_stats,0,sizeof(m_stats));
+    m_statsTime = bufferMetaNow();
+    for(Slave &slave : m_slaves){
+        bool offline = slave.stats.offline;
+        memset(&slave.stats,0,sizeof(slave.stats));
+        slave.stats.offline = offline;
+    }
+}
+
+SerialBusTiming SerialBus::timing(qint32 baudRate,
+                                  QSerialPort::DataBits dataBits,
+                                  QSerialPort::Parity parity,
+                                  QSerialPort::StopBits stopBits)
+{
+    if(baudRate <= 0){
+        baudRate = QSerialPort::Baud9600;
+    }
+
+    // count in half bit for 1.5 stop bit
+    qint64 halfBits = 2 * (1 + static_cast<int>(dataBits) + (parity == QSerialPort::NoParity ? 0 : 1));
+    switch(stopBits){
+    case QSerialPort::OneAndHalfStop:
+        halfBits += 3;
+        break;
+    case QSerialPort::TwoStop:
+        halfBits += 4;
+        break;
+    default:
+        halfBits += 2;
+        break;
+    }
+
+    SerialBusTiming timing;
+    timing.charTime = halfBits * 500000000 / baudRate;
+    timing.interCharTimeout = timing.charTime * 3 / 2;
+    timing.interFrameDelay = timing.charTime * 7 / 2;
+    return timing;
+}
+
+qint64 SerialBus::modbusRtuFrameLength(const char *data, qint64 len)
+{
+    if(len < 2){
+        return 0;
+    }
+
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    if(p[1] & 0x80){
+        // address, function, exception code, crc
+        return 5;
+    }
+    switch(p[1]){
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x17:
+        if(len < 3){
+            return 0;
+        }
+        return 5 + p[2];
+    case 0x05:
+    case 0x06:
+    case 0x0f:
+    case 0x10:
+        return 8;
+    default:
+        return -1;
+    }
+}
+
+QByteArray SerialBus::modbusRtuRequest(quint8 slave, quint8 function, quint16 address, quint16 count)
+{
+    QByteArray frame(8,0);
+    frame[0] = static_cast<char>(slave);
+    frame[1] = static_cast<char>(function);
+    frame[2] = static_cast<char>(address >> 8);
+    frame[3] = static_cast<char>(address);
+    frame[4] = static_cast<char>(count >> 8);
+    frame[5] = static_cast<char>(count);
+    quint16 crc = Checksum::crc16Modbus(frame.constData(),6);
+    frame[6] = static_cast<char>(crc);
+    frame[7] = static_cast<char>(crc >> 8);
+    return frame;
+}
+
+void SerialBus::startSlot()
+{
+    tickSlot();
+}
+
+void SerialBus::stopSlot()
+{
+    m_timer->stop();
+}
+
+void SerialBus::tickSlot()
+{
+    forever{
+        CompletionList completions;
+        StateList states;
+
+        m_mutex.lock();
+        m_schedulePending = false;
+        if(!m_running){
+            m_mutex.unlock();
+            return;
+        }
+        qint64 now = bufferMetaNow();
+        std::shared_ptr<Request> sending;
+        process(now,&completions,&states,&sending);
+        qint64 next = nextEvent();
+        m_mutex.unlock();
+
+        if(sending){
+            // client write may block on outbound watermark, never hold the lock
+            send(sending,&completions);
+            finish(completions,states);
+            continue;
+        }
+        finish(completions,states);
+
+        if(next < 0){
+            // wait request or response
+            m_timer->stop();
+            return;
+        }
+
+        qint64 wait = next - bufferMetaNow();
+        if(wait <= 0){
+            continue;
+        }
+
+        // round up, never wake before due, event loop keep running meanwhile
+        m_timer->start(static_cast<int>((wait + 999999) / 1000000));
+        return;
+    }
+}
+
+SerialBus::Slave &SerialBus::slave(int address)
+{
+    QHash<int,Slave>::iterator it = m_slaves.find(address);
+    if(it != m_slaves.end()){
+        return it.value();
+    }
+
+    Slave slave;
+    slave.timeout = 0;
+    slave.failures = 0;
+    slave.backoffUntil = 0;
+    memset(&slave.stats,0,sizeof(slave.stats));
+    m_slaves.insert(address,slave);
+    m_order.append(address);
+    return m_slaves[address];
+}
+
+void SerialBus::process(qint64 now, CompletionList *completions, StateList *states,
+                        std::shared_ptr<Request> *sending)
+{
+    if(m_writing && now >= m_writing->deadline){
+        // client never report it written, e.g. port closed, stop hold the bus
+        qDebug()<<"Request not written before timeout! Slave: "<<m_writing->slave;
+        m_writing.reset();
+        m_writePending = 0;
+    }
+
+    if(m_current){
+        if(!m_rxBuffer.isEmpty()){
+            // known length wait rest until deadline, usb adapter deliver byte in burst,
+            // unknown length end by silence
+            bool end = expectedLength() >= 0 ? now >= m_current->deadline :
+                                               now - m_lastRxTime >= m_timing.interFrameDelay;
+            if(end){
+                endFrame(m_lastRxTime,completions,states);
+            }
+        }else if(now >= m_current->deadline){
+            std::shared_ptr<Request> request = m_current;
+            m_current.reset();
+            m_slaves[request->slave].stats.timeouts++;
+            m_stats.timeouts++;
+            fail(request->slave,now,states);
+            complete(request,RequestTimeout,QByteArray(),now,completions);
+        }
+    }
+
+    // request of offline slave fail at once, never queue behind backoff
+    for(Slave &slave : m_slaves){
+        if(slave.backoffUntil <= now){
+            continue;
+        }
+        while(!slave.waiting.isEmpty()){
+            std::shared_ptr<Request> request = slave.waiting.takeFirst();
+            m_waitingCount--;
+            slave.stats.timeouts++;
+            m_stats.timeouts++;
+            complete(request,RequestTimeout,QByteArray(),now,completions);
+        }
+    }
+
+    if(!m_current && !m_writing && now >= m_readyTime){
+        sendNext(now,sending);
+    }
+}
+
+bool SerialBus::sendNext(qint64 now, std::shared_ptr<Request> *sending)
+{
+    int count = m_order.size();
+    for(int i = 0;i < count;i++){
+        int index = (m_next + i) % count;
+        int address = m_order.at(index);
+        Slave &slave = m_slaves[address];
+        if(slave.waiting.isEmpty() || slave.backoffUntil > now){
+            continue;
+        }
+
+        // round robin, a busy slave never starve the others
+        m_next = (index + 1) % count;
+        std::shared_ptr<Request> request = slave.waiting.takeFirst();
+        m_waitingCount--;
+        slave.stats.requests++;
+
+        // txEnd, deadline and ready time from send until client report it written
+        request->timeout = request->timeout > 0 ? request->timeout :
+                           (slave.timeout > 0 ? slave.timeout : m_defaultTimeout);
+        request->sendTime = now;
+        request->txEnd = now + request->frame.size() * m_timing.charTime;
+        request->deadline = request->txEnd + static_cast<qint64>(request->timeout) * 1000000;
+        if(address == SERIALBUS_BROADCAST){
+            // no response, give slave time to process it
+            m_readyTime = request->txEnd + qMax(m_turnaroundDelay,m_timing.interFrameDelay);
+        }else{
+            m_readyTime = request->txEnd + m_timing.interFrameDelay;
+            m_rxBuffer.clear();
+            m_current = request;
+        }
+        m_writing = request;
+        m_writePending = request->frame.size();
+        m_sending = request;
+        *sending = request;
+        return true;
+    }
+    return false;
+}
+
+void SerialBus::send(const std::shared_ptr<Request> &request, CompletionList *completions)
+{
+    bool sent = m_sender(request->frame);
+
+    QMutexLocker locker(&m_mutex);
+    if(m_sending != request){
+        // stop abort it during send, already completed
+        return;
+    }
+    m_sending.reset();
+
+    qint64 now = bufferMetaNow();
+    if(!sent){
+        if(m_writing == request){
+            m_writing.reset();
+            m_writePending = 0;
+        }
+        if(m_current == request){
+            m_current.reset();
+        }else if(request->slave != SERIALBUS_BROADCAST){
+            // response completed it during send
+            return;
+        }
+        complete(request,RequestSendFailure,QByteArray(),now,completions);
+        return;
+    }
+
+    m_stats.txBytes += static_cast<quint64>(request->frame.size());
+    m_stats.wireTime += request->frame.size() * m_timing.charTime;
+    if(request->slave == SERIALBUS_BROADCAST){
+        m_stats.transactions++;
+        complete(request,RequestSuccess,QByteArray(),now,completions);
+    }
+}
+
+void SerialBus::endFrame(qint64 now, CompletionList *completions, StateList *states)
+{
+    std::shared_ptr<Request> request = m_current;
+    m_current.reset();
+    QByteArray response = m_rxBuffer;
+    m_rxBuffer.clear();
+
+    Slave &slave = m_slaves[request->slave];
+    qint64 frameLen = m_frameLength ? m_frameLength(response.constData(),response.size()) : -1;
+    if(frameLen == 0 || frameLen > response.size() ||
+            (m_frameValidator && !m_frameValidator(response.constData(),response.size()))){
+        // slave answered, bad frame is noise or collision, not a failure of slave
+        slave.stats.invalids++;
+        m_stats.invalids++;
+        complete(request,RequestInvalidResponse,response,now,completions);
+        return;
+    }
+
+    slave.failures = 0;
+    slave.backoffUntil = 0;
+    if(slave.stats.offline){
+        slave.stats.offline = false;
+        states->append(std::make_pair(request->slave,true));
+    }
+
+    qint64 latency = qMax(static_cast<qint64>(0),(now - request->txEnd) / 1000);
+    slave.stats.responses++;
+    slave.stats.lastLatency = latency;
+    slave.stats.maxLatency = qMax(slave.stats.maxLatency,latency);
+    m_stats.transactions++;
+    complete(request,RequestSuccess,response,now,completions);
+}
+
+void SerialBus::complete(const std::shared_ptr<Request> &request,
+                         RequestStatus status,
+                         const QByteArray &response,
+                         qint64 now,
+                         CompletionList *completions)
+{
+    RequestResult result;
+    result.status = status;
+    result.transactionId = static_cast<quint32>(request->slave);
+    result.response = response;
+    result.elapsed = request->sendTime > 0 ? (now - request->sendTime) / 1000000 : 0;
+    completions->append(std::make_pair(request,result));
+}
+
+void SerialBus::fail(int address, qint64 now, StateList *states)
+{
+    Slave &slave = m_slaves[address];
+    slave.failures++;
+    if(slave.failures < m_maxFailures){
+        return;
+    }
+
+    // next request after backoff is the probe, one more timeout back off again
+    slave.backoffUntil = now + m_backoff;
+    if(!slave.stats.offline){
+        slave.stats.offline = true;
+        states->append(std::make_pair(address,false));
+    }
+}
+
+qint64 SerialBus::expectedLength()
+{
+    if(!m_frameLength){
+        return -1;
+    }
+    return m_frameLength(m_rxBuffer.constData(),m_rxBuffer.size());
+}
+
+qint64 SerialBus::nextEvent()
+{
+    if(m_current){
+        if(!m_rxBuffer.isEmpty() && expectedLength() < 0){
+            return m_lastRxTime + m_timing.interFrameDelay;
+        }
+        return m_current->deadline;
+    }
+    if(m_writing){
+        // written wake the bus, deadline is the limit
+        return m_writing->deadline;
+    }
+    if(m_waitingCount == 0){
+        return -1;
+    }
+
+    qint64 next = -1;
+    for(const Slave &slave : m_slaves){
+        if(slave.waiting.isEmpty()){
+            continue;
+        }
+        qint64 due = qMax(slave.backoffUntil,m_readyTime);
+        if(next < 0 || due < next){
+            next = due;
+        }
+    }
+    return next;
+}
+
+void SerialBus::schedule()
+{
+    if(m_running && !m_schedulePending){
+        m_schedulePending = true;
+        emit scheduleSignal();
+    }
+}
+
+void SerialBus::finish(const CompletionList &completions, const StateList &states)
+{
+    for(const std::pair<std::shared_ptr<Request>,RequestResult> &completion : completions){
+        if(completion.first->callback){
+            completion.first->callback(completion.second);
+        }
+    }
+    for(const std::pair<int,bool> &state : states){
+        if(state.second){
+            emit slaveOnline(state.first);
+        }else{
+            emit slaveOffline(state.first);
+        }
+    }
+}
+
+void SerialBus::abortAll(CompletionList *completions)
+{
+    qint64 now = bufferMetaNow();
+    if(m_current){
+        complete(m_current,RequestAborted,QByteArray(),now,completions);
+        m_current.reset();
+    }
+    if(m_sending && m_sending->slave == SERIALBUS_BROADCAST){
+        // broadcast has no m_current, complete it here, send skip it
+        complete(m_sending,RequestAborted,QByteArray(),now,completions);
+    }
+    m_sending.reset();
+    m_writing.reset();
+    m_writePending = 0;
+    for(Slave &slave : m_slaves){
+        while(!slave.waiting.isEmpty()){
+            complete(slave.waiting.takeFirst(),RequestAborted,QByteArray(),now,completions);
+        }
+    }
+    m_waitingCount = 0;
+}
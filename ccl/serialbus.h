@@ -0,0 +1,247 @@
+﻿#ifndef SERIALBUS_H
+#define SERIALBUS_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <QSerialPort>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "ccl/requestengine.h"
+#include "ccl/serialportclient.h"
+#include "ccl/checksum.h"
+#include "ccl/buffermeta.h"
+
+#define SERIALBUS_BROADCAST 0
+#define SERIALBUS_DEFAULT_TIMEOUT 100
+#define SERIALBUS_DEFAULT_TURNAROUND 100
+#define SERIALBUS_DEFAULT_MAX_FAILURES 3
+#define SERIALBUS_DEFAULT_BACKOFF 1000
+// wait shorter than it is slept in bus thread, longer one use timer
+
+/**
+ * character timing of serial line in ns.
+ * 1.charTime: start bit + data bit + parity bit + stop bit, over baud rate.
+ * 2.interCharTimeout: 1.5 character, gap inside a frame.
+ * 3.interFrameDelay: 3.5 character, silence between frame(modbus rtu t3.5).
+ */
+typedef struct SerialBusTiming_TAG{
+    qint64 charTime;
+    qint64 interCharTimeout;
+    qint64 interFrameDelay;
+}SerialBusTiming;
+
+/**
+ * latency is from end of request on wire to end of response, in us.
+ */
+typedef struct SerialBusSlaveStats_TAG{
+    quint64 requests;
+    quint64 responses;
+    quint64 timeouts;
+    quint64 invalids;
+    qint64 lastLatency;
+    qint64 maxLatency;
+    bool offline;
+}SerialBusSlaveStats;
+
+/**
+ * wireTime is time of all transmitted and received byte on wire in ns,
+ * utilization is wireTime over time since start or resetStats.
+ */
+typedef struct SerialBusStats_TAG{
+    quint64 transactions;
+    quint64 timeouts;
+    quint64 invalids;
+    quint64 txBytes;
+    quint64 rxBytes;
+    quint64 unmatchedBytes;
+    qint64 wireTime;
+    double utilization;
+}SerialBusStats;
+
+/**
+ * master of half duplex multi drop bus(rs-485) over SerialPortClient, e.g. modbus rtu.
+ * 1.request
+ *  call request function with slave address and complete request frame, every slave has own
+ *  fifo, bus send the head of next slave in round robin, one transaction on bus at a time.
+ *  broadcast(address 0) has no response, bus wait turnaround delay after it.
+ * 2.timing
+ *  next request is sent interFrameDelay after last byte on bus, not a fixed sleep.
+ *  end of request on wire is taken from bytesWritten of client, bytes reach the driver and go out
+ *  after bytes before them, so it is later of written time and last end, plus bytes * charTime.
+ *  timeout of slave count from it, before it is reported it count from send.
+ *  next request wait until request is written, or its timeout if client never report it.
+ *  wait is rounded up to ms of precise timer, bus thread never sleep, e.g. t3.5 of 1.75ms wait 2ms.
+ * 3.response
+ *  call feed function with received bytes(ResponseThread<SerialPortBuffer,SerialBus> do it).
+ *  frame length function end response at once, return 0 wait more byte until timeout,
+ *  short frame is RequestInvalidResponse(usb adapter deliver byte in burst with gap longer than t3.5).
+ *  without it(or return < 0, length unknown) response end after interFrameDelay silence.
+ *  byte received without outstanding request(late response) is dropped but still hold the bus.
+ * 4.failure
+ *  slave timeout maxFailures times in a row is offline, its request fail at once with
+ *  RequestTimeout for backoff ms, then next request probe it.
+ *  other slave never wait for it more than one timeout.
+ *  response fail frame validator is RequestInvalidResponse, not a failure of slave.
+ * e.g.
+ *  bus = new SerialBus(client,SerialBus::modbusRtuFrameLength);
+ *  bus->setFrameValidator(Checksum::validator(ChecksumCrc16Modbus,ChecksumLittleEndian));
+ *  bus->moveToThread(&busThread);
+ *  bus->start();
+ *  bus->request(1,SerialBus::modbusRtuRequest(1,0x03,0,10),callback);
+ * Warning!!!
+ * 1.callback is called in the thread that feed response or in bus thread, it must not block.
+ * 2.timing is taken from client in constructor, call setTiming if client setting is changed.
+ *   modbus rtu ask fixed 1750us interFrameDelay above 19200 baud, set it if slave need.
+ * 3.frame scanner of client must be FrameNone, bus split frame itself.
+ * 4.bus is the only writer of client, other byte written would move end of request.
+ */
+class SerialBus: public QObject
+{
+    Q_OBJECT
+public:
+    explicit SerialBus(SerialPortClient * client,
+                       const FrameLengthFunction &frameLength = FrameLengthFunction(),
+                       QObject * parent = nullptr);
+    virtual ~SerialBus() override;
+
+    void start();
+    void stop();
+
+    std::future<RequestResult> request(int slave,const QByteArray &frame,unsigned long timeout = 0);
+    void request(int slave,const QByteArray &frame,
+                 const RequestCallback &callback,
+                 unsigned long timeout = 0);
+
+    void feed(const char * data,qint64 len,qint64 recvTime = bufferMetaNow());
+
+    /**
+     * bytes of request reached serial port driver, connected to bytesWritten of client in constructor.
+     */
+    void written(qint64 bytes,qint64 writtenTime = bufferMetaNow());
+
+    SerialBusTiming timing();
+    void setTiming(const SerialBusTiming &timing);
+
+    /**
+     * 0 use default timeout.
+     */
+    void setSlaveTimeout(int slave,unsigned long timeout);
+    void setDefaultTimeout(unsigned long timeout);
+    void setTurnaroundDelay(unsigned long turnaroundDelay);
+    void setFailurePolicy(int maxFailures,unsigned long backoff);
+    void setFrameValidator(const FrameValidator &frameValidator);
+
+    int waitingCount();
+    SerialBusSlaveStats slaveStats(int slave);
+    SerialBusStats stats();
+    void resetStats();
+
+    static SerialBusTiming timing(qint32 baudRate,
+                                  QSerialPort::DataBits dataBits,
+                                  QSerialPort::Parity parity,
+                                  QSerialPort::StopBits stopBits);
+
+    /**
+     * modbus rtu: response length from function code, exception is 5 byte,
+     * unknown function return -1 and end by silence.
+     */
+    static qint64 modbusRtuFrameLength(const char * data,qint64 len);
+
+    /**
+     * modbus rtu request of read(0x01-0x04) or write single(0x05,0x06), crc appended.
+     */
+    static QByteArray modbusRtuRequest(quint8 slave,quint8 function,quint16 address,quint16 count);
+
+signals:
+    void startSignal();
+    void stopSignal();
+    void scheduleSignal();
+
+    void slaveOffline(int slave);
+    void slaveOnline(int slave);
+
+private slots:
+    void startSlot();
+    void stopSlot();
+    void tickSlot();
+
+private:
+    struct Request{
+        int slave;
+        QByteArray frame;
+        unsigned long timeout;
+        RequestCallback callback;
+        qint64 sendTime;
+        qint64 txEnd;
+        qint64 deadline;
+    };
+
+    struct Slave{
+        QList<std::shared_ptr<Request>> waiting;
+        unsigned long timeout;
+        int failures;
+        qint64 backoffUntil;
+        SerialBusSlaveStats stats;
+    };
+
+    typedef QList<std::pair<std::shared_ptr<Request>,RequestResult>> CompletionList;
+    typedef QList<std::pair<int,bool>> StateList;
+
+    Slave & slave(int address);
+    void process(qint64 now,CompletionList * completions,StateList * states,
+                 std::shared_ptr<Request> * sending);
+    bool sendNext(qint64 now,std::shared_ptr<Request> * sending);
+    void send(const std::shared_ptr<Request> &request,CompletionList * completions);
+    void endFrame(qint64 now,CompletionList * completions,StateList * states);
+    void complete(const std::shared_ptr<Request> &request,RequestStatus status,
+                  const QByteArray &response,qint64 now,CompletionList * completions);
+    void fail(int address,qint64 now,StateList * states);
+    qint64 expectedLength();
+    qint64 nextEvent();
+    void schedule();
+    void finish(const CompletionList &completions,const StateList &states);
+    void abortAll(CompletionList * completions);
+
+    RequestSender m_sender;
+    FrameLengthFunction m_frameLength;
+    FrameValidator m_frameValidator;
+    SerialBusTiming m_timing;
+
+    unsigned long m_defaultTimeout;
+    qint64 m_turnaroundDelay;
+    int m_maxFailures;
+    qint64 m_backoff;
+
+    QHash<int,Slave> m_slaves;
+    QList<int> m_order;
+    int m_next;
+    int m_waitingCount;
+
+    std::shared_ptr<Request> m_current;
+    // request in sender call, abort complete it, send skip it if it is reset
+    std::shared_ptr<Request> m_sending;
+    // request handed to client and not yet reported written, hold the bus
+    std::shared_ptr<Request> m_writing;
+    qint64 m_writePending;
+    qint64 m_wireEnd;
+    QByteArray m_rxBuffer;
+    qint64 m_lastRxTime;
+    qint64 m_readyTime;
+
+    QTimer * m_timer;
+    bool m_running;
+    bool m_schedulePending;
+
+    SerialBusStats m_stats;
+    qint64 m_statsTime;
+
+    QMutex m_mutex;
+};
+
+#endif // SERIALBUS_H
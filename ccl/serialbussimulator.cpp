@@ -0,0 +1,302 @@
+﻿#include "serialbussimulator.h"
+#include <QMutexLocker>
+#include <QDebug>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+SerialBusSimulator::SerialBusSimulator(const SerialBusTiming &timing, QObject *parent)
+    :QThread(parent),
+      m_timing(timing),
+      m_fd(-1),
+      m_lastFrameEnd(0),
+      m_requestCount(0),
+      m_responseCount(0),
+      m_crcErrorCount(0),
+      m_frameGapViolationCount(0)
+{
+
+}
+
+SerialBusSimulator::~SerialBusSimulator()
+{
+    requestInterruption();
+    wait();
+    close();
+}
+
+bool SerialBusSimulator::open()
+{
+    close();
+
+    m_fd = ::posix_openpt(O_RDWR | O_NOCTTY);
+    if(m_fd < 0){
+        qDebug()<<"Open pty failure! errno: "<<errno;
+        return false;
+    }
+    if(::grantpt(m_fd) != 0 || ::unlockpt(m_fd) != 0){
+        qDebug()<<"Unlock pty failure! errno: "<<errno;
+        close();
+        return false;
+    }
+
+    const char * name = ::ptsname(m_fd);
+    if(!name){
+        close();
+        return false;
+    }
+    m_slavePath = QString::fromLocal8Bit(name);
+    return true;
+}
+
+void SerialBusSimulator::close()
+{
+    if(m_fd >= 0){
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+QString SerialBusSimulator::slavePath() const
+{
+    return m_slavePath;
+}
+
+void SerialBusSimulator::addSlave(int address, qint64 responseDelay)
+{
+    QMutexLocker locker(&m_mutex);
+    Slave slave;
+    slave.responseDelay = responseDelay;
+    slave.silent = false;
+    m_slaves.insert(address,slave);
+}
+
+void SerialBusSimulator::setSilent(int address, bool silent)
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_slaves.contains(address)){
+        m_slaves[address].silent = silent;
+    }
+}
+
+quint64 SerialBusSimulator::requestCount() const
+{
+    return m_requestCount.load();
+}
+
+quint64 SerialBusSimulator::responseCount() const
+{
+    return m_responseCount.load();
+}
+
+quint64 SerialBusSimulator::crcErrorCount() const
+{
+    return m_crcErrorCount.load();
+}
+
+quint64 SerialBusSimulator::frameGapViolationCount() const
+{
+    return m_frameGapViolationCount.load();
+}
+
+qint64 SerialBusSimulator::modbusRtuRequestLength(const char *data, qint64 len)
+{
+    if(len < 2){
+        return 0;
+    }
+
+    const uchar * p = reinterpret_cast<const uchar *>(data);
+    switch(p[1]){
+    case 0x0f:
+    case 0x10:
+        // address, function, start, count, byte count, value, crc
+        if(len < 7){
+            return 0;
+        }
+        return 9 + p[6];
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x05:
+    case 0x06:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+void SerialBusSimulator::run()
+{
+    QByteArray frame;
+    qint64 frameBegin = 0;
+    qint64 lastRxTime = 0;
+    char buffer[256];
+
+    while(!isInterruptionRequested() && m_fd >= 0){
+        struct pollfd fd;
+        fd.fd = m_fd;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        int ret = ::poll(&fd,1,SERIALBUS_SIMULATOR_POLL_INTERVAL);
+        qint64 now = bufferMetaNow();
+
+        if(ret > 0 && (fd.revents & POLLIN)){
+            ssize_t len = ::read(m_fd,buffer,sizeof(buffer));
+            if(len > 0){
+                if(frame.isEmpty()){
+                    frameBegin = now;
+                    if(m_lastFrameEnd > 0 && frameBegin - m_lastFrameEnd < m_timing.interFrameDelay){
+                        m_frameGapViolationCount.fetchAndAddRelaxed(1);
+                    }
+                }
+                frame.append(buffer,static_cast<int>(len));
+                lastRxTime = now;
+            }else{
+                // no port open on slave side yet
+                QThread::msleep(SERIALBUS_SIMULATOR_POLL_INTERVAL);
+            }
+        }else if(ret > 0){
+            QThread::msleep(SERIALBUS_SIMULATOR_POLL_INTERVAL);
+        }
+
+        while(!frame.isEmpty()){
+            qint64 frameLen = modbusRtuRequestLength(frame.constData(),frame.size());
+            bool silence = now - lastRxTime >= m_timing.interFrameDelay;
+            if(frameLen <= 0 || frameLen > frame.size()){
+                if(!silence){
+                    break;
+                }
+                // unknown or short frame end by silence
+                frameLen = frame.size();
+            }
+
+            QByteArray request = frame.left(static_cast<int>(frameLen));
+            frame.remove(0,static_cast<int>(frameLen));
+            handle(request,frameBegin + request.size() * m_timing.charTime);
+            frameBegin = bufferMetaNow();
+            if(!frame.isEmpty()){
+                // next request sent while this one was on bus
+                m_frameGapViolationCount.fetchAndAddRelaxed(1);
+            }
+        }
+    }
+}
+
+void SerialBusSimulator::handle(const QByteArray &frame, qint64 wireEnd)
+{
+    m_requestCount.fetchAndAddRelaxed(1);
+    if(frame.size() < 4){
+        m_crcErrorCount.fetchAndAddRelaxed(1);
+        m_lastFrameEnd = wireEnd;
+        return;
+    }
+
+    const uchar * p = reinterpret_cast<const uchar *>(frame.constData());
+    quint16 crc = static_cast<quint16>(p[frame.size() - 2] | (p[frame.size() - 1] << 8));
+    if(Checksum::crc16Modbus(frame.constData(),frame.size() - 2) != crc){
+        m_crcErrorCount.fetchAndAddRelaxed(1);
+        m_lastFrameEnd = wireEnd;
+        return;
+    }
+
+    int address = p[0];
+    Slave slave;
+    m_mutex.lock();
+    bool answer = address != SERIALBUS_BROADCAST && m_slaves.contains(address);
+    if(answer){
+        slave = m_slaves[address];
+        answer = !slave.silent;
+    }
+    m_mutex.unlock();
+    if(!answer){
+        m_lastFrameEnd = wireEnd;
+        return;
+    }
+
+    QByteArray reply = response(frame);
+    writeFrame(reply,wireEnd + slave.responseDelay * 1000);
+    m_responseCount.fetchAndAddRelaxed(1);
+}
+
+QByteArray SerialBusSimulator::response(const QByteArray &request)
+{
+    const uchar * p = reinterpret_cast<const uchar *>(request.constData());
+    quint8 function = p[1];
+    quint16 address = static_cast<quint16>((p[2] << 8) | p[3]);
+    quint16 count = static_cast<quint16>((p[4] << 8) | p[5]);
+
+    QByteArray reply;
+    reply.append(static_cast<char>(p[0]));
+    switch(function){
+    case 0x01:
+    case 0x02:
+        count = qMin(count,static_cast<quint16>(2000));
+        reply.append(static_cast<char>(function));
+        reply.append(static_cast<char>((count + 7) / 8));
+        reply.append(QByteArray((count + 7) / 8,0x55));
+        break;
+    case 0x03:
+    case 0x04:
+        count = qMin(count,static_cast<quint16>(125));
+        reply.append(static_cast<char>(function));
+        reply.append(static_cast<char>(count * 2));
+        for(quint16 i = 0;i < count;i++){
+            quint16 value = static_cast<quint16>(address + i);
+            reply.append(static_cast<char>(value >> 8));
+            reply.append(static_cast<char>(value));
+        }
+        break;
+    case 0x05:
+    case 0x06:
+        reply = request.left(6);
+        break;
+    default:
+        reply.append(static_cast<char>(function | 0x80));
+        reply.append(static_cast<char>(0x01));
+        break;
+    }
+
+    quint16 crc = Checksum::crc16Modbus(reply.constData(),reply.size());
+    reply.append(static_cast<char>(crc));
+    reply.append(static_cast<char>(crc >> 8));
+    return reply;
+}
+
+void SerialBusSimulator::writeFrame(const QByteArray &frame, qint64 begin)
+{
+    // byte is written when it is out on wire, master see frame arrive as on real line
+    int offset = 0;
+    while(offset < frame.size()){
+        qint64 now = bufferMetaNow();
+        int due = static_cast<int>(qMin(static_cast<qint64>(frame.size()),
+                                        (now - begin) / m_timing.charTime));
+        if(due <= offset){
+            sleepUntil(begin + (offset + 1) * m_timing.charTime);
+            continue;
+        }
+
+        ssize_t len = ::write(m_fd,frame.constData() + offset,static_cast<size_t>(due - offset));
+        if(len < 0){
+            if(errno == EINTR || errno == EAGAIN){
+                continue;
+            }
+            qDebug()<<"Write pty failure! errno: "<<errno;
+            break;
+        }
+        offset += static_cast<int>(len);
+    }
+    m_lastFrameEnd = begin + frame.size() * m_timing.charTime;
+}
+
+void SerialBusSimulator::sleepUntil(qint64 time)
+{
+    qint64 wait = time - bufferMetaNow();
+    while(wait > 0){
+        QThread::usleep(static_cast<unsigned long>((wait + 999) / 1000));
+        wait = time - bufferMetaNow();
+    }
+}
@@ -0,0 +1,90 @@
+﻿#ifndef SERIALBUSSIMULATOR_H
+#define SERIALBUSSIMULATOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QAtomicInteger>
+
+#include "ccl/serialbus.h"
+
+// slave processing time in us
+#define SERIALBUS_SIMULATOR_DEFAULT_RESPONSE_DELAY 1000
+#define SERIALBUS_SIMULATOR_POLL_INTERVAL 1
+
+/**
+ * simulated rs-485 bus on pseudo terminal, modbus rtu slave for test and benchmark of SerialBus.
+ * 1.open function create pty, SerialPortClient open slavePath as real serial port.
+ * 2.request is taken after its wire time, answered after response delay of slave,
+ *   response byte is written when it is out on wire, so bus run as fast as given timing.
+ * 3.slave: read register(0x03,0x04) return register address as value, read bit(0x01,0x02)
+ *   return 0x55, write single(0x05,0x06) is echoed, other function is exception 0x01.
+ *   silent slave and address not added never answer, broadcast is never answered.
+ * 4.counter
+ *  1) frameGapViolations: request begin less than interFrameDelay after previous frame on bus.
+ *  2) crcErrors: request with bad crc, not answered.
+ * e.g.
+ *  SerialBusSimulator simulator(SerialBus::timing(115200,QSerialPort::Data8,
+ *                                                 QSerialPort::NoParity,QSerialPort::OneStop));
+ *  simulator.addSlave(1);
+ *  simulator.open();
+ *  simulator.start();
+ *  client = new SerialPortClient(simulator.slavePath(),QSerialPort::Baud115200,...);
+ * Warning!!!
+ * unix only. add slave before start, stop with requestInterruption and wait.
+ */
+class SerialBusSimulator: public QThread
+{
+public:
+    explicit SerialBusSimulator(const SerialBusTiming &timing,QObject * parent = nullptr);
+    virtual ~SerialBusSimulator() override;
+
+    bool open();
+    void close();
+    QString slavePath() const;
+
+    /**
+     * responseDelay in us.
+     */
+    void addSlave(int address,qint64 responseDelay = SERIALBUS_SIMULATOR_DEFAULT_RESPONSE_DELAY);
+    void setSilent(int address,bool silent);
+
+    quint64 requestCount() const;
+    quint64 responseCount() const;
+    quint64 crcErrorCount() const;
+    quint64 frameGapViolationCount() const;
+
+    static qint64 modbusRtuRequestLength(const char * data,qint64 len);
+
+protected:
+    void run() override;
+
+private:
+    struct Slave{
+        qint64 responseDelay;
+        bool silent;
+    };
+
+    void handle(const QByteArray &frame,qint64 wireEnd);
+    QByteArray response(const QByteArray &request);
+    void writeFrame(const QByteArray &frame,qint64 begin);
+    static void sleepUntil(qint64 time);
+
+    SerialBusTiming m_timing;
+    int m_fd;
+    QString m_slavePath;
+
+    QHash<int,Slave> m_slaves;
+    QMutex m_mutex;
+
+    qint64 m_lastFrameEnd;
+
+    QAtomicInteger<quint64> m_requestCount;
+    QAtomicInteger<quint64> m_responseCount;
+    QAtomicInteger<quint64> m_crcErrorCount;
+    QAtomicInteger<quint64> m_frameGapViolationCount;
+};
+
+#endif // SERIALBUSSIMULATOR_H
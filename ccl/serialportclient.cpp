@@ -1,5 +1,9 @@
 ﻿#include "serialportclient.h"
+#include "trace.h"
 #include <QDebug>
+#include <QThread>
+#include <QElapsedTimer>
+#include <cstring>
 
 SerialPortClient::SerialPortClient(const QString &portName,
                    AbstractQueue<SerialPortBuffer> * queue,
@@ -11,14 +15,12 @@ SerialPortClient::SerialPortClient(const QString &portName,
       m_parity(QSerialPort::Parity::NoParity),
       m_stopBits(QSerialPort::StopBits::OneStop),
       m_flowControl(QSerialPort::FlowControl::NoFlowControl),
-      m_queue(queue)
+      m_queue(queue),
+      m_drainTimeout(SERIALPORT_DEFAULT_DRAIN_TIMEOUT),
+      m_opened(false),
+      m_scanner(FrameNone,SERIALPORT_DEFAULT_BUF_SIZE)
 {
-    m_serialPort = new QSerialPort(this);
-    connect(m_serialPort,&QSerialPort::readyRead,this,&::SerialPortClient::readyReadSlot);
-    connect(m_serialPort,&QSerialPort::errorOccurred,this,&SerialPortClient::errorOccuredSlot);
-    connect(this,&SerialPortClient::startSignal,this,&SerialPortClient::startSlot);
-    connect(this,&SerialPortClient::stopSignal,this,&SerialPortClient::stopSlot);
-    connect(this,&SerialPortClient::writeSignal,this,&SerialPortClient::writeSlot);
+    init();
 }
 
 SerialPortClient::SerialPortClient(const QString &portName,
@@ -36,9 +38,23 @@ SerialPortClient::SerialPortClient(const QString &portName,
       m_parity(parity),
       m_stopBits(stopBits),
       m_flowControl(flowControl),
-      m_queue(queue)
+      m_queue(queue),
+      m_drainTimeout(SERIALPORT_DEFAULT_DRAIN_TIMEOUT),
+      m_opened(false),
+      m_scanner(FrameNone,SERIALPORT_DEFAULT_BUF_SIZE)
 {
+    init();
+}
 
+void SerialPortClient::init()
+{
+    m_serialPort = new QSerialPort(this);
+    connect(m_serialPort,&QSerialPort::readyRead,this,&::SerialPortClient::readyReadSlot);
+    connect(m_serialPort,&QSerialPort::bytesWritten,this,&SerialPortClient::bytesWrittenSlot);
+    connect(m_serialPort,&QSerialPort::errorOccurred,this,&SerialPortClient::errorOccuredSlot);
+    connect(this,&SerialPortClient::startSignal,this,&SerialPortClient::startSlot);
+    connect(this,&SerialPortClient::stopSignal,this,&SerialPortClient::stopSlot);
+    connect(this,&SerialPortClient::writeSignal,this,&SerialPortClient::writeSlot);
 }
 
 void SerialPortClient::start()
@@ -48,11 +64,70 @@ void SerialPortClient::start()
 
 void SerialPortClient::stop()
 {
+    // wake writer blocked in admit
+    m_outbound.abort();
     emit stopSignal();
 }
 
+bool SerialPortClient::write(const SerialPortBuffer &buffer)
+{
+    // never block client thread, it is the thread drain outbound buffer
+    OutboundBuffer::Crossing crossing = OutboundBuffer::NoCrossing;
+    if(!m_outbound.admit(buffer.len,QThread::currentThread() != thread(),&crossing)){
+        return false;
+    }
+    emitCrossing(crossing);
+
+    emit writeSignal(buffer);
+    return true;
+}
+
+bool SerialPortClient::tryWrite(const SerialPortBuffer &buffer, bool *isFull)
+{
+    OutboundBuffer::Crossing crossing = OutboundBuffer::NoCrossing;
+    if(!m_outbound.tryAdmit(buffer.len,isFull,&crossing)){
+        return false;
+    }
+    emitCrossing(crossing);
+
+    emit writeSignal(buffer);
+    return true;
+}
+
+OutboundBuffer *SerialPortClient::outboundBuffer()
+{
+    return &m_outbound;
+}
+
+int SerialPortClient::drainTimeout() const
+{
+    return m_drainTimeout;
+}
+
+void SerialPortClient::setDrainTimeout(int drainTimeout)
+{
+    m_drainTimeout = drainTimeout;
+}
+
+FrameScanner *SerialPortClient::frameScanner()
+{
+    return &m_scanner;
+}
+
+quint32 SerialPortClient::linkId() const
+{
+    return m_stamper.linkId();
+}
+
+void SerialPortClient::setLinkId(quint32 linkId)
+{
+    m_stamper.setLinkId(linkId);
+}
+
 void SerialPortClient::startSlot()
 {
+    m_outbound.reset();
+    m_scanner.reset();
     if(m_serialPort->isOpen()){
         m_serialPort->close();
     }
@@ -63,6 +138,10 @@ void SerialPortClient::startSlot()
     m_serialPort->setParity(m_parity);
     m_serialPort->setStopBits(m_stopBits);
     m_serialPort->setFlowControl(m_flowControl);
+    if(m_opened){
+        m_metrics.reconnects.add();
+    }
+    m_opened = true;
     if(!m_serialPort->open(QIODevice::ReadWrite)){
         // open error
         QString errorString = m_serialPort->errorString();
@@ -74,44 +153,175 @@ void SerialPortClient::startSlot()
 void SerialPortClient::stopSlot()
 {
     if(m_serialPort->isOpen()){
+        drain();
         m_serialPort->close();
     }
+    // serial port write buffer is dropped by close
+    emitCrossing(m_outbound.clear());
+    emitCrossing(m_outbound.resetDevice());
 }
 
 void SerialPortClient::writeSlot(const SerialPortBuffer &buffer)
 {
-    qint64 len = 0;
-    while(len < buffer.len){
-        qint64 lenTmp = m_serialPort->write(buffer.buffer + len,buffer.len - len);
+    emitCrossing(m_outbound.enqueue(QByteArray(buffer.buffer,static_cast<int>(buffer.len))));
+    drainOutbound();
+}
+
+void SerialPortClient::bytesWrittenSlot(qint64 bytes)
+{
+    m_metrics.bytesWritten.add(static_cast<quint64>(bytes));
+    emit bytesWritten(bytes);
+    emitCrossing(m_outbound.written(bytes));
+    drainOutbound();
+}
+
+void SerialPortClient::drainOutbound()
+{
+    // keep serial port write buffer below high watermark, remaining stay in outbound buffer
+    while(m_serialPort->bytesToWrite() < m_outbound.highWatermark() && m_outbound.hasPending()){
+        QByteArray data = m_outbound.takePending();
+        qint64 len = writeData(data.constData(),data.size());
+        m_outbound.handed(len);
+        if(len < data.size()){
+            emitCrossing(m_outbound.discard(data.size() - len));
+        }
+    }
+}
+
+void SerialPortClient::drain()
+{
+    if(m_drainTimeout <= 0){
+        return;
+    }
+
+    // ignore watermark, serial port take all, then wait it written
+    QElapsedTimer timer;
+    timer.start();
+    while(m_outbound.hasPending() || m_serialPort->bytesToWrite() > 0){
+        while(m_outbound.hasPending()){
+            QByteArray data = m_outbound.takePending();
+            qint64 len = writeData(data.constData(),data.size());
+            m_outbound.handed(len);
+            if(len < data.size()){
+                emitCrossing(m_outbound.discard(data.size() - len));
+            }
+        }
+
+        qint64 remaining = m_drainTimeout - timer.elapsed();
+        if(remaining <= 0 || !m_serialPort->waitForBytesWritten(static_cast<int>(remaining))){
+            break;
+        }
+    }
+    if(m_outbound.hasPending() || m_serialPort->bytesToWrite() > 0){
+        qDebug()<<"Drain timeout! Bytes to write: "<<m_serialPort->bytesToWrite()<<
+                  " Port: "<<m_portName;
+    }
+}
+
+qint64 SerialPortClient::writeData(const char *data, qint64 len)
+{
+    qint64 writeLen = 0;
+    while(writeLen < len){
+        qint64 lenTmp = m_serialPort->write(data + writeLen,len - writeLen);
         if(lenTmp < 0){
+            m_metrics.writeErrors.add();
             qDebug()<<"Write buffer failure! buffer: "<<
-                  QByteArray(buffer.buffer + len,
-                         static_cast<int>(buffer.len - len)).toHex();
+                  QByteArray(data + writeLen,
+                         static_cast<int>(len - writeLen)).toHex();
             break;
 
         }
-        len += lenTmp;
+        writeLen += lenTmp;
     }
+    return writeLen;
 }
 
-void SerialPortClient::readyReadSlot()
+void SerialPortClient::emitCrossing(OutboundBuffer::Crossing crossing)
+{
+    if(crossing == OutboundBuffer::CrossHigh){
+        emit highWatermarkReached(m_outbound.outstandingBytes());
+    }else if(crossing == OutboundBuffer::CrossLow){
+        emit lowWatermarkReached(m_outbound.outstandingBytes());
+    }
+}
+
+bool SerialPortClient::readChunk(qint64 recvTime)
 {
     SerialPortBuffer *buffer = m_queue->peekWriteable();
     if(!buffer){
         qDebug()<<"Peek write buffer failure! Please check queue is abort!";
-        return;
+        return false;
     }
     buffer->len = m_serialPort->read(buffer->buffer,SERIALPORT_DEFAULT_BUF_SIZE);
     if(buffer->len < 0){
+        m_metrics.readErrors.add();
         qDebug()<<"SerialPort read failure! Error: "<< m_serialPort->errorString();
         m_queue->next(buffer);
-        return;
+        return false;
     }
+    m_metrics.bytesRead.add(static_cast<quint64>(buffer->len));
+    m_metrics.messagesRead.add();
+    m_stamper.stamp(&buffer->meta,recvTime);
     m_queue->push(buffer);
+    return true;
+}
+
+bool SerialPortClient::readFrame(qint64 recvTime)
+{
+    // read straight into scanner buffer, frame is copied once into queue buffer
+    char * data = m_scanner.reserve(FRAME_DEFAULT_READ_SIZE);
+    qint64 len = m_serialPort->read(data,FRAME_DEFAULT_READ_SIZE);
+    if(len < 0){
+        m_metrics.readErrors.add();
+        qDebug()<<"SerialPort read failure! Error: "<< m_serialPort->errorString();
+        return false;
+    }
+    m_metrics.bytesRead.add(static_cast<quint64>(len));
+
+    m_frames.resize(0);
+    m_scanner.scan(len,&m_frames);
+    for(int i = 0;i < m_frames.size();i++){
+        const FrameView &frame = m_frames.at(i);
+        if(frame.len > SERIALPORT_DEFAULT_BUF_SIZE){
+            qDebug()<<"Frame too long! Length: "<<frame.len;
+            continue;
+        }
+
+        SerialPortBuffer *buffer = m_queue->peekWriteable();
+        if(!buffer){
+            qDebug()<<"Peek write buffer failure! Please check queue is abort!";
+            return false;
+        }
+        memcpy(buffer->buffer,frame.data,static_cast<size_t>(frame.len));
+        buffer->len = frame.len;
+        m_metrics.messagesRead.add();
+        m_stamper.stamp(&buffer->meta,recvTime);
+        m_queue->push(buffer);
+    }
+    return true;
+}
+
+void SerialPortClient::readyReadSlot()
+{
+    CCL_TRACE_SCOPE("SerialPortClient::readyReadSlot");
+
+    // byte read in this slot all arrived before it
+    qint64 recvTime = bufferMetaNow();
+
+    // readyRead is not emitted again for byte left in port, read all of it
+    while(m_serialPort->bytesAvailable() > 0){
+        bool ret = m_scanner.mode() == FrameNone ? readChunk(recvTime) : readFrame(recvTime);
+        if(!ret){
+            return;
+        }
+    }
 }
 
 void SerialPortClient::errorOccuredSlot(QSerialPort::SerialPortError error)
 {
+    if(error != QSerialPort::NoError){
+        m_metrics.errors.add();
+    }
     qDebug()<<"Serial Prot Error: "<<error;
     emit errorOccured(error);
 }
@@ -175,3 +385,8 @@ void SerialPortClient::setPortName(const QString &portName)
 {
     m_portName = portName;
 }
+
+const LinkMetrics *SerialPortClient::linkMetrics() const
+{
+    return &m_metrics;
+}
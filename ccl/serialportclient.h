@@ -1,15 +1,21 @@
-#ifndef SERIALPORTCLIENT_H
+﻿#ifndef SERIALPORTCLIENT_H
 #define SERIALPORTCLIENT_H
 
 #include <QObject>
 #include <QSerialPort>
 #include "queue/abstractqueue.h"
+#include "outboundbuffer.h"
+#include "framescanner.h"
+#include "buffermeta.h"
+#include "metrics.h"
 
 #define SERIALPORT_DEFAULT_BUF_SIZE 1024
+#define SERIALPORT_DEFAULT_DRAIN_TIMEOUT 1000
 
 typedef struct SerialPortBuffer_TAG{
     char buffer[SERIALPORT_DEFAULT_BUF_SIZE];
     qint64 len;
+    BufferMeta meta;
 }SerialPortBuffer;
 
 
@@ -34,7 +40,43 @@ public:
     void start();
     void stop();
 
-    void write(const SerialPortBuffer &buffer);
+    bool write(const SerialPortBuffer &buffer);
+
+    /**
+     * never block, return false and set isFull if OutboundBlock outbound buffer is above high watermark,
+     * try again after lowWatermarkReached, buffer is not counted as dropped. used by coWrite.
+     */
+    bool tryWrite(const SerialPortBuffer &buffer,bool * isFull);
+
+    /**
+     * bounded outbound buffer, set watermark and policy, read drop counter.
+     */
+    OutboundBuffer * outboundBuffer();
+
+    /**
+     * stop hand all admitted buffer to serial port and wait it written up to drainTimeout ms,
+     * before close port. 0 close at once, pending buffer is dropped.
+     */
+    int drainTimeout() const;
+    void setDrainTimeout(int drainTimeout);
+
+    /**
+     * inbound framing, FrameNone(default) push every read chunk as is.
+     * other mode push one frame per buffer, frame longer than SERIALPORT_DEFAULT_BUF_SIZE is dropped.
+     * set mode and validator before start.
+     */
+    FrameScanner * frameScanner();
+
+    /**
+     * link id in meta of every read buffer, unique by default, set before start.
+     */
+    quint32 linkId() const;
+    void setLinkId(quint32 linkId);
+
+    /**
+     * byte, message, error and reconnect counter, export with MetricsRegistry::addLink.
+     */
+    const LinkMetrics * linkMetrics() const;
 
     QString portName() const;
     void setPortName(const QString &portName);
@@ -63,6 +105,14 @@ signals:
     void openFailure(const QString &errorString);
     void errorOccured(QSerialPort::SerialPortError error);
 
+    void highWatermarkReached(qint64 outstandingBytes);
+    void lowWatermarkReached(qint64 outstandingBytes);
+
+    /**
+     * bytes written to serial port driver, emitted in client thread, e.g. SerialBus take wire time from it.
+     */
+    void bytesWritten(qint64 bytes);
+
 private slots:
     void startSlot();
     void stopSlot();
@@ -70,9 +120,18 @@ private slots:
     void writeSlot(const SerialPortBuffer &buffer);
 
     void readyReadSlot();
+    void bytesWrittenSlot(qint64 bytes);
     void errorOccuredSlot(QSerialPort::SerialPortError error);
 
 private:
+    void init();
+    void drainOutbound();
+    void drain();
+    qint64 writeData(const char * data,qint64 len);
+    void emitCrossing(OutboundBuffer::Crossing crossing);
+    bool readChunk(qint64 recvTime);
+    bool readFrame(qint64 recvTime);
+
     QString m_portName;
     QSerialPort::BaudRate m_baudRate;
     QSerialPort::DataBits m_dataBits;
@@ -83,6 +142,17 @@ private:
 
     QSerialPort * m_serialPort;
     AbstractQueue<SerialPortBuffer> *m_queue;
+
+    OutboundBuffer m_outbound;
+    int m_drainTimeout;
+    // first open is not reopen, not counted in reconnects
+    bool m_opened;
+
+    FrameScanner m_scanner;
+    QVector<FrameView> m_frames;
+
+    BufferStamper m_stamper;
+    LinkMetrics m_metrics;
 };
 
 #endif // SERIALPORTCLIENT_H
@@ -0,0 +1,225 @@
+﻿#include "tagstore.h"
+#include "queue/waitstrategy.h"
+#include <QDateTime>
+#include <QMutexLocker>
+#include <atomic>
+#include <cstring>
+
+TagStore::TagStore(int capacity)
+    :m_capacity(capacity > 0 ? capacity : TAG_DEFAULT_CAPACITY),
+      m_count(0),
+      m_version(0),
+      m_published(0)
+{
+    m_seqs = new QAtomicInteger<quint32>[m_capacity];
+    m_values = new QAtomicInteger<quint64>[m_capacity];
+    m_qualities = new QAtomicInteger<quint32>[m_capacity];
+    m_timestamps = new QAtomicInteger<qint64>[m_capacity];
+    m_versions = new QAtomicInteger<quint64>[m_capacity];
+    m_blockVersions = new QAtomicInteger<quint64>[(m_capacity + TAG_BLOCK_SIZE - 1) / TAG_BLOCK_SIZE];
+}
+
+TagStore::~TagStore()
+{
+    delete [] m_seqs;
+    delete [] m_values;
+    delete [] m_qualities;
+    delete [] m_timestamps;
+    delete [] m_versions;
+    delete [] m_blockVersions;
+}
+
+int TagStore::registerTag(const QString &name)
+{
+    QMutexLocker locker(&m_nameMutex);
+    if(m_ids.contains(name)){
+        return m_ids.value(name);
+    }
+    if(m_names.size() >= m_capacity){
+        return -1;
+    }
+
+    int id = m_names.size();
+    m_names.append(name);
+    m_ids.insert(name,id);
+    m_count.storeRelease(id + 1);
+    return id;
+}
+
+int TagStore::tagId(const QString &name)
+{
+    QMutexLocker locker(&m_nameMutex);
+    return m_ids.value(name,-1);
+}
+
+QString TagStore::tagName(int id)
+{
+    QMutexLocker locker(&m_nameMutex);
+    if(id < 0 || id >= m_names.size()){
+        return QString();
+    }
+    return m_names.at(id);
+}
+
+int TagStore::capacity() const
+{
+    return m_capacity;
+}
+
+int TagStore::count() const
+{
+    return m_count.loadAcquire();
+}
+
+bool TagStore::write(int id, double value, quint32 quality, qint64 timestamp)
+{
+    if(id < 0 || id >= m_count.loadAcquire()){
+        return false;
+    }
+
+    TagValue tag;
+    tag.id = id;
+    tag.value = value;
+    tag.quality = quality;
+    tag.timestamp = timestamp;
+
+    quint64 version = m_version.fetchAndAddOrdered(1) + 1;
+    store(tag,version);
+    publish(version,version);
+    return true;
+}
+
+int TagStore::writeBatch(const TagValue *values, int count)
+{
+    if(count <= 0){
+        return 0;
+    }
+
+    // one version range and one publish for whole batch
+    quint64 last = m_version.fetchAndAddOrdered(static_cast<quint64>(count)) +
+            static_cast<quint64>(count);
+    quint64 first = last - static_cast<quint64>(count) + 1;
+    int tagCount = m_count.loadAcquire();
+    int written = 0;
+    for(int i = 0;i < count;i++){
+        if(values[i].id < 0 || values[i].id >= tagCount){
+            continue;
+        }
+        store(values[i],first + static_cast<quint64>(i));
+        written++;
+    }
+    publish(first,last);
+    return written;
+}
+
+bool TagStore::read(int id, TagValue *value) const
+{
+    if(id < 0 || id >= m_count.loadAcquire()){
+        return false;
+    }
+
+    quint64 bits = 0;
+    forever{
+        quint32 seq = m_seqs[id].loadAcquire();
+        if(seq & 1){
+            // writer in progress
+            queueCpuRelax();
+            continue;
+        }
+
+        bits = m_values[id].load();
+        value->quality = m_qualities[id].load();
+        value->timestamp = m_timestamps[id].load();
+        value->version = m_versions[id].load();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(m_seqs[id].load() == seq){
+            break;
+        }
+    }
+
+    value->id = id;
+    memcpy(&value->value,&bits,sizeof(bits));
+    return true;
+}
+
+quint64 TagStore::changedSince(quint64 version, QVector<TagValue> *values) const
+{
+    // every version not greater than published is visible in block version
+    quint64 published = m_published.loadAcquire();
+    int tagCount = m_count.loadAcquire();
+    int blockCount = (tagCount + TAG_BLOCK_SIZE - 1) / TAG_BLOCK_SIZE;
+
+    for(int block = 0;block < blockCount;block++){
+        if(m_blockVersions[block].loadAcquire() <= version){
+            continue;
+        }
+
+        int end = qMin((block + 1) * TAG_BLOCK_SIZE,tagCount);
+        for(int id = block * TAG_BLOCK_SIZE;id < end;id++){
+            if(m_versions[id].loadAcquire() <= version){
+                continue;
+            }
+
+            TagValue value;
+            if(read(id,&value) && value.version > version){
+                values->append(value);
+            }
+        }
+    }
+    return published;
+}
+
+quint64 TagStore::version() const
+{
+    return m_published.loadAcquire();
+}
+
+void TagStore::store(const TagValue &value, quint64 version)
+{
+    int id = value.id;
+    QAtomicInteger<quint32> &seq = m_seqs[id];
+
+    // odd seq lock tag against other writer and mark reader retry
+    forever{
+        quint32 current = seq.load();
+        if(!(current & 1) && seq.testAndSetAcquire(current,current + 1)){
+            break;
+        }
+        queueCpuRelax();
+    }
+    // odd seq visible before any field store, pair with reader acquire fence
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if(m_versions[id].load() < version){
+        quint64 bits = 0;
+        memcpy(&bits,&value.value,sizeof(bits));
+        m_values[id].store(bits);
+        m_qualities[id].store(value.quality);
+        m_timestamps[id].store(value.timestamp != 0 ?
+                                   value.timestamp : QDateTime::currentMSecsSinceEpoch());
+        m_versions[id].store(version);
+
+        QAtomicInteger<quint64> &blockVersion = m_blockVersions[id / TAG_BLOCK_SIZE];
+        quint64 current = blockVersion.load();
+        while(current < version && !blockVersion.testAndSetOrdered(current,version)){
+            current = blockVersion.load();
+        }
+    }
+
+    seq.fetchAndAddRelease(1);
+}
+
+void TagStore::publish(quint64 first, quint64 last)
+{
+    // publish in version order, so published version has no hole
+    int spin = 0;
+    while(m_published.loadAcquire() != first - 1){
+        if(++spin < WAIT_DEFAULT_YIELD_SPIN_COUNT){
+            queueCpuRelax();
+        }else{
+            QThread::yieldCurrentThread();
+        }
+    }
+    m_published.storeRelease(last);
+}
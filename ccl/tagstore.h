@@ -0,0 +1,92 @@
+﻿#ifndef TAGSTORE_H
+#define TAGSTORE_H
+
+#include <QAtomicInteger>
+#include <QHash>
+#include <QString>
+#include <QVector>
+#include <QMutex>
+
+#define TAG_BLOCK_SIZE 64
+#define TAG_DEFAULT_CAPACITY 4096
+
+enum TagQuality{
+    TagBad = 0,
+    TagUncertain = 1,
+    TagGood = 2
+};
+
+typedef struct TagValue_TAG{
+    int id;
+    double value;
+    quint32 quality;
+    qint64 timestamp;
+    quint64 version;
+}TagValue;
+
+/**
+ * in memory tag value of parse stage, read by gui, alarm and historian.
+ * 1.tag
+ *  call registerTag function at setup, return integer tag id from 0, -1 if store is full.
+ *  tag value is struct of array indexed by tag id.
+ * 2.write
+ *  call write or writeBatch function in parse thread, every write get a global version.
+ *  timestamp 0 mean current time(ms since epoch).
+ * 3.read, never lock
+ *  1) call read function get consistent value of one tag.
+ *  2) call changedSince function with version returned last time(0 at first),
+ *     get tag changed since that version, return version for next call.
+ * Warning!!!
+ * 1.registerTag is not thread safe with write, register all tag before start parse thread.
+ * 2.changedSince is at least once, a tag written during the call may be returned again next time.
+ * 3.a write with older version than tag current version is dropped, tag never go back in time.
+ */
+class TagStore
+{
+public:
+    explicit TagStore(int capacity = TAG_DEFAULT_CAPACITY);
+    ~TagStore();
+
+    int registerTag(const QString &name);
+    int tagId(const QString &name);
+    QString tagName(int id);
+
+    int capacity() const;
+    int count() const;
+
+    bool write(int id,double value,quint32 quality = TagGood,qint64 timestamp = 0);
+    int writeBatch(const TagValue * values,int count);
+
+    bool read(int id,TagValue * value) const;
+    quint64 changedSince(quint64 version,QVector<TagValue> * values) const;
+
+    quint64 version() const;
+
+private:
+    Q_DISABLE_COPY(TagStore)
+
+    void store(const TagValue &value,quint64 version);
+    void publish(quint64 first,quint64 last);
+
+    int m_capacity;
+    QAtomicInt m_count;
+
+    // struct of array, one entry per tag
+    QAtomicInteger<quint32> * m_seqs;
+    QAtomicInteger<quint64> * m_values;
+    QAtomicInteger<quint32> * m_qualities;
+    QAtomicInteger<qint64> * m_timestamps;
+    QAtomicInteger<quint64> * m_versions;
+
+    // max version of every TAG_BLOCK_SIZE tag
+    QAtomicInteger<quint64> * m_blockVersions;
+
+    QAtomicInteger<quint64> m_version;
+    QAtomicInteger<quint64> m_published;
+
+    QHash<QString,int> m_ids;
+    QVector<QString> m_names;
+    QMutex m_nameMutex;
+};
+
+#endif // TAGSTORE_H
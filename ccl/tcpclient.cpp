@@ -1,7 +1,16 @@
 ﻿#include "tcpclient.h"
+#include "trace.h"
 #include <QDebug>
 #include <QThread>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
 
 TcpClient::TcpClient(const QString &host,
              quint16 port,
@@ -13,20 +22,39 @@ TcpClient::TcpClient(const QString &host,
       m_queue(queue),
       m_socket(nullptr),
       m_timer(nullptr),
-      m_interval(TCP_DEfAULT_RECONNECT_TIME)
+      m_interval(TCP_DEfAULT_RECONNECT_TIME),
+      m_flushTimer(nullptr),
+      m_coalesceSize(TCP_DEFAULT_COALESCE_SIZE),
+      m_coalesceDelay(TCP_DEFAULT_COALESCE_DELAY),
+      m_noDelay(0),
+      m_cork(0),
+      m_drainTimeout(TCP_DEFAULT_DRAIN_TIMEOUT),
+      m_spool(nullptr),
+      m_replayTimer(nullptr),
+      m_replayRate(TCP_DEFAULT_REPLAY_RATE),
+      m_replayBudget(0),
+      m_replayTime(0),
+      m_replayDeviceBytes(0),
+      m_scanner(FrameNone,TCP_DEFAULT_BUF_SIZE)
 {
     m_socket = new QTcpSocket(this);
     m_timer = new QTimer(this);
+    m_flushTimer = new QTimer(this);
+    m_flushTimer->setSingleShot(true);
+    m_replayTimer = new QTimer(this);
 
     // socket
     qRegisterMetaType<QTcpSocket::SocketState>("QTcpSocket::SocketState");
     connect(m_socket,&QTcpSocket::stateChanged,this,&TcpClient::stateChangedSlot);
     connect(m_socket,&QTcpSocket::readyRead,this,&TcpClient::readyReadSlot);
+    connect(m_socket,&QTcpSocket::bytesWritten,this,&TcpClient::bytesWrittenSlot);
     connect(m_socket,QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error),
         this,&TcpClient::errorSlot);
 
     // timer
     connect(m_timer,&QTimer::timeout,this,&TcpClient::timeoutSlot);
+    connect(m_flushTimer,&QTimer::timeout,this,&TcpClient::flushSlot);
+    connect(m_replayTimer,&QTimer::timeout,this,&TcpClient::replaySlot);
 
     // self
     connect(this,&TcpClient::startSignal,this,&TcpClient::startSlot);
@@ -34,6 +62,8 @@ TcpClient::TcpClient(const QString &host,
 
     // self write
     connect(this,&TcpClient::writeBufferSignal,this,&TcpClient::writeBufferSlot);
+    connect(this,&TcpClient::flushSignal,this,&TcpClient::flushSlot);
+    connect(this,&TcpClient::socketOptionSignal,this,&TcpClient::socketOptionSlot);
 }
 
 TcpClient::~TcpClient()
@@ -41,9 +71,34 @@ TcpClient::~TcpClient()
 
 }
 
-void TcpClient::write(const TCPBuffer &buffer)
+bool TcpClient::write(const TCPBuffer &buffer)
 {
+    // never block client thread, it is the thread drain outbound buffer
+    OutboundBuffer::Crossing crossing = OutboundBuffer::NoCrossing;
+    if(!m_outbound.admit(buffer.len,QThread::currentThread() != thread(),&crossing)){
+        return false;
+    }
+    emitCrossing(crossing);
+
     emit writeBufferSignal(buffer);
+    return true;
+}
+
+bool TcpClient::tryWrite(const TCPBuffer &buffer, bool *isFull)
+{
+    OutboundBuffer::Crossing crossing = OutboundBuffer::NoCrossing;
+    if(!m_outbound.tryAdmit(buffer.len,isFull,&crossing)){
+        return false;
+    }
+    emitCrossing(crossing);
+
+    emit writeBufferSignal(buffer);
+    return true;
+}
+
+void TcpClient::flush()
+{
+    emit flushSignal();
 }
 
 void TcpClient::start()
@@ -53,11 +108,14 @@ void TcpClient::start()
 
 void TcpClient::stop()
 {
+    // wake writer blocked in admit
+    m_outbound.abort();
     emit stopSignal();
 }
 
 void TcpClient::startSlot()
 {
+    m_outbound.reset();
     if(m_socket->state() == QAbstractSocket::ConnectedState){
         m_socket->close();
     }
@@ -68,41 +126,256 @@ void TcpClient::startSlot()
 void TcpClient::stopSlot()
 {
     m_timer->stop();
+    m_replayTimer->stop();
+    flushSlot();
+    drain();
     m_socket->close();
+    emitCrossing(m_outbound.clear());
+    emitCrossing(m_outbound.resetDevice());
 }
 
 void TcpClient::writeBufferSlot(const TCPBuffer &buffer)
 {
-    qint64 len = 0;
+    if(m_coalesceSize <= 0){
+        sendData(buffer.buffer,buffer.len);
+        return;
+    }
+
+    m_pending.append(buffer.buffer,static_cast<int>(buffer.len));
+    if(m_pending.size() >= m_coalesceSize){
+        flushSlot();
+    }else if(!m_flushTimer->isActive()){
+        // delay 0 timeout after all queued write event handled
+        m_flushTimer->start(m_coalesceDelay);
+    }
+}
+
+void TcpClient::flushSlot()
+{
+    m_flushTimer->stop();
+    if(!m_pending.isEmpty()){
+        sendData(m_pending.constData(),m_pending.size());
+        m_pending.clear();
+    }
+
+    // send now, not wait event loop
+    m_socket->flush();
+
+#ifdef Q_OS_LINUX
+    if(m_cork.loadAcquire() && m_socket->state() == QAbstractSocket::ConnectedState){
+        // uncork push out partial segment, then cork again
+        int fd = static_cast<int>(m_socket->socketDescriptor());
+        int off = 0;
+        int on = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_CORK,&off,sizeof(off));
+        setsockopt(fd,IPPROTO_TCP,TCP_CORK,&on,sizeof(on));
+    }
+#endif
+}
+
+void TcpClient::socketOptionSlot()
+{
+    if(m_socket->state() != QAbstractSocket::ConnectedState){
+        // apply when connected
+        return;
+    }
+
+    m_socket->setSocketOption(QAbstractSocket::LowDelayOption,m_noDelay.loadAcquire() ? 1 : 0);
+
+#ifdef Q_OS_LINUX
+    int fd = static_cast<int>(m_socket->socketDescriptor());
+    int cork = m_cork.loadAcquire() ? 1 : 0;
+    if(setsockopt(fd,IPPROTO_TCP,TCP_CORK,&cork,sizeof(cork)) != 0){
+        qDebug()<<"Set TCP_CORK failure! Host: "<<m_host<<" Port: "<<m_port;
+    }
+#endif
+}
+
+void TcpClient::sendData(const char *data, qint64 len)
+{
+    if(m_spool && m_socket->state() != QAbstractSocket::ConnectedState){
+        // peer is down, keep it for replay, admitted byte is released
+        m_spool->append(data,len);
+        emitCrossing(m_outbound.discard(len));
+        return;
+    }
+
+    emitCrossing(m_outbound.enqueue(QByteArray(data,static_cast<int>(len))));
+    drainOutbound();
+}
+
+void TcpClient::drainOutbound()
+{
+    // keep socket write buffer below high watermark, remaining stay in outbound buffer
+    while(m_socket->bytesToWrite() < m_outbound.highWatermark() && m_outbound.hasPending()){
+        handPending();
+    }
+}
+
+void TcpClient::handPending()
+{
+    QByteArray data = m_outbound.takePending();
+    qint64 len = writeData(data.constData(),data.size());
+    m_outbound.handed(len);
+    if(m_spool && len > 0){
+        m_inFlight.append(data.constData(),static_cast<int>(len));
+    }
+    if(len < data.size()){
+        emitCrossing(m_outbound.discard(data.size() - len));
+    }
+}
+
+void TcpClient::drain()
+{
+    if(m_drainTimeout <= 0 || m_socket->state() != QAbstractSocket::ConnectedState){
+        return;
+    }
+
+    // ignore watermark, socket take all, then wait it written
+    QElapsedTimer timer;
+    timer.start();
+    while(m_outbound.hasPending() || m_socket->bytesToWrite() > 0){
+        while(m_outbound.hasPending()){
+            handPending();
+        }
+
+        qint64 remaining = m_drainTimeout - timer.elapsed();
+        if(remaining <= 0 || !m_socket->waitForBytesWritten(static_cast<int>(remaining))){
+            break;
+        }
+    }
+    if(m_outbound.hasPending() || m_socket->bytesToWrite() > 0){
+        qDebug()<<"Drain timeout! Bytes to write: "<<m_socket->bytesToWrite()<<
+                  " Host: "<<m_host<<" Port: "<<m_port;
+    }
+}
+
+qint64 TcpClient::writeData(const char *data, qint64 len)
+{
+    qint64 writeLen = 0;
 
-    while(len < buffer.len){
-        qint64 lenTmp = m_socket->write(buffer.buffer + len,buffer.len - len);
+    while(writeLen < len){
+        qint64 lenTmp = m_socket->write(data + writeLen,len - writeLen);
         if(lenTmp < 0){
+            m_metrics.writeErrors.add();
             qDebug()<<"Write buffer failure! Error:"<<m_socket->errorString()<<
-                  " buffer: "<<QByteArray(buffer.buffer + len,
-                              static_cast<int>(buffer.len - len)).toHex();
+                  " buffer: "<<QByteArray(data + writeLen,
+                              static_cast<int>(len - writeLen)).toHex();
             break;
         }
-        len += lenTmp;
+        writeLen += lenTmp;
     }
+    return writeLen;
 }
 
-void TcpClient::readyReadSlot()
+void TcpClient::spoolPending()
+{
+    while(m_outbound.hasPending()){
+        QByteArray data = m_outbound.takePending();
+        m_spool->append(data.constData(),data.size());
+        emitCrossing(m_outbound.discard(data.size()));
+    }
+}
+
+void TcpClient::emitCrossing(OutboundBuffer::Crossing crossing)
+{
+    if(crossing == OutboundBuffer::CrossHigh){
+        emit highWatermarkReached(m_outbound.outstandingBytes());
+    }else if(crossing == OutboundBuffer::CrossLow){
+        emit lowWatermarkReached(m_outbound.outstandingBytes());
+    }
+}
+
+bool TcpClient::readChunk(qint64 recvTime)
 {
     TCPBuffer *buffer = m_queue->peekWriteable();
     if(!buffer){
         qDebug()<<"Peek write buffer failure! Please check queue is abort!";
-        return;
+        return false;
     }
 
     buffer->len = m_socket->read(buffer->buffer,TCP_DEFAULT_BUF_SIZE);
     if(buffer->len < 0){
+        m_metrics.readErrors.add();
         qDebug()<<"Socket read failure! Error: "<< m_socket->errorString();
         m_queue->next(buffer);
-        return;
+        return false;
     }
 
+    m_metrics.bytesRead.add(static_cast<quint64>(buffer->len));
+    m_metrics.messagesRead.add();
+    m_stamper.stamp(&buffer->meta,recvTime);
     m_queue->push(buffer);
+    return true;
+}
+
+bool TcpClient::readFrame(qint64 recvTime)
+{
+    // read straight into scanner buffer, frame is copied once into queue buffer
+    char * data = m_scanner.reserve(FRAME_DEFAULT_READ_SIZE);
+    qint64 len = m_socket->read(data,FRAME_DEFAULT_READ_SIZE);
+    if(len < 0){
+        m_metrics.readErrors.add();
+        qDebug()<<"Socket read failure! Error: "<< m_socket->errorString();
+        return false;
+    }
+    m_metrics.bytesRead.add(static_cast<quint64>(len));
+
+    m_frames.resize(0);
+    m_scanner.scan(len,&m_frames);
+    for(int i = 0;i < m_frames.size();i++){
+        const FrameView &frame = m_frames.at(i);
+        if(frame.len > TCP_DEFAULT_BUF_SIZE){
+            qDebug()<<"Frame too long! Length: "<<frame.len;
+            continue;
+        }
+
+        TCPBuffer *buffer = m_queue->peekWriteable();
+        if(!buffer){
+            qDebug()<<"Peek write buffer failure! Please check queue is abort!";
+            return false;
+        }
+        memcpy(buffer->buffer,frame.data,static_cast<size_t>(frame.len));
+        buffer->len = frame.len;
+        m_metrics.messagesRead.add();
+        m_stamper.stamp(&buffer->meta,recvTime);
+        m_queue->push(buffer);
+    }
+    return true;
+}
+
+void TcpClient::readyReadSlot()
+{
+    CCL_TRACE_SCOPE("TcpClient::readyReadSlot");
+
+    // byte read in this slot all arrived before it
+    qint64 recvTime = bufferMetaNow();
+
+    // readyRead is not emitted again for byte left in socket, read all of it
+    while(m_socket->bytesAvailable() > 0){
+        bool ret = m_scanner.mode() == FrameNone ? readChunk(recvTime) : readFrame(recvTime);
+        if(!ret){
+            return;
+        }
+    }
+}
+
+void TcpClient::bytesWrittenSlot(qint64 bytes)
+{
+    m_metrics.bytesWritten.add(static_cast<quint64>(bytes));
+
+    // replay go into empty socket only, its byte is ahead of live byte
+    qint64 replayed = qMin(bytes,m_replayDeviceBytes);
+    if(replayed > 0){
+        m_replayDeviceBytes -= replayed;
+        m_spool->acknowledge(replayed);
+    }
+
+    if(m_spool){
+        m_inFlight.remove(0,static_cast<int>(qMin(bytes - replayed,static_cast<qint64>(m_inFlight.size()))));
+    }
+    emitCrossing(m_outbound.written(bytes - replayed));
+    drainOutbound();
 }
 
 void TcpClient::stateChangedSlot(QAbstractSocket::SocketState state)
@@ -111,12 +384,35 @@ void TcpClient::stateChangedSlot(QAbstractSocket::SocketState state)
 
     switch (state) {
     case QTcpSocket::UnconnectedState:
+        // socket write buffer is dropped
+        emitCrossing(m_outbound.resetDevice());
+        if(m_spool){
+            // replayed byte not written is replayed again, live byte not written
+            // and pending buffer wait in spool after it, in order
+            m_replayTimer->stop();
+            m_replayDeviceBytes = 0;
+            m_spool->rewind();
+            if(!m_inFlight.isEmpty()){
+                m_spool->append(m_inFlight.constData(),m_inFlight.size());
+                m_inFlight.clear();
+            }
+            spoolPending();
+        }
+        // partial frame of lost connection never complete
+        m_scanner.reset();
         emit unconnected();
         break;
     case QTcpSocket::ConnectingState:
         emit connecting();
         break;
     case QTcpSocket::ConnectedState:
+        socketOptionSlot();
+        if(m_spool){
+            m_replayBudget = 0;
+            m_replayTime = bufferMetaNow();
+            m_spool->startReplay();
+            m_replayTimer->start(TCP_DEFAULT_REPLAY_TICK);
+        }
         emit connected();
         break;
     case QTcpSocket::ClosingState:
@@ -130,6 +426,7 @@ void TcpClient::stateChangedSlot(QAbstractSocket::SocketState state)
 
 void TcpClient::errorSlot(QAbstractSocket::SocketError socketError)
 {
+    m_metrics.errors.add();
     qDebug()<<"Tcp Socket Error: "<< socketError;
     emit error(socketError);
 }
@@ -137,6 +434,7 @@ void TcpClient::errorSlot(QAbstractSocket::SocketError socketError)
 void TcpClient::timeoutSlot()
 {
     if(m_socket->state() == QTcpSocket::UnconnectedState){
+        m_metrics.reconnects.add();
         m_socket->connectToHost(m_host,m_port);
         if(!m_socket->waitForConnected(m_interval/2)){
             qDebug()<<"Reconnect server failure!"<<
@@ -150,6 +448,43 @@ void TcpClient::timeoutSlot()
     }
 }
 
+void TcpClient::replaySlot()
+{
+    if(!m_spool || m_socket->state() != QAbstractSocket::ConnectedState){
+        m_replayTimer->stop();
+        return;
+    }
+    if(m_spool->isEmpty()){
+        m_spool->stopReplay();
+        m_replayTimer->stop();
+        return;
+    }
+
+    qint64 maxBytes = m_outbound.highWatermark();
+    if(m_replayRate > 0){
+        // token bucket, burst of 100 ms at most
+        qint64 now = bufferMetaNow();
+        qint64 elapsed = qMin(now - m_replayTime,static_cast<qint64>(1000000000));
+        m_replayTime = now;
+        m_replayBudget = qMin(m_replayBudget + elapsed * m_replayRate / 1000000000,
+                              qMax(m_replayRate / 10,static_cast<qint64>(1)));
+        maxBytes = m_replayBudget;
+    }
+
+    // live write first, replay only into empty socket
+    if(maxBytes <= 0 || m_outbound.hasPending() || m_socket->bytesToWrite() > 0){
+        return;
+    }
+
+    m_replay.resize(0);
+    qint64 len = m_spool->take(maxBytes,&m_replay);
+    if(len <= 0){
+        return;
+    }
+    m_replayBudget -= len;
+    m_replayDeviceBytes += writeData(m_replay.constData(),len);
+}
+
 quint16 TcpClient::port() const
 {
     return m_port;
@@ -169,3 +504,100 @@ void TcpClient::setHost(const QString &host)
 {
     m_host = host;
 }
+
+int TcpClient::coalesceSize() const
+{
+    return m_coalesceSize;
+}
+
+void TcpClient::setCoalesceSize(int coalesceSize)
+{
+    m_coalesceSize = coalesceSize;
+}
+
+int TcpClient::coalesceDelay() const
+{
+    return m_coalesceDelay;
+}
+
+void TcpClient::setCoalesceDelay(int coalesceDelay)
+{
+    m_coalesceDelay = coalesceDelay < 0 ? 0 : coalesceDelay;
+}
+
+bool TcpClient::noDelay() const
+{
+    return m_noDelay.loadAcquire() != 0;
+}
+
+void TcpClient::setNoDelay(bool noDelay)
+{
+    m_noDelay.storeRelease(noDelay ? 1 : 0);
+    emit socketOptionSignal();
+}
+
+bool TcpClient::cork() const
+{
+    return m_cork.loadAcquire() != 0;
+}
+
+void TcpClient::setCork(bool cork)
+{
+    m_cork.storeRelease(cork ? 1 : 0);
+    emit socketOptionSignal();
+}
+
+OutboundBuffer *TcpClient::outboundBuffer()
+{
+    return &m_outbound;
+}
+
+int TcpClient::drainTimeout() const
+{
+    return m_drainTimeout;
+}
+
+void TcpClient::setDrainTimeout(int drainTimeout)
+{
+    m_drainTimeout = drainTimeout;
+}
+
+OutboundSpool *TcpClient::spool() const
+{
+    return m_spool;
+}
+
+void TcpClient::setSpool(OutboundSpool *spool)
+{
+    m_spool = spool;
+}
+
+qint64 TcpClient::replayRate() const
+{
+    return m_replayRate;
+}
+
+void TcpClient::setReplayRate(qint64 replayRate)
+{
+    m_replayRate = replayRate < 0 ? 0 : replayRate;
+}
+
+FrameScanner *TcpClient::frameScanner()
+{
+    return &m_scanner;
+}
+
+quint32 TcpClient::linkId() const
+{
+    return m_stamper.linkId();
+}
+
+void TcpClient::setLinkId(quint32 linkId)
+{
+    m_stamper.setLinkId(linkId);
+}
+
+const LinkMetrics *TcpClient::linkMetrics() const
+{
+    return &m_metrics;
+}
@@ -2,19 +2,31 @@
 #define TCPCLIENT_H
 
 #include <QTcpSocket>
+#include <QAtomicInt>
 #include <QMutex>
 #include <QWaitCondition>
 #include <QTimer>
 #include <QHostAddress>
 
 #include "ccl/queue/abstractqueue.h"
+#include "ccl/outboundbuffer.h"
+#include "ccl/outboundspool.h"
+#include "ccl/framescanner.h"
+#include "ccl/buffermeta.h"
+#include "ccl/metrics.h"
 
 #define TCP_DEFAULT_BUF_SIZE 1024
 #define TCP_DEfAULT_RECONNECT_TIME 2000
+#define TCP_DEFAULT_COALESCE_SIZE 0
+#define TCP_DEFAULT_COALESCE_DELAY 0
+#define TCP_DEFAULT_DRAIN_TIMEOUT 1000
+#define TCP_DEFAULT_REPLAY_RATE (1024 * 1024)
+#define TCP_DEFAULT_REPLAY_TICK 10
 
 typedef struct TCPBuffer_TAG{
     char buffer[TCP_DEFAULT_BUF_SIZE];
     qint64 len;
+    BufferMeta meta;
 }TCPBuffer;
 
 class TcpClient: public QObject
@@ -28,7 +40,14 @@ public:
 
     virtual ~TcpClient() override;
 
-    void write(const TCPBuffer &buffer);
+    bool write(const TCPBuffer &buffer);
+
+    /**
+     * never block, return false and set isFull if OutboundBlock outbound buffer is above high watermark,
+     * try again after lowWatermarkReached, buffer is not counted as dropped. used by coWrite.
+     */
+    bool tryWrite(const TCPBuffer &buffer,bool * isFull);
+    void flush();
 
     void start();
 
@@ -40,11 +59,84 @@ public:
     quint16 port() const;
     void setPort(const quint16 &port);
 
+    /**
+     * outbound coalescing, disabled if coalesceSize is 0.
+     * written buffer is gathered, and sent in one syscall when:
+     * 1.gathered size reach coalesceSize.
+     * 2.coalesceDelay ms elapsed, 0 mean send after all queued write handled.
+     * 3.flush function called.
+     */
+    int coalesceSize() const;
+    void setCoalesceSize(int coalesceSize);
+
+    int coalesceDelay() const;
+    void setCoalesceDelay(int coalesceDelay);
+
+    bool noDelay() const;
+    void setNoDelay(bool noDelay);
+
+    /**
+     * TCP_CORK, linux only, corked socket is uncorked for a moment in every flush.
+     */
+    bool cork() const;
+    void setCork(bool cork);
+
+    /**
+     * bounded outbound buffer, set watermark and policy, read drop counter.
+     */
+    OutboundBuffer * outboundBuffer();
+
+    /**
+     * stop hand all admitted buffer to socket and wait it written up to drainTimeout ms,
+     * before close socket. 0 close at once, pending buffer is dropped.
+     */
+    int drainTimeout() const;
+    void setDrainTimeout(int drainTimeout);
+
+    /**
+     * store and forward, disabled if spool is nullptr(default).
+     * 1.buffer written while socket is not connected go to spool instead of closed socket,
+     *   so do pending outbound buffer when connection is lost.
+     * 2.after reconnect spool is replayed at replayRate byte per second, 0 as fast as socket take.
+     *   replay only go into empty socket write buffer, live write never wait behind it,
+     *   order between live and replayed byte is not kept.
+     * 3.byte still in socket write buffer when connection is lost, live or replayed, go back to spool.
+     *   byte is done when bytesWritten report it handed to kernel, replayed byte is acknowledged then.
+     *   byte lost in kernel or network after it is not sent again, at most once from there,
+     *   peer must acknowledge by its protocol if every byte matter.
+     * set before start, open and start spool before, stop it after client.
+     */
+    OutboundSpool * spool() const;
+    void setSpool(OutboundSpool * spool);
+
+    qint64 replayRate() const;
+    void setReplayRate(qint64 replayRate);
+
+    /**
+     * inbound framing, FrameNone(default) push every read chunk as is.
+     * other mode push one frame per buffer, frame longer than TCP_DEFAULT_BUF_SIZE is dropped.
+     * set mode and validator before start.
+     */
+    FrameScanner * frameScanner();
+
+    /**
+     * link id in meta of every read buffer, unique by default, set before start.
+     */
+    quint32 linkId() const;
+    void setLinkId(quint32 linkId);
+
+    /**
+     * byte, message, error and reconnect counter, export with MetricsRegistry::addLink.
+     */
+    const LinkMetrics * linkMetrics() const;
+
 signals:
     void startSignal();
     void stopSignal();
 
     void writeBufferSignal(const TCPBuffer &buffer);
+    void flushSignal();
+    void socketOptionSignal();
 
     void unconnected();
     void connecting();
@@ -53,19 +145,36 @@ signals:
 
     void error(QAbstractSocket::SocketError sockeError);
 
+    void highWatermarkReached(qint64 outstandingBytes);
+    void lowWatermarkReached(qint64 outstandingBytes);
+
 private slots:
     void startSlot();
     void stopSlot();
 
     void writeBufferSlot(const TCPBuffer &buffer);
+    void flushSlot();
+    void socketOptionSlot();
 
     void readyReadSlot();
+    void bytesWrittenSlot(qint64 bytes);
     void stateChangedSlot(QTcpSocket::SocketState state);
     void errorSlot(QAbstractSocket::SocketError socketError);
 
     void timeoutSlot();
+    void replaySlot();
 
 private:
+    void sendData(const char * data,qint64 len);
+    void drainOutbound();
+    void handPending();
+    void drain();
+    qint64 writeData(const char * data,qint64 len);
+    void emitCrossing(OutboundBuffer::Crossing crossing);
+    void spoolPending();
+    bool readChunk(qint64 recvTime);
+    bool readFrame(qint64 recvTime);
+
     QString m_host;
     quint16 m_port;
 
@@ -75,6 +184,33 @@ private:
     QTimer * m_timer;
 
     int m_interval;
+
+    QByteArray m_pending;
+    QTimer * m_flushTimer;
+    int m_coalesceSize;
+    int m_coalesceDelay;
+    // set in caller thread, read in client thread
+    QAtomicInt m_noDelay;
+    QAtomicInt m_cork;
+
+    OutboundBuffer m_outbound;
+    int m_drainTimeout;
+
+    OutboundSpool * m_spool;
+    QTimer * m_replayTimer;
+    qint64 m_replayRate;
+    qint64 m_replayBudget;
+    qint64 m_replayTime;
+    qint64 m_replayDeviceBytes;
+    QByteArray m_replay;
+    // live byte in socket write buffer, spooled if connection is lost before it is written
+    QByteArray m_inFlight;
+
+    FrameScanner m_scanner;
+    QVector<FrameView> m_frames;
+
+    BufferStamper m_stamper;
+    LinkMetrics m_metrics;
 };
 
 #endif // TCPCLIENT_H
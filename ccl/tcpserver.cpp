@@ -0,0 +1,519 @@
+﻿#include "tcpserver.h"
+#include "trace.h"
+#include <QDebug>
+#include <QTimer>
+
+#ifdef Q_OS_UNIX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+#define TCP_SERVER_HAS_REUSEPORT
+#endif
+
+/**
+ * create listening socket with SO_REUSEPORT, return -1 if failure.
+ */
+static qintptr listenReusePort(const QHostAddress &host,quint16 port,QString * errorString)
+{
+#ifdef TCP_SERVER_HAS_REUSEPORT
+    bool isIPv4 = host.protocol() == QAbstractSocket::IPv4Protocol ||
+            host == QHostAddress(QHostAddress::AnyIPv4);
+    int fd = ::socket(isIPv4 ? AF_INET : AF_INET6,SOCK_STREAM,0);
+    if(fd < 0){
+        *errorString = QString("Create socket failure! Error: ") + strerror(errno);
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&on,sizeof(on)) != 0){
+        *errorString = QString("Set SO_REUSEPORT failure! Error: ") + strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+
+    int ret = -1;
+    if(isIPv4){
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(host.toIPv4Address());
+        ret = ::bind(fd,reinterpret_cast<struct sockaddr *>(&addr),sizeof(addr));
+    }else{
+        // any address accept both ipv4 and ipv6
+        int off = 0;
+        setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&off,sizeof(off));
+
+        struct sockaddr_in6 addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(port);
+        if(host != QHostAddress(QHostAddress::Any)){
+            Q_IPV6ADDR ip = host.toIPv6Address();
+            memcpy(&addr.sin6_addr,&ip,sizeof(addr.sin6_addr));
+        }
+        ret = ::bind(fd,reinterpret_cast<struct sockaddr *>(&addr),sizeof(addr));
+    }
+
+    if(ret != 0 || ::listen(fd,TCP_SERVER_DEFAULT_BACKLOG) != 0){
+        *errorString = QString("Bind and listen failure! Error: ") + strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(host)
+    Q_UNUSED(port)
+    *errorString = "SO_REUSEPORT is not supported!";
+    return -1;
+#endif
+}
+
+TcpServer::TcpServer(quint16 port,
+                     AbstractQueue<TCPServerBuffer> *queue,
+                     int ioThreadCount,
+                     QObject *parent)
+    :QObject(parent),
+      m_host(QHostAddress::Any),
+      m_port(port),
+      m_reusePort(true),
+      m_queue(queue),
+      m_connectionSerial(0),
+      m_dispatchIdx(0),
+      m_connectionCount(0)
+{
+    init(ioThreadCount);
+}
+
+TcpServer::TcpServer(quint16 port,
+                     const TcpServerQueueFactory &queueFactory,
+                     int ioThreadCount,
+                     QObject *parent)
+    :QObject(parent),
+      m_host(QHostAddress::Any),
+      m_port(port),
+      m_reusePort(true),
+      m_queue(nullptr),
+      m_queueFactory(queueFactory),
+      m_connectionSerial(0),
+      m_dispatchIdx(0),
+      m_connectionCount(0)
+{
+    init(ioThreadCount);
+}
+
+TcpServer::~TcpServer()
+{
+    for(TcpServerWorker * worker : m_workers){
+        QMetaObject::invokeMethod(worker,[worker](){
+            worker->stopListen();
+            worker->closeAll();
+        },Qt::BlockingQueuedConnection);
+    }
+
+    for(QThread * thread : m_threads){
+        thread->quit();
+        thread->wait();
+    }
+
+    qDeleteAll(m_workers);
+    m_workers.clear();
+}
+
+void TcpServer::init(int ioThreadCount)
+{
+    qRegisterMetaType<QHostAddress>("QHostAddress");
+    qRegisterMetaType<QAbstractSocket::SocketError>("QAbstractSocket::SocketError");
+
+#ifndef TCP_SERVER_HAS_REUSEPORT
+    m_reusePort = false;
+#endif
+
+    ioThreadCount = qBound(1,ioThreadCount,TCP_SERVER_MAX_IO_THREAD);
+    for(int i = 0;i < ioThreadCount;i++){
+        QThread * thread = new QThread(this);
+        TcpServerWorker * worker = new TcpServerWorker(i,this);
+        worker->moveToThread(thread);
+
+        connect(worker,&TcpServerWorker::newConnection,this,&TcpServer::newConnection);
+        connect(worker,&TcpServerWorker::connectionClosed,this,&TcpServer::connectionClosed);
+        connect(worker,&TcpServerWorker::listenFailure,this,&TcpServer::listenFailure);
+        connect(worker,&TcpServerWorker::error,this,&TcpServer::error);
+
+        thread->start();
+        m_threads.append(thread);
+        m_workers.append(worker);
+    }
+}
+
+void TcpServer::start()
+{
+    QHostAddress host = m_host;
+    quint16 port = m_port;
+    bool reusePort = m_reusePort;
+
+    for(int i = 0;i < m_workers.size();i++){
+        if(!reusePort && i > 0){
+            // io thread 0 accept for all
+            break;
+        }
+
+        TcpServerWorker * worker = m_workers.at(i);
+        QMetaObject::invokeMethod(worker,[worker,host,port,reusePort](){
+            worker->listen(host,port,reusePort);
+        },Qt::QueuedConnection);
+    }
+}
+
+void TcpServer::stop()
+{
+    for(TcpServerWorker * worker : m_workers){
+        QMetaObject::invokeMethod(worker,[worker](){
+            worker->stopListen();
+            worker->closeAll();
+        },Qt::QueuedConnection);
+    }
+}
+
+void TcpServer::write(quint64 connectionId, const TCPServerBuffer &buffer)
+{
+    int index = static_cast<int>(connectionId & 0xff);
+    if(index >= m_workers.size()){
+        qDebug()<<"Write buffer failure! Unknown connection: "<<connectionId;
+        return;
+    }
+
+    TcpServerWorker * worker = m_workers.at(index);
+    QMetaObject::invokeMethod(worker,[worker,connectionId,buffer](){
+        worker->write(connectionId,buffer);
+    },Qt::QueuedConnection);
+}
+
+void TcpServer::close(quint64 connectionId)
+{
+    int index = static_cast<int>(connectionId & 0xff);
+    if(index >= m_workers.size()){
+        return;
+    }
+
+    TcpServerWorker * worker = m_workers.at(index);
+    QMetaObject::invokeMethod(worker,[worker,connectionId](){
+        worker->close(connectionId);
+    },Qt::QueuedConnection);
+}
+
+quint64 TcpServer::nextConnectionId(int ioThreadIndex)
+{
+    quint64 serial = m_connectionSerial.fetchAndAddRelaxed(1) + 1;
+    return (serial << 8) | static_cast<quint64>(ioThreadIndex);
+}
+
+void TcpServer::dispatch(qintptr socketDescriptor)
+{
+    int index = (m_dispatchIdx.fetchAndAddRelaxed(1) & 0x7fffffff) % m_workers.size();
+    TcpServerWorker * worker = m_workers.at(index);
+    if(worker->thread() == QThread::currentThread()){
+        worker->addSocket(socketDescriptor);
+        return;
+    }
+
+    QMetaObject::invokeMethod(worker,[worker,socketDescriptor](){
+        worker->addSocket(socketDescriptor);
+    },Qt::QueuedConnection);
+}
+
+int TcpServer::connectionCount() const
+{
+    return m_connectionCount.load();
+}
+
+const LinkMetrics *TcpServer::linkMetrics() const
+{
+    return &m_metrics;
+}
+
+int TcpServer::ioThreadCount() const
+{
+    return m_workers.size();
+}
+
+bool TcpServer::reusePort() const
+{
+    return m_reusePort;
+}
+
+void TcpServer::setReusePort(bool reusePort)
+{
+#ifdef TCP_SERVER_HAS_REUSEPORT
+    m_reusePort = reusePort;
+#else
+    Q_UNUSED(reusePort)
+#endif
+}
+
+quint16 TcpServer::port() const
+{
+    return m_port;
+}
+
+void TcpServer::setPort(const quint16 &port)
+{
+    m_port = port;
+}
+
+QHostAddress TcpServer::host() const
+{
+    return m_host;
+}
+
+void TcpServer::setHost(const QHostAddress &host)
+{
+    m_host = host;
+}
+
+TcpServerAcceptor::TcpServerAcceptor(QObject *parent)
+    :QTcpServer(parent)
+{
+
+}
+
+void TcpServerAcceptor::incomingConnection(qintptr socketDescriptor)
+{
+    emit descriptorReady(socketDescriptor);
+}
+
+TcpServerWorker::TcpServerWorker(int index, TcpServer *server)
+    :QObject(nullptr),
+      m_index(index),
+      m_server(server),
+      m_acceptor(nullptr)
+{
+    m_acceptor = new TcpServerAcceptor(this);
+}
+
+TcpServerWorker::~TcpServerWorker()
+{
+
+}
+
+void TcpServerWorker::listen(const QHostAddress &host, quint16 port, bool reusePort)
+{
+    if(m_acceptor->isListening()){
+        m_acceptor->close();
+    }
+    disconnect(m_acceptor,nullptr,this,nullptr);
+
+    if(reusePort){
+        // kernel balance accept between io thread, keep socket in this thread
+        connect(m_acceptor,&TcpServerAcceptor::descriptorReady,this,&TcpServerWorker::addSocket);
+
+        QString errorString;
+        qintptr fd = listenReusePort(host,port,&errorString);
+        if(fd < 0 || !m_acceptor->setSocketDescriptor(fd)){
+            if(fd >= 0){
+                errorString = m_acceptor->errorString();
+#ifdef Q_OS_UNIX
+                ::close(static_cast<int>(fd));
+#endif
+            }
+            qDebug()<<"TcpServer listen failure! "<<errorString<<" Port: "<<port;
+            emit listenFailure(errorString);
+        }
+        return;
+    }
+
+    TcpServer * server = m_server;
+    connect(m_acceptor,&TcpServerAcceptor::descriptorReady,this,[server](qintptr socketDescriptor){
+        server->dispatch(socketDescriptor);
+    });
+
+    if(!m_acceptor->listen(host,port)){
+        QString errorString = m_acceptor->errorString();
+        qDebug()<<"TcpServer listen failure! "<<errorString<<" Port: "<<port;
+        emit listenFailure(errorString);
+    }
+}
+
+void TcpServerWorker::stopListen()
+{
+    if(m_acceptor->isListening()){
+        m_acceptor->close();
+    }
+}
+
+void TcpServerWorker::addSocket(qintptr socketDescriptor)
+{
+    QTcpSocket * socket = new QTcpSocket(this);
+    // bounded, data beyond it stay in kernel when queue is full
+    socket->setReadBufferSize(TCP_SERVER_DEFAULT_READ_BUFFER_SIZE);
+    if(!socket->setSocketDescriptor(socketDescriptor)){
+        qDebug()<<"Accept socket failure! Error: "<<socket->errorString();
+        delete socket;
+        return;
+    }
+
+    quint64 connectionId = m_server->nextConnectionId(m_index);
+    AbstractQueue<TCPServerBuffer> * queue = m_server->m_queue;
+    if(!queue && m_server->m_queueFactory){
+        queue = m_server->m_queueFactory(connectionId);
+    }
+    if(!queue){
+        qDebug()<<"Create connection queue failure! Close connection: "<<connectionId;
+        socket->abort();
+        delete socket;
+        return;
+    }
+
+    m_sockets.insert(connectionId,socket);
+    m_queues.insert(connectionId,queue);
+    m_stampers.insert(connectionId,BufferStamper());
+    m_server->m_connectionCount.ref();
+
+    connect(socket,&QTcpSocket::readyRead,this,[this,connectionId](){
+        readyRead(connectionId);
+    });
+    connect(socket,&QTcpSocket::disconnected,this,[this,connectionId](){
+        disconnected(connectionId);
+    });
+    connect(socket,QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error),
+            this,[this,connectionId](QAbstractSocket::SocketError socketError){
+        m_server->m_metrics.errors.add();
+        emit error(connectionId,socketError);
+    });
+
+    emit newConnection(connectionId,socket->peerAddress(),socket->peerPort());
+
+    // data may arrive before connect readyRead
+    if(socket->bytesAvailable() > 0){
+        readyRead(connectionId);
+    }
+}
+
+void TcpServerWorker::write(quint64 connectionId, const TCPServerBuffer &buffer)
+{
+    QTcpSocket * socket = m_sockets.value(connectionId,nullptr);
+    if(!socket){
+        qDebug()<<"Write buffer failure! Connection is closed: "<<connectionId;
+        return;
+    }
+
+    qint64 len = 0;
+    while(len < buffer.len){
+        qint64 lenTmp = socket->write(buffer.buffer + len,buffer.len - len);
+        if(lenTmp < 0){
+            m_server->m_metrics.writeErrors.add();
+            qDebug()<<"Write buffer failure! Error:"<<socket->errorString()<<
+                      " connection: "<<connectionId;
+            break;
+        }
+        len += lenTmp;
+    }
+    m_server->m_metrics.bytesWritten.add(static_cast<quint64>(len));
+}
+
+void TcpServerWorker::close(quint64 connectionId)
+{
+    QTcpSocket * socket = m_sockets.value(connectionId,nullptr);
+    if(socket){
+        socket->disconnectFromHost();
+    }
+}
+
+void TcpServerWorker::closeAll()
+{
+    // abort emit disconnected, which remove socket from m_sockets
+    const QList<quint64> connectionIds = m_sockets.keys();
+    for(quint64 connectionId : connectionIds){
+        QTcpSocket * socket = m_sockets.value(connectionId,nullptr);
+        if(socket){
+            socket->abort();
+        }
+        if(m_sockets.contains(connectionId)){
+            disconnected(connectionId);
+        }
+    }
+}
+
+void TcpServerWorker::readyRead(quint64 connectionId)
+{
+    CCL_TRACE_SCOPE("TcpServerWorker::readyRead");
+
+    QTcpSocket * socket = m_sockets.value(connectionId,nullptr);
+    AbstractQueue<TCPServerBuffer> * queue = m_queues.value(connectionId,nullptr);
+    if(!socket || !queue){
+        return;
+    }
+
+    // byte read in this slot all arrived before it
+    qint64 recvTime = bufferMetaNow();
+    BufferStamper &stamper = m_stampers[connectionId];
+
+    // read all, readyRead will not emit again for remaining data
+    while(socket->bytesAvailable() > 0){
+        TCPServerBuffer * buffer = queue->peekWriteable(TCP_SERVER_DEFAULT_PEEK_TIME_OUT);
+        if(!buffer){
+            if(queue->isAbort()){
+                qDebug()<<"Peek write buffer failure! Queue is abort!";
+                return;
+            }
+
+            // queue is full, never block other connection, leave data in socket
+            m_server->m_metrics.queueFull.add();
+            retryRead(connectionId);
+            return;
+        }
+
+        buffer->len = socket->read(buffer->buffer,TCP_DEFAULT_BUF_SIZE);
+        if(buffer->len <= 0){
+            if(buffer->len < 0){
+                m_server->m_metrics.readErrors.add();
+                qDebug()<<"Socket read failure! Error: "<<socket->errorString();
+            }
+            queue->next(buffer);
+            return;
+        }
+
+        buffer->connectionId = connectionId;
+        m_server->m_metrics.bytesRead.add(static_cast<quint64>(buffer->len));
+        m_server->m_metrics.messagesRead.add();
+        stamper.stamp(&buffer->meta,recvTime);
+        queue->push(buffer);
+    }
+}
+
+void TcpServerWorker::retryRead(quint64 connectionId)
+{
+    // readyRead is not emitted for data already in socket, read it again later
+    if(m_retrying.contains(connectionId)){
+        return;
+    }
+
+    m_retrying.insert(connectionId);
+    QTimer::singleShot(TCP_SERVER_DEFAULT_PEEK_TIME_OUT,this,[this,connectionId](){
+        if(m_retrying.remove(connectionId)){
+            readyRead(connectionId);
+        }
+    });
+}
+
+void TcpServerWorker::disconnected(quint64 connectionId)
+{
+    QTcpSocket * socket = m_sockets.take(connectionId);
+    m_queues.remove(connectionId);
+    m_stampers.remove(connectionId);
+    m_retrying.remove(connectionId);
+    if(!socket){
+        return;
+    }
+
+    socket->deleteLater();
+    m_server->m_connectionCount.deref();
+    emit connectionClosed(connectionId);
+}
@@ -0,0 +1,177 @@
+﻿#ifndef TCPSERVER_H
+#define TCPSERVER_H
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QAtomicInteger>
+#include <QHostAddress>
+#include <functional>
+
+#include "ccl/queue/abstractqueue.h"
+#include "ccl/tcpclient.h"
+
+#define TCP_SERVER_DEFAULT_IO_THREAD 1
+#define TCP_SERVER_MAX_IO_THREAD 256
+#define TCP_SERVER_DEFAULT_BACKLOG 128
+#define TCP_SERVER_DEFAULT_PEEK_TIME_OUT 10
+#define TCP_SERVER_DEFAULT_READ_BUFFER_SIZE (64 * TCP_DEFAULT_BUF_SIZE)
+
+typedef struct TCPServerBuffer_TAG{
+    char buffer[TCP_DEFAULT_BUF_SIZE];
+    qint64 len;
+    quint64 connectionId;
+    BufferMeta meta;
+}TCPServerBuffer;
+
+/**
+ * create queue for new connection, called in io thread, must be thread safe.
+ * queue is owned by caller, it is safe to delete queue after connectionClosed signal.
+ */
+typedef std::function<AbstractQueue<TCPServerBuffer> *(quint64 connectionId)> TcpServerQueueFactory;
+
+class TcpServerWorker;
+
+/**
+ * accept many tcp client, read buffer to queue.
+ * 1.queue
+ *  1) shared queue: all connection push to one queue, buffer tagged with connectionId.
+ *  2) connection queue: every connection push to own queue created by queue factory.
+ * 2.io thread
+ *  accepted socket is spread across ioThreadCount io thread.
+ *  if reuse port is supported(linux), every io thread listen with SO_REUSEPORT,
+ *  kernel balance accept, else io thread 0 accept and dispatch socket round robin.
+ * 3.connectionId low 8 bit is io thread index.
+ * 4.every connection is a link, with own link id and sequence in buffer meta.
+ * 5.full queue
+ *  io thread is shared by many connection, never wait queue long. if queue is full
+ *  TCP_SERVER_DEFAULT_PEEK_TIME_OUT ms, data is left in socket and read again later,
+ *  socket read buffer is bounded, so peer is pushed back by tcp window, queueFull is counted.
+ */
+class TcpServer: public QObject
+{
+    Q_OBJECT
+public:
+    TcpServer(quint16 port,
+              AbstractQueue<TCPServerBuffer> * queue,
+              int ioThreadCount = TCP_SERVER_DEFAULT_IO_THREAD,
+              QObject * parent = nullptr);
+
+    TcpServer(quint16 port,
+              const TcpServerQueueFactory &queueFactory,
+              int ioThreadCount = TCP_SERVER_DEFAULT_IO_THREAD,
+              QObject * parent = nullptr);
+
+    virtual ~TcpServer() override;
+
+    void start();
+    void stop();
+
+    void write(quint64 connectionId,const TCPServerBuffer &buffer);
+    void close(quint64 connectionId);
+
+    QHostAddress host() const;
+    void setHost(const QHostAddress &host);
+
+    quint16 port() const;
+    void setPort(const quint16 &port);
+
+    bool reusePort() const;
+    void setReusePort(bool reusePort);
+
+    int ioThreadCount() const;
+    int connectionCount() const;
+
+    /**
+     * counter of all connection, export with MetricsRegistry::addLink.
+     */
+    const LinkMetrics * linkMetrics() const;
+
+signals:
+    void newConnection(quint64 connectionId,const QHostAddress &address,quint16 port);
+    void connectionClosed(quint64 connectionId);
+
+    void listenFailure(const QString &errorString);
+    void error(quint64 connectionId,QAbstractSocket::SocketError socketError);
+
+private:
+    friend class TcpServerWorker;
+
+    void init(int ioThreadCount);
+    quint64 nextConnectionId(int ioThreadIndex);
+    void dispatch(qintptr socketDescriptor);
+
+    QHostAddress m_host;
+    quint16 m_port;
+    bool m_reusePort;
+
+    AbstractQueue<TCPServerBuffer> * m_queue;
+    TcpServerQueueFactory m_queueFactory;
+
+    QVector<QThread *> m_threads;
+    QVector<TcpServerWorker *> m_workers;
+
+    QAtomicInteger<quint64> m_connectionSerial;
+    QAtomicInt m_dispatchIdx;
+    QAtomicInt m_connectionCount;
+
+    LinkMetrics m_metrics;
+};
+
+class TcpServerAcceptor: public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit TcpServerAcceptor(QObject * parent = nullptr);
+
+signals:
+    void descriptorReady(qintptr socketDescriptor);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+};
+
+/**
+ * io thread of TcpServer, only used by TcpServer.
+ */
+class TcpServerWorker: public QObject
+{
+    Q_OBJECT
+public:
+    TcpServerWorker(int index,TcpServer * server);
+    virtual ~TcpServerWorker() override;
+
+    void listen(const QHostAddress &host,quint16 port,bool reusePort);
+    void stopListen();
+    void addSocket(qintptr socketDescriptor);
+
+    void write(quint64 connectionId,const TCPServerBuffer &buffer);
+    void close(quint64 connectionId);
+    void closeAll();
+
+signals:
+    void newConnection(quint64 connectionId,const QHostAddress &address,quint16 port);
+    void connectionClosed(quint64 connectionId);
+
+    void listenFailure(const QString &errorString);
+    void error(quint64 connectionId,QAbstractSocket::SocketError socketError);
+
+private:
+    void readyRead(quint64 connectionId);
+    void retryRead(quint64 connectionId);
+    void disconnected(quint64 connectionId);
+
+    int m_index;
+    TcpServer * m_server;
+    TcpServerAcceptor * m_acceptor;
+
+    QHash<quint64,QTcpSocket *> m_sockets;
+    QHash<quint64,AbstractQueue<TCPServerBuffer> *> m_queues;
+    QHash<quint64,BufferStamper> m_stampers;
+    QSet<quint64> m_retrying;
+};
+
+#endif // TCPSERVER_H
@@ -0,0 +1,239 @@
+﻿#include "timerwheel.h"
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOT - 1)
+
+TimerWheel::TimerWheel(int tick)
+    :m_tick(tick > 0 ? tick : TIMER_WHEEL_DEFAULT_TICK),
+      m_current(0),
+      m_serial(0),
+      m_firing(false),
+      m_overflow(nullptr)
+{
+    for(int level = 0;level < TIMER_WHEEL_LEVEL;level++){
+        for(int slot = 0;slot < TIMER_WHEEL_SLOT;slot++){
+            m_slots[level][slot] = nullptr;
+        }
+    }
+    m_clock.start();
+}
+
+TimerWheel::~TimerWheel()
+{
+    for(Node * node : m_nodes){
+        delete node;
+    }
+    m_nodes.clear();
+}
+
+quint64 TimerWheel::schedule(quint64 delay, const Callback &callback)
+{
+    quint64 current = now();
+    // saturate, huge delay never wrap to past
+    quint64 expire = delay > ~Q_UINT64_C(0) - current ? ~Q_UINT64_C(0) : current + delay;
+    return scheduleAt(expire,callback);
+}
+
+quint64 TimerWheel::scheduleAt(quint64 expire, const Callback &callback)
+{
+    Node * node = new Node;
+    node->id = ++m_serial;
+    // round up, timer never fire early, division first so huge expire never wrap
+    quint64 tick = static_cast<quint64>(m_tick);
+    node->expire = expire / tick + (expire % tick != 0 ? 1 : 0);
+    node->callback = callback;
+    node->prev = nullptr;
+    node->next = nullptr;
+    node->head = nullptr;
+
+    m_nodes.insert(node->id,node);
+    add(node);
+    return node->id;
+}
+
+bool TimerWheel::cancel(quint64 id)
+{
+    Node * node = m_nodes.take(id);
+    if(!node){
+        return false;
+    }
+
+    unlink(node);
+    delete node;
+    return true;
+}
+
+bool TimerWheel::contains(quint64 id) const
+{
+    return m_nodes.contains(id);
+}
+
+int TimerWheel::advance()
+{
+    return advance(now());
+}
+
+int TimerWheel::advance(quint64 now)
+{
+    quint64 target = now / static_cast<quint64>(m_tick);
+    int fired = 0;
+
+    while(m_current <= target){
+        if(m_nodes.isEmpty()){
+            // nothing to cascade, jump to target
+            m_current = target + 1;
+            break;
+        }
+        fired += expireTick();
+        m_current++;
+    }
+    return fired;
+}
+
+quint64 TimerWheel::now() const
+{
+    return static_cast<quint64>(m_clock.elapsed());
+}
+
+int TimerWheel::tick() const
+{
+    return m_tick;
+}
+
+int TimerWheel::count() const
+{
+    return m_nodes.size();
+}
+
+qint64 TimerWheel::nextExpire() const
+{
+    if(m_nodes.isEmpty()){
+        return -1;
+    }
+
+    qint64 current = static_cast<qint64>(now());
+    quint64 expire = 0;
+    bool found = false;
+    for(int i = 0;i < TIMER_WHEEL_SLOT;i++){
+        quint64 tickIdx = m_current + static_cast<quint64>(i);
+        if(i > 0 && (tickIdx & TIMER_WHEEL_SLOT_MASK) == 0){
+            // next slot need cascade first
+            expire = tickIdx;
+            found = true;
+            break;
+        }
+        if(m_slots[0][tickIdx & TIMER_WHEEL_SLOT_MASK]){
+            expire = tickIdx;
+            found = true;
+            break;
+        }
+    }
+    if(!found){
+        expire = m_current + TIMER_WHEEL_SLOT;
+    }
+
+    qint64 ret = static_cast<qint64>(expire * static_cast<quint64>(m_tick)) - current;
+    return ret > 0 ? ret : 0;
+}
+
+void TimerWheel::add(Node *node)
+{
+    quint64 minExpire = m_firing ? m_current + 1 : m_current;
+    if(node->expire < minExpire){
+        node->expire = minExpire;
+    }
+
+    quint64 delta = node->expire - m_current;
+    Node ** head = &m_overflow;
+    for(int level = 0;level < TIMER_WHEEL_LEVEL;level++){
+        int bits = TIMER_WHEEL_SLOT_BITS * (level + 1);
+        if(delta < (Q_UINT64_C(1) << bits)){
+            int slot = static_cast<int>((node->expire >> (TIMER_WHEEL_SLOT_BITS * level)) &
+                                        TIMER_WHEEL_SLOT_MASK);
+            head = &m_slots[level][slot];
+            break;
+        }
+    }
+    link(head,node);
+}
+
+void TimerWheel::link(Node **head, Node *node)
+{
+    node->head = head;
+    node->prev = nullptr;
+    node->next = *head;
+    if(*head){
+        (*head)->prev = node;
+    }
+    *head = node;
+}
+
+void TimerWheel::unlink(Node *node)
+{
+    if(!node->head){
+        return;
+    }
+
+    if(node->prev){
+        node->prev->next = node->next;
+    }else{
+        *node->head = node->next;
+    }
+    if(node->next){
+        node->next->prev = node->prev;
+    }
+    node->prev = nullptr;
+    node->next = nullptr;
+    node->head = nullptr;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+    Node * node = m_slots[level][slot];
+    m_slots[level][slot] = nullptr;
+    while(node){
+        Node * next = node->next;
+        node->head = nullptr;
+        add(node);
+        node = next;
+    }
+}
+
+int TimerWheel::expireTick()
+{
+    int idx = static_cast<int>(m_current & TIMER_WHEEL_SLOT_MASK);
+    if(idx == 0){
+        // move high level timer down, level n + 1 only when level n wrap
+        for(int level = 1;level < TIMER_WHEEL_LEVEL;level++){
+            int slot = static_cast<int>((m_current >> (TIMER_WHEEL_SLOT_BITS * level)) &
+                                        TIMER_WHEEL_SLOT_MASK);
+            cascade(level,slot);
+            if(slot != 0){
+                break;
+            }
+            if(level == TIMER_WHEEL_LEVEL - 1){
+                Node * node = m_overflow;
+                m_overflow = nullptr;
+                while(node){
+                    Node * next = node->next;
+                    node->head = nullptr;
+                    add(node);
+                    node = next;
+                }
+            }
+        }
+    }
+
+    int fired = 0;
+    m_firing = true;
+    while(Node * node = m_slots[0][idx]){
+        unlink(node);
+        m_nodes.remove(node->id);
+        Callback callback = node->callback;
+        delete node;
+
+        callback();
+        fired++;
+    }
+    m_firing = false;
+    return fired;
+}
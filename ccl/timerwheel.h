@@ -0,0 +1,84 @@
+﻿#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QtGlobal>
+#include <QHash>
+#include <QElapsedTimer>
+#include <functional>
+
+#define TIMER_WHEEL_DEFAULT_TICK 1
+#define TIMER_WHEEL_LEVEL 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOT (1 << TIMER_WHEEL_SLOT_BITS)
+
+/**
+ * hierarchical timer wheel, schedule and cancel is O(1), many thousand timer is cheap.
+ * 1.time
+ *  time is millisecond from wheel construct, resolution is tick millisecond.
+ *  level 0 hold timer in next 64 tick, level n hold next 64^(n+1) tick,
+ *  timer beyond level 3 stay in overflow list until level 3 cascade.
+ * 2.schedule
+ *  call schedule function add a timer, return timer id, call cancel function remove it.
+ *  delay or expire beyond quint64 is saturated, e.g. ULONG_MAX timer never fire.
+ * 3.advance
+ *  call advance function in owner thread periodic(QTimer with tick interval),
+ *  expired timer callback is called in advance function.
+ * Warning!!!
+ * 1.not thread safe, caller must lock or use it in one thread.
+ * 2.callback can schedule and cancel timer, timer scheduled in callback never fire in same tick.
+ */
+class TimerWheel
+{
+public:
+    typedef std::function<void()> Callback;
+
+    explicit TimerWheel(int tick = TIMER_WHEEL_DEFAULT_TICK);
+    ~TimerWheel();
+
+    quint64 schedule(quint64 delay,const Callback &callback);
+    quint64 scheduleAt(quint64 expire,const Callback &callback);
+    bool cancel(quint64 id);
+    bool contains(quint64 id) const;
+
+    int advance();
+    int advance(quint64 now);
+
+    quint64 now() const;
+    int tick() const;
+    int count() const;
+
+    /**
+     * millisecond until next timer expire, -1 if no timer.
+     * it is lower bound of level 0, timer in high level return next cascade time.
+     */
+    qint64 nextExpire() const;
+
+private:
+    struct Node{
+        quint64 id;
+        quint64 expire;
+        Callback callback;
+        Node * prev;
+        Node * next;
+        Node ** head;
+    };
+
+    void add(Node * node);
+    void link(Node ** head,Node * node);
+    void unlink(Node * node);
+    void cascade(int level,int slot);
+    int expireTick();
+
+    int m_tick;
+    quint64 m_current;
+    quint64 m_serial;
+    bool m_firing;
+
+    Node * m_slots[TIMER_WHEEL_LEVEL][TIMER_WHEEL_SLOT];
+    Node * m_overflow;
+    QHash<quint64,Node *> m_nodes;
+
+    QElapsedTimer m_clock;
+};
+
+#endif // TIMERWHEEL_H
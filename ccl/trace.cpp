@@ -0,0 +1,217 @@
+﻿#include "trace.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+
+namespace {
+
+QMutex s_mutex;
+QVector<TraceRing *> s_rings;
+quint32 s_ringSize = TRACE_DEFAULT_RING_SIZE;
+qint64 s_clearTime = 0;
+
+QByteArray escapeJson(const QByteArray &text)
+{
+    QByteArray escaped;
+    escaped.reserve(text.size());
+    for(int i = 0;i < text.size();i++){
+        char c = text.at(i);
+        if(c == '"' || c == '\\'){
+            escaped.append('\\');
+            escaped.append(c);
+        }else if(static_cast<unsigned char>(c) < 0x20){
+            escaped.append(' ');
+        }else{
+            escaped.append(c);
+        }
+    }
+    return escaped;
+}
+
+// chrome trace time is us
+QByteArray toUs(qint64 ns)
+{
+    return QByteArray::number(ns / 1000.0,'f',3);
+}
+
+}
+
+QAtomicInt Trace::s_enabled(1);
+
+TraceRing::TraceRing(quint32 capacity, int tid)
+    :m_events(nullptr),
+      m_mask(capacity - 1),
+      m_head(0),
+      m_tid(tid)
+{
+    m_events = new TraceEvent[capacity];
+}
+
+TraceRing::~TraceRing()
+{
+    delete [] m_events;
+}
+
+void TraceRing::snapshot(QVector<TraceEvent> *events) const
+{
+    quint64 capacity = static_cast<quint64>(m_mask) + 1;
+    quint64 head = m_head.loadAcquire();
+    quint64 first = head > capacity ? head - capacity : 0;
+
+    int begin = events->size();
+    for(quint64 i = first;i < head;i++){
+        events->append(m_events[i & m_mask]);
+    }
+
+    // owner may overwrite oldest event during copy, slot of index head again is being written
+    quint64 last = m_head.loadAcquire();
+    if(last >= capacity && last - capacity + 1 > first){
+        int overwritten = static_cast<int>(qMin(last - capacity + 1 - first,head - first));
+        events->remove(begin,overwritten);
+    }
+}
+
+int TraceRing::tid() const
+{
+    return m_tid;
+}
+
+QString TraceRing::threadName() const
+{
+    return m_threadName;
+}
+
+void TraceRing::setThreadName(const QString &threadName)
+{
+    m_threadName = threadName;
+}
+
+void Trace::setThreadName(const QString &threadName)
+{
+    TraceRing * ring = threadRing();
+    QMutexLocker locker(&s_mutex);
+    ring->setThreadName(threadName);
+}
+
+void Trace::setEnabled(bool enabled)
+{
+    s_enabled.store(enabled ? 1 : 0);
+}
+
+quint32 Trace::ringSize()
+{
+    QMutexLocker locker(&s_mutex);
+    return s_ringSize;
+}
+
+void Trace::setRingSize(quint32 ringSize)
+{
+    // power of 2, index is masked
+    quint32 size = 1;
+    while(size < ringSize && size < (1u << 31)){
+        size <<= 1;
+    }
+    QMutexLocker locker(&s_mutex);
+    s_ringSize = size;
+}
+
+void Trace::clear()
+{
+    QMutexLocker locker(&s_mutex);
+    s_clearTime = bufferMetaNow();
+}
+
+QByteArray Trace::chromeJson()
+{
+    QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+
+    QMutexLocker locker(&s_mutex);
+    QByteArray json;
+    json += "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    QVector<TraceEvent> events;
+    for(int i = 0;i < s_rings.size();i++){
+        const TraceRing * ring = s_rings.at(i);
+        QByteArray head = "\"pid\":" + pid + ",\"tid\":" + QByteArray::number(ring->tid());
+
+        if(!ring->threadName().isEmpty()){
+            json += first ? "" : ",\n";
+            json += "{\"name\":\"thread_name\",\"ph\":\"M\"," + head +
+                    ",\"args\":{\"name\":\"" + escapeJson(ring->threadName().toUtf8()) + "\"}}";
+            first = false;
+        }
+
+        events.resize(0);
+        ring->snapshot(&events);
+        for(int j = 0;j < events.size();j++){
+            const TraceEvent &event = events.at(j);
+            if(event.time < s_clearTime){
+                continue;
+            }
+
+            json += first ? "" : ",\n";
+            first = false;
+            json += "{\"name\":\"" + escapeJson(QByteArray(event.name)) + "\",\"cat\":\"ccl\"," + head +
+                    ",\"ts\":" + toUs(event.time);
+            switch(event.phase){
+            case TracePhaseComplete:
+                json += ",\"ph\":\"X\",\"dur\":" + toUs(static_cast<qint64>(event.value)) + "}";
+                break;
+            case TracePhaseInstant:
+                json += ",\"ph\":\"i\",\"s\":\"t\"}";
+                break;
+            case TracePhaseAsyncBegin:
+                json += ",\"ph\":\"b\",\"id\":\"0x" + QByteArray::number(event.value,16) +
+                        "\",\"args\":{\"link\":" + QByteArray::number(event.value >> TRACE_SEQUENCE_BITS) +
+                        ",\"sequence\":" +
+                        QByteArray::number(event.value & ((Q_UINT64_C(1) << TRACE_SEQUENCE_BITS) - 1)) + "}}";
+                break;
+            case TracePhaseAsyncStep:
+                json += ",\"ph\":\"n\",\"id\":\"0x" + QByteArray::number(event.value,16) + "\"}";
+                break;
+            case TracePhaseAsyncEnd:
+                json += ",\"ph\":\"e\",\"id\":\"0x" + QByteArray::number(event.value,16) + "\"}";
+                break;
+            default:
+                json += "}";
+                break;
+            }
+        }
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+bool Trace::writeChromeJson(const QString &fileName)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        qDebug()<<"Open trace file failure! Error: "<<file.errorString()<<" File: "<<fileName;
+        return false;
+    }
+    QByteArray json = chromeJson();
+    if(file.write(json) != json.size()){
+        qDebug()<<"Write trace file failure! Error: "<<file.errorString()<<" File: "<<fileName;
+        return false;
+    }
+    return true;
+}
+
+TraceRing *Trace::threadRing()
+{
+    thread_local TraceRing * ring = nullptr;
+    if(!ring){
+        ring = createRing();
+    }
+    return ring;
+}
+
+TraceRing *Trace::createRing()
+{
+    QMutexLocker locker(&s_mutex);
+    TraceRing * ring = new TraceRing(s_ringSize,s_rings.size() + 1);
+    s_rings.append(ring);
+    return ring;
+}
@@ -0,0 +1,201 @@
+﻿#ifndef TRACE_H
+#define TRACE_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include "ccl/buffermeta.h"
+
+#define TRACE_DEFAULT_RING_SIZE 65536
+
+/**
+ * trace point, compiled in only with CCL_ENABLE_TRACE(qmake CONFIG+=ccl_trace),
+ * else every macro is empty, argument is not evaluated.
+ * 1.CCL_TRACE_SCOPE(name): span from here to end of scope.
+ * 2.CCL_TRACE_INSTANT(name): point in time.
+ * 3.CCL_TRACE_MESSAGE_BEGIN(meta), CCL_TRACE_MESSAGE_STEP(meta,step,time), CCL_TRACE_MESSAGE_END(meta):
+ *   span of one buffer from receive to parse done, across thread, keyed by link id and sequence.
+ *   BufferStamper begin it at recvTime, consumer end it.
+ * 4.CCL_TRACE_THREAD_NAME(name): name current thread in trace.
+ * name must be string literal or live forever, only pointer is kept.
+ */
+#ifdef CCL_ENABLE_TRACE
+#define CCL_TRACE_CONCAT_(a,b) a##b
+#define CCL_TRACE_CONCAT(a,b) CCL_TRACE_CONCAT_(a,b)
+#define CCL_TRACE_SCOPE(name) TraceScope CCL_TRACE_CONCAT(cclTraceScope,__LINE__)(name)
+#define CCL_TRACE_INSTANT(name) Trace::instant(name)
+#define CCL_TRACE_MESSAGE_BEGIN(meta) \
+    Trace::record(TracePhaseAsyncBegin,TRACE_MESSAGE_NAME,traceMessageId(meta),(meta).recvTime)
+#define CCL_TRACE_MESSAGE_STEP(meta,step,time) \
+    Trace::record(TracePhaseAsyncStep,step,traceMessageId(meta),time)
+#define CCL_TRACE_MESSAGE_END(meta) \
+    Trace::record(TracePhaseAsyncEnd,TRACE_MESSAGE_NAME,traceMessageId(meta),bufferMetaNow())
+#define CCL_TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+#else
+#define CCL_TRACE_SCOPE(name) static_cast<void>(0)
+#define CCL_TRACE_INSTANT(name) static_cast<void>(0)
+#define CCL_TRACE_MESSAGE_BEGIN(meta) static_cast<void>(0)
+#define CCL_TRACE_MESSAGE_STEP(meta,step,time) static_cast<void>(0)
+#define CCL_TRACE_MESSAGE_END(meta) static_cast<void>(0)
+#define CCL_TRACE_THREAD_NAME(name) static_cast<void>(0)
+#endif
+
+#define TRACE_MESSAGE_NAME "message"
+#define TRACE_SEQUENCE_BITS 40
+
+enum TracePhase{
+    TracePhaseComplete,
+    TracePhaseInstant,
+    TracePhaseAsyncBegin,
+    TracePhaseAsyncStep,
+    TracePhaseAsyncEnd
+};
+
+/**
+ * value is duration ns of complete event, id of async event.
+ */
+typedef struct TraceEvent_TAG{
+    const char * name;
+    qint64 time;
+    quint64 value;
+    quint32 phase;
+}TraceEvent;
+
+/**
+ * link id in high 24 bit, sequence in low 40 bit.
+ */
+inline quint64 traceMessageId(const BufferMeta &meta)
+{
+    return (static_cast<quint64>(meta.linkId) << TRACE_SEQUENCE_BITS) |
+            (meta.sequence & ((Q_UINT64_C(1) << TRACE_SEQUENCE_BITS) - 1));
+}
+
+/**
+ * event of one thread, overwrite oldest when full, written by owner thread only.
+ */
+class TraceRing
+{
+public:
+    TraceRing(quint32 capacity,int tid);
+    ~TraceRing();
+
+    inline void append(quint32 phase,const char * name,quint64 value,qint64 time)
+    {
+        quint64 head = m_head.load();
+        TraceEvent &event = m_events[head & m_mask];
+        event.name = name;
+        event.time = time;
+        event.value = value;
+        event.phase = phase;
+        m_head.storeRelease(head + 1);
+    }
+
+    /**
+     * copy event still in ring, event overwritten during copy is skipped.
+     */
+    void snapshot(QVector<TraceEvent> * events) const;
+
+    int tid() const;
+
+    QString threadName() const;
+    void setThreadName(const QString &threadName);
+
+private:
+    Q_DISABLE_COPY(TraceRing)
+
+    TraceEvent * m_events;
+    quint32 m_mask;
+    QAtomicInteger<quint64> m_head;
+    int m_tid;
+
+    // written by owner thread, read under Trace mutex
+    QString m_threadName;
+};
+
+/**
+ * per thread ring of trace event and chrome trace exporter.
+ * 1.record
+ *  first event of a thread create its ring(ringSize event), ring live until process exit.
+ *  record is a clock read and a few store, no lock.
+ * 2.export
+ *  call chromeJson or writeChromeJson function in any thread, open in chrome://tracing or ui.perfetto.dev.
+ *  event of every ring since last clear, old event may be overwritten by then.
+ * Warning!!!
+ * 1.setRingSize before first event, ring already created keep its size.
+ * 2.clear only hide earlier event from export, ring is not freed.
+ */
+class Trace
+{
+public:
+    static inline void record(quint32 phase,const char * name,quint64 value,qint64 time)
+    {
+        if(!s_enabled.load()){
+            return;
+        }
+        threadRing()->append(phase,name,value,time);
+    }
+
+    static inline void instant(const char * name)
+    {
+        if(s_enabled.load()){
+            threadRing()->append(TracePhaseInstant,name,0,bufferMetaNow());
+        }
+    }
+
+    static void setThreadName(const QString &threadName);
+
+    static inline bool isEnabled()
+    {
+        return s_enabled.load();
+    }
+
+    static void setEnabled(bool enabled);
+
+    static quint32 ringSize();
+    static void setRingSize(quint32 ringSize);
+
+    static void clear();
+
+    static QByteArray chromeJson();
+    static bool writeChromeJson(const QString &fileName);
+
+private:
+    static TraceRing * threadRing();
+    static TraceRing * createRing();
+
+    static QAtomicInt s_enabled;
+};
+
+/**
+ * complete event of enclosing scope, used by CCL_TRACE_SCOPE.
+ */
+class TraceScope
+{
+public:
+    inline explicit TraceScope(const char * name)
+        :m_name(name),
+          m_start(Trace::isEnabled() ? bufferMetaNow() : -1)
+    {
+
+    }
+
+    inline ~TraceScope()
+    {
+        if(m_start < 0){
+            return;
+        }
+        qint64 end = bufferMetaNow();
+        Trace::record(TracePhaseComplete,m_name,static_cast<quint64>(end - m_start),m_start);
+    }
+
+private:
+    Q_DISABLE_COPY(TraceScope)
+
+    const char * m_name;
+    qint64 m_start;
+};
+
+#endif // TRACE_H
@@ -1,4 +1,6 @@
 ﻿#include "udpclient.h"
+#include "trace.h"
+#include <cstring>
 
 UdpClient::UdpClient(quint16 port,
              AbstractQueue<UDPBuffer> *queue,
@@ -6,9 +8,13 @@ UdpClient::UdpClient(quint16 port,
     :QObject(parent),
       m_host(QHostAddress::LocalHost),
       m_port(port),
-      m_queue(queue)
+      m_queue(queue),
+      m_rejectedCount(0),
+      m_reassembler(nullptr)
 {
     m_socket = new QUdpSocket(this);
+    m_expireTimer = new QTimer(this);
+    m_expireTimer->setInterval(UDP_REASSEMBLY_DEFAULT_TICK);
 
     connect(this,&UdpClient::startSignal,this,&UdpClient::startSlot);
     connect(this,&UdpClient::stopSignal,this,&UdpClient::stopSlot);
@@ -19,7 +25,7 @@ UdpClient::UdpClient(quint16 port,
     connect(m_socket,&QUdpSocket::stateChanged,this,&UdpClient::stateChangedSlot);
     connect(m_socket,QOverload<QAbstractSocket::SocketError>::of(&QUdpSocket::error),
         this,&UdpClient::errorSlot);
-
+    connect(m_expireTimer,&QTimer::timeout,this,&UdpClient::expireSlot);
 }
 
 UdpClient::UdpClient(const QHostAddress &host,
@@ -29,9 +35,13 @@ UdpClient::UdpClient(const QHostAddress &host,
     :QObject(parent),
       m_host(host),
       m_port(port),
-      m_queue(queue)
+      m_queue(queue),
+      m_rejectedCount(0),
+      m_reassembler(nullptr)
 {
     m_socket = new QUdpSocket(this);
+    m_expireTimer = new QTimer(this);
+    m_expireTimer->setInterval(UDP_REASSEMBLY_DEFAULT_TICK);
 
     connect(this,&UdpClient::startSignal,this,&UdpClient::startSlot);
     connect(this,&UdpClient::stopSignal,this,&UdpClient::stopSlot);
@@ -42,7 +52,7 @@ UdpClient::UdpClient(const QHostAddress &host,
     connect(m_socket,&QUdpSocket::stateChanged,this,&UdpClient::stateChangedSlot);
     connect(m_socket,QOverload<QAbstractSocket::SocketError>::of(&QUdpSocket::error),
         this,&UdpClient::errorSlot);
-
+    connect(m_expireTimer,&QTimer::timeout,this,&UdpClient::expireSlot);
 }
 
 void UdpClient::write(const UDPBuffer &buffer)
@@ -66,11 +76,18 @@ void UdpClient::startSlot()
         m_socket->close();
     }
     m_socket->bind(m_host,m_port);
+    if(m_reassembler){
+        m_expireTimer->start();
+    }
 }
 
 void UdpClient::stopSlot()
 {
+    m_expireTimer->stop();
     m_socket->close();
+    if(m_reassembler){
+        m_reassembler->clear();
+    }
 }
 
 void UdpClient::writeBufferSlot(const UDPBuffer &buffer)
@@ -78,17 +95,36 @@ void UdpClient::writeBufferSlot(const UDPBuffer &buffer)
     qint64 len = m_socket->writeDatagram(buffer.buffer,buffer.len,
                          buffer.addres,buffer.port);
     if(len < 0){
+        m_metrics.writeErrors.add();
         qDebug()<<"Write buffer failure! buffer: "<<
               QByteArray(buffer.buffer + len,
                      static_cast<int>(buffer.len - len)).toHex()<<
               " Host: "<<buffer.addres<<
               " Port: "<<buffer.port;
+    }else{
+        m_metrics.bytesWritten.add(static_cast<quint64>(len));
     }
 }
 
 void UdpClient::readyReadSlot()
 {
-    if(m_socket->hasPendingDatagrams()){
+    CCL_TRACE_SCOPE("UdpClient::readyReadSlot");
+
+    // datagram read in this slot all arrived before it
+    qint64 recvTime = bufferMetaNow();
+
+    if(m_reassembler){
+        readReassembled(recvTime);
+        return;
+    }
+
+    if(m_frameValidator){
+        readValidated(recvTime);
+        return;
+    }
+
+    // readyRead is not emitted again until all pending datagram is read
+    while(m_socket->hasPendingDatagrams()){
         UDPBuffer * buffer = m_queue->peekWriteable();
         if(!buffer){
             qDebug()<<"Peek write buffer failure! Please check queue is abort!";
@@ -96,14 +132,80 @@ void UdpClient::readyReadSlot()
         }
         buffer->len = m_socket->readDatagram(buffer->buffer,UDP_DEFAULT_BUF_SIZE,&buffer->addres,&buffer->port);
         if(buffer->len < 0){
+            m_metrics.readErrors.add();
             qDebug()<<"Socket read failure! Error: "<< m_socket->errorString();
             m_queue->next(buffer);
             return;
         }
+        m_metrics.bytesRead.add(static_cast<quint64>(buffer->len));
+        m_metrics.messagesRead.add();
+        m_stamper.stamp(&buffer->meta,recvTime);
         m_queue->push(buffer);
     }
 }
 
+void UdpClient::readValidated(qint64 recvTime)
+{
+    // validate in scratch buffer, invalid frame never take a queue slot
+    while(m_socket->hasPendingDatagrams()){
+        QHostAddress address;
+        quint16 port = 0;
+        qint64 len = m_socket->readDatagram(m_datagram.data(),UDP_DEFAULT_BUF_SIZE,&address,&port);
+        if(len < 0){
+            m_metrics.readErrors.add();
+            qDebug()<<"Socket read failure! Error: "<< m_socket->errorString();
+            return;
+        }
+        if(!m_frameValidator(m_datagram.constData(),len)){
+            m_rejectedCount.fetchAndAddRelaxed(1);
+            continue;
+        }
+
+        UDPBuffer * buffer = m_queue->peekWriteable();
+        if(!buffer){
+            qDebug()<<"Peek write buffer failure! Please check queue is abort!";
+            return;
+        }
+        memcpy(buffer->buffer,m_datagram.constData(),static_cast<size_t>(len));
+        buffer->len = len;
+        buffer->addres = address;
+        buffer->port = port;
+        m_metrics.bytesRead.add(static_cast<quint64>(len));
+        m_metrics.messagesRead.add();
+        m_stamper.stamp(&buffer->meta,recvTime);
+        m_queue->push(buffer);
+    }
+}
+
+void UdpClient::readReassembled(qint64 recvTime)
+{
+    while(m_socket->hasPendingDatagrams()){
+        QHostAddress address;
+        quint16 port = 0;
+        qint64 len = m_socket->readDatagram(m_datagram.data(),m_datagram.size(),&address,&port);
+        if(len < 0){
+            m_metrics.readErrors.add();
+            qDebug()<<"Socket read failure! Error: "<< m_socket->errorString();
+            return;
+        }
+        if(m_frameValidator && !m_frameValidator(m_datagram.constData(),len)){
+            m_rejectedCount.fetchAndAddRelaxed(1);
+            continue;
+        }
+        m_metrics.bytesRead.add(static_cast<quint64>(len));
+        if(m_reassembler->feed(m_datagram.constData(),len,address,port,recvTime) > 0){
+            m_metrics.messagesRead.add();
+        }
+    }
+}
+
+void UdpClient::expireSlot()
+{
+    if(m_reassembler){
+        m_reassembler->expire();
+    }
+}
+
 void UdpClient::stateChangedSlot(QAbstractSocket::SocketState state)
 {
     qDebug()<<"UDPClient state changed! Current state: " << state;
@@ -111,6 +213,7 @@ void UdpClient::stateChangedSlot(QAbstractSocket::SocketState state)
 
 void UdpClient::errorSlot(QAbstractSocket::SocketError socketError)
 {
+    m_metrics.errors.add();
     qDebug()<<"Udp Socket Error: "<< socketError;
     emit error(socketError);
 }
@@ -134,3 +237,50 @@ void UdpClient::setHost(const QHostAddress &host)
 {
     m_host = host;
 }
+
+void UdpClient::setFrameValidator(const FrameValidator &frameValidator)
+{
+    m_frameValidator = frameValidator;
+    if(m_frameValidator && m_datagram.size() < UDP_DEFAULT_BUF_SIZE){
+        // scratch buffer of validated datagram, allocated once
+        m_datagram.resize(UDP_DEFAULT_BUF_SIZE);
+    }
+}
+
+quint64 UdpClient::rejectedCount() const
+{
+    return m_rejectedCount.load();
+}
+
+quint32 UdpClient::linkId() const
+{
+    return m_stamper.linkId();
+}
+
+void UdpClient::setLinkId(quint32 linkId)
+{
+    m_stamper.setLinkId(linkId);
+    if(m_reassembler){
+        m_reassembler->setLinkId(linkId);
+    }
+}
+
+const LinkMetrics *UdpClient::linkMetrics() const
+{
+    return &m_metrics;
+}
+
+void UdpClient::setReassembler(UdpReassembler *reassembler)
+{
+    m_reassembler = reassembler;
+    if(m_reassembler){
+        // datagram buffer allocated once, largest udp payload
+        m_datagram.resize(UDP_MESSAGE_MAX_SIZE);
+        m_reassembler->setLinkId(m_stamper.linkId());
+    }
+}
+
+UdpReassembler *UdpClient::reassembler() const
+{
+    return m_reassembler;
+}
@@ -2,7 +2,15 @@
 #define UDPCLIENT_H
 
 #include <QUdpSocket>
+#include <QTimer>
+#include <QAtomicInteger>
+#include <QtEndian>
 #include "queue/abstractqueue.h"
+#include "queue/bytebudgetqueue.h"
+#include "checksum.h"
+#include "buffermeta.h"
+#include "metrics.h"
+#include "udpreassembler.h"
 
 #define UDP_DEFAULT_BUF_SIZE 1024
 
@@ -11,8 +19,43 @@ typedef struct UDPBuffer_TAG{
     qint64 len;
     QHostAddress addres;
     quint16 port;
+    BufferMeta meta;
 }UDPBuffer;
 
+/**
+ * ByteBudgetQueue<UDPBuffer> record header: meta, ipv6 address, port, ipv4 flag.
+ */
+template <>
+struct ByteBudgetTraits<UDPBuffer>{
+    static constexpr int addressOffset = sizeof(BufferMeta);
+    static constexpr int portOffset = addressOffset + 16;
+    static constexpr int flagOffset = portOffset + sizeof(quint16);
+    static constexpr int headerSize = (flagOffset + 1 + 7) & ~7;
+
+    static void pack(const UDPBuffer &buffer,char * header)
+    {
+        memcpy(header,&buffer.meta,sizeof(BufferMeta));
+        Q_IPV6ADDR address = buffer.addres.toIPv6Address();
+        memcpy(header + addressOffset,address.c,16);
+        memcpy(header + portOffset,&buffer.port,sizeof(quint16));
+        header[flagOffset] = buffer.addres.protocol() == QAbstractSocket::IPv4Protocol ? 1 : 0;
+    }
+
+    static void unpack(const char * header,UDPBuffer * buffer)
+    {
+        memcpy(&buffer->meta,header,sizeof(BufferMeta));
+        Q_IPV6ADDR address;
+        memcpy(address.c,header + addressOffset,16);
+        if(header[flagOffset]){
+            // ipv4 mapped ::ffff:a.b.c.d
+            buffer->addres = QHostAddress(qFromBigEndian<quint32>(address.c + 12));
+        }else{
+            buffer->addres = QHostAddress(address);
+        }
+        memcpy(&buffer->port,header + portOffset,sizeof(quint16));
+    }
+};
+
 class UdpClient:public QObject
 {
     Q_OBJECT
@@ -37,6 +80,34 @@ public:
     quint16 port() const;
     void setPort(const quint16 &port);
 
+    /**
+     * every datagram is a frame, it is read to scratch buffer and validated before peek queue,
+     * invalid datagram never take a queue slot, valid one is copied once.
+     * set validator before start, e.g. Checksum::validator(ChecksumCrc16Modbus,ChecksumLittleEndian).
+     */
+    void setFrameValidator(const FrameValidator &frameValidator);
+    quint64 rejectedCount() const;
+
+    /**
+     * link id in meta of every read buffer, unique by default, set before start.
+     */
+    quint32 linkId() const;
+    void setLinkId(quint32 linkId);
+
+    /**
+     * byte, message, error and reconnect counter, export with MetricsRegistry::addLink.
+     */
+    const LinkMetrics * linkMetrics() const;
+
+    /**
+     * reassemble fragment datagram, complete message is pushed to queue of reassembler,
+     * queue of client is not used then. frame validator check every datagram.
+     * set before start, reassembler must outlive client, nullptr disable it.
+     * messagesRead count complete message, bytesRead count datagram.
+     */
+    void setReassembler(UdpReassembler * reassembler);
+    UdpReassembler * reassembler() const;
+
 signals:
     void startSignal();
     void stopSignal();
@@ -53,14 +124,28 @@ private slots:
     void readyReadSlot();
     void stateChangedSlot(QUdpSocket::SocketState state);
     void errorSlot(QAbstractSocket::SocketError socketError);
+    void expireSlot();
 
 private:
+    void readValidated(qint64 recvTime);
+    void readReassembled(qint64 recvTime);
+
     QHostAddress m_host;
     quint16 m_port;
 
     AbstractQueue<UDPBuffer> *m_queue;
 
     QUdpSocket * m_socket;
+
+    FrameValidator m_frameValidator;
+    QAtomicInteger<quint64> m_rejectedCount;
+
+    BufferStamper m_stamper;
+    LinkMetrics m_metrics;
+
+    UdpReassembler * m_reassembler;
+    QByteArray m_datagram;
+    QTimer * m_expireTimer;
 };
 
 #endif // UDPCLIENT_H
@@ -0,0 +1,372 @@
+﻿#include "udpreassembler.h"
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+
+UdpReassembler::UdpReassembler(AbstractQueue<UDPMessageBuffer> *queue,
+                               int capacity,
+                               int timeout,
+                               qint64 maxMessageSize)
+    :m_queue(queue),
+      m_capacity(capacity > 0 ? capacity : UDP_REASSEMBLY_DEFAULT_CAPACITY),
+      m_timeout(timeout > 0 ? timeout : UDP_REASSEMBLY_DEFAULT_TIMEOUT),
+      m_maxMessageSize(qBound(static_cast<qint64>(1),maxMessageSize,static_cast<qint64>(UDP_MESSAGE_MAX_SIZE))),
+      m_parser(&UdpReassembler::parseHeader),
+      m_arena(nullptr),
+      m_pendingCount(0),
+      m_wheel(UDP_REASSEMBLY_DEFAULT_TICK),
+      m_fragmentCount(0),
+      m_completedCount(0),
+      m_gapCount(0),
+      m_duplicateCount(0),
+      m_reorderedCount(0),
+      m_evictedCount(0),
+      m_droppedCount(0)
+{
+    // all message buffer up front, nothing allocated per datagram
+    m_arena = new char[static_cast<size_t>(m_capacity * m_maxMessageSize)];
+    m_slots.resize(m_capacity);
+    for(int i = 0;i < m_capacity;i++){
+        Slot &slot = m_slots[i];
+        slot.used = false;
+        slot.generation = 0;
+        slot.timerId = 0;
+        slot.data = m_arena + i * m_maxMessageSize;
+    }
+}
+
+UdpReassembler::~UdpReassembler()
+{
+    delete [] m_arena;
+}
+
+int UdpReassembler::feed(const char *data, qint64 len, const QHostAddress &address, quint16 port, qint64 recvTime)
+{
+    m_fragmentCount.fetchAndAddRelaxed(1);
+
+    UdpFragment fragment;
+    if(!m_parser(data,len,&fragment) ||
+            fragment.count == 0 || fragment.count > UDP_REASSEMBLY_MAX_FRAGMENTS ||
+            fragment.index >= fragment.count || fragment.len < 0 ||
+            static_cast<qint64>(fragment.offset) + fragment.len > m_maxMessageSize){
+        m_droppedCount.fetchAndAddRelaxed(1);
+        return -1;
+    }
+
+    Slot * slot = find(address,port,fragment.messageId);
+    if(!slot){
+        if(!checkMessage(address,port,fragment.messageId)){
+            return 0;
+        }
+
+        slot = allocate();
+        slot->used = true;
+        slot->generation++;
+        slot->address = address;
+        slot->port = port;
+        slot->messageId = fragment.messageId;
+        slot->count = fragment.count;
+        slot->receivedCount = 0;
+        slot->maxIndex = -1;
+        slot->received = 0;
+        slot->len = 0;
+        slot->recvTime = recvTime;
+        m_pendingCount++;
+
+        int index = static_cast<int>(slot - m_slots.data());
+        quint32 generation = slot->generation;
+        slot->timerId = m_wheel.schedule(static_cast<quint64>(m_timeout),[this,index,generation](){
+            evict(index,generation);
+        });
+    }else if(slot->count != fragment.count){
+        m_droppedCount.fetchAndAddRelaxed(1);
+        return -1;
+    }
+
+    quint64 bit = Q_UINT64_C(1) << fragment.index;
+    if(slot->received & bit){
+        m_duplicateCount.fetchAndAddRelaxed(1);
+        return 0;
+    }
+    if(fragment.index < slot->maxIndex){
+        m_reorderedCount.fetchAndAddRelaxed(1);
+    }
+    slot->maxIndex = qMax(slot->maxIndex,static_cast<int>(fragment.index));
+    slot->received |= bit;
+    slot->receivedCount++;
+    slot->offsets[fragment.index] = fragment.offset;
+    slot->lens[fragment.index] = fragment.len;
+
+    memcpy(slot->data + fragment.offset,fragment.payload,static_cast<size_t>(fragment.len));
+    slot->len = qMax(slot->len,static_cast<qint64>(fragment.offset) + fragment.len);
+
+    if(slot->receivedCount < slot->count){
+        return 0;
+    }
+    if(!covered(slot)){
+        // byte in gap would be stale data of last message in slot
+        qDebug()<<"Udp message fragment gap or overlap! Message id: "<<slot->messageId;
+        m_droppedCount.fetchAndAddRelaxed(1);
+        release(slot,true);
+        return -1;
+    }
+    return complete(slot) ? 1 : -1;
+}
+
+int UdpReassembler::expire()
+{
+    quint64 evicted = m_evictedCount.load();
+    m_wheel.advance();
+    return static_cast<int>(m_evictedCount.load() - evicted);
+}
+
+void UdpReassembler::clear()
+{
+    for(int i = 0;i < m_slots.size();i++){
+        if(m_slots.at(i).used){
+            release(&m_slots[i],false);
+        }
+    }
+    m_senders.clear();
+}
+
+void UdpReassembler::setFragmentParser(const UdpFragmentParser &parser)
+{
+    m_parser = parser;
+}
+
+bool UdpReassembler::parseHeader(const char *data, qint64 len, UdpFragment *fragment)
+{
+    if(len < UDP_REASSEMBLY_HEADER_SIZE){
+        return false;
+    }
+
+    fragment->messageId = qFromBigEndian<quint32>(data);
+    fragment->index = qFromBigEndian<quint16>(data + 4);
+    fragment->count = qFromBigEndian<quint16>(data + 6);
+    fragment->offset = qFromBigEndian<quint32>(data + 8);
+    fragment->payload = data + UDP_REASSEMBLY_HEADER_SIZE;
+    fragment->len = len - UDP_REASSEMBLY_HEADER_SIZE;
+    return true;
+}
+
+quint32 UdpReassembler::linkId() const
+{
+    return m_stamper.linkId();
+}
+
+void UdpReassembler::setLinkId(quint32 linkId)
+{
+    m_stamper.setLinkId(linkId);
+}
+
+int UdpReassembler::capacity() const
+{
+    return m_capacity;
+}
+
+int UdpReassembler::timeout() const
+{
+    return m_timeout;
+}
+
+int UdpReassembler::pendingCount() const
+{
+    return m_pendingCount;
+}
+
+quint64 UdpReassembler::fragmentCount() const
+{
+    return m_fragmentCount.load();
+}
+
+quint64 UdpReassembler::completedCount() const
+{
+    return m_completedCount.load();
+}
+
+quint64 UdpReassembler::gapCount() const
+{
+    return m_gapCount.load();
+}
+
+quint64 UdpReassembler::duplicateCount() const
+{
+    return m_duplicateCount.load();
+}
+
+quint64 UdpReassembler::reorderedCount() const
+{
+    return m_reorderedCount.load();
+}
+
+quint64 UdpReassembler::evictedCount() const
+{
+    return m_evictedCount.load();
+}
+
+quint64 UdpReassembler::droppedCount() const
+{
+    return m_droppedCount.load();
+}
+
+UdpReassembler::Slot *UdpReassembler::find(const QHostAddress &address, quint16 port, quint32 messageId)
+{
+    if(m_pendingCount == 0){
+        return nullptr;
+    }
+
+    // table is small, scan is cheaper than hash
+    for(int i = 0;i < m_slots.size();i++){
+        Slot &slot = m_slots[i];
+        if(slot.used && slot.messageId == messageId && slot.port == port && slot.address == address){
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+UdpReassembler::Slot *UdpReassembler::allocate()
+{
+    Slot * oldest = nullptr;
+    for(int i = 0;i < m_slots.size();i++){
+        Slot &slot = m_slots[i];
+        if(!slot.used){
+            return &slot;
+        }
+        if(!oldest || slot.recvTime < oldest->recvTime){
+            oldest = &slot;
+        }
+    }
+
+    // table full, oldest message is least likely to complete
+    m_evictedCount.fetchAndAddRelaxed(1);
+    release(oldest,true);
+    return oldest;
+}
+
+void UdpReassembler::release(Slot *slot, bool isDone)
+{
+    if(slot->timerId != 0){
+        m_wheel.cancel(slot->timerId);
+        slot->timerId = 0;
+    }
+    if(isDone){
+        markDone(slot->address,slot->port,slot->messageId);
+    }
+    slot->used = false;
+    m_pendingCount--;
+}
+
+void UdpReassembler::evict(int index, quint32 generation)
+{
+    Slot &slot = m_slots[index];
+    if(!slot.used || slot.generation != generation){
+        return;
+    }
+
+    // timer already fired
+    slot.timerId = 0;
+    m_evictedCount.fetchAndAddRelaxed(1);
+    release(&slot,true);
+}
+
+bool UdpReassembler::checkMessage(const QHostAddress &address, quint16 port, quint32 messageId)
+{
+    quint64 key = senderKey(address,port);
+    QHash<quint64,Sender>::iterator it = m_senders.find(key);
+    if(it == m_senders.end()){
+        Sender sender;
+        sender.highest = messageId;
+        sender.done = 0;
+        m_senders.insert(key,sender);
+        return true;
+    }
+
+    Sender &sender = it.value();
+    qint32 diff = static_cast<qint32>(messageId - sender.highest);
+    if(diff > 0){
+        if(diff > 1){
+            m_gapCount.fetchAndAddRelaxed(static_cast<quint64>(diff - 1));
+        }
+        sender.done = diff >= UDP_REASSEMBLY_WINDOW ? 0 : sender.done << diff;
+        sender.highest = messageId;
+        return true;
+    }
+
+    quint32 back = static_cast<quint32>(-static_cast<qint64>(diff));
+    if(back >= UDP_REASSEMBLY_WINDOW){
+        // sender restart, forget history
+        sender.highest = messageId;
+        sender.done = 0;
+        return true;
+    }
+    if(sender.done & (Q_UINT64_C(1) << back)){
+        m_duplicateCount.fetchAndAddRelaxed(1);
+        return false;
+    }
+    if(back > 0){
+        // late message, already counted in gap
+        m_reorderedCount.fetchAndAddRelaxed(1);
+    }
+    return true;
+}
+
+void UdpReassembler::markDone(const QHostAddress &address, quint16 port, quint32 messageId)
+{
+    QHash<quint64,Sender>::iterator it = m_senders.find(senderKey(address,port));
+    if(it == m_senders.end()){
+        return;
+    }
+
+    Sender &sender = it.value();
+    quint32 back = sender.highest - messageId;
+    if(back < UDP_REASSEMBLY_WINDOW){
+        sender.done |= Q_UINT64_C(1) << back;
+    }
+}
+
+bool UdpReassembler::covered(const Slot *slot) const
+{
+    qint64 end = 0;
+    for(int i = 0;i < slot->count;i++){
+        if(static_cast<qint64>(slot->offsets[i]) != end){
+            return false;
+        }
+        end += slot->lens[i];
+    }
+    return end == slot->len;
+}
+
+bool UdpReassembler::complete(Slot *slot)
+{
+    UDPMessageBuffer * buffer = m_queue->peekWriteable();
+    if(!buffer){
+        qDebug()<<"Peek write buffer failure! Please check queue is abort!";
+        m_droppedCount.fetchAndAddRelaxed(1);
+        release(slot,true);
+        return false;
+    }
+
+    memcpy(buffer->buffer,slot->data,static_cast<size_t>(slot->len));
+    buffer->len = slot->len;
+    buffer->addres = slot->address;
+    buffer->port = slot->port;
+    buffer->messageId = slot->messageId;
+    m_stamper.stamp(&buffer->meta,slot->recvTime);
+    release(slot,true);
+
+    m_queue->push(buffer);
+    m_completedCount.fetchAndAddRelaxed(1);
+    return true;
+}
+
+quint64 UdpReassembler::senderKey(const QHostAddress &address, quint16 port)
+{
+    bool isIPv4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isIPv4);
+    if(isIPv4){
+        return (static_cast<quint64>(ipv4) << 16) | port;
+    }
+    return (static_cast<quint64>(qHash(address)) << 16) ^ port ^ (Q_UINT64_C(1) << 63);
+}
@@ -0,0 +1,173 @@
+﻿#ifndef UDPREASSEMBLER_H
+#define UDPREASSEMBLER_H
+
+#include <QHostAddress>
+#include <QAtomicInteger>
+#include <QHash>
+#include <QVector>
+#include <functional>
+
+#include "ccl/queue/abstractqueue.h"
+#include "ccl/buffermeta.h"
+#include "ccl/timerwheel.h"
+
+#define UDP_MESSAGE_MAX_SIZE 65536
+#define UDP_REASSEMBLY_DEFAULT_CAPACITY 16
+#define UDP_REASSEMBLY_DEFAULT_TIMEOUT 500
+#define UDP_REASSEMBLY_DEFAULT_TICK 10
+#define UDP_REASSEMBLY_MAX_FRAGMENTS 64
+#define UDP_REASSEMBLY_HEADER_SIZE 12
+#define UDP_REASSEMBLY_WINDOW 64
+
+typedef struct UDPMessageBuffer_TAG{
+    char buffer[UDP_MESSAGE_MAX_SIZE];
+    qint64 len;
+    QHostAddress addres;
+    quint16 port;
+    quint32 messageId;
+    BufferMeta meta;
+}UDPMessageBuffer;
+
+/**
+ * one datagram of a message, payload point into datagram.
+ */
+typedef struct UdpFragment_TAG{
+    quint32 messageId;
+    quint16 index;
+    quint16 count;
+    quint32 offset;
+    const char * payload;
+    qint64 len;
+}UdpFragment;
+
+/**
+ * parse fragment header of datagram, return false if datagram is not a valid fragment.
+ */
+typedef std::function<bool(const char * data,qint64 len,UdpFragment * fragment)> UdpFragmentParser;
+
+/**
+ * reassemble message split across datagram, push complete message only.
+ * 1.fragment
+ *  message of one sender(address and port) is keyed by messageId, fragment by index in count.
+ *  payload is copied to offset in message, fragment may arrive in any order.
+ *  fragment in index order must cover message from 0 without gap or overlap,
+ *  e.g. offset of index n is offset + len of index n - 1, else message is dropped.
+ *  default header(parseHeader) is big endian: messageId(4) index(2) count(2) offset(4).
+ * 2.table
+ *  capacity slot of maxMessageSize byte is allocated in constructor, no allocation per datagram.
+ *  message not complete in timeout ms is evicted by timer wheel,
+ *  table full evict oldest message.
+ * 3.counter
+ *  1) gap: messageId skipped by sender, counted when a newer message arrive.
+ *  2) duplicate: fragment already received, or message already complete or evicted.
+ *  3) reordered: fragment index lower than received one, or late message already counted in gap.
+ *  4) evicted: incomplete message dropped by timeout or full table.
+ *  5) dropped: invalid header, too many fragment, message larger than maxMessageSize,
+ *     fragment with gap or overlap.
+ *  messageId go back more than UDP_REASSEMBLY_WINDOW is sender restart, history of sender is reset.
+ * Warning!!!
+ * 1.not thread safe, used in UdpClient thread(UdpClient::setReassembler) or owner thread.
+ * 2.call expire function periodic(UdpClient do it every UDP_REASSEMBLY_DEFAULT_TICK ms).
+ */
+class UdpReassembler
+{
+public:
+    explicit UdpReassembler(AbstractQueue<UDPMessageBuffer> * queue,
+                            int capacity = UDP_REASSEMBLY_DEFAULT_CAPACITY,
+                            int timeout = UDP_REASSEMBLY_DEFAULT_TIMEOUT,
+                            qint64 maxMessageSize = UDP_MESSAGE_MAX_SIZE);
+    ~UdpReassembler();
+
+    /**
+     * return 1 if a message is complete and pushed, 0 if message is not complete, -1 if dropped.
+     */
+    int feed(const char * data,qint64 len,const QHostAddress &address,quint16 port,
+             qint64 recvTime = bufferMetaNow());
+
+    /**
+     * evict timeout message, return evicted count.
+     */
+    int expire();
+    void clear();
+
+    void setFragmentParser(const UdpFragmentParser &parser);
+    static bool parseHeader(const char * data,qint64 len,UdpFragment * fragment);
+
+    quint32 linkId() const;
+    void setLinkId(quint32 linkId);
+
+    int capacity() const;
+    int timeout() const;
+    int pendingCount() const;
+
+    quint64 fragmentCount() const;
+    quint64 completedCount() const;
+    quint64 gapCount() const;
+    quint64 duplicateCount() const;
+    quint64 reorderedCount() const;
+    quint64 evictedCount() const;
+    quint64 droppedCount() const;
+
+private:
+    Q_DISABLE_COPY(UdpReassembler)
+
+    struct Slot{
+        bool used;
+        quint32 generation;
+        QHostAddress address;
+        quint16 port;
+        quint32 messageId;
+        quint16 count;
+        quint16 receivedCount;
+        int maxIndex;
+        quint64 received;
+        qint64 len;
+        qint64 recvTime;
+        quint64 timerId;
+        char * data;
+        // offset and len by index, checked when complete
+        quint32 offsets[UDP_REASSEMBLY_MAX_FRAGMENTS];
+        qint64 lens[UDP_REASSEMBLY_MAX_FRAGMENTS];
+    };
+
+    // messageId history of one sender, bit n of done is highest - n
+    struct Sender{
+        quint32 highest;
+        quint64 done;
+    };
+
+    Slot * find(const QHostAddress &address,quint16 port,quint32 messageId);
+    Slot * allocate();
+    void release(Slot * slot,bool isDone);
+    void evict(int index,quint32 generation);
+    bool checkMessage(const QHostAddress &address,quint16 port,quint32 messageId);
+    void markDone(const QHostAddress &address,quint16 port,quint32 messageId);
+    bool covered(const Slot * slot) const;
+    bool complete(Slot * slot);
+
+    static quint64 senderKey(const QHostAddress &address,quint16 port);
+
+    AbstractQueue<UDPMessageBuffer> * m_queue;
+    int m_capacity;
+    int m_timeout;
+    qint64 m_maxMessageSize;
+    UdpFragmentParser m_parser;
+
+    QVector<Slot> m_slots;
+    char * m_arena;
+    int m_pendingCount;
+    TimerWheel m_wheel;
+
+    QHash<quint64,Sender> m_senders;
+    BufferStamper m_stamper;
+
+    QAtomicInteger<quint64> m_fragmentCount;
+    QAtomicInteger<quint64> m_completedCount;
+    QAtomicInteger<quint64> m_gapCount;
+    QAtomicInteger<quint64> m_duplicateCount;
+    QAtomicInteger<quint64> m_reorderedCount;
+    QAtomicInteger<quint64> m_evictedCount;
+    QAtomicInteger<quint64> m_droppedCount;
+};
+
+#endif // UDPREASSEMBLER_H
@@ -0,0 +1,85 @@
+﻿#include "uibridge.h"
+
+UiBridge::UiBridge(TagStore *store, QObject *parent)
+    :QObject(parent),
+      m_store(store),
+      m_frameRate(UI_BRIDGE_DEFAULT_FRAME_RATE),
+      m_version(0),
+      m_lastFrameTime(0),
+      m_maxFrameTime(0),
+      m_lastBatchSize(0),
+      m_frameCount(0)
+{
+    qRegisterMetaType<TagValue>("TagValue");
+    qRegisterMetaType<QVector<TagValue>>("QVector<TagValue>");
+
+    m_timer = new QTimer(this);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer,&QTimer::timeout,this,&UiBridge::frameSlot);
+}
+
+UiBridge::~UiBridge()
+{
+
+}
+
+void UiBridge::start()
+{
+    m_timer->start(1000 / m_frameRate);
+}
+
+void UiBridge::stop()
+{
+    m_timer->stop();
+}
+
+int UiBridge::frameRate() const
+{
+    return m_frameRate;
+}
+
+void UiBridge::setFrameRate(int frameRate)
+{
+    m_frameRate = frameRate > 0 ? qMin(frameRate,1000) : UI_BRIDGE_DEFAULT_FRAME_RATE;
+    if(m_timer->isActive()){
+        m_timer->start(1000 / m_frameRate);
+    }
+}
+
+qint64 UiBridge::lastFrameTime() const
+{
+    return m_lastFrameTime;
+}
+
+qint64 UiBridge::maxFrameTime() const
+{
+    return m_maxFrameTime;
+}
+
+int UiBridge::lastBatchSize() const
+{
+    return m_lastBatchSize;
+}
+
+quint64 UiBridge::frameCount() const
+{
+    return m_frameCount;
+}
+
+void UiBridge::frameSlot()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // batch buffer keep its capacity, no allocation in steady state
+    m_batch.resize(0);
+    m_version = m_store->changedSince(m_version,&m_batch);
+    m_lastBatchSize = m_batch.size();
+    m_frameCount++;
+    if(!m_batch.isEmpty()){
+        emit tagsChanged(m_batch);
+    }
+
+    m_lastFrameTime = timer.nsecsElapsed() / 1000;
+    m_maxFrameTime = qMax(m_maxFrameTime,m_lastFrameTime);
+}
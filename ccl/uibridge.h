@@ -0,0 +1,69 @@
+﻿#ifndef UIBRIDGE_H
+#define UIBRIDGE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QMetaType>
+
+#include "ccl/tagstore.h"
+
+#define UI_BRIDGE_DEFAULT_FRAME_RATE 60
+
+Q_DECLARE_METATYPE(TagValue)
+Q_DECLARE_METATYPE(QVector<TagValue>)
+
+/**
+ * deliver tag change to gui thread once per display frame.
+ * 1.parse thread write tag store, never signal gui thread.
+ * 2.bridge live in gui thread, every frame it read tag changed since last frame from tag store
+ *   without lock, and emit tagsChanged once with all change, one entry per tag.
+ *   gui event queue get one timer event per frame whatever the wire rate.
+ * 3.no signal if nothing changed.
+ * Warning!!!
+ * 1.create bridge in gui thread, slot of tagsChanged run in gui thread, keep it short.
+ * 2.tag changed many times in a frame is delivered once with latest value.
+ */
+class UiBridge: public QObject
+{
+    Q_OBJECT
+public:
+    explicit UiBridge(TagStore * store,QObject * parent = nullptr);
+    virtual ~UiBridge() override;
+
+    void start();
+    void stop();
+
+    int frameRate() const;
+    void setFrameRate(int frameRate);
+
+    /**
+     * statistic of frame, frame time(microsecond) is time of read tag store and tagsChanged slot.
+     */
+    qint64 lastFrameTime() const;
+    qint64 maxFrameTime() const;
+    int lastBatchSize() const;
+    quint64 frameCount() const;
+
+signals:
+    void tagsChanged(const QVector<TagValue> &tags);
+
+private slots:
+    void frameSlot();
+
+private:
+    TagStore * m_store;
+    QTimer * m_timer;
+    int m_frameRate;
+
+    quint64 m_version;
+    QVector<TagValue> m_batch;
+
+    qint64 m_lastFrameTime;
+    qint64 m_maxFrameTime;
+    int m_lastBatchSize;
+    quint64 m_frameCount;
+};
+
+#endif // UIBRIDGE_H
@@ -1,5 +1,6 @@
 ﻿#include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "ccl/trace.h"
 #include <QDebug>
 
 
@@ -9,95 +10,209 @@ MainWindow::MainWindow(QWidget *parent)
 {
     ui->setupUi(this);
 
-    thread = new QThread(this);
-    thread->start();
-
-    UdpClient * udpClient = new UdpClient(8888,&udpQueue);
-    TcpClient * tcpClient = new TcpClient("127.0.0.1",8765,&tcpQueue);
-    SerialPortClient * serialPortClient = new SerialPortClient("COM1",&serialPortQueue);
-
-    udpClient->moveToThread(thread);
-    udpClient->start();
-    tcpClient->moveToThread(thread);
-    tcpClient->start();
-    serialPortClient->moveToThread(thread);
-    serialPortClient->start();
-
-    tcpParseThread = new TcpParseThread(&tcpQueue,this);
-    tcpParseThread->start();
-    udpParseThread = new UdpParseThread(&udpQueue,this);
-    udpParseThread->start();
-    serialPortParseThread = new SerialPortParseThread(&serialPortQueue,this);
-    serialPortParseThread->start();
+    // every link in own thread, slow serial write never delay tcp read
+    linkPool = new LinkThreadPool(LINK_DEFAULT_POOL_SIZE,this);
+
+    UdpClient * udpClient = linkPool->add(new UdpClient(8888,&udpQueue),LinkDedicated);
+    TcpClient * tcpClient = linkPool->add(new TcpClient("127.0.0.1",8765,&tcpQueue),LinkDedicated);
+    SerialPortClient * serialPortClient = linkPool->add(new SerialPortClient("COM1",&serialPortQueue),
+                                                        LinkDedicated);
+
+    // register all tag before parse thread start
+    const char * links[] = {"tcp","udp","serialport"};
+    for(const char * link : links){
+        tags.registerTag(QString(link) + ".frames");
+        tags.registerTag(QString(link) + ".frameLength");
+    }
+
+    tcpParseThread = new TcpParseThread(&tcpQueue,&metrics,&tags,this);
+    udpParseThread = new UdpParseThread(&udpQueue,&metrics,&tags,this);
+    serialPortParseThread = new SerialPortParseThread(&serialPortQueue,&metrics,&tags,this);
+
+    // curl http://127.0.0.1:9464/metrics
+    metrics.addLink("udp",udpClient->linkMetrics());
+    metrics.addLink("tcp",tcpClient->linkMetrics());
+    metrics.addLink("serialport",serialPortClient->linkMetrics());
+    metrics.addQueue("udp",&udpQueue);
+    metrics.addQueue("tcp",&tcpQueue);
+    metrics.addQueue("serialport",&serialPortQueue);
+    metricsExporter = new MetricsExporter(&metrics,this);
+    metricsExporter->listen();
+
+    lifecycle.setLinks(linkPool);
+    lifecycle.addQueue(&tcpQueue);
+    lifecycle.addQueue(&udpQueue);
+    lifecycle.addQueue(&serialPortQueue);
+    lifecycle.addThread(tcpParseThread);
+    lifecycle.addThread(udpParseThread);
+    lifecycle.addThread(serialPortParseThread);
+    lifecycle.start();
 }
 
 MainWindow::~MainWindow()
 {
+    // registry keep pointer to client
+    metricsExporter->close();
+
+    // stop ingest, drain queue, join parse thread, then delete client in own thread
+    if(!lifecycle.stop(LIFECYCLE_DEFAULT_TIMEOUT)){
+        // never delete running thread
+        tcpParseThread->wait();
+        udpParseThread->wait();
+        serialPortParseThread->wait();
+    }
+    linkPool->shutdown();
     delete ui;
 
 }
 
 TcpParseThread::TcpParseThread(AbstractQueue<TCPBuffer> *queue,
+                               MetricsRegistry *metrics,
+                               TagStore *tags,
                                QObject *parent)
-    :QThread(parent),m_queue(queue)
+    :QThread(parent),m_queue(queue),m_metrics(metrics),m_tags(tags)
 {
 
 }
 
 void TcpParseThread::run()
 {
+    CCL_TRACE_THREAD_NAME("tcp parse");
+    m_metrics->addCurrentThread("tcp parse");
+    LatencyHistogram * latency = m_metrics->histogram("ccl_ingest_latency_seconds",
+                                                      "Link receive to parse thread.",
+                                                      MetricsRegistry::label("queue","tcp"));
+
+    // frame count and last frame length of this link, one version range per buffer
+    TagValue values[2];
+    values[0].id = m_tags->tagId("tcp.frames");
+    values[1].id = m_tags->tagId("tcp.frameLength");
+    values[0].value = 0;
+    for(TagValue &value : values){
+        value.quality = TagGood;
+        value.timestamp = 0;
+    }
+
     while(!isInterruptionRequested()){
         TCPBuffer *buffer = m_queue->peekReadable(2000);
         if(!buffer){
+            if(m_queue->isAbort()){
+                break;
+            }
             qDebug()<<"Peek readable TcpBuffer timeout";
             continue;
         }
-
-        qDebug()<<"TcpBuffer: "<<QByteArray(buffer->buffer,
-                                            static_cast<int>(buffer->len)).toHex();
-
+        latency->recordIngest(buffer->meta);
+        CCL_TRACE_MESSAGE_STEP(buffer->meta,"dequeue",bufferMetaNow());
+        {
+            CCL_TRACE_SCOPE("parse");
+            qDebug()<<"TcpBuffer: "<<QByteArray(buffer->buffer,
+                                                static_cast<int>(buffer->len)).toHex();
+        }
+        values[0].value += 1;
+        values[1].value = static_cast<double>(buffer->len);
+        m_tags->writeBatch(values,2);
+        CCL_TRACE_MESSAGE_END(buffer->meta);
         m_queue->next(buffer);
     }
 }
 
-UdpParseThread::UdpParseThread(AbstractQueue<UDPBuffer> *queue, QObject *parent)
-    :QThread(parent),m_queue(queue)
+UdpParseThread::UdpParseThread(AbstractQueue<UDPBuffer> *queue, MetricsRegistry *metrics,
+                               TagStore *tags, QObject *parent)
+    :QThread(parent),m_queue(queue),m_metrics(metrics),m_tags(tags)
 {
 
 }
 
 void UdpParseThread::run()
 {
+    CCL_TRACE_THREAD_NAME("udp parse");
+    m_metrics->addCurrentThread("udp parse");
+    LatencyHistogram * latency = m_metrics->histogram("ccl_ingest_latency_seconds",
+                                                      "Link receive to parse thread.",
+                                                      MetricsRegistry::label("queue","udp"));
+
+    // frame count and last frame length of this link, one version range per buffer
+    TagValue values[2];
+    values[0].id = m_tags->tagId("udp.frames");
+    values[1].id = m_tags->tagId("udp.frameLength");
+    values[0].value = 0;
+    for(TagValue &value : values){
+        value.quality = TagGood;
+        value.timestamp = 0;
+    }
+
     while(!isInterruptionRequested()){
         UDPBuffer *buffer = m_queue->peekReadable(2000);
         if(!buffer){
+            if(m_queue->isAbort()){
+                break;
+            }
             qDebug()<<"Peek readable UdpBuffer timeout!";
             continue;
         }
-        qDebug()<<"UdpBuffer: "<<QByteArray(buffer->buffer,
-                                            static_cast<int>(buffer->len)).toHex();
+        latency->recordIngest(buffer->meta);
+        CCL_TRACE_MESSAGE_STEP(buffer->meta,"dequeue",bufferMetaNow());
+        {
+            CCL_TRACE_SCOPE("parse");
+            qDebug()<<"UdpBuffer: "<<QByteArray(buffer->buffer,
+                                                static_cast<int>(buffer->len)).toHex();
+        }
+        values[0].value += 1;
+        values[1].value = static_cast<double>(buffer->len);
+        m_tags->writeBatch(values,2);
+        CCL_TRACE_MESSAGE_END(buffer->meta);
         m_queue->next(buffer);
     }
 }
 
 SerialPortParseThread::SerialPortParseThread(AbstractQueue<SerialPortBuffer> *queue,
+                                             MetricsRegistry *metrics,
+                                             TagStore *tags,
                                              QObject *parent)
-    :QThread(parent),m_queue(queue)
+    :QThread(parent),m_queue(queue),m_metrics(metrics),m_tags(tags)
 {
 
 }
 
 void SerialPortParseThread::run()
 {
+    CCL_TRACE_THREAD_NAME("serialport parse");
+    m_metrics->addCurrentThread("serialport parse");
+    LatencyHistogram * latency = m_metrics->histogram("ccl_ingest_latency_seconds",
+                                                      "Link receive to parse thread.",
+                                                      MetricsRegistry::label("queue","serialport"));
+
+    // frame count and last frame length of this link, one version range per buffer
+    TagValue values[2];
+    values[0].id = m_tags->tagId("serialport.frames");
+    values[1].id = m_tags->tagId("serialport.frameLength");
+    values[0].value = 0;
+    for(TagValue &value : values){
+        value.quality = TagGood;
+        value.timestamp = 0;
+    }
+
     while(!isInterruptionRequested()){
         SerialPortBuffer *buffer = m_queue->peekReadable(2000);
         if(!buffer){
+            if(m_queue->isAbort()){
+                break;
+            }
             qDebug()<<"Peek readable SerialPortBuffer timeout";
             continue;
         }
-
-        qDebug()<<"SerialPortBuffer: "<<QByteArray(buffer->buffer,
-                                                   static_cast<int>(buffer->len)).toHex();
+        latency->recordIngest(buffer->meta);
+        CCL_TRACE_MESSAGE_STEP(buffer->meta,"dequeue",bufferMetaNow());
+        {
+            CCL_TRACE_SCOPE("parse");
+            qDebug()<<"SerialPortBuffer: "<<QByteArray(buffer->buffer,
+                                                       static_cast<int>(buffer->len)).toHex();
+        }
+        values[0].value += 1;
+        values[1].value = static_cast<double>(buffer->len);
+        m_tags->writeBatch(values,2);
+        CCL_TRACE_MESSAGE_END(buffer->meta);
         m_queue->next(buffer);
     }
 }
@@ -4,7 +4,12 @@
 #include <QMainWindow>
 #include <QThread>
 
+#include "ccl/lifecycle.h"
+#include "ccl/linkthreadpool.h"
+#include "ccl/metrics.h"
+#include "ccl/metricsexporter.h"
 #include "ccl/serialportclient.h"
+#include "ccl/tagstore.h"
 #include "ccl/tcpclient.h"
 #include "ccl/udpclient.h"
 #include "ccl/queue/waitqueue.h"
@@ -33,7 +38,14 @@ private:
     WaitQueue<TCPBuffer> tcpQueue;
     WaitQueue<UDPBuffer> udpQueue;
     WaitQueue<SerialPortBuffer> serialPortQueue;
-    QThread * thread;
+    LinkThreadPool * linkPool;
+    Lifecycle lifecycle;
+
+    MetricsRegistry metrics;
+    MetricsExporter * metricsExporter;
+
+    // written by parse thread, read by gui
+    TagStore tags;
 
     TcpParseThread * tcpParseThread;
     UdpParseThread * udpParseThread;
@@ -43,37 +55,46 @@ private:
 class TcpParseThread: public QThread{
 
 public:
-    TcpParseThread(AbstractQueue<TCPBuffer> * queue,QObject * parent = nullptr);
+    TcpParseThread(AbstractQueue<TCPBuffer> * queue,MetricsRegistry * metrics,TagStore * tags,
+                  QObject * parent = nullptr);
 
 protected:
     void run() override;
 
 private:
     AbstractQueue<TCPBuffer> * m_queue;
+    MetricsRegistry * m_metrics;
+    TagStore * m_tags;
 };
 
 class UdpParseThread: public QThread{
 
 public:
-    UdpParseThread(AbstractQueue<UDPBuffer> * queue,QObject * parent = nullptr);
+    UdpParseThread(AbstractQueue<UDPBuffer> * queue,MetricsRegistry * metrics,TagStore * tags,
+                  QObject * parent = nullptr);
 
 protected:
     void run() override;
 
 private:
     AbstractQueue<UDPBuffer> * m_queue;
+    MetricsRegistry * m_metrics;
+    TagStore * m_tags;
 };
 
 class SerialPortParseThread: public QThread{
 
 public:
-    SerialPortParseThread(AbstractQueue<SerialPortBuffer> * queue,QObject * parent = nullptr);
+    SerialPortParseThread(AbstractQueue<SerialPortBuffer> * queue,MetricsRegistry * metrics,TagStore * tags,
+                          QObject * parent = nullptr);
 
 protected:
     void run() override;
 
 private:
     AbstractQueue<SerialPortBuffer> * m_queue;
+    MetricsRegistry * m_metrics;
+    TagStore * m_tags;
 };
 
 #endif // MAINWINDOW_H